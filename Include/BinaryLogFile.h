@@ -0,0 +1,126 @@
+
+// BinaryLogFile.h
+
+// Interfaces to the cBinaryLogFile class representing a log listener that writes the deferred messages unformatted
+
+// The deferred (FASTLOG) messages that the asynchronous writer passes to this listener are written as the ID of their
+// format and the captured arguments, so that the server spends no time formatting them; the offline decoder
+// (Decode(), the server's --log-decode option) formats them later, into the same lines as the text log file has.
+// The other messages come already formatted and are written as text. The thread IDs of the Debug builds' line prefix
+// are not kept, the decoded deferred messages have the Release builds' prefix.
+//
+// The binary log file format (the numbers are little-endian):
+//  - File header: cFileHeader, 16 bytes: the magic "P2PLOG\0\0", UInt32 version (1), UInt32 size of the file header
+//  - Records: cRecordHeader (8 bytes) followed by m_Size bytes of the payload, depending on m_Type:
+//    - rtFormat: UInt32 format ID, the format string. Written before the first message using the format.
+//    - rtText: the whole formatted line, as passed to the listener
+//    - rtDeferred: Int64 time of logging (seconds since the Unix epoch), UInt32 format ID, the encoded arguments
+// Each encoded argument starts with a type tag: 'i' and 'u' (signed and unsigned integers), 'd' (double) and 'p' (pointer)
+// are followed by the UInt8 size of the original argument and the UInt64 value; 's' (string) is followed by
+// the UInt32 length and the contents.
+
+
+
+
+
+#pragma once
+
+#include "Logger.h"
+#include "OSSupport/File.h"
+#include <functional>
+#include <unordered_map>
+
+
+
+
+
+class COMMON_API cBinaryLogFile :
+	public cLogger::cListener
+{
+public:
+	enum eRecordType
+	{
+		rtFormat   = 1,
+		rtText     = 2,
+		rtDeferred = 3,
+	};
+
+
+	struct cFileHeader
+	{
+		char m_Magic[8];
+		UInt32 m_Version;
+		UInt32 m_HeaderSize;
+	};
+
+
+	struct cRecordHeader
+	{
+		/** Size of the payload following this header. */
+		UInt32 m_Size;
+
+		/** One of eRecordType. */
+		UInt8 m_Type;
+
+		/** The cLogger::eLogLevel of the message; zero for the rtFormat records. */
+		UInt8 m_LogLevel;
+
+		UInt8 m_Reserved[2];
+	};
+
+
+	/** Called by Decode() with each decoded line, including the log level prefix and the trailing newline. */
+	typedef std::function<void(const AString & a_Line)> cLineCallback;
+
+
+	cBinaryLogFile(void);
+
+	/** Creates the binary log file and writes its header. Returns true on success. */
+	bool Open(const AString & a_FileName);
+
+	// cLogger::cListener overrides:
+	virtual void Log(AString a_Message, cLogger::eLogLevel a_LogLevel) override;
+	virtual bool TakesDeferred(void) const override { return true; }
+	virtual void LogDeferred(const cLogger::cDeferredMessage & a_Message, cLogger::eLogLevel a_LogLevel) override;
+	virtual void Flush(void) override;
+
+	/** Offline tool: decodes the binary log file, calling a_Callback with each line as the text log file has it.
+	Returns false if the file is not a valid binary log (an error is printed); the lines before a truncated record
+	at the end of the file are still decoded. */
+	static bool Decode(const AString & a_FileName, cLineCallback a_Callback);
+
+	/** Offline tool: prints the binary log file's lines to stdout. Returns the exit code for the process. */
+	static int Dump(const AString & a_FileName);
+
+	/** Formats the message from the format and the encoded arguments, the same as Printf() does with the original
+	arguments. The conversions whose argument is missing or of a mismatched type are printed as "<?>". */
+	static AString FormatArgs(const char * a_Format, const char * a_Args, size_t a_ArgsSize);
+
+protected:
+
+	/** The magic at the start of each binary log file. */
+	static const char MAGIC[8];
+
+	static const UInt32 VERSION = 1;
+
+
+	cFile m_File;
+
+	/** The IDs of the formats already written to the file, by the format literal's address. */
+	std::unordered_map<const char *, UInt32> m_FormatIDs;
+
+	/** The record being composed, kept to reuse its buffer. */
+	AString m_Record;
+
+	/** Set when a warning or an error has been written, the file is then flushed in Flush(). */
+	bool m_ShouldFlush;
+
+
+	/** Composes the record of the specified type and log level from the payload in m_Record (after the space reserved
+	for the header) and writes it to the file. */
+	void WriteRecord(eRecordType a_Type, cLogger::eLogLevel a_LogLevel);
+};
+
+
+
+
@@ -0,0 +1,151 @@
+
+// BlockPool.h
+
+// Interfaces to the cBlockPool class representing a pool of fixed-size memory blocks with per-thread caches
+
+// Each thread allocating from the pool gets its own cache of free blocks, so the allocations and the frees done
+// by the same thread take no lock and touch no shared cache line except for the pool's counters.
+// A block freed by a different thread than the one that allocated it is pushed onto a lock-free list of
+// the allocating thread's cache, which that thread takes over the next time its own cache runs dry. This suits
+// the producer / consumer patterns of the server, where the network threads free what the tick thread allocated.
+// The caches spill over into a shared depot (protected by a CS) and take blocks from it in batches; the blocks
+// over the depot's limit are returned to the heap, so that the pool doesn't pin the memory of a load spike forever.
+//
+// The pools are meant to be static objects, living for the whole lifetime of the process.
+
+
+
+
+
+#pragma once
+
+#include <atomic>
+#include "OSSupport/CriticalSection.h"
+
+
+
+
+
+class COMMON_API cBlockPool
+{
+public:
+	/** The counters of a single pool, as reported by GetStats(). */
+	struct cStats
+	{
+		AString m_Name;
+		size_t m_BlockSize;
+
+		/** Number of blocks currently allocated from the pool. */
+		size_t m_NumInUse;
+
+		/** The most blocks there have been allocated from the pool at once. */
+		size_t m_HighWater;
+
+		/** Number of free blocks kept in the pool (in the per-thread caches and the depot). */
+		size_t m_NumCached;
+
+		/** The maximum number of free blocks kept in the depot. */
+		size_t m_MaxCached;
+
+		/** Number of threads that have a cache in the pool. */
+		size_t m_NumThreads;
+
+		/** Number of blocks allocated from the pool so far. */
+		UInt64 m_NumAllocations;
+
+		/** Number of blocks taken from the heap, because the pool had no free block. */
+		UInt64 m_NumHeapAllocations;
+
+		/** Number of blocks freed by a different thread than the one that allocated them. */
+		UInt64 m_NumRemoteFrees;
+	};
+
+
+	/** Creates a pool of blocks of the specified size. a_Name is used only for the statistics.
+	The depot keeps up to a_MaxCached free blocks, the rest is returned to the heap. */
+	cBlockPool(const AString & a_Name, size_t a_BlockSize, size_t a_MaxCached);
+
+	~cBlockPool();
+
+	/** Returns a block of GetBlockSize() bytes. Can be called from any thread. */
+	void * Allocate(void);
+
+	/** Returns the block into the pool. Can be called from any thread, not only the one that allocated the block. */
+	void Free(void * a_Block);
+
+	size_t GetBlockSize(void) const { return m_BlockSize; }
+
+	/** Sets the maximum number of free blocks kept in the depot; the excess is returned to the heap right away. */
+	void SetMaxCached(size_t a_MaxCached);
+
+	/** Returns the current counters. */
+	cStats GetStats(void);
+
+	/** Returns the counters of all the pools in the process. */
+	static std::vector<cStats> GetAllStats(void);
+
+protected:
+	class cThreadCache;
+	class cThreadCaches;
+
+	/** The header stored in front of each block. Its size keeps the blocks aligned the same as the heap does. */
+	struct cBlockHeader
+	{
+		/** The cache of the thread that allocated the block, the block is returned there when freed. */
+		cThreadCache * m_Owner;
+
+		/** Links the free blocks into lists. */
+		cBlockHeader * m_Next;
+	};
+
+
+	/** The ID of the pool, indexes the per-thread cache arrays. */
+	size_t m_ID;
+
+	AString m_Name;
+	size_t m_BlockSize;
+
+	/** Protects m_Caches, m_Depot, m_NumDepot and m_MaxCached. */
+	cCriticalSection m_CS;
+
+	/** All the caches ever created for the pool; a cache whose thread has exited is kept for adoption by a new thread. */
+	std::vector<std::unique_ptr<cThreadCache>> m_Caches;
+
+	/** The free blocks shared among the threads, a singly-linked list. */
+	cBlockHeader * m_Depot;
+	size_t m_NumDepot;
+	size_t m_MaxCached;
+
+	std::atomic<size_t> m_NumInUse;
+	std::atomic<size_t> m_HighWater;
+
+	/** Number of blocks currently taken from the heap, either in use or cached. */
+	std::atomic<size_t> m_NumBlocks;
+
+	std::atomic<UInt64> m_NumAllocations;
+	std::atomic<UInt64> m_NumHeapAllocations;
+	std::atomic<UInt64> m_NumRemoteFrees;
+
+
+	/** Returns the calling thread's caches of all the pools, indexed by the pool ID. */
+	static cThreadCaches & GetThreadCaches(void);
+
+	/** Returns the calling thread's cache, creating (or adopting) one if the thread doesn't have any yet. */
+	cThreadCache & GetLocalCache(void);
+
+	/** Returns the calling thread's cache, or nullptr if the thread has none. */
+	cThreadCache * FindLocalCache(void);
+
+	/** Called when the cache's thread exits; moves the cache's blocks into the depot and marks the cache for adoption. */
+	void OrphanCache(cThreadCache & a_Cache);
+
+	/** Moves the list of a_Count blocks into the depot, returns the blocks over the depot's limit to the heap. */
+	void PutToDepot(cBlockHeader * a_First, cBlockHeader * a_Last, size_t a_Count);
+
+	/** Frees the singly-linked list of blocks back to the heap. */
+	void FreeList(cBlockHeader * a_First);
+};
+
+
+
+
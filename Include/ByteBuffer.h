@@ -120,6 +120,11 @@ public:
 	
 	/** Reads the specified number of bytes and writes it into the destinatio bytebuffer. Returns true on success. */
 	bool ReadToByteBuffer(cByteBuffer & a_Dst, size_t a_NumBytes);
+
+	/** If the next a_Count bytes are available for reading and are stored contiguously (not wrapping around the ringbuffer end),
+	sets a_Data to point to them and returns true. Returns false otherwise. Doesn't move the read pointer.
+	The pointer stays valid until the next write into the ringbuffer. */
+	bool PeekContiguous(const char *& a_Data, size_t a_Count) const;
 	
 	/** Removes the bytes that have been read from the ringbuffer */
 	void CommitRead(void);
@@ -149,6 +154,12 @@ protected:
 		mutable std::thread::id m_ThreadID;
 	#endif
 	
+	/** Returns the number of readable bytes starting at m_ReadPos that are stored contiguously (not wrapping around the ringbuffer end) */
+	size_t GetContiguousReadableSpace(void) const;
+
+	/** Returns the number of bytes that can be written starting at m_WritePos without wrapping around the ringbuffer end */
+	size_t GetContiguousFreeSpace(void) const;
+
 	/** Advances the m_ReadPos by a_Count bytes */
 	void AdvanceReadPos(size_t a_Count);
 } ;
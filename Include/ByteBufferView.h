@@ -0,0 +1,91 @@
+
+// ByteBufferView.h
+
+// Interfaces to the cByteBufferView class representing a read-only cursor over a contiguous block of bytes
+
+
+
+
+
+#pragma once
+
+
+
+
+
+/** A non-owning reader over a contiguous block of bytes, with the same ReadXXX API as cByteBuffer.
+Used for parsing a packet in place, without copying it out of the buffer it was received into.
+The viewed data must stay valid and unchanged for the lifetime of the view.
+Like cByteBuffer, this class doesn't implement thread safety. */
+class COMMON_API cByteBufferView
+{
+public:
+	cByteBufferView(const char * a_Data, size_t a_Size);
+
+	/** Returns the total number of bytes in the view. */
+	size_t GetUsedSpace(void) const { return m_Size; }
+
+	/** Returns the number of bytes that are still available for reading */
+	size_t GetReadableSpace(void) const { return m_Size - m_ReadPos; }
+
+	/** Returns true if the specified amount of bytes are available for reading */
+	bool CanReadBytes(size_t a_Count) const { return (a_Count <= GetReadableSpace()); }
+
+	// Read the specified datatype and advance the read pointer; return true if successfully read:
+	bool ReadBEInt8         (Int8 & a_Value);
+	bool ReadBEInt16        (Int16 & a_Value);
+	bool ReadBEInt32        (Int32 & a_Value);
+	bool ReadBEInt64        (Int64 & a_Value);
+	bool ReadBEUInt8        (UInt8 & a_Value);
+	bool ReadBEUInt16       (UInt16 & a_Value);
+	bool ReadBEUInt32       (UInt32 & a_Value);
+	bool ReadBEUInt64       (UInt64 & a_Value);
+	bool ReadBEFloat        (float & a_Value);
+	bool ReadBEDouble       (double & a_Value);
+	bool ReadBool           (bool & a_Value);
+	bool ReadVarInt32       (UInt32 & a_Value);
+	bool ReadVarInt64       (UInt64 & a_Value);
+	bool ReadVarUTF8String  (AString & a_Value);  // string length as VarInt, then string as UTF-8
+
+	/** Reads VarInt, assigns it to anything that can be assigned from an UInt64 (unsigned short, char, Byte, double, ...) */
+	template <typename T> bool ReadVarInt(T & a_Value)
+	{
+		UInt64 v;
+		bool res = ReadVarInt64(v);
+		if (res)
+		{
+			a_Value = static_cast<T>(v);
+		}
+		return res;
+	}
+
+	/** Reads a_Count bytes into a_Buffer; returns true if successful */
+	bool ReadBuf(void * a_Buffer, size_t a_Count);
+
+	/** Reads a_Count bytes into a_String; returns true if successful */
+	bool ReadString(AString & a_String, size_t a_Count);
+
+	/** Skips reading by a_Count bytes; returns false if not enough bytes in the view */
+	bool SkipRead(size_t a_Count);
+
+	/** Reads all available data into a_Data */
+	void ReadAll(AString & a_Data);
+
+	/** Restarts next reading operation at the start of the view */
+	void ResetRead(void) { m_ReadPos = 0; }
+
+	/** Checks if the internal state is valid (read position in bounds) using ASSERTs */
+	void CheckValid(void) const
+	{
+		ASSERT(m_ReadPos <= m_Size);
+	}
+
+protected:
+	const char * m_Data;
+	size_t m_Size;     // Total number of bytes in the view
+	size_t m_ReadPos;  // Where the next read will start
+} ;
+
+
+
+
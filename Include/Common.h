@@ -27,6 +27,10 @@ COMMON_API void LOGINFO(const char * a_Format, ...) FORMATSTRING(1, 2);
 COMMON_API void LOGWARNING(const char * a_Format, ...) FORMATSTRING(1, 2);
 COMMON_API void LOGERROR(const char * a_Format, ...) FORMATSTRING(1, 2);
 
+/** Writes out the queued log messages and switches to synchronous logging (cLogger::StopAsync()).
+Called before terminating on a fatal error, so that the error's diagnostics aren't left in the queue. */
+COMMON_API void StopAsyncLogging(void);
+
 
 
 
@@ -59,13 +63,13 @@ COMMON_API void LOGERROR(const char * a_Format, ...) FORMATSTRING(1, 2);
 
 // Own version of assert() that writes failed assertions to the log for review
 #ifdef  _DEBUG
-#define ASSERT( x) ( !!(x) || ( LOGERROR("Assertion failed: %s, file %s, line %i", #x, __FILE__, __LINE__), PrintStackTrace(), assert(0), 0))
+#define ASSERT( x) ( !!(x) || ( StopAsyncLogging(), LOGERROR("Assertion failed: %s, file %s, line %i", #x, __FILE__, __LINE__), PrintStackTrace(), assert(0), 0))
 #else
 #define ASSERT(x) ((void)(x))
 #endif
 
 // Pretty much the same as ASSERT() but stays in Release builds
-#define VERIFY( x) ( !!(x) || ( LOGERROR("Verification failed: %s, file %s, line %i", #x, __FILE__, __LINE__), PrintStackTrace(), exit(1), 0))
+#define VERIFY( x) ( !!(x) || ( StopAsyncLogging(), LOGERROR("Verification failed: %s, file %s, line %i", #x, __FILE__, __LINE__), PrintStackTrace(), exit(1), 0))
 
 //temporary replacement for std::make_unique until we get c++14
 
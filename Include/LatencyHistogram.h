@@ -0,0 +1,68 @@
+
+// LatencyHistogram.h
+
+// Interfaces to the cLatencyHistogram class representing a lock-free histogram of measured latencies
+
+
+
+
+
+#pragma once
+
+#include <atomic>
+
+
+
+
+
+/** Collects latency samples into power-of-two microsecond buckets.
+Bucket 0 holds the samples below 1 us, bucket N holds the samples in the [2^(N-1), 2^N) us range,
+the last bucket holds everything above that.
+Adding a sample is lock-free and can be done from any thread; the percentiles are computed from a
+non-atomic snapshot of the buckets, so they may be slightly off while samples are being added. */
+class COMMON_API cLatencyHistogram
+{
+public:
+	/** Number of buckets; the last bucket collects all samples of 2^(NUM_BUCKETS - 2) us (~9 minutes) and above. */
+	static const size_t NUM_BUCKETS = 32;
+
+
+	cLatencyHistogram(void);
+
+	/** Adds a single sample to the histogram. */
+	void Add(std::chrono::steady_clock::duration a_Latency);
+
+	/** Adds a single sample, measured from a_Start until now. */
+	void AddSince(std::chrono::steady_clock::time_point a_Start)
+	{
+		Add(std::chrono::steady_clock::now() - a_Start);
+	}
+
+	/** Removes all samples from the histogram. */
+	void Reset(void);
+
+	/** Returns the number of samples in the histogram. */
+	UInt64 GetCount(void) const;
+
+	/** Returns the highest sample seen so far, in microseconds. */
+	UInt64 GetMaxUsec(void) const { return m_MaxUsec.load(std::memory_order_relaxed); }
+
+	/** Returns the upper bound, in microseconds, of the bucket into which the specified percentile (0 - 100) falls.
+	Returns 0 if there are no samples. */
+	UInt64 GetPercentileUsec(double a_Percentile) const;
+
+	/** Returns a one-line summary of the histogram: the sample count, p50, p90, p99 and max. */
+	AString Format(void) const;
+
+protected:
+
+	/** The number of samples in each bucket. */
+	std::array<std::atomic<UInt64>, NUM_BUCKETS> m_Buckets;
+
+	/** The highest sample seen so far, in microseconds. */
+	std::atomic<UInt64> m_MaxUsec;
+};
+
+
+
+
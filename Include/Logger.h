@@ -1,6 +1,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
 
 class COMMON_API cLogger
 {
@@ -15,14 +20,94 @@ public:
 	};
 
 
+	/** What happens to a message logged while the asynchronous queue is full. */
+	enum eOverflowPolicy
+	{
+		opBlock,  ///< The logging thread waits until the writer thread makes room in the queue
+		opDrop,   ///< The message is dropped (and counted in cAsyncStats::m_NumDropped)
+	};
+
+
+	/** Counters describing the asynchronous logging, as reported by GetAsyncStats(). */
+	struct cAsyncStats
+	{
+		/** True if the messages are being written by the writer thread. */
+		bool m_IsAsync;
+
+		/** Number of messages currently waiting in the queue, and the queue's capacity. */
+		size_t m_QueueSize;
+		size_t m_MaxQueueSize;
+
+		/** Number of messages written to the listeners, and the number of batches they were written in. */
+		UInt64 m_NumWritten;
+		UInt64 m_NumBatches;
+
+		/** Number of messages dropped because the queue was full. */
+		UInt64 m_NumDropped;
+
+		/** Number of messages whose logging thread had to wait for room in the queue. */
+		UInt64 m_NumBlocked;
+	};
+
+
+	class cDeferredMessage;
+
+
 	class cListener
 	{
 		public:
 		virtual void Log(AString a_Message, eLogLevel a_LogLevel) = 0;
 
+		/** Returns true if the listener takes the deferred messages unformatted, through LogDeferred(). */
+		virtual bool TakesDeferred(void) const { return false; }
+
+		/** Called instead of Log() for the deferred messages written by the asynchronous writer, if TakesDeferred().
+		The other messages, and the deferred ones logged synchronously, still come formatted through Log(). */
+		virtual void LogDeferred(const cDeferredMessage & a_Message, eLogLevel a_LogLevel)
+		{
+			UNUSED(a_Message);
+			UNUSED(a_LogLevel);
+		}
+
+		/** Called after a message, or a batch of messages, has been passed to Log().
+		Listeners that buffer their output should flush it here, rather than in each Log() call. */
+		virtual void Flush(void) {}
+
 		virtual ~cListener(){}
 	};
 
+	/** A message whose formatting is deferred to the writer thread.
+	Holds the format string (which must be a literal, it serves as the message's static ID) and the time of logging;
+	the descendants hold the captured arguments. */
+	class cDeferredMessage
+	{
+	public:
+		cDeferredMessage(const char * a_Format) :
+			m_Format(a_Format),
+			m_Time(time(nullptr))
+			#ifdef _DEBUG
+			, m_ThreadID(std::this_thread::get_id())
+			#endif
+		{
+		}
+
+		virtual ~cDeferredMessage() {}
+
+		/** Returns the formatted message, without the line prefix. */
+		virtual AString Format(void) const = 0;
+
+		/** Appends the captured arguments to a_Out, in the binary log's encoding (see cBinaryLogFile). */
+		virtual void AppendArgs(AString & a_Out) const = 0;
+
+		const char * m_Format;
+		time_t m_Time;
+
+		#ifdef _DEBUG
+			std::thread::id m_ThreadID;
+		#endif
+	};
+
+
 	class cAttachment
 	{
 		public:
@@ -30,11 +115,16 @@ public:
 		cAttachment(cAttachment && a_other)
 			: m_listener(a_other.m_listener)
 		{
+			// The moved-from attachment mustn't detach the listener:
+			a_other.m_listener = nullptr;
 		}
 
 		~cAttachment()
 		{
-			cLogger::GetInstance().DetachListener(m_listener);
+			if (m_listener != nullptr)
+			{
+				cLogger::GetInstance().DetachListener(m_listener);
+			}
 		}
 
 		private:
@@ -46,33 +136,280 @@ public:
 		cAttachment(cListener * a_listener) : m_listener(a_listener) {}
 	};
 
+	cLogger(void);
+	~cLogger();
+
 	void Log  (const char * a_Format, eLogLevel a_LogLevel, va_list a_ArgList) FORMATSTRING(2, 0);
 
 	/** Logs the simple text message at the specified log level. */
 	void LogSimple(AString a_Message, eLogLevel a_LogLevel = llRegular);
 
+	/** Logs the message with deferred formatting: when logging asynchronously, only the format and a copy of the
+	arguments are queued, the writer thread does the formatting. Use through the FASTLOG family of macros,
+	which check the format at compile time and make sure it is a literal. */
+	template <typename... Args>
+	void LogDeferred(eLogLevel a_LogLevel, const char * a_Format, const Args &... a_Args)
+	{
+		if (m_Async.load(std::memory_order_relaxed) == nullptr)
+		{
+			// Nothing to defer to, format right away:
+			LogSimple(Printf(a_Format, a_Args...), a_LogLevel);
+			return;
+		}
+		LogDeferredMessage(
+			std::unique_ptr<cDeferredMessage>(new cDeferredMessageImpl<typename cCapturedArg<Args>::Type...>(a_Format, a_Args...)),
+			a_LogLevel
+		);
+	}
+
+	/** Never called, only used in the FASTLOG macros to let the compiler check the format against the arguments. */
+	static void CheckFormat(const char * a_Format, ...) FORMATSTRING(1, 2);
+
 	cAttachment AttachListener(std::unique_ptr<cListener> a_Listener);
-	
+
+	/** Switches to asynchronous logging: the messages are queued and a dedicated writer thread passes them to
+	the listeners in batches, so that the logging threads never wait for the listeners' I/O.
+	At most a_MaxQueueSize messages may wait in the queue, a_Policy decides what happens to messages over that.
+	May be called only once. */
+	void StartAsync(size_t a_MaxQueueSize, eOverflowPolicy a_Policy);
+
+	/** Writes out all the queued messages, stops the writer thread and switches back to synchronous logging.
+	The messages still being pushed by other threads at that moment are written out as well.
+	Used also on a crash, so that the diagnostics logged afterwards are written synchronously; it may then be called
+	on the writer thread itself, or again after it has already stopped. */
+	void StopAsync(void);
+
+	/** Returns the current asynchronous logging counters. */
+	cAsyncStats GetAsyncStats(void);
+
+
 	static cLogger & GetInstance(void);
 	// Must be called before calling GetInstance in a multithreaded context
 	static void InitiateMultithreading();
 private:
 
+	class cAsyncWriter;
+
 	cCriticalSection m_CriticalSection;
 	std::vector<std::unique_ptr<cListener>> m_LogListeners;
 
+	/** The writer thread used for asynchronous logging, nullptr if StartAsync() hasn't been called.
+	Kept even after StopAsync(), because other threads may still be pushing into it. */
+	std::unique_ptr<cAsyncWriter> m_AsyncWriter;
+
+	/** The writer into which the messages are currently queued, nullptr when logging synchronously. */
+	std::atomic<cAsyncWriter *> m_Async;
+
+	/** Number of logging threads that may have loaded a non-null m_Async and not yet finished pushing into it.
+	Incremented before loading m_Async, so that StopAsync() can wait for their messages. */
+	std::atomic<int> m_NumPushing;
+
 	void DetachListener(cListener * a_Listener);
 
+	/** Passes the line to all the listeners. The caller must hold m_CriticalSection. */
+	void WriteToListeners(const AString & a_Line, eLogLevel a_LogLevel);
+
+	/** Passes the deferred message to all the listeners, unformatted to those that take it so; it is formatted
+	only if another listener needs the line. The caller must hold m_CriticalSection. */
+	void WriteDeferredToListeners(const cDeferredMessage & a_Message, eLogLevel a_LogLevel);
+
+	/** Lets all the listeners flush their output. The caller must hold m_CriticalSection. */
+	void FlushListeners(void);
+
+	/** Queues the deferred message to the writer thread, or formats and logs it right away if logging synchronously. */
+	void LogDeferredMessage(std::unique_ptr<cDeferredMessage> a_Message, eLogLevel a_LogLevel);
+
+
+	/** The type in which an argument of a deferred message is captured.
+	Strings are copied, because the caller's buffer may be gone by the time the message is formatted;
+	other pointers are kept as values (for "%p"). Class types are not allowed, same as in printf(). */
+	template <typename T>
+	struct cCapturedArg
+	{
+		static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value,
+			"Deferred log arguments must be numbers, enums, pointers or C strings"
+		);
+		typedef T Type;
+		static const T & Capture(const T & a_Arg) { return a_Arg; }
+	};
+
+	/** Strings are captured by copying them. */
+	struct cCapturedString
+	{
+		typedef AString Type;
+		static AString Capture(const char * a_Arg) { return (a_Arg != nullptr) ? AString(a_Arg) : AString("(null)"); }
+	};
+
+
+	/** A deferred message holding the arguments as Captured types. */
+	template <typename... Captured>
+	class cDeferredMessageImpl :
+		public cDeferredMessage
+	{
+	public:
+		template <typename... Args>
+		cDeferredMessageImpl(const char * a_Format, const Args &... a_Args) :
+			cDeferredMessage(a_Format),
+			m_Args(cCapturedArg<Args>::Capture(a_Args)...)
+		{
+		}
+
+		virtual AString Format(void) const override
+		{
+			return FormatArgs(std::index_sequence_for<Captured...>());
+		}
+
+		virtual void AppendArgs(AString & a_Out) const override
+		{
+			AppendArgs(a_Out, std::index_sequence_for<Captured...>());
+		}
+
+	protected:
+		std::tuple<Captured...> m_Args;
+
+		template <size_t... Idx>
+		AString FormatArgs(std::index_sequence<Idx...>) const
+		{
+			return Printf(m_Format, PassArg(std::get<Idx>(m_Args))...);
+		}
+
+		template <size_t... Idx>
+		void AppendArgs(AString & a_Out, std::index_sequence<Idx...>) const
+		{
+			// Append the arguments in their order (the braced list guarantees the order of evaluation):
+			int Dummy[] = {0, (AppendArg(a_Out, std::get<Idx>(m_Args)), 0)...};
+			UNUSED(Dummy);
+		}
+
+		/** Returns the captured argument in the form that printf() expects. */
+		template <typename T>
+		static const T & PassArg(const T & a_Arg) { return a_Arg; }
+		static const char * PassArg(const AString & a_Arg) { return a_Arg.c_str(); }
+
+		/** Appends a number or pointer argument: its type tag, its size and 8 bytes of its value. */
+		template <typename T>
+		static void AppendArg(AString & a_Out, const T & a_Arg)
+		{
+			char Tag;
+			UInt64 Bits;
+			EncodeArg(a_Arg, Tag, Bits);
+			a_Out.push_back(Tag);
+			a_Out.push_back(static_cast<char>(sizeof(T)));
+			a_Out.append(reinterpret_cast<const char *>(&Bits), sizeof(Bits));
+		}
+
+		/** Appends a string argument: its type tag, its 4-byte length and its contents. */
+		static void AppendArg(AString & a_Out, const AString & a_Arg)
+		{
+			UInt32 Length = static_cast<UInt32>(a_Arg.size());
+			a_Out.push_back('s');
+			a_Out.append(reinterpret_cast<const char *>(&Length), sizeof(Length));
+			a_Out.append(a_Arg);
+		}
+
+		/** Integers and enums are sign- or zero-extended, according to their (underlying) type. */
+		template <typename T>
+		static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type EncodeArg(T a_Arg, char & a_Tag, UInt64 & a_Bits)
+		{
+			a_Tag = cIsSignedArg<T>::value ? 'i' : 'u';
+			a_Bits = static_cast<UInt64>(a_Arg);
+		}
+
+		/** Floating point numbers are kept as the bits of the double that printf() receives. */
+		static void EncodeArg(double a_Arg, char & a_Tag, UInt64 & a_Bits)
+		{
+			static_assert(sizeof(a_Arg) == sizeof(a_Bits), "The double must fit the encoding");
+			a_Tag = 'd';
+			memcpy(&a_Bits, &a_Arg, sizeof(a_Bits));
+		}
+
+		static void EncodeArg(const void * a_Arg, char & a_Tag, UInt64 & a_Bits)
+		{
+			a_Tag = 'p';
+			a_Bits = static_cast<UInt64>(reinterpret_cast<uintptr_t>(a_Arg));
+		}
+	};
+
+
+	/** Whether the integer or enum argument is encoded as signed. */
+	template <typename T, bool IsEnum = std::is_enum<T>::value>
+	struct cIsSignedArg : public std::is_signed<T> {};
+
+	template <typename T>
+	struct cIsSignedArg<T, true> : public std::is_signed<typename std::underlying_type<T>::type> {};
+
 };
 
 
 
 
+template <> struct cLogger::cCapturedArg<const char *> : public cLogger::cCapturedString {};
+template <> struct cLogger::cCapturedArg<char *> : public cLogger::cCapturedString {};
+template <size_t N> struct cLogger::cCapturedArg<char[N]> : public cLogger::cCapturedString {};
+
+
+
+inline void cLogger::CheckFormat(const char * a_Format, ...)
+{
+	UNUSED(a_Format);
+}
+
+
+
+
+
+/** The minimum level of the FASTLOG messages compiled in; the messages below it compile to nothing.
+Define on the compiler command line to strip the less important messages from a build, for example
+-DLOG_MIN_LEVEL=2 leaves only the warnings and errors. */
+#ifndef LOG_MIN_LEVEL
+	#define LOG_MIN_LEVEL 0
+#endif
+
+/** Logs a message with deferred formatting (see cLogger::LogDeferred()).
+The format must be a string literal, the arguments are checked against it at compile time.
+The arguments are not evaluated at all if a_LogLevel is below LOG_MIN_LEVEL. */
+#define FASTLOG_LEVEL(a_LogLevel, a_Format, ...) \
+	do \
+	{ \
+		if (false) \
+		{ \
+			cLogger::CheckFormat("" a_Format, ##__VA_ARGS__); \
+		} \
+		if (static_cast<int>(a_LogLevel) >= LOG_MIN_LEVEL) \
+		{ \
+			cLogger::GetInstance().LogDeferred(a_LogLevel, "" a_Format, ##__VA_ARGS__); \
+		} \
+	} while (false)
+
+#define FASTLOG(a_Format, ...)        FASTLOG_LEVEL(cLogger::llRegular, a_Format, ##__VA_ARGS__)
+#define FASTLOGINFO(a_Format, ...)    FASTLOG_LEVEL(cLogger::llInfo,    a_Format, ##__VA_ARGS__)
+#define FASTLOGWARNING(a_Format, ...) FASTLOG_LEVEL(cLogger::llWarning, a_Format, ##__VA_ARGS__)
+#define FASTLOGERROR(a_Format, ...)   FASTLOG_LEVEL(cLogger::llError,   a_Format, ##__VA_ARGS__)
+
+// In debug builds, FASTLOGD is the same as FASTLOG; otherwise only the format check is left:
+#ifdef _DEBUG
+	#define FASTLOGD FASTLOG
+#else
+	#define FASTLOGD(a_Format, ...) \
+		do \
+		{ \
+			if (false) \
+			{ \
+				cLogger::CheckFormat("" a_Format, ##__VA_ARGS__); \
+			} \
+		} while (false)
+#endif  // _DEBUG
+
+
+
+
+
 // These declarations are duplicated in globals.h
 COMMON_API void LOG(const char * a_Format, ...) FORMATSTRING(1, 2);
 COMMON_API void LOGINFO(const char * a_Format, ...) FORMATSTRING(1, 2);
 COMMON_API void LOGWARNING(const char * a_Format, ...) FORMATSTRING(1, 2);
 COMMON_API void LOGERROR(const char * a_Format, ...) FORMATSTRING(1, 2);
+COMMON_API void StopAsyncLogging(void);
 
 
 
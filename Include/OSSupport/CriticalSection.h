@@ -7,6 +7,10 @@ class COMMON_API cCriticalSection
 public:
 	void Lock(void);
 	void Unlock(void);
+
+	/** Locks the CS only if it can be done without waiting.
+	Returns true if the CS has been locked (and needs an Unlock() call), false if it is held by another thread. */
+	bool TryLock(void);
 	
 	// IsLocked / IsLockedByCurrentThread are only used in ASSERT statements, but because of the changes with ASSERT they must always be defined
 	// The fake versions (in Release) will not effect the program in any way
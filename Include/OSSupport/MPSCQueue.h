@@ -0,0 +1,104 @@
+
+// MPSCQueue.h
+
+// Implements the cMPSCQueue class representing a lock-free multiple-producer single-consumer queue
+
+#pragma once
+
+#include <atomic>
+
+/*
+Any number of threads may enqueue items at the same time, each Enqueue() is a single atomic exchange,
+no lock is ever taken. Only a single thread (the owner of the queue) may dequeue the items.
+The items enqueued by a single thread are dequeued in the order they were enqueued.
+
+Note that TryDequeue() may return false while an Enqueue() is still in progress in another thread,
+the item becomes available only after Enqueue() returns. Producers that need to wake up the consumer
+should do so only after their Enqueue() call returns.
+
+Usage:
+To create a queue of type T, instantiate a cMPSCQueue<T> object. T needs to be default-constructible
+and movable. */
+
+
+
+
+
+template <class ItemType>
+class cMPSCQueue
+{
+public:
+	cMPSCQueue(void):
+		m_Head(new cNode),
+		m_Tail(m_Head.load(std::memory_order_relaxed))
+	{
+	}
+
+
+	~cMPSCQueue()
+	{
+		while (m_Tail != nullptr)
+		{
+			cNode * Next = m_Tail->m_Next.load(std::memory_order_relaxed);
+			delete m_Tail;
+			m_Tail = Next;
+		}
+	}
+
+
+	/** Adds the item at the end of the queue. Can be called from any thread. */
+	void Enqueue(ItemType && a_Item)
+	{
+		cNode * Node = new cNode(std::move(a_Item));
+		cNode * Prev = m_Head.exchange(Node, std::memory_order_acq_rel);
+		Prev->m_Next.store(Node, std::memory_order_release);
+	}
+
+
+	/** Removes the item from the front of the queue into a_Item.
+	Returns false if the queue is empty, a_Item is left untouched then.
+	Must be called only from the consumer thread. */
+	bool TryDequeue(ItemType & a_Item)
+	{
+		cNode * Next = m_Tail->m_Next.load(std::memory_order_acquire);
+		if (Next == nullptr)
+		{
+			return false;
+		}
+
+		// The Next node becomes the new stub, its item has been taken:
+		a_Item = std::move(Next->m_Item);
+		delete m_Tail;
+		m_Tail = Next;
+		return true;
+	}
+
+private:
+
+	struct cNode
+	{
+		std::atomic<cNode *> m_Next;
+		ItemType m_Item;
+
+		cNode(void):
+			m_Next(nullptr)
+		{
+		}
+
+		cNode(ItemType && a_Item):
+			m_Next(nullptr),
+			m_Item(std::move(a_Item))
+		{
+		}
+	};
+
+	/** The most recently enqueued node, where producers link new nodes. */
+	std::atomic<cNode *> m_Head;
+
+	/** The stub node preceding the oldest item in the queue; only accessed by the consumer. */
+	cNode * m_Tail;
+};
+
+
+
+
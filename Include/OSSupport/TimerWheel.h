@@ -0,0 +1,200 @@
+
+// TimerWheel.h
+
+// Interfaces to the cTimerWheel class representing a hierarchical timing wheel for large numbers of timers
+
+// The wheel has NUM_LEVELS levels; the lowest one has a slot per tick (the wheel's granularity), each higher one
+// has slots spanning the whole range of the level below it. A timer is put into the lowest level whose range covers
+// its deadline, and is moved down a level ("cascaded") when the level below wraps around to its slot; it expires
+// when the lowest level reaches its slot. Arming and cancelling a timer is O(1) (the slots are intrusive
+// doubly-linked lists), expiry is done in batches of whole slots, and the stretches of ticks with no timers
+// to process are skipped, so an idle wheel costs nothing to advance.
+//
+// The wheel is not thread-safe, all its timers must be armed, cancelled and advanced from a single thread.
+// cNetworkSingleton keeps a wheel for each LibEvent loop, advanced from the loop's own thread.
+
+
+
+
+
+#pragma once
+
+#include <functional>
+
+
+
+
+
+class COMMON_API cTimerWheel
+{
+public:
+	typedef std::chrono::steady_clock::time_point cTimePoint;
+
+
+	/** The link part of a timer, also used as the head of the slots' lists. */
+	struct cLink
+	{
+		cLink * m_Prev;
+		cLink * m_Next;
+	};
+
+
+	/** A single timer, usually a member of the object whose timeout it tracks.
+	When the timer expires, it is disarmed and its callback is called from within cTimerWheel::Advance(); the callback
+	may re-arm or cancel any timer, including its own one, and may even destroy the object owning the timer.
+	A timer is cancelled automatically when destroyed. */
+	class COMMON_API cTimer :
+		protected cLink
+	{
+	public:
+		cTimer(void);
+		cTimer(std::function<void()> a_Callback);
+		~cTimer();
+
+		/** Sets the function called when the timer expires. */
+		void SetCallback(std::function<void()> a_Callback) { m_Callback = std::move(a_Callback); }
+
+		/** Disarms the timer, if armed. Must be called from the wheel's thread. */
+		void Cancel(void);
+
+		/** Returns true if the timer is armed in a wheel. */
+		bool IsArmed(void) const { return (m_Wheel != nullptr); }
+
+		/** Returns the deadline the timer was last armed with. */
+		cTimePoint GetDeadline(void) const { return m_Deadline; }
+
+	protected:
+		friend class cTimerWheel;
+
+		std::function<void()> m_Callback;
+
+		/** The wheel in which the timer is armed, nullptr if not armed. */
+		cTimerWheel * m_Wheel;
+
+		/** The level of the wheel whose slot the timer is in (or was taken from, while being cascaded or expired). */
+		size_t m_Level;
+
+		/** The tick in which the timer expires. */
+		UInt64 m_ExpiryTick;
+
+		cTimePoint m_Deadline;
+
+		DISALLOW_COPY_AND_ASSIGN(cTimer);
+	};
+
+
+	/** Counters describing the wheel's work, as reported by GetStats(). */
+	struct cStats
+	{
+		/** Number of timers currently armed. */
+		size_t m_NumArmed;
+
+		/** Number of times a timer has been armed (including re-arming an armed timer). */
+		UInt64 m_NumArms;
+
+		/** Number of timers cancelled while armed. */
+		UInt64 m_NumCancels;
+
+		/** Number of timers that have expired. */
+		UInt64 m_NumExpired;
+
+		/** Number of timers moved down a level. */
+		UInt64 m_NumCascaded;
+	};
+
+
+	/** Number of bits of the tick indexing the lowest level's slots. */
+	static const unsigned LEVEL0_BITS = 8;
+
+	/** Number of bits of the tick indexing the slots of each higher level. */
+	static const unsigned LEVEL_BITS = 6;
+
+	/** Number of levels; with the bits above, the wheel spans 2^26 ticks, the timers further away are parked in the top level. */
+	static const size_t NUM_LEVELS = 4;
+
+
+	/** Creates a wheel with the specified tick length. The wheel's time starts now. */
+	cTimerWheel(std::chrono::milliseconds a_Granularity);
+
+	/** Disarms all the timers still armed. */
+	~cTimerWheel();
+
+	/** Arms the timer to expire at the specified deadline; if it's already armed (in this or another wheel), it is re-armed.
+	The timer never expires before its deadline; it expires in the first Advance() after the end of the deadline's tick. */
+	void Arm(cTimer & a_Timer, cTimePoint a_Deadline);
+
+	/** Expires all the timers whose deadline is at or before a_Now, calling their callbacks.
+	Returns the number of timers expired. */
+	size_t Advance(cTimePoint a_Now);
+
+	/** Returns the time when the next Advance() call may have something to do: a slot with timers expires, or a higher
+	level needs cascading. Returns false if there's no timer armed. */
+	bool GetNextExpiry(cTimePoint & a_Time) const;
+
+	/** Returns the number of timers currently armed. */
+	size_t GetNumArmed(void) const { return m_NumArmed; }
+
+	std::chrono::milliseconds GetGranularity(void) const { return m_Granularity; }
+
+	/** Returns the current counters. */
+	cStats GetStats(void) const;
+
+protected:
+
+	/** The length of a single tick. */
+	std::chrono::milliseconds m_Granularity;
+
+	/** The time of tick 0. */
+	cTimePoint m_StartTime;
+
+	/** The first tick not yet processed by Advance(). */
+	UInt64 m_NextTick;
+
+	/** The slots of all the levels; the level L slots start at index L * 2^LEVEL0_BITS (only the lowest level uses all of them). */
+	std::vector<cLink> m_Slots;
+
+	/** Number of timers in each level, including the ones taken from the level's slots but not yet cascaded or expired. */
+	size_t m_LevelCounts[NUM_LEVELS];
+
+	size_t m_NumArmed;
+	UInt64 m_NumArms;
+	UInt64 m_NumCancels;
+	UInt64 m_NumExpired;
+	UInt64 m_NumCascaded;
+
+
+	/** Puts the armed timer into the slot corresponding to its m_ExpiryTick. */
+	void Place(cTimer & a_Timer);
+
+	/** Removes the timer from whatever list it is in. */
+	void Unlink(cTimer & a_Timer);
+
+	/** Moves all the timers from the specified slot into a_List (an unlinked list head). */
+	void TakeSlot(size_t a_Level, size_t a_SlotIdx, cLink & a_List);
+
+	/** Processes the tick m_NextTick: cascades the higher levels if the lower ones wrap around
+	and expires the lowest level's slot. Returns the number of timers expired. */
+	size_t ProcessNextTick(void);
+
+	/** Returns the head of the specified slot's list. */
+	cLink & GetSlot(size_t a_Level, size_t a_SlotIdx) { return m_Slots[(a_Level << LEVEL0_BITS) + a_SlotIdx]; }
+
+	/** Returns the number of the tick that ends at or after the specified time. */
+	UInt64 GetTickAtOrAfter(cTimePoint a_Time) const;
+
+	/** Returns the number of the last tick that has ended at or before the specified time. */
+	UInt64 GetTickBefore(cTimePoint a_Time) const;
+
+	/** Returns the time when the specified tick ends. */
+	cTimePoint GetTickEnd(UInt64 a_Tick) const { return m_StartTime + m_Granularity * static_cast<std::chrono::milliseconds::rep>(a_Tick); }
+
+	/** Returns the first bit of the tick that indexes the specified level's slots. */
+	static unsigned GetLevelShift(size_t a_Level) { return (a_Level == 0) ? 0 : LEVEL0_BITS + static_cast<unsigned>(a_Level - 1) * LEVEL_BITS; }
+
+	/** Returns the number of slots in the specified level. */
+	static size_t GetLevelSize(size_t a_Level) { return static_cast<size_t>(1) << ((a_Level == 0) ? LEVEL0_BITS : LEVEL_BITS); }
+};
+
+
+
+
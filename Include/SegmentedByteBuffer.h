@@ -0,0 +1,152 @@
+
+// SegmentedByteBuffer.h
+
+// Interfaces to the cSegmentedByteBuffer class representing a growable byte queue stored in pooled fixed-size chunks
+
+
+
+
+
+#pragma once
+
+#include "BlockPool.h"
+
+
+
+
+
+/** A byte queue for the received data, stored in fixed-size chunks instead of a single preallocated ringbuffer.
+It has the subset of cByteBuffer's API that the packet framing uses: the data is written in blocks as received,
+the packet length is read as a VarInt and the packet itself is either accessed in place or copied out.
+An empty buffer owns no memory at all. The chunks are taken from a global cBlockPool as the data is written and returned
+to the pool as soon as all their data has been read and committed, so an idle connection costs only the object itself.
+The buffer grows up to the maximum size specified in the constructor; if more than that is requested, the write
+operation fails, same as with cByteBuffer.
+The reading doesn't actually remove the bytes, it only moves the internal read ptr.
+To remove the bytes, call CommitRead(). To re-start reading from the beginning, call ResetRead().
+This class doesn't implement thread safety, the clients of this class need to provide their own synchronization.
+The chunk pool is thread-safe, a buffer may be destroyed by a different thread than the one that filled it. */
+class COMMON_API cSegmentedByteBuffer
+{
+public:
+	/** Size of a single chunk. */
+	static const size_t CHUNK_SIZE = 4 KiB;
+
+
+	/** Creates an empty buffer that can hold up to a_MaxSize bytes. */
+	cSegmentedByteBuffer(size_t a_MaxSize);
+	~cSegmentedByteBuffer();
+
+	/** Writes the bytes specified to the buffer. Returns true if successful, false if not */
+	bool Write(const void * a_Bytes, size_t a_Count);
+
+	/** Returns the number of bytes that can be successfully written to the buffer */
+	size_t GetFreeSpace(void) const { return m_MaxSize - GetUsedSpace(); }
+
+	/** Returns the number of bytes that are currently in the buffer. Note GetReadableBytes() */
+	size_t GetUsedSpace(void) const { return m_WritePos - m_DataStart; }
+
+	/** Returns the number of bytes that are currently available for reading (may be less than UsedSpace due to some data having been read already) */
+	size_t GetReadableSpace(void) const { return m_WritePos - m_ReadPos; }
+
+	/** Returns the number of bytes of memory currently held by the buffer's chunks. */
+	size_t GetAllocatedSize(void) const { return m_NumChunks * CHUNK_SIZE; }
+
+	/** Returns true if the specified amount of bytes are available for reading */
+	bool CanReadBytes(size_t a_Count) const { return (a_Count <= GetReadableSpace()); }
+
+	/** Returns true if the specified amount of bytes are available for writing */
+	bool CanWriteBytes(size_t a_Count) const { return (a_Count <= GetFreeSpace()); }
+
+	/** Reads a VarInt and advances the read pointer; returns true if successfully read. */
+	bool ReadVarInt64(UInt64 & a_Value);
+
+	/** Reads VarInt, assigns it to anything that can be assigned from an UInt64 (unsigned short, char, Byte, double, ...) */
+	template <typename T> bool ReadVarInt(T & a_Value)
+	{
+		UInt64 v;
+		bool res = ReadVarInt64(v);
+		if (res)
+		{
+			a_Value = static_cast<T>(v);
+		}
+		return res;
+	}
+
+	/** Reads a_Count bytes into a_String; returns true if successful */
+	bool ReadString(AString & a_String, size_t a_Count);
+
+	/** Skips reading by a_Count bytes; returns false if not enough bytes in the buffer */
+	bool SkipRead(size_t a_Count);
+
+	/** If the next a_Count bytes are available for reading and are stored contiguously (within a single chunk),
+	sets a_Data to point to them and returns true. Returns false otherwise. Doesn't move the read pointer.
+	The pointer stays valid until the next CommitRead() or write into the buffer. */
+	bool PeekContiguous(const char *& a_Data, size_t a_Count) const;
+
+	/** Removes the bytes that have been read from the buffer, returning the drained chunks to the pool.
+	The pointers returned by PeekContiguous() are invalid afterwards, the chunks may be reused by another thread right away. */
+	void CommitRead(void);
+
+	/** Restarts next reading operation at the start of the uncommitted data */
+	void ResetRead(void) { m_ReadPos = m_DataStart; }
+
+	/** Checks if the internal state is valid (read and write positions in the correct bounds) using ASSERTs */
+	void CheckValid(void) const;
+
+	/** Sets the maximum number of free chunks kept in the global pool's depot for reuse. */
+	static void SetMaxPooledChunks(size_t a_MaxPooled);
+
+	/** Returns the counters of the global chunk pool. */
+	static cBlockPool::cStats GetPoolStats(void);
+
+protected:
+	/** Number of the chunk pointers stored in the object itself. A buffer holding more chunks keeps the list of the pointers
+	on the heap, until it is drained completely. */
+	static const size_t NUM_INLINE_CHUNKS = 2;
+
+
+	/** The chunks holding the data, in order; points either to m_InlineChunks, or to a heap array of m_ChunksCapacity pointers.
+	The positions below are relative to the start of the first chunk. */
+	char ** m_Chunks;
+
+	/** Number of the chunks in m_Chunks. */
+	size_t m_NumChunks;
+
+	/** Number of the chunk pointers m_Chunks has space for. */
+	size_t m_ChunksCapacity;
+
+	/** The storage for the first chunk pointers, used while the buffer holds at most NUM_INLINE_CHUNKS chunks. */
+	char * m_InlineChunks[NUM_INLINE_CHUNKS];
+
+	/** The maximum number of bytes the buffer may hold. */
+	size_t m_MaxSize;
+
+	size_t m_DataStart;  // Where the data starts
+	size_t m_WritePos;   // Where the data ends
+	size_t m_ReadPos;    // Where the next read will start
+
+
+	/** Returns the pointer to the data at the specified position. */
+	char * GetPtr(size_t a_Pos) const { return m_Chunks[a_Pos / CHUNK_SIZE] + (a_Pos % CHUNK_SIZE); }
+
+	/** Returns the number of bytes from the specified position till the end of its chunk. */
+	static size_t TillChunkEnd(size_t a_Pos) { return CHUNK_SIZE - (a_Pos % CHUNK_SIZE); }
+
+	/** Appends a chunk from the pool to m_Chunks, moving the list of the chunks to the heap if it doesn't fit the object. */
+	void AddChunk(void);
+
+	/** Returns the first a_Count chunks to the pool and removes them from m_Chunks.
+	Once no chunks are left, the heap list of the chunks is freed. */
+	void FreeChunks(size_t a_Count);
+
+	/** Copies a_Count bytes starting at a_Pos into a_Dst; the bytes must be present. */
+	void CopyOut(size_t a_Pos, char * a_Dst, size_t a_Count) const;
+
+private:
+	DISALLOW_COPY_AND_ASSIGN(cSegmentedByteBuffer);
+} ;
+
+
+
+
@@ -0,0 +1,111 @@
+
+// VarInt.h
+
+// Declares the functions encoding and decoding the VarInts (LEB128, 7 bits per byte, lowest bits first) over raw memory
+
+// These are the fast paths used by cByteBuffer, cByteBufferView and cPacketizer when the whole VarInt fits
+// into a contiguous block of memory. The decoders don't check the bounds per byte, the callers are responsible
+// for guaranteeing that MAX_VARINT32_SIZE / MAX_VARINT64_SIZE bytes can be read.
+
+
+
+
+
+#pragma once
+
+
+
+
+
+/** The maximum number of bytes a VarInt-encoded 32-bit value takes. */
+static const size_t MAX_VARINT32_SIZE = 5;
+
+/** The maximum number of bytes a VarInt-encoded 64-bit value takes. */
+static const size_t MAX_VARINT64_SIZE = 10;
+
+
+
+
+
+/** Encodes the value as a VarInt into a_Dst, which must have space for at least MAX_VARINT32_SIZE bytes.
+Returns the number of bytes written. */
+inline size_t EncodeVarInt32(UInt32 a_Value, char * a_Dst)
+{
+	size_t idx = 0;
+	while (a_Value > 0x7f)
+	{
+		a_Dst[idx++] = static_cast<char>(a_Value | 0x80);
+		a_Value >>= 7;
+	}
+	a_Dst[idx++] = static_cast<char>(a_Value);
+	return idx;
+}
+
+
+
+
+
+/** Encodes the value as a VarInt into a_Dst, which must have space for at least MAX_VARINT64_SIZE bytes.
+Returns the number of bytes written. */
+inline size_t EncodeVarInt64(UInt64 a_Value, char * a_Dst)
+{
+	size_t idx = 0;
+	while (a_Value > 0x7f)
+	{
+		a_Dst[idx++] = static_cast<char>(a_Value | 0x80);
+		a_Value >>= 7;
+	}
+	a_Dst[idx++] = static_cast<char>(a_Value);
+	return idx;
+}
+
+
+
+
+
+/** Decodes a VarInt from a_Src, which must have at least MAX_VARINT32_SIZE bytes readable.
+Returns the number of bytes consumed, or 0 if the VarInt is longer than MAX_VARINT32_SIZE bytes (a_Value is not set then).
+The bits above the 32nd are silently dropped, same as the byte-by-byte readers do. */
+inline size_t DecodeVarInt32(const char * a_Src, UInt32 & a_Value)
+{
+	const unsigned char * Src = reinterpret_cast<const unsigned char *>(a_Src);
+	UInt32 b;
+	UInt32 res;
+
+	// Each step adds the whole byte and subtracts the continuation bit of the previous byte, saving a mask per byte:
+	b = Src[0]; res  = b;                        if (b < 0x80) { a_Value = res; return 1; }
+	b = Src[1]; res += (b << 7)  - 0x80;         if (b < 0x80) { a_Value = res; return 2; }
+	b = Src[2]; res += (b << 14) - (0x80 << 7);  if (b < 0x80) { a_Value = res; return 3; }
+	b = Src[3]; res += (b << 21) - (0x80 << 14); if (b < 0x80) { a_Value = res; return 4; }
+	b = Src[4]; res += (b << 28) - (0x80 << 21); if (b < 0x80) { a_Value = res; return 5; }
+	return 0;
+}
+
+
+
+
+
+/** Decodes a VarInt from a_Src, which must have at least MAX_VARINT64_SIZE bytes readable.
+Returns the number of bytes consumed, or 0 if the VarInt is longer than MAX_VARINT64_SIZE bytes (a_Value is not set then). */
+inline size_t DecodeVarInt64(const char * a_Src, UInt64 & a_Value)
+{
+	const unsigned char * Src = reinterpret_cast<const unsigned char *>(a_Src);
+
+	// The loop has a constant trip count and no bounds checks, so the compilers unroll it:
+	UInt64 res = 0;
+	for (size_t i = 0; i < MAX_VARINT64_SIZE; i++)
+	{
+		UInt64 b = Src[i];
+		res |= (b & 0x7f) << (7 * i);
+		if (b < 0x80)
+		{
+			a_Value = res;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+
+
+
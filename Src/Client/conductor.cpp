@@ -55,6 +55,7 @@ protected:
 
 Conductor::Conductor(PeerConnectionClient* client, MainWindow* main_wnd)
 	: peer_id_(-1),
+	relay_port_(0),
 	client_(client),
 	main_wnd_(main_wnd) {
 	client_->RegisterObserver(this);
@@ -353,6 +354,14 @@ void Conductor::OnMessageFromPeer(int peer_id, const std::string& message) {
 	}
 }
 
+void Conductor::OnRelayAllocated(int peer_id, int port) {
+	RTC_LOG(INFO) << __FUNCTION__ << " " << peer_id << " " << port;
+	if (peer_id != peer_id_) {
+		return;
+	}
+	relay_port_ = port;
+}
+
 void Conductor::OnMessageSent(int err) {
 	// Process the next pending message if any.
 	main_wnd_->QueueUIThreadCallback(SEND_MESSAGE_TO_PEER, NULL);
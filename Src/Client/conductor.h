@@ -80,6 +80,8 @@ protected:
 
 	virtual void OnMessageFromPeer(int peer_id, const AString& message);
 
+	virtual void OnRelayAllocated(int peer_id, int port);
+
 	virtual void OnMessageSent(int err);
 
 	virtual void OnServerConnectionFailure();
@@ -110,6 +112,8 @@ protected:
 	void SendMessage(const AString& json_object);
 
 	int peer_id_;
+	// Our UDP relay port on the server for the current peer, 0 if there is no relay.
+	int relay_port_;
 	rtc::scoped_refptr<webrtc::PeerConnectionInterface> peer_connection_;
 	rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface>
 		peer_connection_factory_;
@@ -169,6 +169,14 @@ bool PeerConnectionClient::RequestToPeer(int peer_id)
 	return true;
 }
 
+bool PeerConnectionClient::RequestRelay(int peer_id, UInt16 own_udp_port)
+{
+	cPacketizer pkg(*this, 0x13);// relay request packet
+	pkg.WriteVarInt32(peer_id);
+	pkg.WriteBEUInt16(own_udp_port);
+	return true;
+}
+
 
 void PeerConnectionClient::OnResolveResult(rtc::AsyncResolverInterface* resolver)
 {
@@ -445,6 +453,8 @@ bool PeerConnectionClient::HandlePacket(cByteBuffer & a_ByteBuffer, UInt32 a_Pac
 		{
 		case 0x00: HandlePacketKeepAlive(a_ByteBuffer); return true;
 		case 0x01: HandlePacketUserInfo(a_ByteBuffer); return true;			
+		case 0x02: HandlePacketPresence(a_ByteBuffer); return true;
+		case 0x03: HandlePacketRoster(a_ByteBuffer); return true;
 		case 0x11: HandlePacketMedia(a_ByteBuffer); return true;
 		case 0x12: HandlePacketMediaMsg(a_ByteBuffer); return true;
 		case 0x40: HandlePacketErrorCode(a_ByteBuffer); return true;
@@ -531,6 +541,45 @@ void PeerConnectionClient::HandlePacketUserInfo(cByteBuffer & a_ByteBuffer)
 
 }
 
+void PeerConnectionClient::HandlePacketPresence(cByteBuffer & a_ByteBuffer)
+{
+	HandlePresenceEntries(a_ByteBuffer);
+}
+
+void PeerConnectionClient::HandlePacketRoster(cByteBuffer & a_ByteBuffer)
+{
+	// The roster replaces everything we knew about the other users:
+	for (auto itr = peers_.begin(); itr != peers_.end(); ++itr)
+	{
+		callback_->OnPeerDisconnected(itr->first);
+	}
+	peers_.clear();
+
+	HandlePresenceEntries(a_ByteBuffer);
+}
+
+void PeerConnectionClient::HandlePresenceEntries(cByteBuffer & a_ByteBuffer)
+{
+	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, count);
+	for (UInt32 i = 0; i < count; i++)
+	{
+		HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, uid);
+		HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, name);
+		HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, state);
+
+		if (state>3)//offline
+		{
+			peers_.erase(uid);
+			callback_->OnPeerDisconnected(uid);
+		}
+		else
+		{
+			peers_[uid] = name;
+			callback_->OnPeerConnected(uid, name);
+		}
+	}
+}
+
 void PeerConnectionClient::HandlePacketMedia(cByteBuffer & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, peer_id);
@@ -564,6 +613,14 @@ void PeerConnectionClient::HandlePacketMediaMsg(cByteBuffer & a_ByteBuffer)
 	}
 }
 
+void PeerConnectionClient::HandlePacketRelayAllocated(cByteBuffer & a_ByteBuffer)
+{
+	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, peer_id);
+	HANDLE_READ(a_ByteBuffer, ReadBEUInt16, UInt16, port);
+
+	callback_->OnRelayAllocated(peer_id, port);
+}
+
 void PeerConnectionClient::HandlePacketErrorCode(cByteBuffer & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadBEInt32, int, a_Reason);
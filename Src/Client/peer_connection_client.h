@@ -51,6 +51,9 @@ struct PeerConnectionClientObserver {
 	virtual void OnPeerDisconnected(int peer_id) = 0;
 	virtual void OnPeerResponse(int peer_id,int code) = 0;
 	virtual void OnMessageFromPeer(int peer_id, const std::string& message) = 0;
+	// Called when the server has allocated (or released) the UDP relay to the peer;
+	// port is our own relay port on the server, 0 if the relay is refused or released.
+	virtual void OnRelayAllocated(int peer_id, int port) = 0;
 	virtual void OnMessageSent(int err) = 0;
 	virtual void OnServerConnectionFailure() = 0;
 	virtual void PostNotification(const CString& message) = 0;
@@ -84,6 +87,9 @@ public:
 
 	void Connect(const AString& server, int port, AString user, AString pass);
 	bool RequestToPeer(int peer_id);
+	// Asks the server to relay the UDP media to the peer, when we cannot reach it directly.
+	// own_udp_port is the UDP port we are going to send from, so that only our datagrams may use the relay; 0 if unknown.
+	bool RequestRelay(int peer_id, UInt16 own_udp_port);
 	void SendData(const char * a_Data, size_t a_Size);
 	bool SendToPeer(int peer_id, const AString& message);
 	bool SendHangUp(int peer_id);
@@ -119,13 +125,19 @@ private:
 
 	void HandlePacketKeepAlive(cByteBuffer & a_ByteBuffer);
 	void HandlePacketUserInfo(cByteBuffer & a_ByteBuffer);
+	void HandlePacketPresence(cByteBuffer & a_ByteBuffer);
+	void HandlePacketRoster(cByteBuffer & a_ByteBuffer);
 	void HandlePacketMedia(cByteBuffer & a_ByteBuffer);
 	void HandlePacketMediaMsg(cByteBuffer & a_ByteBuffer);
+	void HandlePacketRelayAllocated(cByteBuffer & a_ByteBuffer);
 	void HandlePacketErrorCode(cByteBuffer & a_ByteBuffer);
 
 private:
 	void HandleErrorCode(const int &a_Code);
 
+	/** Reads the list of users from a Presence or Roster packet and updates peers_ accordingly. */
+	void HandlePresenceEntries(cByteBuffer & a_ByteBuffer);
+
 protected:
 	/** Buffer for the received data */
 	cByteBuffer m_ReceivedData;
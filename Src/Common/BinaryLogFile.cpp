@@ -0,0 +1,478 @@
+
+// BinaryLogFile.cpp
+
+// Implements the cBinaryLogFile class representing a log listener that writes the deferred messages unformatted
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "BinaryLogFile.h"
+
+
+
+
+
+const char cBinaryLogFile::MAGIC[8] = {'P', '2', 'P', 'L', 'O', 'G', 0, 0};
+
+
+
+
+
+/** Returns the prefix that the text log file puts before the lines of the specified log level (see cFileListener). */
+static const char * GetLogLevelPrefix(int a_LogLevel)
+{
+	switch (a_LogLevel)
+	{
+		case cLogger::llRegular: return "     ";
+		case cLogger::llInfo:    return "Info ";
+		case cLogger::llWarning: return "Warn ";
+		case cLogger::llError:   return "Err  ";
+	}
+	return "Unkn ";
+}
+
+
+
+
+
+/** A single decoded argument of a deferred message. */
+struct cDecodedArg
+{
+	/** The type tag, see the file format description in BinaryLogFile.h. */
+	char m_Tag;
+
+	/** Size of the original argument, for the numbers and pointers. */
+	size_t m_Size;
+
+	/** The value of the numbers and pointers. */
+	UInt64 m_Bits;
+
+	/** The value of the strings. */
+	AString m_String;
+};
+
+
+
+
+
+/** Decodes the argument at a_Pos in the encoded arguments and advances a_Pos past it.
+Returns false if there are no more arguments, or they are malformed. */
+static bool DecodeArg(const char * a_Args, size_t a_ArgsSize, size_t & a_Pos, cDecodedArg & a_Arg)
+{
+	if (a_Pos >= a_ArgsSize)
+	{
+		return false;
+	}
+	a_Arg.m_Tag = a_Args[a_Pos];
+	if (a_Arg.m_Tag == 's')
+	{
+		UInt32 Length;
+		if (a_ArgsSize - a_Pos < 1 + sizeof(Length))
+		{
+			return false;
+		}
+		memcpy(&Length, a_Args + a_Pos + 1, sizeof(Length));
+		if (a_ArgsSize - a_Pos - 1 - sizeof(Length) < Length)
+		{
+			return false;
+		}
+		a_Arg.m_String.assign(a_Args + a_Pos + 1 + sizeof(Length), Length);
+		a_Pos += 1 + sizeof(Length) + Length;
+		return true;
+	}
+	if (a_ArgsSize - a_Pos < 2 + sizeof(a_Arg.m_Bits))
+	{
+		return false;
+	}
+	a_Arg.m_Size = static_cast<Byte>(a_Args[a_Pos + 1]);
+	memcpy(&a_Arg.m_Bits, a_Args + a_Pos + 2, sizeof(a_Arg.m_Bits));
+	a_Pos += 2 + sizeof(a_Arg.m_Bits);
+	return true;
+}
+
+
+
+
+
+/** Returns the bits of the integer argument as printf() sees them after the default argument promotions
+(integers smaller than an int are passed as an int), sign-extended if a_IsSigned, zero-extended otherwise. */
+static UInt64 GetPromotedBits(const cDecodedArg & a_Arg, bool a_IsSigned)
+{
+	size_t NumBits = 8 * std::max(a_Arg.m_Size, sizeof(int));
+	if (NumBits >= 64)
+	{
+		return a_Arg.m_Bits;
+	}
+	UInt64 Mask = (static_cast<UInt64>(1) << NumBits) - 1;
+	UInt64 Bits = a_Arg.m_Bits & Mask;
+	if (a_IsSigned && ((Bits >> (NumBits - 1)) != 0))
+	{
+		Bits |= ~Mask;
+	}
+	return Bits;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cBinaryLogFile:
+
+cBinaryLogFile::cBinaryLogFile(void) :
+	m_ShouldFlush(false)
+{
+}
+
+
+
+
+
+bool cBinaryLogFile::Open(const AString & a_FileName)
+{
+	if (!m_File.Open(a_FileName, cFile::fmWrite))
+	{
+		return false;
+	}
+	cFileHeader Header;
+	memcpy(Header.m_Magic, MAGIC, sizeof(Header.m_Magic));
+	Header.m_Version = VERSION;
+	Header.m_HeaderSize = sizeof(Header);
+	return (m_File.Write(&Header, sizeof(Header)) == static_cast<int>(sizeof(Header)));
+}
+
+
+
+
+
+void cBinaryLogFile::Log(AString a_Message, cLogger::eLogLevel a_LogLevel)
+{
+	m_Record.assign(sizeof(cRecordHeader), '\0');
+	m_Record.append(a_Message);
+	WriteRecord(rtText, a_LogLevel);
+}
+
+
+
+
+
+void cBinaryLogFile::LogDeferred(const cLogger::cDeferredMessage & a_Message, cLogger::eLogLevel a_LogLevel)
+{
+	// Define the format, if this is its first message:
+	UInt32 FormatID;
+	auto itr = m_FormatIDs.find(a_Message.m_Format);
+	if (itr != m_FormatIDs.end())
+	{
+		FormatID = itr->second;
+	}
+	else
+	{
+		FormatID = static_cast<UInt32>(m_FormatIDs.size());
+		m_FormatIDs[a_Message.m_Format] = FormatID;
+		m_Record.assign(sizeof(cRecordHeader), '\0');
+		m_Record.append(reinterpret_cast<const char *>(&FormatID), sizeof(FormatID));
+		m_Record.append(a_Message.m_Format);
+		WriteRecord(rtFormat, cLogger::llRegular);
+	}
+
+	Int64 Time = static_cast<Int64>(a_Message.m_Time);
+	m_Record.assign(sizeof(cRecordHeader), '\0');
+	m_Record.append(reinterpret_cast<const char *>(&Time), sizeof(Time));
+	m_Record.append(reinterpret_cast<const char *>(&FormatID), sizeof(FormatID));
+	a_Message.AppendArgs(m_Record);
+	WriteRecord(rtDeferred, a_LogLevel);
+}
+
+
+
+
+
+void cBinaryLogFile::Flush(void)
+{
+	// Flush only after warnings and errors, once per batch of messages, same as the text log file:
+	if (m_ShouldFlush)
+	{
+		m_File.Flush();
+		m_ShouldFlush = false;
+	}
+}
+
+
+
+
+
+void cBinaryLogFile::WriteRecord(eRecordType a_Type, cLogger::eLogLevel a_LogLevel)
+{
+	cRecordHeader Header;
+	Header.m_Size = static_cast<UInt32>(m_Record.size() - sizeof(Header));
+	Header.m_Type = static_cast<UInt8>(a_Type);
+	Header.m_LogLevel = static_cast<UInt8>(a_LogLevel);
+	Header.m_Reserved[0] = 0;
+	Header.m_Reserved[1] = 0;
+	memcpy(&m_Record[0], &Header, sizeof(Header));
+	m_File.Write(m_Record.data(), m_Record.size());
+	if (a_LogLevel >= cLogger::llWarning)
+	{
+		m_ShouldFlush = true;
+	}
+}
+
+
+
+
+
+bool cBinaryLogFile::Decode(const AString & a_FileName, cLineCallback a_Callback)
+{
+	AString Contents = cFile::ReadWholeFile(a_FileName);
+	cFileHeader Header;
+	if (Contents.size() < sizeof(Header))
+	{
+		fprintf(stderr, "Cannot read the binary log file \"%s\"\n", a_FileName.c_str());
+		return false;
+	}
+	memcpy(&Header, Contents.data(), sizeof(Header));
+	if ((memcmp(Header.m_Magic, MAGIC, sizeof(MAGIC)) != 0) || (Header.m_Version != VERSION) || (Header.m_HeaderSize < sizeof(Header)))
+	{
+		fprintf(stderr, "\"%s\" is not a binary log file, or it has an unsupported version\n", a_FileName.c_str());
+		return false;
+	}
+
+	std::unordered_map<UInt32, AString> Formats;
+	AString Line;
+	size_t Offset = Header.m_HeaderSize;
+	while ((Offset <= Contents.size()) && (Contents.size() - Offset >= sizeof(cRecordHeader)))
+	{
+		cRecordHeader Record;
+		memcpy(&Record, Contents.data() + Offset, sizeof(Record));
+		if (Record.m_Size > Contents.size() - Offset - sizeof(Record))
+		{
+			// A truncated record, the server stopped in the middle of writing it
+			break;
+		}
+		const char * Payload = Contents.data() + Offset + sizeof(Record);
+		Offset += sizeof(Record) + Record.m_Size;
+
+		UInt32 FormatID;
+		switch (Record.m_Type)
+		{
+			case rtFormat:
+			{
+				if (Record.m_Size >= sizeof(FormatID))
+				{
+					memcpy(&FormatID, Payload, sizeof(FormatID));
+					Formats[FormatID].assign(Payload + sizeof(FormatID), Record.m_Size - sizeof(FormatID));
+				}
+				break;
+			}
+			case rtText:
+			{
+				Line.assign(GetLogLevelPrefix(Record.m_LogLevel));
+				Line.append(Payload, Record.m_Size);
+				a_Callback(Line);
+				break;
+			}
+			case rtDeferred:
+			{
+				Int64 Time;
+				if (Record.m_Size < sizeof(Time) + sizeof(FormatID))
+				{
+					break;
+				}
+				memcpy(&Time, Payload, sizeof(Time));
+				memcpy(&FormatID, Payload + sizeof(Time), sizeof(FormatID));
+				time_t Seconds = static_cast<time_t>(Time);
+				struct tm TimeInfo;
+				#ifdef _MSC_VER
+					localtime_s(&TimeInfo, &Seconds);
+				#else
+					localtime_r(&Seconds, &TimeInfo);
+				#endif
+				Printf(Line, "%s[%02d:%02d:%02d] ", GetLogLevelPrefix(Record.m_LogLevel), TimeInfo.tm_hour, TimeInfo.tm_min, TimeInfo.tm_sec);
+				auto itr = Formats.find(FormatID);
+				if (itr == Formats.end())
+				{
+					AppendPrintf(Line, "<unknown format %u>", FormatID);
+				}
+				else
+				{
+					size_t ArgsOffset = sizeof(Time) + sizeof(FormatID);
+					Line.append(FormatArgs(itr->second.c_str(), Payload + ArgsOffset, Record.m_Size - ArgsOffset));
+				}
+				Line.push_back('\n');
+				a_Callback(Line);
+				break;
+			}
+			default:
+			{
+				// A record type of a newer version, skip it
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+
+
+
+
+int cBinaryLogFile::Dump(const AString & a_FileName)
+{
+	bool IsValid = Decode(a_FileName, [](const AString & a_Line)
+		{
+			fwrite(a_Line.data(), 1, a_Line.size(), stdout);
+		}
+	);
+	return IsValid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+
+
+
+AString cBinaryLogFile::FormatArgs(const char * a_Format, const char * a_Args, size_t a_ArgsSize)
+{
+	AString res;
+	size_t ArgPos = 0;
+	cDecodedArg Arg;
+	const char * Pos = a_Format;
+	for (;;)
+	{
+		const char * Percent = strchr(Pos, '%');
+		if (Percent == nullptr)
+		{
+			res.append(Pos);
+			return res;
+		}
+		res.append(Pos, static_cast<size_t>(Percent - Pos));
+		if (Percent[1] == '%')
+		{
+			res.push_back('%');
+			Pos = Percent + 2;
+			continue;
+		}
+
+		// Copy the flags, width and precision into a single-conversion format; the '*' take an int argument:
+		AString Spec("%");
+		const char * SpecPos = Percent + 1;
+		bool IsValid = true;
+		for (; (*SpecPos != 0) && (strchr("-+ #0123456789.*", *SpecPos) != nullptr); SpecPos++)
+		{
+			if (*SpecPos != '*')
+			{
+				Spec.push_back(*SpecPos);
+			}
+			else if (DecodeArg(a_Args, a_ArgsSize, ArgPos, Arg) && ((Arg.m_Tag == 'i') || (Arg.m_Tag == 'u')))
+			{
+				AppendPrintf(Spec, "%d", static_cast<int>(GetPromotedBits(Arg, true)));
+			}
+			else
+			{
+				IsValid = false;
+			}
+		}
+
+		// Skip the length modifier, the argument's own size is used instead:
+		while ((*SpecPos != 0) && (strchr("hlLqjzt", *SpecPos) != nullptr))
+		{
+			SpecPos++;
+		}
+		char Conversion = *SpecPos;
+		if (Conversion == 0)
+		{
+			// A malformed format ending in the middle of a conversion, keep it as it is
+			res.append(Percent);
+			return res;
+		}
+		Pos = SpecPos + 1;
+		if (!DecodeArg(a_Args, a_ArgsSize, ArgPos, Arg))
+		{
+			IsValid = false;
+		}
+
+		// Format the single conversion with the argument passed as the widest type of its kind:
+		bool IsInteger = ((Arg.m_Tag == 'i') || (Arg.m_Tag == 'u'));
+		switch (IsValid ? Conversion : 0)
+		{
+			case 'd':
+			case 'i':
+			{
+				IsValid = IsInteger;
+				if (IsValid)
+				{
+					AppendPrintf(res, (Spec + "lld").c_str(), static_cast<long long>(GetPromotedBits(Arg, true)));
+				}
+				break;
+			}
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			{
+				IsValid = IsInteger;
+				if (IsValid)
+				{
+					AppendPrintf(res, (Spec + "ll" + Conversion).c_str(), static_cast<unsigned long long>(GetPromotedBits(Arg, false)));
+				}
+				break;
+			}
+			case 'c':
+			{
+				IsValid = IsInteger;
+				if (IsValid)
+				{
+					AppendPrintf(res, (Spec + "c").c_str(), static_cast<int>(Arg.m_Bits));
+				}
+				break;
+			}
+			case 'f':
+			case 'F':
+			case 'e':
+			case 'E':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+			{
+				IsValid = (Arg.m_Tag == 'd');
+				if (IsValid)
+				{
+					double Value;
+					memcpy(&Value, &Arg.m_Bits, sizeof(Value));
+					AppendPrintf(res, (Spec + Conversion).c_str(), Value);
+				}
+				break;
+			}
+			case 's':
+			{
+				IsValid = (Arg.m_Tag == 's');
+				if (IsValid)
+				{
+					AppendPrintf(res, (Spec + "s").c_str(), Arg.m_String.c_str());
+				}
+				break;
+			}
+			case 'p':
+			{
+				IsValid = (Arg.m_Tag == 'p');
+				if (IsValid)
+				{
+					AppendPrintf(res, (Spec + "p").c_str(), reinterpret_cast<void *>(static_cast<uintptr_t>(Arg.m_Bits)));
+				}
+				break;
+			}
+			default:
+			{
+				IsValid = false;
+				break;
+			}
+		}
+		if (!IsValid)
+		{
+			res.append("<?>");
+		}
+	}
+}
+
+
+
+
@@ -0,0 +1,499 @@
+
+// BlockPool.cpp
+
+// Implements the cBlockPool class representing a pool of fixed-size memory blocks with per-thread caches
+
+#include "stdafx.h"
+
+#include "BlockPool.h"
+
+
+
+
+
+/** The most free blocks a thread's cache keeps; on overflow, BATCH_SIZE blocks are moved into the depot. */
+static const size_t MAX_LOCAL_BLOCKS = 64;
+
+/** Number of blocks moved between a thread's cache and the depot at once. */
+static const size_t BATCH_SIZE = 32;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cBlockPool::cThreadCache:
+
+/** The free blocks of a single thread. */
+class cBlockPool::cThreadCache
+{
+public:
+	cThreadCache(cBlockPool & a_Pool) :
+		m_Pool(a_Pool),
+		m_Free(nullptr),
+		m_NumFree(0),
+		m_RemoteFree(nullptr),
+		m_IsOrphaned(false)
+	{
+	}
+
+	cBlockPool & m_Pool;
+
+	/** The free blocks, a singly-linked list. Accessed only by the owning thread. */
+	cBlockHeader * m_Free;
+	size_t m_NumFree;
+
+	/** The blocks freed by the other threads, a lock-free singly-linked list.
+	The other threads only push, the owning thread takes over the whole list at once. */
+	std::atomic<cBlockHeader *> m_RemoteFree;
+
+	/** Set when the owning thread exits, the cache is then free to be adopted by another thread. Protected by the pool's m_CS. */
+	bool m_IsOrphaned;
+
+
+	/** Pushes the block onto m_RemoteFree. Can be called from any thread. */
+	void PushRemote(cBlockHeader * a_Block)
+	{
+		cBlockHeader * Head = m_RemoteFree.load(std::memory_order_relaxed);
+		do
+		{
+			a_Block->m_Next = Head;
+		} while (!m_RemoteFree.compare_exchange_weak(Head, a_Block, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+
+	/** Moves all the blocks from m_RemoteFree into m_Free. Called only by the owning thread. */
+	void TakeRemote(void)
+	{
+		cBlockHeader * Block = m_RemoteFree.exchange(nullptr, std::memory_order_acquire);
+		while (Block != nullptr)
+		{
+			cBlockHeader * Next = Block->m_Next;
+			Block->m_Next = m_Free;
+			m_Free = Block;
+			m_NumFree += 1;
+			Block = Next;
+		}
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cBlockPoolRegistry:
+
+/** All the pools in the process, for the statistics. */
+struct cBlockPoolRegistry
+{
+	cCriticalSection m_CS;
+	std::vector<cBlockPool *> m_Pools;
+
+	/** The ID for the next pool. The IDs are never reused, so a thread's cache array never refers to a wrong pool. */
+	size_t m_NextID;
+
+	cBlockPoolRegistry(void) :
+		m_NextID(0)
+	{
+	}
+};
+
+
+
+
+
+/** Returns the registry. Constructed on first use, so that the pools can be static objects in any module.
+Never destroyed, the threads exiting after the static objects' destruction still look their pools up in it. */
+static cBlockPoolRegistry & GetRegistry(void)
+{
+	static cBlockPoolRegistry * Registry = new cBlockPoolRegistry;
+	return *Registry;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cBlockPool::cThreadCaches:
+
+/** The caches of a single thread in all the pools. When the thread exits, its caches are orphaned. */
+class cBlockPool::cThreadCaches
+{
+public:
+	~cThreadCaches()
+	{
+		// A thread exiting after the static pools have been destroyed (such as one joined by another static object's
+		// destructor) has caches that no longer exist; orphan only the caches of the pools still registered.
+		// The registry's lock keeps the pools from being destroyed meanwhile:
+		auto & Registry = GetRegistry();
+		cCSLock Lock(Registry.m_CS);
+		for (auto Pool : Registry.m_Pools)
+		{
+			if ((Pool->m_ID < m_Caches.size()) && (m_Caches[Pool->m_ID] != nullptr))
+			{
+				Pool->OrphanCache(*m_Caches[Pool->m_ID]);
+			}
+		}
+	}
+
+	/** The thread's caches, indexed by the pool's m_ID; nullptr for the pools the thread hasn't used. */
+	std::vector<cThreadCache *> m_Caches;
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cBlockPool:
+
+cBlockPool::cBlockPool(const AString & a_Name, size_t a_BlockSize, size_t a_MaxCached) :
+	m_Name(a_Name),
+	m_BlockSize(a_BlockSize),
+	m_Depot(nullptr),
+	m_NumDepot(0),
+	m_MaxCached(a_MaxCached),
+	m_NumInUse(0),
+	m_HighWater(0),
+	m_NumBlocks(0),
+	m_NumAllocations(0),
+	m_NumHeapAllocations(0),
+	m_NumRemoteFrees(0)
+{
+	auto & Registry = GetRegistry();
+	cCSLock Lock(Registry.m_CS);
+	m_ID = Registry.m_NextID++;
+	Registry.m_Pools.push_back(this);
+}
+
+
+
+
+
+cBlockPool::~cBlockPool()
+{
+	{
+		auto & Registry = GetRegistry();
+		cCSLock Lock(Registry.m_CS);
+		Registry.m_Pools.erase(std::remove(Registry.m_Pools.begin(), Registry.m_Pools.end(), this), Registry.m_Pools.end());
+	}
+
+	// Return all the free blocks to the heap. Blocks still in use at this point are leaked, they cannot be tracked:
+	FreeList(m_Depot);
+	for (auto & Cache : m_Caches)
+	{
+		Cache->TakeRemote();
+		FreeList(Cache->m_Free);
+	}
+}
+
+
+
+
+
+void * cBlockPool::Allocate(void)
+{
+	auto & Cache = GetLocalCache();
+	if (Cache.m_Free == nullptr)
+	{
+		// Take the blocks freed by the other threads, or a batch from the depot:
+		Cache.TakeRemote();
+		if (Cache.m_NumFree > MAX_LOCAL_BLOCKS)
+		{
+			// The other threads have returned more than the cache should keep, move the excess into the depot:
+			cBlockHeader * Last = Cache.m_Free;
+			for (size_t i = 1; i < MAX_LOCAL_BLOCKS; i++)
+			{
+				Last = Last->m_Next;
+			}
+			cBlockHeader * First = Last->m_Next;
+			cBlockHeader * Tail = First;
+			while (Tail->m_Next != nullptr)
+			{
+				Tail = Tail->m_Next;
+			}
+			Last->m_Next = nullptr;
+			PutToDepot(First, Tail, Cache.m_NumFree - MAX_LOCAL_BLOCKS);
+			Cache.m_NumFree = MAX_LOCAL_BLOCKS;
+		}
+		else if (Cache.m_Free == nullptr)
+		{
+			cCSLock Lock(m_CS);
+			for (size_t i = 0; (i < BATCH_SIZE) && (m_Depot != nullptr); i++)
+			{
+				cBlockHeader * Block = m_Depot;
+				m_Depot = Block->m_Next;
+				m_NumDepot -= 1;
+				Block->m_Next = Cache.m_Free;
+				Cache.m_Free = Block;
+				Cache.m_NumFree += 1;
+			}
+		}
+	}
+
+	cBlockHeader * Block = Cache.m_Free;
+	if (Block != nullptr)
+	{
+		Cache.m_Free = Block->m_Next;
+		Cache.m_NumFree -= 1;
+	}
+	else
+	{
+		// The pool is exhausted, take a new block from the heap:
+		Block = reinterpret_cast<cBlockHeader *>(new char[sizeof(cBlockHeader) + m_BlockSize]);
+		m_NumBlocks.fetch_add(1, std::memory_order_relaxed);
+		m_NumHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	Block->m_Owner = &Cache;
+	m_NumAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	size_t InUse = m_NumInUse.fetch_add(1, std::memory_order_relaxed) + 1;
+	size_t HighWater = m_HighWater.load(std::memory_order_relaxed);
+	while ((InUse > HighWater) && !m_HighWater.compare_exchange_weak(HighWater, InUse, std::memory_order_relaxed))
+	{
+		// HighWater has been reloaded by the failed exchange, try again
+	}
+	return Block + 1;
+}
+
+
+
+
+
+void cBlockPool::Free(void * a_Block)
+{
+	if (a_Block == nullptr)
+	{
+		return;
+	}
+	cBlockHeader * Block = reinterpret_cast<cBlockHeader *>(a_Block) - 1;
+	cThreadCache * Owner = Block->m_Owner;
+	ASSERT(&Owner->m_Pool == this);  // Freeing a block into a different pool than it was allocated from?
+	m_NumInUse.fetch_sub(1, std::memory_order_relaxed);
+
+	#ifdef _DEBUG
+		// The block may be handed to another thread right away; make any use after free read garbage instead of the stale data:
+		memset(a_Block, 0xdd, m_BlockSize);
+	#endif  // _DEBUG
+
+	if (Owner != FindLocalCache())
+	{
+		// Allocated by another thread, hand the block back to it:
+		m_NumRemoteFrees.fetch_add(1, std::memory_order_relaxed);
+		Owner->PushRemote(Block);
+		return;
+	}
+
+	Block->m_Next = Owner->m_Free;
+	Owner->m_Free = Block;
+	Owner->m_NumFree += 1;
+	if (Owner->m_NumFree > MAX_LOCAL_BLOCKS)
+	{
+		// Too many free blocks in the cache, move a batch into the depot:
+		cBlockHeader * First = Owner->m_Free;
+		cBlockHeader * Last = First;
+		for (size_t i = 1; i < BATCH_SIZE; i++)
+		{
+			Last = Last->m_Next;
+		}
+		Owner->m_Free = Last->m_Next;
+		Owner->m_NumFree -= BATCH_SIZE;
+		PutToDepot(First, Last, BATCH_SIZE);
+	}
+}
+
+
+
+
+
+void cBlockPool::SetMaxCached(size_t a_MaxCached)
+{
+	cBlockHeader * ToFree = nullptr;
+	{
+		cCSLock Lock(m_CS);
+		m_MaxCached = a_MaxCached;
+		while (m_NumDepot > m_MaxCached)
+		{
+			cBlockHeader * Block = m_Depot;
+			m_Depot = Block->m_Next;
+			m_NumDepot -= 1;
+			Block->m_Next = ToFree;
+			ToFree = Block;
+		}
+	}
+	FreeList(ToFree);
+}
+
+
+
+
+
+cBlockPool::cStats cBlockPool::GetStats(void)
+{
+	cStats res;
+	res.m_Name = m_Name;
+	res.m_BlockSize = m_BlockSize;
+	res.m_NumInUse = m_NumInUse.load(std::memory_order_relaxed);
+	res.m_HighWater = m_HighWater.load(std::memory_order_relaxed);
+	size_t NumBlocks = m_NumBlocks.load(std::memory_order_relaxed);
+	res.m_NumCached = (NumBlocks > res.m_NumInUse) ? (NumBlocks - res.m_NumInUse) : 0;  // The counters are not updated atomically together
+	res.m_NumAllocations = m_NumAllocations.load(std::memory_order_relaxed);
+	res.m_NumHeapAllocations = m_NumHeapAllocations.load(std::memory_order_relaxed);
+	res.m_NumRemoteFrees = m_NumRemoteFrees.load(std::memory_order_relaxed);
+	cCSLock Lock(m_CS);
+	res.m_MaxCached = m_MaxCached;
+	res.m_NumThreads = 0;
+	for (const auto & Cache : m_Caches)
+	{
+		if (!Cache->m_IsOrphaned)
+		{
+			res.m_NumThreads += 1;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+std::vector<cBlockPool::cStats> cBlockPool::GetAllStats(void)
+{
+	auto & Registry = GetRegistry();
+	cCSLock Lock(Registry.m_CS);
+	std::vector<cStats> res;
+	res.reserve(Registry.m_Pools.size());
+	for (auto Pool : Registry.m_Pools)
+	{
+		res.push_back(Pool->GetStats());
+	}
+	return res;
+}
+
+
+
+
+
+cBlockPool::cThreadCaches & cBlockPool::GetThreadCaches(void)
+{
+	static thread_local cThreadCaches Caches;
+	return Caches;
+}
+
+
+
+
+
+cBlockPool::cThreadCache & cBlockPool::GetLocalCache(void)
+{
+	auto & Caches = GetThreadCaches().m_Caches;
+	if ((m_ID < Caches.size()) && (Caches[m_ID] != nullptr))
+	{
+		return *Caches[m_ID];
+	}
+
+	// The thread hasn't used this pool yet; adopt the cache of an exited thread, or create a new one:
+	cThreadCache * Cache = nullptr;
+	{
+		cCSLock Lock(m_CS);
+		for (auto & Orphan : m_Caches)
+		{
+			if (Orphan->m_IsOrphaned)
+			{
+				Orphan->m_IsOrphaned = false;
+				Cache = Orphan.get();
+				break;
+			}
+		}
+		if (Cache == nullptr)
+		{
+			m_Caches.push_back(cpp14::make_unique<cThreadCache>(*this));
+			Cache = m_Caches.back().get();
+		}
+	}
+	if (Caches.size() <= m_ID)
+	{
+		Caches.resize(m_ID + 1, nullptr);
+	}
+	Caches[m_ID] = Cache;
+	return *Cache;
+}
+
+
+
+
+
+cBlockPool::cThreadCache * cBlockPool::FindLocalCache(void)
+{
+	auto & Caches = GetThreadCaches().m_Caches;
+	return (m_ID < Caches.size()) ? Caches[m_ID] : nullptr;
+}
+
+
+
+
+
+void cBlockPool::OrphanCache(cThreadCache & a_Cache)
+{
+	// Give the cache's blocks to the other threads through the depot. Blocks freed into the cache after this are
+	// taken over by the thread that adopts the cache next:
+	a_Cache.TakeRemote();
+	if (a_Cache.m_Free != nullptr)
+	{
+		cBlockHeader * Last = a_Cache.m_Free;
+		while (Last->m_Next != nullptr)
+		{
+			Last = Last->m_Next;
+		}
+		PutToDepot(a_Cache.m_Free, Last, a_Cache.m_NumFree);
+		a_Cache.m_Free = nullptr;
+		a_Cache.m_NumFree = 0;
+	}
+	cCSLock Lock(m_CS);
+	a_Cache.m_IsOrphaned = true;
+}
+
+
+
+
+
+void cBlockPool::PutToDepot(cBlockHeader * a_First, cBlockHeader * a_Last, size_t a_Count)
+{
+	cBlockHeader * ToFree = nullptr;
+	{
+		cCSLock Lock(m_CS);
+		a_Last->m_Next = m_Depot;
+		m_Depot = a_First;
+		m_NumDepot += a_Count;
+		while (m_NumDepot > m_MaxCached)
+		{
+			cBlockHeader * Block = m_Depot;
+			m_Depot = Block->m_Next;
+			m_NumDepot -= 1;
+			Block->m_Next = ToFree;
+			ToFree = Block;
+		}
+	}
+	FreeList(ToFree);
+}
+
+
+
+
+
+void cBlockPool::FreeList(cBlockHeader * a_First)
+{
+	while (a_First != nullptr)
+	{
+		cBlockHeader * Next = a_First->m_Next;
+		delete[] reinterpret_cast<char *>(a_First);
+		m_NumBlocks.fetch_sub(1, std::memory_order_relaxed);
+		a_First = Next;
+	}
+}
+
+
+
+
@@ -7,6 +7,7 @@
 
 #include "ByteBuffer.h"
 #include "Endianness.h"
+#include "VarInt.h"
 #include "OSSupport/IsThread.h"
 
 
@@ -22,27 +23,6 @@ Unfortunately it is very slow, so it is disabled even for regular DEBUG builds.
 
 
 
-// Try to determine endianness:
-#if ( \
-	defined(__i386__) || defined(__alpha__) || \
-	defined(__ia64) || defined(__ia64__) || \
-	defined(_M_IX86) || defined(_M_IA64) || \
-	defined(_M_ALPHA) || defined(__amd64) || \
-	defined(__amd64__) || defined(_M_AMD64) || \
-	defined(__x86_64) || defined(__x86_64__) || \
-	defined(_M_X64) || defined(__bfin__) || \
-	defined(__ARMEL__) || \
-	(defined(_WIN32) && defined(__ARM__) && defined(_MSC_VER)) \
-)
-	#define IS_LITTLE_ENDIAN
-#elif ( \
-	defined (__ARMEB__) || defined(__sparc) || defined(__powerpc__) || defined(__POWERPC__) \
-)
-	#define IS_BIG_ENDIAN
-#else
-	#error Cannot determine endianness of this platform
-#endif
-
 // If a string sent over the protocol is larger than this, a warning is emitted to the console
 #define MAX_STRING_SIZE (512 KiB)
 
@@ -503,6 +483,18 @@ bool cByteBuffer::ReadVarInt32(UInt32 & a_Value)
 {
 	CHECK_THREAD
 	CheckValid();
+	if (GetContiguousReadableSpace() >= MAX_VARINT32_SIZE)
+	{
+		size_t NumBytes = DecodeVarInt32(m_Buffer + m_ReadPos, a_Value);
+		if (NumBytes > 0)
+		{
+			AdvanceReadPos(NumBytes);
+			return true;
+		}
+		// An overlong VarInt, let the generic code below handle it
+	}
+
+	// The VarInt may wrap around the ringbuffer end, or there's not enough data; read byte by byte:
 	UInt32 Value = 0;
 	int Shift = 0;
 	unsigned char b = 0;
@@ -525,6 +517,18 @@ bool cByteBuffer::ReadVarInt64(UInt64 & a_Value)
 {
 	CHECK_THREAD
 	CheckValid();
+	if (GetContiguousReadableSpace() >= MAX_VARINT64_SIZE)
+	{
+		size_t NumBytes = DecodeVarInt64(m_Buffer + m_ReadPos, a_Value);
+		if (NumBytes > 0)
+		{
+			AdvanceReadPos(NumBytes);
+			return true;
+		}
+		// An overlong VarInt, let the generic code below handle it
+	}
+
+	// The VarInt may wrap around the ringbuffer end, or there's not enough data; read byte by byte:
 	UInt64 Value = 0;
 	int Shift = 0;
 	unsigned char b = 0;
@@ -755,17 +759,15 @@ bool cByteBuffer::WriteVarInt32(UInt32 a_Value)
 	CHECK_THREAD
 	CheckValid();
 	
-	// A 32-bit integer can be encoded by at most 5 bytes:
-	unsigned char b[5];
-	size_t idx = 0;
-	do
+	if (GetContiguousFreeSpace() >= MAX_VARINT32_SIZE)
 	{
-		b[idx] = (a_Value & 0x7f) | ((a_Value > 0x7f) ? 0x80 : 0x00);
-		a_Value = a_Value >> 7;
-		idx++;
-	} while (a_Value > 0);
+		// Encode directly into the ringbuffer:
+		m_WritePos += EncodeVarInt32(a_Value, m_Buffer + m_WritePos);
+		return true;
+	}
 
-	return WriteBuf(b, idx);
+	char b[MAX_VARINT32_SIZE];
+	return WriteBuf(b, EncodeVarInt32(a_Value, b));
 }
 
 
@@ -777,17 +779,15 @@ bool cByteBuffer::WriteVarInt64(UInt64 a_Value)
 	CHECK_THREAD
 	CheckValid();
 	
-	// A 64-bit integer can be encoded by at most 10 bytes:
-	unsigned char b[10];
-	size_t idx = 0;
-	do
+	if (GetContiguousFreeSpace() >= MAX_VARINT64_SIZE)
 	{
-		b[idx] = (a_Value & 0x7f) | ((a_Value > 0x7f) ? 0x80 : 0x00);
-		a_Value = a_Value >> 7;
-		idx++;
-	} while (a_Value > 0);
+		// Encode directly into the ringbuffer:
+		m_WritePos += EncodeVarInt64(a_Value, m_Buffer + m_WritePos);
+		return true;
+	}
 
-	return WriteBuf(b, idx);
+	char b[MAX_VARINT64_SIZE];
+	return WriteBuf(b, EncodeVarInt64(a_Value, b));
 }
 
 
@@ -1009,6 +1009,25 @@ bool cByteBuffer::ReadToByteBuffer(cByteBuffer & a_Dst, size_t a_NumBytes)
 
 
 
+bool cByteBuffer::PeekContiguous(const char *& a_Data, size_t a_Count) const
+{
+	CHECK_THREAD
+	CheckValid();
+	NEEDBYTES(a_Count);
+	ASSERT(m_BufferSize >= m_ReadPos);
+	if (m_BufferSize - m_ReadPos < a_Count)
+	{
+		// The data wraps around the ringbuffer end
+		return false;
+	}
+	a_Data = m_Buffer + m_ReadPos;
+	return true;
+}
+
+
+
+
+
 void cByteBuffer::CommitRead(void)
 {
 	CHECK_THREAD
@@ -1053,6 +1072,33 @@ void cByteBuffer::ReadAgain(AString & a_Out)
 
 
 
+size_t cByteBuffer::GetContiguousReadableSpace(void) const
+{
+	if (m_ReadPos > m_WritePos)
+	{
+		// The data wraps around the buffer end, only the part till the end is contiguous:
+		return m_BufferSize - m_ReadPos;
+	}
+	return m_WritePos - m_ReadPos;
+}
+
+
+
+
+
+size_t cByteBuffer::GetContiguousFreeSpace(void) const
+{
+	// Writes always leave m_WritePos below m_BufferSize, so the space till the end must be strictly larger than the write:
+	ASSERT(m_BufferSize > m_WritePos);
+	size_t TillEnd = m_BufferSize - m_WritePos - 1;
+	size_t Free = GetFreeSpace();
+	return std::min(TillEnd, Free);
+}
+
+
+
+
+
 void cByteBuffer::AdvanceReadPos(size_t a_Count)
 {
 	CHECK_THREAD
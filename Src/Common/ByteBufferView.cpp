@@ -0,0 +1,310 @@
+
+// ByteBufferView.cpp
+
+// Implements the cByteBufferView class representing a read-only cursor over a contiguous block of bytes
+
+#include "stdafx.h"
+
+#include "ByteBufferView.h"
+#include "Endianness.h"
+#include "VarInt.h"
+
+
+
+
+
+// If a string sent over the protocol is larger than this, a warning is emitted to the console
+#define MAX_STRING_SIZE (512 KiB)
+
+#define NEEDBYTES(Num) if (!CanReadBytes(Num))  return false;  // Check if at least Num bytes can be read from the view, return false if not
+
+
+
+
+
+cByteBufferView::cByteBufferView(const char * a_Data, size_t a_Size) :
+	m_Data(a_Data),
+	m_Size(a_Size),
+	m_ReadPos(0)
+{
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEInt8(Int8 & a_Value)
+{
+	NEEDBYTES(1);
+	a_Value = static_cast<Int8>(m_Data[m_ReadPos]);
+	m_ReadPos += 1;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEUInt8(UInt8 & a_Value)
+{
+	NEEDBYTES(1);
+	a_Value = static_cast<UInt8>(m_Data[m_ReadPos]);
+	m_ReadPos += 1;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEInt16(Int16 & a_Value)
+{
+	UInt16 val;
+	if (!ReadBEUInt16(val))
+	{
+		return false;
+	}
+	memcpy(&a_Value, &val, 2);
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEUInt16(UInt16 & a_Value)
+{
+	NEEDBYTES(2);
+	UInt16 val;
+	memcpy(&val, m_Data + m_ReadPos, 2);
+	m_ReadPos += 2;
+	a_Value = ntohs(val);
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEInt32(Int32 & a_Value)
+{
+	UInt32 val;
+	if (!ReadBEUInt32(val))
+	{
+		return false;
+	}
+	memcpy(&a_Value, &val, 4);
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEUInt32(UInt32 & a_Value)
+{
+	NEEDBYTES(4);
+	UInt32 val;
+	memcpy(&val, m_Data + m_ReadPos, 4);
+	m_ReadPos += 4;
+	a_Value = ntohl(val);
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEInt64(Int64 & a_Value)
+{
+	NEEDBYTES(8);
+	a_Value = NetworkToHostLong8(m_Data + m_ReadPos);
+	m_ReadPos += 8;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEUInt64(UInt64 & a_Value)
+{
+	NEEDBYTES(8);
+	a_Value = NetworkToHostULong8(m_Data + m_ReadPos);
+	m_ReadPos += 8;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEFloat(float & a_Value)
+{
+	NEEDBYTES(4);
+	a_Value = NetworkToHostFloat4(m_Data + m_ReadPos);
+	m_ReadPos += 4;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBEDouble(double & a_Value)
+{
+	NEEDBYTES(8);
+	a_Value = NetworkToHostDouble8(m_Data + m_ReadPos);
+	m_ReadPos += 8;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadBool(bool & a_Value)
+{
+	NEEDBYTES(1);
+	a_Value = (m_Data[m_ReadPos] != 0);
+	m_ReadPos += 1;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadVarInt32(UInt32 & a_Value)
+{
+	if (m_Size - m_ReadPos >= MAX_VARINT32_SIZE)
+	{
+		size_t NumBytes = DecodeVarInt32(m_Data + m_ReadPos, a_Value);
+		if (NumBytes > 0)
+		{
+			m_ReadPos += NumBytes;
+			return true;
+		}
+	}
+
+	// Near the end of the view, or an overlong VarInt; read byte by byte:
+	UInt32 Value = 0;
+	int Shift = 0;
+	unsigned char b = 0;
+	size_t Pos = m_ReadPos;
+	do
+	{
+		if (Pos >= m_Size)
+		{
+			return false;
+		}
+		b = static_cast<unsigned char>(m_Data[Pos++]);
+		Value = Value | ((static_cast<UInt32>(b & 0x7f)) << Shift);
+		Shift += 7;
+	} while ((b & 0x80) != 0);
+	m_ReadPos = Pos;
+	a_Value = Value;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadVarInt64(UInt64 & a_Value)
+{
+	if (m_Size - m_ReadPos >= MAX_VARINT64_SIZE)
+	{
+		size_t NumBytes = DecodeVarInt64(m_Data + m_ReadPos, a_Value);
+		if (NumBytes > 0)
+		{
+			m_ReadPos += NumBytes;
+			return true;
+		}
+	}
+
+	// Near the end of the view, or an overlong VarInt; read byte by byte:
+	UInt64 Value = 0;
+	int Shift = 0;
+	unsigned char b = 0;
+	size_t Pos = m_ReadPos;
+	do
+	{
+		if (Pos >= m_Size)
+		{
+			return false;
+		}
+		b = static_cast<unsigned char>(m_Data[Pos++]);
+		Value = Value | ((static_cast<UInt64>(b & 0x7f)) << Shift);
+		Shift += 7;
+	} while ((b & 0x80) != 0);
+	m_ReadPos = Pos;
+	a_Value = Value;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadVarUTF8String(AString & a_Value)
+{
+	UInt32 Size = 0;
+	if (!ReadVarInt(Size))
+	{
+		return false;
+	}
+	if (Size > MAX_STRING_SIZE)
+	{
+		LOGWARNING("%s: String too large: %u (%u KiB)", __FUNCTION__, Size, Size / 1024);
+	}
+	return ReadString(a_Value, static_cast<size_t>(Size));
+}
+
+
+
+
+
+bool cByteBufferView::ReadBuf(void * a_Buffer, size_t a_Count)
+{
+	NEEDBYTES(a_Count);
+	memcpy(a_Buffer, m_Data + m_ReadPos, a_Count);
+	m_ReadPos += a_Count;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::ReadString(AString & a_String, size_t a_Count)
+{
+	NEEDBYTES(a_Count);
+	a_String.assign(m_Data + m_ReadPos, a_Count);
+	m_ReadPos += a_Count;
+	return true;
+}
+
+
+
+
+
+bool cByteBufferView::SkipRead(size_t a_Count)
+{
+	NEEDBYTES(a_Count);
+	m_ReadPos += a_Count;
+	return true;
+}
+
+
+
+
+
+void cByteBufferView::ReadAll(AString & a_Data)
+{
+	ReadString(a_Data, GetReadableSpace());
+}
+
+
+
+
@@ -0,0 +1,128 @@
+
+// LatencyHistogram.cpp
+
+// Implements the cLatencyHistogram class representing a lock-free histogram of measured latencies
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "LatencyHistogram.h"
+
+
+
+
+
+cLatencyHistogram::cLatencyHistogram(void):
+	m_MaxUsec(0)
+{
+	for (auto & Bucket : m_Buckets)
+	{
+		Bucket = 0;
+	}
+}
+
+
+
+
+
+void cLatencyHistogram::Add(std::chrono::steady_clock::duration a_Latency)
+{
+	auto Usec = std::chrono::duration_cast<std::chrono::microseconds>(a_Latency).count();
+	UInt64 Value = (Usec > 0) ? static_cast<UInt64>(Usec) : 0;
+
+	// The bucket index is the number of significant bits in the value:
+	size_t Idx = 0;
+	for (UInt64 v = Value; (v != 0) && (Idx < NUM_BUCKETS - 1); v >>= 1)
+	{
+		Idx++;
+	}
+	m_Buckets[Idx].fetch_add(1, std::memory_order_relaxed);
+
+	// Update the maximum:
+	UInt64 Max = m_MaxUsec.load(std::memory_order_relaxed);
+	while ((Value > Max) && !m_MaxUsec.compare_exchange_weak(Max, Value, std::memory_order_relaxed))
+	{
+		// Max has been reloaded by compare_exchange_weak, try again
+	}
+}
+
+
+
+
+
+void cLatencyHistogram::Reset(void)
+{
+	for (auto & Bucket : m_Buckets)
+	{
+		Bucket.store(0, std::memory_order_relaxed);
+	}
+	m_MaxUsec.store(0, std::memory_order_relaxed);
+}
+
+
+
+
+
+UInt64 cLatencyHistogram::GetCount(void) const
+{
+	UInt64 res = 0;
+	for (const auto & Bucket : m_Buckets)
+	{
+		res += Bucket.load(std::memory_order_relaxed);
+	}
+	return res;
+}
+
+
+
+
+
+UInt64 cLatencyHistogram::GetPercentileUsec(double a_Percentile) const
+{
+	// Take a snapshot of the buckets, so that the count and the walk agree:
+	std::array<UInt64, NUM_BUCKETS> Snapshot;
+	UInt64 Count = 0;
+	for (size_t i = 0; i < NUM_BUCKETS; i++)
+	{
+		Snapshot[i] = m_Buckets[i].load(std::memory_order_relaxed);
+		Count += Snapshot[i];
+	}
+	if (Count == 0)
+	{
+		return 0;
+	}
+
+	// Find the bucket containing the requested rank:
+	double Percentile = std::min(std::max(a_Percentile, 0.0), 100.0);
+	auto Rank = static_cast<UInt64>(std::ceil(static_cast<double>(Count) * Percentile / 100));
+	Rank = std::max<UInt64>(Rank, 1);
+	UInt64 Seen = 0;
+	for (size_t i = 0; i < NUM_BUCKETS - 1; i++)
+	{
+		Seen += Snapshot[i];
+		if (Seen >= Rank)
+		{
+			// Report the bucket's upper bound, but never more than the actual maximum seen:
+			return std::min<UInt64>(static_cast<UInt64>(1) << i, GetMaxUsec());
+		}
+	}
+	return GetMaxUsec();
+}
+
+
+
+
+
+AString cLatencyHistogram::Format(void) const
+{
+	return Printf("%llu samples, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us",
+		static_cast<unsigned long long>(GetCount()),
+		static_cast<unsigned long long>(GetPercentileUsec(50)),
+		static_cast<unsigned long long>(GetPercentileUsec(90)),
+		static_cast<unsigned long long>(GetPercentileUsec(99)),
+		static_cast<unsigned long long>(GetMaxUsec())
+	);
+}
+
+
+
+
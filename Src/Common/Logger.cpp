@@ -3,6 +3,7 @@
 #include "Logger.h"
 
 #include "OSSupport/IsThread.h"
+#include "OSSupport/MPSCQueue.h"
 #ifdef _WIN32
 	#include <time.h>
 #endif
@@ -11,52 +12,381 @@
 
 
 
-cLogger & cLogger::GetInstance(void)
-{
-	static cLogger Instance;
-	return Instance;
-}
+/** Size of the buffer for a log line prefix. */
+static const size_t LINE_PREFIX_SIZE = 32;
 
+/** The longest cAsyncWriter::StopAndWriteOut() waits for the logging threads still pushing. */
+static const std::chrono::milliseconds MAX_STOP_WAIT(1000);
 
 
 
 
-void cLogger::InitiateMultithreading()
+
+/** Formats the prefix of a log line for the specified time (and thread, in Debug builds) into a_Prefix. */
+static void FormatLinePrefix(char (& a_Prefix)[LINE_PREFIX_SIZE], time_t a_Time, std::thread::id a_ThreadID)
 {
-	GetInstance();
+	struct tm timeinfo;
+	#ifdef _MSC_VER
+		localtime_s(&timeinfo, &a_Time);
+	#else
+		localtime_r(&a_Time, &timeinfo);
+	#endif
+
+	#ifdef _DEBUG
+		snprintf(a_Prefix, sizeof(a_Prefix), "[%04llx|%02d:%02d:%02d] ", static_cast<unsigned long long>(std::hash<std::thread::id>()(a_ThreadID)), timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+	#else
+		UNUSED(a_ThreadID);
+		snprintf(a_Prefix, sizeof(a_Prefix), "[%02d:%02d:%02d] ", timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+	#endif
 }
 
 
 
 
 
-void cLogger::LogSimple(AString a_Message, eLogLevel a_LogLevel)
+/** Returns the prefix of a log line for the current time (and the current thread, in Debug builds).
+The prefix is cached per thread, localtime() is called only when the second changes. */
+static const char * GetLinePrefix(void)
 {
+	static thread_local time_t LastTime = 0;
+	static thread_local char Prefix[LINE_PREFIX_SIZE];
+
 	time_t rawtime;
 	time(&rawtime);
+	if (rawtime != LastTime)
+	{
+		LastTime = rawtime;
+		FormatLinePrefix(Prefix, rawtime, std::this_thread::get_id());
+	}
+	return Prefix;
+}
 
-	struct tm * timeinfo;
-	#ifdef _MSC_VER
-		struct tm timeinforeal;
-		timeinfo = &timeinforeal;
-		localtime_s(timeinfo, &rawtime);
-	#else
-		timeinfo = localtime(&rawtime);
-	#endif
 
-	AString Line;
+
+
+
+/** Formats the deferred message into a full log line.
+The last prefix is cached, consecutive messages from the same second (and thread) reuse it. */
+static AString FormatDeferredLine(const cLogger::cDeferredMessage & a_Message)
+{
+	static thread_local time_t LastTime = 0;
+	static thread_local char Prefix[LINE_PREFIX_SIZE];
 	#ifdef _DEBUG
-		Printf(Line, "[%04llx|%02d:%02d:%02d] %s\n", static_cast<UInt64>(std::hash<std::thread::id>()(std::this_thread::get_id())), timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, a_Message.c_str());
+		static thread_local std::thread::id LastThreadID;
+		if ((a_Message.m_Time != LastTime) || (a_Message.m_ThreadID != LastThreadID))
+		{
+			LastTime = a_Message.m_Time;
+			LastThreadID = a_Message.m_ThreadID;
+			FormatLinePrefix(Prefix, a_Message.m_Time, a_Message.m_ThreadID);
+		}
 	#else
-		Printf(Line, "[%02d:%02d:%02d] %s\n", timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, a_Message.c_str());
+		if (a_Message.m_Time != LastTime)
+		{
+			LastTime = a_Message.m_Time;
+			FormatLinePrefix(Prefix, a_Message.m_Time, std::thread::id());
+		}
 	#endif
+	AString res(Prefix);
+	res.append(a_Message.Format());
+	res.push_back('\n');
+	return res;
+}
 
 
-	cCSLock Lock(m_CriticalSection);
-	for (size_t i = 0; i < m_LogListeners.size(); i++)
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cLogger::cAsyncWriter:
+
+/** The writer thread of the asynchronous logging.
+The logging threads push the formatted lines into a lock-free queue; the writer thread takes them out and passes
+them to the listeners in batches, holding the logger's lock once per batch and flushing the listeners once per batch.
+The number of queued messages is kept in a separate counter, which bounds the queue and tells the writer thread
+whether a message is still being pushed when it finds the queue empty. */
+class cLogger::cAsyncWriter :
+	public cIsThread
+{
+	typedef cIsThread super;
+
+public:
+
+	cAsyncWriter(cLogger & a_Logger, size_t a_MaxQueueSize, eOverflowPolicy a_Policy) :
+		super("cLogger::cAsyncWriter"),
+		m_Logger(a_Logger),
+		m_MaxQueueSize(std::max<size_t>(a_MaxQueueSize, 1)),
+		m_Policy(a_Policy),
+		m_QueueSize(0),
+		m_NumWritten(0),
+		m_NumBatches(0),
+		m_NumDropped(0),
+		m_NumBlocked(0),
+		m_NumWaiting(0)
 	{
-		m_LogListeners[i]->Log(Line, a_LogLevel);
 	}
+
+
+	/** Queues the line to be written by the writer thread, applying the overflow policy if the queue is full.
+	Can be called from any thread. */
+	void Push(AString && a_Line, eLogLevel a_LogLevel)
+	{
+		Push({std::move(a_Line), nullptr, a_LogLevel});
+	}
+
+
+	/** Queues the deferred message to be formatted and written by the writer thread. Can be called from any thread. */
+	void Push(std::unique_ptr<cDeferredMessage> a_Message, eLogLevel a_LogLevel)
+	{
+		Push({AString(), std::move(a_Message), a_LogLevel});
+	}
+
+
+	/** Stops the writer thread and writes out all the messages still in the queue.
+	a_NumPushing is the logger's count of the logging threads that may still push into this writer; their messages
+	are written out as well, waiting for them at most MAX_STOP_WAIT (a thread that crashed in the middle of
+	pushing never finishes). May be called on the writer thread itself, when it has crashed. */
+	void StopAndWriteOut(const std::atomic<int> & a_NumPushing)
+	{
+		m_ShouldTerminate = true;
+		if (!IsCurrentThread())
+		{
+			m_evtQueued.Set();
+			Wait();
+		}
+
+		// The writer thread has finished, the current thread is the only consumer now. Keep writing out until no
+		// logging thread is pushing anymore; the blocked ones are released by the room that the writing makes:
+		auto Deadline = std::chrono::steady_clock::now() + MAX_STOP_WAIT;
+		for (;;)
+		{
+			bool IsLastPass = (a_NumPushing.load() == 0) || (std::chrono::steady_clock::now() > Deadline);
+			while (WriteBatch())
+			{
+			}
+			if (IsLastPass)
+			{
+				return;
+			}
+			std::this_thread::yield();
+		}
+	}
+
+
+	/** Fills in the queue-related members of a_Stats. */
+	void GetStats(cAsyncStats & a_Stats) const
+	{
+		a_Stats.m_QueueSize    = m_QueueSize.load(std::memory_order_relaxed);
+		a_Stats.m_MaxQueueSize = m_MaxQueueSize;
+		a_Stats.m_NumWritten   = m_NumWritten.load(std::memory_order_relaxed);
+		a_Stats.m_NumBatches   = m_NumBatches.load(std::memory_order_relaxed);
+		a_Stats.m_NumDropped   = m_NumDropped.load(std::memory_order_relaxed);
+		a_Stats.m_NumBlocked   = m_NumBlocked.load(std::memory_order_relaxed);
+	}
+
+protected:
+
+	/** A single queued message, either an already formatted line or a deferred message. */
+	struct cRecord
+	{
+		AString m_Line;
+		std::unique_ptr<cDeferredMessage> m_Deferred;
+		eLogLevel m_LogLevel;
+	};
+
+	/** The maximum number of messages written while holding the logger's lock. */
+	static const size_t MAX_BATCH_SIZE = 256;
+
+	/** How long the writer thread sleeps when there's nothing to write, before re-checking m_ShouldTerminate. */
+	static const unsigned QUEUED_WAIT_MSEC = 100;
+
+	/** How long a blocked logging thread waits for the writer thread, before re-checking the queue. */
+	static const unsigned ROOM_WAIT_MSEC = 10;
+
+
+	cLogger & m_Logger;
+
+	const size_t m_MaxQueueSize;
+
+	const eOverflowPolicy m_Policy;
+
+	cMPSCQueue<cRecord> m_Queue;
+
+	/** Number of messages pushed (or being pushed) into m_Queue and not yet written. */
+	std::atomic<size_t> m_QueueSize;
+
+	std::atomic<UInt64> m_NumWritten;
+	std::atomic<UInt64> m_NumBatches;
+	std::atomic<UInt64> m_NumDropped;
+	std::atomic<UInt64> m_NumBlocked;
+
+	/** Number of logging threads currently waiting for room in the queue. */
+	std::atomic<int> m_NumWaiting;
+
+	/** Set when a message is pushed into an empty queue, wakes up the writer thread. */
+	cEvent m_evtQueued;
+
+	/** Set when the writer thread has made room in the queue, wakes up the blocked logging threads. */
+	cEvent m_evtRoom;
+
+
+	virtual void Execute(void) override
+	{
+		while (!m_ShouldTerminate)
+		{
+			if (WriteBatch())
+			{
+				continue;
+			}
+			if (m_QueueSize.load(std::memory_order_acquire) > 0)
+			{
+				// A logging thread is in the middle of pushing a message, it will be available in a moment:
+				std::this_thread::yield();
+				continue;
+			}
+			m_evtQueued.Wait(QUEUED_WAIT_MSEC);
+		}
+	}
+
+
+	/** Writes up to MAX_BATCH_SIZE queued messages to the listeners.
+	Returns false if there was nothing to write. Must be called only by the single consumer of m_Queue. */
+	bool WriteBatch(void)
+	{
+		cRecord Record;
+		if (!m_Queue.TryDequeue(Record))
+		{
+			return false;
+		}
+		size_t NumWritten = 0;
+		{
+			cCSLock Lock(m_Logger.m_CriticalSection);
+			do
+			{
+				if (Record.m_Deferred != nullptr)
+				{
+					m_Logger.WriteDeferredToListeners(*Record.m_Deferred, Record.m_LogLevel);
+					Record.m_Deferred.reset();
+				}
+				else
+				{
+					m_Logger.WriteToListeners(Record.m_Line, Record.m_LogLevel);
+				}
+				NumWritten += 1;
+			} while ((NumWritten < MAX_BATCH_SIZE) && m_Queue.TryDequeue(Record));
+			m_Logger.FlushListeners();
+		}
+		m_QueueSize.fetch_sub(NumWritten, std::memory_order_acq_rel);
+		m_NumWritten.fetch_add(NumWritten, std::memory_order_relaxed);
+		m_NumBatches.fetch_add(1, std::memory_order_relaxed);
+		if (m_NumWaiting.load(std::memory_order_acquire) > 0)
+		{
+			m_evtRoom.SetAll();
+		}
+		return true;
+	}
+
+
+	/** Queues the record, applying the overflow policy if the queue is full. */
+	void Push(cRecord && a_Record)
+	{
+		size_t PrevSize = m_QueueSize.fetch_add(1, std::memory_order_acq_rel);
+		if (PrevSize >= m_MaxQueueSize)
+		{
+			// The writer thread itself mustn't wait for itself (a listener logging something):
+			if ((m_Policy == opDrop) || IsCurrentThread())
+			{
+				m_QueueSize.fetch_sub(1, std::memory_order_acq_rel);
+				m_NumDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			m_NumBlocked.fetch_add(1, std::memory_order_relaxed);
+			m_NumWaiting.fetch_add(1, std::memory_order_acq_rel);
+			do
+			{
+				m_QueueSize.fetch_sub(1, std::memory_order_acq_rel);
+				m_evtRoom.Wait(ROOM_WAIT_MSEC);
+				PrevSize = m_QueueSize.fetch_add(1, std::memory_order_acq_rel);
+			} while (PrevSize >= m_MaxQueueSize);
+			m_NumWaiting.fetch_sub(1, std::memory_order_acq_rel);
+		}
+
+		m_Queue.Enqueue(std::move(a_Record));
+
+		// If the queue was empty, the writer thread may be sleeping:
+		if (PrevSize == 0)
+		{
+			m_evtQueued.Set();
+		}
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cLogger:
+
+cLogger::cLogger(void) :
+	m_Async(nullptr),
+	m_NumPushing(0)
+{
+}
+
+
+
+
+
+cLogger::~cLogger()
+{
+	StopAsync();
+}
+
+
+
+
+
+cLogger & cLogger::GetInstance(void)
+{
+	static cLogger Instance;
+	return Instance;
+}
+
+
+
+
+
+void cLogger::InitiateMultithreading()
+{
+	GetInstance();
+}
+
+
+
+
+
+void cLogger::LogSimple(AString a_Message, eLogLevel a_LogLevel)
+{
+	const char * Prefix = GetLinePrefix();
+	AString Line;
+	Line.reserve(strlen(Prefix) + a_Message.size() + 1);
+	Line.append(Prefix);
+	Line.append(a_Message);
+	Line.push_back('\n');
+
+	m_NumPushing.fetch_add(1);
+	auto Async = m_Async.load();
+	if (Async != nullptr)
+	{
+		Async->Push(std::move(Line), a_LogLevel);
+		m_NumPushing.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+	m_NumPushing.fetch_sub(1, std::memory_order_relaxed);
+
+	cCSLock Lock(m_CriticalSection);
+	WriteToListeners(Line, a_LogLevel);
+	FlushListeners();
 }
 
 
@@ -88,6 +418,139 @@ cLogger::cAttachment cLogger::AttachListener(std::unique_ptr<cListener> a_Listen
 
 
 
+void cLogger::LogDeferredMessage(std::unique_ptr<cDeferredMessage> a_Message, eLogLevel a_LogLevel)
+{
+	m_NumPushing.fetch_add(1);
+	auto Async = m_Async.load();
+	if (Async != nullptr)
+	{
+		Async->Push(std::move(a_Message), a_LogLevel);
+		m_NumPushing.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+	m_NumPushing.fetch_sub(1, std::memory_order_relaxed);
+
+	// Switched to synchronous logging in the meantime:
+	AString Line = FormatDeferredLine(*a_Message);
+	cCSLock Lock(m_CriticalSection);
+	WriteToListeners(Line, a_LogLevel);
+	FlushListeners();
+}
+
+
+
+
+
+void cLogger::StartAsync(size_t a_MaxQueueSize, eOverflowPolicy a_Policy)
+{
+	ASSERT(m_AsyncWriter == nullptr);  // May be called only once
+	if (m_AsyncWriter != nullptr)
+	{
+		return;
+	}
+
+	m_AsyncWriter.reset(new cAsyncWriter(*this, a_MaxQueueSize, a_Policy));
+	if (!m_AsyncWriter->Start())
+	{
+		LOGWARNING("Cannot start the log writer thread, logging stays synchronous");
+		return;
+	}
+	m_Async.store(m_AsyncWriter.get(), std::memory_order_release);
+}
+
+
+
+
+
+void cLogger::StopAsync(void)
+{
+	// The threads that loaded m_Async before this exchange are counted in m_NumPushing (both are sequentially consistent),
+	// the writer waits for their messages:
+	auto Async = m_Async.exchange(nullptr);
+	if (Async == nullptr)
+	{
+		return;
+	}
+	Async->StopAndWriteOut(m_NumPushing);
+}
+
+
+
+
+
+cLogger::cAsyncStats cLogger::GetAsyncStats(void)
+{
+	cAsyncStats res;
+	res.m_IsAsync = (m_Async.load(std::memory_order_acquire) != nullptr);
+	res.m_QueueSize = 0;
+	res.m_MaxQueueSize = 0;
+	res.m_NumWritten = 0;
+	res.m_NumBatches = 0;
+	res.m_NumDropped = 0;
+	res.m_NumBlocked = 0;
+	if (m_AsyncWriter != nullptr)
+	{
+		m_AsyncWriter->GetStats(res);
+	}
+	return res;
+}
+
+
+
+
+
+void cLogger::WriteToListeners(const AString & a_Line, eLogLevel a_LogLevel)
+{
+	ASSERT(m_CriticalSection.IsLockedByCurrentThread());
+
+	for (size_t i = 0; i < m_LogListeners.size(); i++)
+	{
+		m_LogListeners[i]->Log(a_Line, a_LogLevel);
+	}
+}
+
+
+
+
+
+void cLogger::WriteDeferredToListeners(const cDeferredMessage & a_Message, eLogLevel a_LogLevel)
+{
+	ASSERT(m_CriticalSection.IsLockedByCurrentThread());
+
+	AString Line;
+	for (size_t i = 0; i < m_LogListeners.size(); i++)
+	{
+		if (m_LogListeners[i]->TakesDeferred())
+		{
+			m_LogListeners[i]->LogDeferred(a_Message, a_LogLevel);
+			continue;
+		}
+		if (Line.empty())
+		{
+			Line = FormatDeferredLine(a_Message);
+		}
+		m_LogListeners[i]->Log(Line, a_LogLevel);
+	}
+}
+
+
+
+
+
+void cLogger::FlushListeners(void)
+{
+	ASSERT(m_CriticalSection.IsLockedByCurrentThread());
+
+	for (size_t i = 0; i < m_LogListeners.size(); i++)
+	{
+		m_LogListeners[i]->Flush();
+	}
+}
+
+
+
+
+
 void cLogger::DetachListener(cListener * a_Listener)
 {
 	cCSLock Lock(m_CriticalSection);
@@ -99,7 +562,8 @@ void cLogger::DetachListener(cListener * a_Listener)
 			{
 				return a_OtherListener.get() == a_Listener;
 			}
-		)
+		),
+		m_LogListeners.end()
 	);
 }
 
@@ -110,6 +574,16 @@ void cLogger::DetachListener(cListener * a_Listener)
 ////////////////////////////////////////////////////////////////////////////////
 // Global functions
 
+void StopAsyncLogging(void)
+{
+	cLogger::GetInstance().StopAsync();
+}
+
+
+
+
+
+
 void LOG(const char * a_Format, ...)
 {
 	va_list argList;
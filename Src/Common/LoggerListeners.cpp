@@ -301,7 +301,10 @@ class cFileListener
 {
 public:
 
-	cFileListener(void) {}
+	cFileListener(void) :
+		m_ShouldFlush(false)
+	{
+	}
 
 	bool Open()
 	{
@@ -322,7 +325,6 @@ public:
 	virtual void Log(AString a_Message, cLogger::eLogLevel a_LogLevel) override
 	{
 		const char * LogLevelPrefix = "Unkn ";
-		bool ShouldFlush = false;
 		switch (a_LogLevel)
 		{
 			case cLogger::llRegular:
@@ -338,26 +340,35 @@ public:
 			case cLogger::llWarning:
 			{
 				LogLevelPrefix = "Warn ";
-				ShouldFlush = true;
+				m_ShouldFlush = true;
 				break;
 			}
 			case cLogger::llError:
 			{
 				LogLevelPrefix = "Err  ";
-				ShouldFlush = true;
+				m_ShouldFlush = true;
 				break;
 			}
 		}
 		m_File.Printf("%s%s", LogLevelPrefix, a_Message.c_str());
-		if (ShouldFlush)
+	}
+
+	virtual void Flush(void) override
+	{
+		// Flush only after warnings and errors, once per batch of messages:
+		if (m_ShouldFlush)
 		{
 			m_File.Flush();
+			m_ShouldFlush = false;
 		}
 	}
 	
 private:
 
 	cFile m_File;
+
+	/** Set when a warning or an error has been written and not yet flushed. */
+	bool m_ShouldFlush;
 };
 
 
@@ -48,6 +48,24 @@ void cCriticalSection::Unlock()
 
 
 
+bool cCriticalSection::TryLock()
+{
+	if (!m_Mutex.try_lock())
+	{
+		return false;
+	}
+
+	#ifdef _DEBUG
+		m_IsLocked += 1;
+		m_OwningThreadID = std::this_thread::get_id();
+	#endif  // _DEBUG
+	return true;
+}
+
+
+
+
+
 #ifdef _DEBUG
 bool cCriticalSection::IsLocked(void)
 {
@@ -0,0 +1,297 @@
+
+// SegmentedByteBuffer.cpp
+
+// Implements the cSegmentedByteBuffer class representing a growable byte queue stored in pooled fixed-size chunks
+
+#include "stdafx.h"
+
+#include "SegmentedByteBuffer.h"
+#include "VarInt.h"
+#include "BlockPool.h"
+
+
+
+
+
+#define NEEDBYTES(Num) if (!CanReadBytes(Num))  return false;  // Check if at least Num bytes can be read from  the buffer, return false if not
+#define PUTBYTES(Num)  if (!CanWriteBytes(Num)) return false;  // Check if at least Num bytes can be written to the buffer, return false if not
+
+
+
+
+
+/** Returns the global pool of the chunks. Constructed on first use, so that it is available to buffers in static objects, too. */
+static cBlockPool & GetChunkPool(void)
+{
+	static cBlockPool Pool("Receive buffers", cSegmentedByteBuffer::CHUNK_SIZE, 1024);
+	return Pool;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cSegmentedByteBuffer:
+
+cSegmentedByteBuffer::cSegmentedByteBuffer(size_t a_MaxSize) :
+	m_Chunks(m_InlineChunks),
+	m_NumChunks(0),
+	m_ChunksCapacity(NUM_INLINE_CHUNKS),
+	m_MaxSize(a_MaxSize),
+	m_DataStart(0),
+	m_WritePos(0),
+	m_ReadPos(0)
+{
+}
+
+
+
+
+
+cSegmentedByteBuffer::~cSegmentedByteBuffer()
+{
+	CheckValid();
+	FreeChunks(m_NumChunks);
+}
+
+
+
+
+
+bool cSegmentedByteBuffer::Write(const void * a_Bytes, size_t a_Count)
+{
+	CheckValid();
+	PUTBYTES(a_Count);
+	const char * Src = reinterpret_cast<const char *>(a_Bytes);
+	while (a_Count > 0)
+	{
+		if (m_WritePos == GetAllocatedSize())
+		{
+			// The last chunk is full (or there's none), add a new one:
+			AddChunk();
+		}
+		size_t Num = std::min(a_Count, TillChunkEnd(m_WritePos));
+		memcpy(GetPtr(m_WritePos), Src, Num);
+		Src += Num;
+		a_Count -= Num;
+		m_WritePos += Num;
+	}
+	return true;
+}
+
+
+
+
+
+bool cSegmentedByteBuffer::ReadVarInt64(UInt64 & a_Value)
+{
+	CheckValid();
+	if ((GetReadableSpace() >= MAX_VARINT64_SIZE) && (TillChunkEnd(m_ReadPos) >= MAX_VARINT64_SIZE))
+	{
+		size_t NumBytes = DecodeVarInt64(GetPtr(m_ReadPos), a_Value);
+		if (NumBytes > 0)
+		{
+			m_ReadPos += NumBytes;
+			return true;
+		}
+	}
+
+	// The VarInt may span two chunks, or there's not enough data; read byte by byte:
+	UInt64 Value = 0;
+	int Shift = 0;
+	unsigned char b = 0;
+	do
+	{
+		NEEDBYTES(1);
+		b = static_cast<unsigned char>(*GetPtr(m_ReadPos));
+		m_ReadPos += 1;
+		Value = Value | ((static_cast<UInt64>(b & 0x7f)) << Shift);
+		Shift += 7;
+	} while ((b & 0x80) != 0);
+	a_Value = Value;
+	return true;
+}
+
+
+
+
+
+bool cSegmentedByteBuffer::ReadString(AString & a_String, size_t a_Count)
+{
+	CheckValid();
+	NEEDBYTES(a_Count);
+	a_String.resize(a_Count);
+	if (a_Count > 0)
+	{
+		CopyOut(m_ReadPos, &a_String[0], a_Count);
+	}
+	m_ReadPos += a_Count;
+	return true;
+}
+
+
+
+
+
+bool cSegmentedByteBuffer::SkipRead(size_t a_Count)
+{
+	CheckValid();
+	NEEDBYTES(a_Count);
+	m_ReadPos += a_Count;
+	return true;
+}
+
+
+
+
+
+bool cSegmentedByteBuffer::PeekContiguous(const char *& a_Data, size_t a_Count) const
+{
+	CheckValid();
+	NEEDBYTES(a_Count);
+	if (a_Count == 0)
+	{
+		a_Data = nullptr;
+		return true;
+	}
+	if (TillChunkEnd(m_ReadPos) < a_Count)
+	{
+		// The data spans several chunks
+		return false;
+	}
+	a_Data = GetPtr(m_ReadPos);
+	return true;
+}
+
+
+
+
+
+
+void cSegmentedByteBuffer::CommitRead(void)
+{
+	CheckValid();
+	m_DataStart = m_ReadPos;
+	if (m_DataStart == m_WritePos)
+	{
+		// All the data has been consumed, return all the chunks:
+		FreeChunks(m_NumChunks);
+		m_DataStart = 0;
+		m_ReadPos = 0;
+		m_WritePos = 0;
+		return;
+	}
+
+	// Return the chunks that have been fully consumed:
+	size_t NumDrained = m_DataStart / CHUNK_SIZE;
+	if (NumDrained == 0)
+	{
+		return;
+	}
+	FreeChunks(NumDrained);
+	size_t Shift = NumDrained * CHUNK_SIZE;
+	m_DataStart -= Shift;
+	m_ReadPos -= Shift;
+	m_WritePos -= Shift;
+}
+
+
+
+
+
+void cSegmentedByteBuffer::CheckValid(void) const
+{
+	ASSERT(m_DataStart <= m_ReadPos);
+	ASSERT(m_ReadPos <= m_WritePos);
+	ASSERT(m_WritePos <= GetAllocatedSize());
+	ASSERT((m_DataStart < CHUNK_SIZE) || (m_NumChunks == 0));  // CommitRead() returns the drained chunks
+	ASSERT(m_NumChunks <= m_ChunksCapacity);
+	ASSERT((m_Chunks == m_InlineChunks) == (m_ChunksCapacity == NUM_INLINE_CHUNKS));
+}
+
+
+
+
+
+void cSegmentedByteBuffer::SetMaxPooledChunks(size_t a_MaxPooled)
+{
+	GetChunkPool().SetMaxCached(a_MaxPooled);
+}
+
+
+
+
+
+cBlockPool::cStats cSegmentedByteBuffer::GetPoolStats(void)
+{
+	return GetChunkPool().GetStats();
+}
+
+
+
+
+
+void cSegmentedByteBuffer::AddChunk(void)
+{
+	if (m_NumChunks == m_ChunksCapacity)
+	{
+		// Move the list of the chunks to the heap, or grow it there:
+		size_t NewCapacity = m_ChunksCapacity * 2;
+		char ** NewChunks = new char *[NewCapacity];
+		std::copy(m_Chunks, m_Chunks + m_NumChunks, NewChunks);
+		if (m_Chunks != m_InlineChunks)
+		{
+			delete[] m_Chunks;
+		}
+		m_Chunks = NewChunks;
+		m_ChunksCapacity = NewCapacity;
+	}
+	m_Chunks[m_NumChunks] = static_cast<char *>(GetChunkPool().Allocate());
+	m_NumChunks += 1;
+}
+
+
+
+
+
+void cSegmentedByteBuffer::FreeChunks(size_t a_Count)
+{
+	ASSERT(a_Count <= m_NumChunks);
+	auto & Pool = GetChunkPool();
+	for (size_t i = 0; i < a_Count; i++)
+	{
+		Pool.Free(m_Chunks[i]);
+	}
+	std::copy(m_Chunks + a_Count, m_Chunks + m_NumChunks, m_Chunks);
+	m_NumChunks -= a_Count;
+
+	// An idle buffer keeps no heap memory:
+	if ((m_NumChunks == 0) && (m_Chunks != m_InlineChunks))
+	{
+		delete[] m_Chunks;
+		m_Chunks = m_InlineChunks;
+		m_ChunksCapacity = NUM_INLINE_CHUNKS;
+	}
+}
+
+
+
+
+
+void cSegmentedByteBuffer::CopyOut(size_t a_Pos, char * a_Dst, size_t a_Count) const
+{
+	ASSERT(a_Pos + a_Count <= m_WritePos);
+	while (a_Count > 0)
+	{
+		size_t Num = std::min(a_Count, TillChunkEnd(a_Pos));
+		memcpy(a_Dst, GetPtr(a_Pos), Num);
+		a_Dst += Num;
+		a_Pos += Num;
+		a_Count -= Num;
+	}
+}
+
+
+
+
@@ -0,0 +1,389 @@
+
+// TimerWheel.cpp
+
+// Implements the cTimerWheel class representing a hierarchical timing wheel for large numbers of timers
+
+#include "stdafx.h"
+#include "OSSupport/TimerWheel.h"
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cTimerWheel::cTimer:
+
+cTimerWheel::cTimer::cTimer(void) :
+	m_Wheel(nullptr),
+	m_Level(0),
+	m_ExpiryTick(0)
+{
+	m_Prev = nullptr;
+	m_Next = nullptr;
+}
+
+
+
+
+
+cTimerWheel::cTimer::cTimer(std::function<void()> a_Callback) :
+	m_Callback(std::move(a_Callback)),
+	m_Wheel(nullptr),
+	m_Level(0),
+	m_ExpiryTick(0)
+{
+	m_Prev = nullptr;
+	m_Next = nullptr;
+}
+
+
+
+
+
+cTimerWheel::cTimer::~cTimer()
+{
+	Cancel();
+}
+
+
+
+
+
+void cTimerWheel::cTimer::Cancel(void)
+{
+	if (m_Wheel == nullptr)
+	{
+		return;
+	}
+	m_Wheel->Unlink(*this);
+	m_Wheel->m_NumArmed -= 1;
+	m_Wheel->m_NumCancels += 1;
+	m_Wheel = nullptr;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cTimerWheel:
+
+cTimerWheel::cTimerWheel(std::chrono::milliseconds a_Granularity) :
+	m_Granularity(a_Granularity),
+	m_StartTime(std::chrono::steady_clock::now()),
+	m_NextTick(1),
+	m_Slots(NUM_LEVELS << LEVEL0_BITS),
+	m_NumArmed(0),
+	m_NumArms(0),
+	m_NumCancels(0),
+	m_NumExpired(0),
+	m_NumCascaded(0)
+{
+	ASSERT(a_Granularity.count() > 0);
+	for (auto & Slot : m_Slots)
+	{
+		Slot.m_Prev = &Slot;
+		Slot.m_Next = &Slot;
+	}
+	for (size_t i = 0; i < NUM_LEVELS; i++)
+	{
+		m_LevelCounts[i] = 0;
+	}
+}
+
+
+
+
+
+cTimerWheel::~cTimerWheel()
+{
+	// Disarm the timers left, so that they don't try to unlink themselves from the freed slots later on:
+	for (auto & Slot : m_Slots)
+	{
+		for (cLink * Link = Slot.m_Next; Link != &Slot; Link = Link->m_Next)
+		{
+			static_cast<cTimer *>(Link)->m_Wheel = nullptr;
+		}
+	}
+}
+
+
+
+
+
+void cTimerWheel::Arm(cTimer & a_Timer, cTimePoint a_Deadline)
+{
+	if (a_Timer.m_Wheel == this)
+	{
+		Unlink(a_Timer);
+		m_NumArmed -= 1;
+	}
+	else
+	{
+		a_Timer.Cancel();
+	}
+
+	a_Timer.m_Wheel = this;
+	a_Timer.m_Deadline = a_Deadline;
+	a_Timer.m_ExpiryTick = std::max(GetTickAtOrAfter(a_Deadline), m_NextTick);
+	Place(a_Timer);
+	m_NumArmed += 1;
+	m_NumArms += 1;
+}
+
+
+
+
+
+size_t cTimerWheel::Advance(cTimePoint a_Now)
+{
+	UInt64 NowTick = GetTickBefore(a_Now);
+	size_t NumExpired = 0;
+	while (m_NextTick <= NowTick)
+	{
+		if (m_LevelCounts[0] == 0)
+		{
+			// Nothing expires before the next cascade of the lowest non-empty level, skip right to it:
+			size_t Level = 1;
+			while ((Level < NUM_LEVELS) && (m_LevelCounts[Level] == 0))
+			{
+				Level++;
+			}
+			if (Level == NUM_LEVELS)
+			{
+				// No timers at all
+				m_NextTick = NowTick + 1;
+				break;
+			}
+			UInt64 Mask = (static_cast<UInt64>(1) << GetLevelShift(Level)) - 1;
+			UInt64 CascadeTick = (m_NextTick + Mask) & ~Mask;
+			if (CascadeTick > NowTick)
+			{
+				m_NextTick = NowTick + 1;
+				break;
+			}
+			m_NextTick = CascadeTick;
+		}
+		NumExpired += ProcessNextTick();
+	}
+	return NumExpired;
+}
+
+
+
+
+
+bool cTimerWheel::GetNextExpiry(cTimePoint & a_Time) const
+{
+	if (m_NumArmed == 0)
+	{
+		return false;
+	}
+
+	// The next cascade of the lowest non-empty higher level:
+	UInt64 NextTick = std::numeric_limits<UInt64>::max();
+	for (size_t Level = 1; Level < NUM_LEVELS; Level++)
+	{
+		if (m_LevelCounts[Level] > 0)
+		{
+			UInt64 Mask = (static_cast<UInt64>(1) << GetLevelShift(Level)) - 1;
+			NextTick = (m_NextTick + Mask) & ~Mask;
+			break;
+		}
+	}
+
+	// The first non-empty slot of the lowest level, if sooner:
+	if (m_LevelCounts[0] > 0)
+	{
+		size_t Size = GetLevelSize(0);
+		for (UInt64 Tick = m_NextTick; (Tick < m_NextTick + Size) && (Tick < NextTick); Tick++)
+		{
+			const cLink & Slot = m_Slots[static_cast<size_t>(Tick & (Size - 1))];
+			if (Slot.m_Next != &Slot)
+			{
+				NextTick = Tick;
+				break;
+			}
+		}
+	}
+
+	if (NextTick == std::numeric_limits<UInt64>::max())
+	{
+		// Only the timers in the middle of expiring are armed
+		return false;
+	}
+	a_Time = GetTickEnd(NextTick);
+	return true;
+}
+
+
+
+
+
+cTimerWheel::cStats cTimerWheel::GetStats(void) const
+{
+	cStats Stats;
+	Stats.m_NumArmed    = m_NumArmed;
+	Stats.m_NumArms     = m_NumArms;
+	Stats.m_NumCancels  = m_NumCancels;
+	Stats.m_NumExpired  = m_NumExpired;
+	Stats.m_NumCascaded = m_NumCascaded;
+	return Stats;
+}
+
+
+
+
+
+void cTimerWheel::Place(cTimer & a_Timer)
+{
+	ASSERT(a_Timer.m_ExpiryTick >= m_NextTick);
+
+	// Find the lowest level whose range covers the expiry:
+	UInt64 ExpiryTick = a_Timer.m_ExpiryTick;
+	UInt64 Delta = ExpiryTick - m_NextTick;
+	size_t Level = 0;
+	while ((Level + 1 < NUM_LEVELS) && ((Delta >> GetLevelShift(Level + 1)) != 0))
+	{
+		Level++;
+	}
+	UInt64 Range = static_cast<UInt64>(GetLevelSize(Level)) << GetLevelShift(Level);
+	if (Delta >= Range)
+	{
+		// Too far away even for the top level, park the timer in the top level's farthest slot; it gets re-placed
+		// by its real expiry when cascaded:
+		ExpiryTick = m_NextTick + Range - 1;
+	}
+
+	size_t SlotIdx = static_cast<size_t>(ExpiryTick >> GetLevelShift(Level)) & (GetLevelSize(Level) - 1);
+	cLink & Slot = GetSlot(Level, SlotIdx);
+	a_Timer.m_Prev = Slot.m_Prev;
+	a_Timer.m_Next = &Slot;
+	Slot.m_Prev->m_Next = &a_Timer;
+	Slot.m_Prev = &a_Timer;
+	a_Timer.m_Level = Level;
+	m_LevelCounts[Level] += 1;
+}
+
+
+
+
+
+void cTimerWheel::Unlink(cTimer & a_Timer)
+{
+	a_Timer.m_Prev->m_Next = a_Timer.m_Next;
+	a_Timer.m_Next->m_Prev = a_Timer.m_Prev;
+	a_Timer.m_Prev = nullptr;
+	a_Timer.m_Next = nullptr;
+	m_LevelCounts[a_Timer.m_Level] -= 1;
+}
+
+
+
+
+
+void cTimerWheel::TakeSlot(size_t a_Level, size_t a_SlotIdx, cLink & a_List)
+{
+	cLink & Slot = GetSlot(a_Level, a_SlotIdx);
+	if (Slot.m_Next == &Slot)
+	{
+		a_List.m_Prev = &a_List;
+		a_List.m_Next = &a_List;
+		return;
+	}
+
+	// Move the whole list over to the new head:
+	a_List.m_Next = Slot.m_Next;
+	a_List.m_Prev = Slot.m_Prev;
+	a_List.m_Next->m_Prev = &a_List;
+	a_List.m_Prev->m_Next = &a_List;
+	Slot.m_Prev = &Slot;
+	Slot.m_Next = &Slot;
+}
+
+
+
+
+
+size_t cTimerWheel::ProcessNextTick(void)
+{
+	UInt64 Tick = m_NextTick;
+
+	// Cascade the higher levels whose slot comes up as the levels below them wrap around:
+	for (size_t Level = 1; Level < NUM_LEVELS; Level++)
+	{
+		unsigned Shift = GetLevelShift(Level);
+		if ((Tick & ((static_cast<UInt64>(1) << Shift) - 1)) != 0)
+		{
+			break;
+		}
+		cLink Cascaded;
+		TakeSlot(Level, static_cast<size_t>(Tick >> Shift) & (GetLevelSize(Level) - 1), Cascaded);
+		while (Cascaded.m_Next != &Cascaded)
+		{
+			cTimer & Timer = *static_cast<cTimer *>(Cascaded.m_Next);
+			Unlink(Timer);
+			Place(Timer);
+			m_NumCascaded += 1;
+		}
+	}
+
+	// Take the expiring slot as a whole, then move past it, so that the callbacks re-arming a timer into the past
+	// get it expired in the next tick instead of a whole revolution later:
+	cLink Expired;
+	TakeSlot(0, static_cast<size_t>(Tick) & (GetLevelSize(0) - 1), Expired);
+	m_NextTick = Tick + 1;
+
+	size_t NumExpired = 0;
+	while (Expired.m_Next != &Expired)
+	{
+		cTimer & Timer = *static_cast<cTimer *>(Expired.m_Next);
+		ASSERT(Timer.m_ExpiryTick == Tick);
+		Unlink(Timer);
+		Timer.m_Wheel = nullptr;
+		m_NumArmed -= 1;
+		m_NumExpired += 1;
+		NumExpired += 1;
+
+		// Call a copy of the callback, the callback may destroy the timer together with its owner:
+		auto Callback = Timer.m_Callback;
+		if (Callback)
+		{
+			Callback();
+		}
+	}
+	return NumExpired;
+}
+
+
+
+
+
+UInt64 cTimerWheel::GetTickAtOrAfter(cTimePoint a_Time) const
+{
+	if (a_Time <= m_StartTime)
+	{
+		return 0;
+	}
+	auto Granularity = std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_Granularity).count();
+	auto Elapsed = (a_Time - m_StartTime).count();
+	return static_cast<UInt64>((Elapsed + Granularity - 1) / Granularity);
+}
+
+
+
+
+
+UInt64 cTimerWheel::GetTickBefore(cTimePoint a_Time) const
+{
+	if (a_Time <= m_StartTime)
+	{
+		return 0;
+	}
+	auto Granularity = std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_Granularity).count();
+	return static_cast<UInt64>((a_Time - m_StartTime).count() / Granularity);
+}
+
+
+
+
@@ -5,6 +5,7 @@
 #include "Root.h"
 #include "Protocol/cProtocol_impl.h"
 #include "Protocol/Authenticator.h"
+#include "Logger.h"
 
 #include "ErrorCode.h"
 
@@ -18,12 +19,23 @@
 Server sends one ping every 30 second. */
 static const std::chrono::milliseconds PING_TIME_MS = std::chrono::milliseconds(1000*15);//15s
 
+/** The client is kicked if nothing is received from it for this long. */
+static const std::chrono::seconds CLIENT_TIMEOUT = std::chrono::seconds(30);
 
+/** Size of the segments in the outgoing data chain.
+Packets are appended to the last segment until it reaches this size, then a new segment is started. */
+static const size_t OUTGOING_SEGMENT_SIZE = 16 KiB;
 
+/** The largest incoming data buffer that ServerTick() hands back for reuse; larger ones are freed, so that a single burst
+doesn't pin its memory for the rest of the connection. */
+static const size_t MAX_REUSED_INCOMING_SIZE = 16 KiB;
 
 
 
-int cClientHandle::s_ClientCount = 0;
+
+
+
+std::atomic<int> cClientHandle::s_ClientCount(0);
 
 
 
@@ -32,10 +44,12 @@ int cClientHandle::s_ClientCount = 0;
 ////////////////////////////////////////////////////////////////////////////////
 // cClientHandle:
 
-cClientHandle::cClientHandle(const AString & a_IPString) :
+cClientHandle::cClientHandle(const AString & a_IPString, bool a_ShouldDispatchImmediately) :
 	m_IPString(a_IPString),
+	m_ShouldDispatchImmediately(a_ShouldDispatchImmediately),
 	m_HasSentDC(false),
-	m_TicksSinceLastPacket(0),
+	m_LastReceivedTime(0),
+	m_IsQueuedForTick(false),
 	m_Ping(1000),
 	m_PingID(1),
 	m_State(csConnected),
@@ -43,11 +57,11 @@ cClientHandle::cClientHandle(const AString & a_IPString) :
 {
 	m_Protocol = new cProtocol_impl(this);
 	
-	s_ClientCount++;  // Not protected by CS because clients are always constructed from the same thread
-	m_UniqueID = s_ClientCount;
+	m_UniqueID = ++s_ClientCount;  // Atomic, clients may be constructed from several listener threads at once
 	m_PingStartTime = std::chrono::steady_clock::now();
+	ResetTimeout();
 
-	LOGD("New ClientHandle created at %p", this);
+	FASTLOGD("New ClientHandle created at %p", this);
 }
 
 
@@ -58,7 +72,7 @@ cClientHandle::~cClientHandle()
 {
 	ASSERT(m_State == csDestroyed);  // Has Destroy() been called?
 	
-	LOGD("Deleting client \"%s\" at %p", GetUsername().c_str(), this);
+	FASTLOGD("Deleting client \"%s\" at %p", GetUsername().c_str(), this);
 
 	if (!m_HasSentDC)
 	{
@@ -68,7 +82,7 @@ cClientHandle::~cClientHandle()
 	delete m_Protocol;
 	m_Protocol = nullptr;
 	
-	LOGD("ClientHandle at %p deleted", this);
+	FASTLOGD("ClientHandle at %p deleted", this);
 }
 
 
@@ -92,7 +106,7 @@ void cClientHandle::Destroy(void)
 	}
 	
 	// DEBUG:
-	LOGD("%s: client %p, \"%s\"", __FUNCTION__, this, m_Username.c_str());
+	FASTLOGD("%s: client %p, \"%s\"", __FUNCTION__, this, m_Username.c_str());
 	
 
 	m_State = csDestroyed;
@@ -100,6 +114,9 @@ void cClientHandle::Destroy(void)
 	//㲥ûϢ
 	cServer *server = cRoot::Get()->GetServer();
 	server->BroadcastUserInfo(this);
+
+	// Let the tick thread remove the client:
+	server->QueueClientTick(*this);
 }
 
 
@@ -107,7 +124,7 @@ void cClientHandle::Kick(const int & a_Reason)
 {
 	if (m_State >= csAuthenticating)  // Don't log pings
 	{
-		LOGINFO("Kicking player %s for error code: \"%d\"", m_Username.c_str(), a_Reason);
+		FASTLOGINFO("Kicking player %s for error code: \"%d\"", m_Username.c_str(), a_Reason);
 	}
 	SendDisconnect(a_Reason);
 }
@@ -143,24 +160,58 @@ void cClientHandle::Authenticate(const AString & a_Name, const AString & a_PassW
 // 	// Delay the first ping until the client "settles down"
 // 	// This should fix #889, "BadCast exception, cannot convert bit to fm" error in client
  	m_PingStartTime = std::chrono::steady_clock::now() + std::chrono::seconds(3);  // Send the first KeepAlive packet in 3 seconds
-	LOGINFO("User [%s] authenticated with IP: %s", a_Name.c_str(), m_IPString.c_str());
+
+	// Let the tick thread switch the client to working and schedule the first ping:
+	server->QueueClientTick(*this);
+	FASTLOGINFO("User [%s] authenticated with IP: %s", a_Name.c_str(), m_IPString.c_str());
 }
 
 
-void cClientHandle::BroadcastUserInfo(const cClientHandle* pClient)
+size_t cClientHandle::SendPresence(const cPresenceEntries & a_Entries, bool a_IsSnapshot)
 {
-	m_Protocol->BroadcastUserInfo(pClient->m_UniqueID, pClient->m_Username, pClient->m_State);
+	return m_Protocol->SendPresence(a_Entries, static_cast<UInt32>(m_UniqueID), a_IsSnapshot);
 }
 
 //ת
-void cClientHandle::ForwardMedia(UInt32 from_id, UInt32 type)
+void cClientHandle::ForwardMedia(UInt32 from_id, UInt32 type, std::chrono::steady_clock::time_point a_ReceivedTime)
 {
 	m_Protocol->ForwardMedia(from_id, type);
+	RelayQueued(a_ReceivedTime);
 }
 
-void cClientHandle::ForwardMediaMsg(UInt32 from_id, AString msg)
+void cClientHandle::ForwardMediaMsg(UInt32 from_id, const AString & msg, std::chrono::steady_clock::time_point a_ReceivedTime)
 {
 	m_Protocol->ForwardMediaMsg(from_id, msg);
+	RelayQueued(a_ReceivedTime);
+}
+
+
+
+void cClientHandle::SendRelayAllocated(UInt32 a_PeerID, UInt16 a_Port)
+{
+	m_Protocol->SendRelayAllocated(a_PeerID, a_Port);
+}
+
+
+
+void cClientHandle::RelayQueued(std::chrono::steady_clock::time_point a_ReceivedTime)
+{
+	if (m_HasSentDC)
+	{
+		// The packet has been dropped by SendData()
+		return;
+	}
+
+	cCSLock Lock(m_CSOutgoingData);
+	if (m_OutgoingData.empty())
+	{
+		// Already handed over to the link (immediate dispatch)
+		cRoot::Get()->GetServer()->GetRelayLatency().AddSince(a_ReceivedTime);
+	}
+	else
+	{
+		m_OutgoingRelayTimes.push_back(a_ReceivedTime);
+	}
 }
 
 
@@ -183,7 +234,13 @@ bool cClientHandle::HandleLogin(const AString & a_Username, const AString & a_Pa
 {
 	// Schedule for authentication; until then, let the player wait (but do not block)
 	m_State = csAuthenticating;
-	cRoot::Get()->GetAuthenticator().Authenticate(GetUniqueID(), a_Username, a_Password);
+	if (!cRoot::Get()->GetAuthenticator().Authenticate(GetUniqueID(), a_Username, a_Password))
+	{
+		// The authenticator is overloaded (login storm), let the client retry later:
+		FASTLOGD("Authentication queue full, rejecting user %s @ %s", a_Username.c_str(), m_IPString.c_str());
+		Kick(ERROR_CODE_SERVER_BUSY);
+		return false;
+	}
 	return true;
 }
 
@@ -250,55 +307,126 @@ void cClientHandle::SendData(const char * a_Data, size_t a_Size)
 	}
 
 	cCSLock Lock(m_CSOutgoingData);
-	m_OutgoingData.append(a_Data, a_Size);
+	if (m_ShouldDispatchImmediately && (m_Link != nullptr))
+	{
+		// Hand the data directly to the link, together with anything queued before the link was available:
+		if (m_OutgoingData.empty())
+		{
+			m_Link->Send(a_Data, a_Size);
+		}
+		else
+		{
+			AppendOutgoingData(a_Data, a_Size);
+			m_Link->Send(std::move(m_OutgoingData));
+			m_OutgoingData.clear();
+		}
+		return;
+	}
+	AppendOutgoingData(a_Data, a_Size);
+	cRoot::Get()->GetServer()->QueueClientTick(*this);
 }
 
-void cClientHandle::ServerTick(float a_Dt)
+
+
+
+
+void cClientHandle::AppendOutgoingData(const char * a_Data, size_t a_Size)
 {
-	// Process received network data:
-	AString IncomingData;
+	ASSERT(m_CSOutgoingData.IsLockedByCurrentThread());
+
+	if (m_OutgoingData.empty() || (m_OutgoingData.back().size() + a_Size > OUTGOING_SEGMENT_SIZE))
 	{
-		cCSLock Lock(m_CSIncomingData);
-		std::swap(IncomingData, m_IncomingData);
+		m_OutgoingData.emplace_back(a_Data, a_Size);
+		return;
 	}
-	if (!IncomingData.empty())
+	m_OutgoingData.back().append(a_Data, a_Size);
+}
+
+void cClientHandle::ServerTick(void)
+{
+	// Process received network data (in immediate dispatch mode it has already been processed in OnReceivedData()):
+	if (!m_ShouldDispatchImmediately)
 	{
-		m_Protocol->DataReceived(IncomingData.data(), IncomingData.size());
+		AString IncomingData;
+		std::chrono::steady_clock::time_point IncomingDataTime;
+		{
+			cCSLock Lock(m_CSIncomingData);
+			std::swap(IncomingData, m_IncomingData);
+			IncomingDataTime = m_IncomingDataTime;
+		}
+		if (!IncomingData.empty())
+		{
+			m_ProcessingDataTime = IncomingDataTime;
+			m_Protocol->DataReceived(IncomingData.data(), IncomingData.size());
+
+			// Hand the buffer back, so that the next received data doesn't need a new allocation:
+			if (IncomingData.capacity() <= MAX_REUSED_INCOMING_SIZE)
+			{
+				IncomingData.clear();
+				cCSLock Lock(m_CSIncomingData);
+				if (m_IncomingData.empty())
+				{
+					std::swap(IncomingData, m_IncomingData);
+				}
+			}
+		}
 	}
 	
-	// Send any queued outgoing data:
-	AString OutgoingData;
+	// Send any queued outgoing data. The network thread may release the link at any time (remote close, error),
+	// so take a reference to it under the same lock, the link must stay alive while sending:
+	cSendSegments OutgoingData;
+	std::vector<std::chrono::steady_clock::time_point> RelayTimes;
+	cTCPLinkPtr Link;
 	{
 		cCSLock Lock(m_CSOutgoingData);
 		std::swap(OutgoingData, m_OutgoingData);
+		std::swap(RelayTimes, m_OutgoingRelayTimes);
+		Link = m_Link;
 	}
-	if ((m_Link != nullptr) && !OutgoingData.empty())
+	if ((Link != nullptr) && !OutgoingData.empty())
 	{
-		m_Link->Send(OutgoingData.data(), OutgoingData.size());
-	}	
+		Link->Send(std::move(OutgoingData));
+		auto & RelayLatency = cRoot::Get()->GetServer()->GetRelayLatency();
+		for (const auto & ReceivedTime : RelayTimes)
+		{
+			RelayLatency.AddSince(ReceivedTime);
+		}
+	}
 
 	// If the chunk the player's in was just sent, spawn the player:
 	if (m_State == csAuthenticated)
 	{
 		m_State = csWorking;
 	}
+}
+
+
+
+
+
+std::chrono::steady_clock::time_point cClientHandle::CheckTimers(std::chrono::steady_clock::time_point a_Now)
+{
+	// Kick the client if nothing has been received for too long:
+	auto LastReceivedTime = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_LastReceivedTime.load(std::memory_order_relaxed)));
+	auto NextCheck = LastReceivedTime + CLIENT_TIMEOUT;
+	if (NextCheck <= a_Now)
+	{
+		SendDisconnect(ERROR_CODE_CLIENT_TIMEOUT);
+		NextCheck = a_Now + CLIENT_TIMEOUT;
+	}
 
 	// Send a ping packet:
 	if (m_State == csWorking)
 	{
-		if ((m_PingStartTime + PING_TIME_MS <= std::chrono::steady_clock::now()))
+		if (m_PingStartTime + PING_TIME_MS <= a_Now)
 		{
 			m_PingID++;
-			m_PingStartTime = std::chrono::steady_clock::now();
+			m_PingStartTime = a_Now;
 			m_Protocol->SendKeepAlive(m_PingID);
 		}
+		NextCheck = std::min(NextCheck, m_PingStartTime + PING_TIME_MS);
 	}
-
-	m_TicksSinceLastPacket += 1;
-	if (m_TicksSinceLastPacket > 600)  // 30 seconds
-	{
-		SendDisconnect(ERROR_CODE_CLIENT_TIMEOUT);
-	}
+	return NextCheck;
 }
 
 
@@ -364,6 +492,15 @@ void cClientHandle::SocketClosed(void)
 
 
 
+
+void cClientHandle::ResetTimeout(void)
+{
+	m_LastReceivedTime.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+
+
+
 void cClientHandle::OnLinkCreated(cTCPLinkPtr a_Link)
 {
 	m_Link = a_Link;
@@ -431,12 +568,64 @@ void cClientHandle::SendDisconnect(const int & a_Reason)
 
 void cClientHandle::OnReceivedData(const char * a_Data, size_t a_Length)
 {
-	// Reset the timeout:
-	m_TicksSinceLastPacket = 0;
+	ResetTimeout();
 
-	// Queue the incoming data to be processed in the tick thread:
+	auto Now = std::chrono::steady_clock::now();
 	cCSLock Lock(m_CSIncomingData);
+	if (m_ShouldDispatchImmediately)
+	{
+		// Parse the data right here in the network thread, relayed packets get sent out without waiting for a tick.
+		// The CS serializes the parsing in case the link calls us from multiple threads.
+		m_ProcessingDataTime = Now;
+		m_Protocol->DataReceived(a_Data, a_Length);
+		return;
+	}
+
+	// Queue the incoming data to be processed in the tick thread:
+	if (m_IncomingData.empty())
+	{
+		m_IncomingDataTime = Now;
+	}
 	m_IncomingData.append(a_Data, a_Length);
+	cRoot::Get()->GetServer()->QueueClientTick(*this);
+}
+
+
+
+
+
+void cClientHandle::OnReceivedDataChunks(const cTCPLink::cReceivedChunk * a_Chunks, size_t a_NumChunks)
+{
+	ResetTimeout();
+
+	// Same as OnReceivedData(), but with the lock taken only once for all the chunks:
+	auto Now = std::chrono::steady_clock::now();
+	cCSLock Lock(m_CSIncomingData);
+	if (m_ShouldDispatchImmediately)
+	{
+		m_ProcessingDataTime = Now;
+		for (size_t i = 0; i < a_NumChunks; i++)
+		{
+			m_Protocol->DataReceived(a_Chunks[i].m_Data, a_Chunks[i].m_Length);
+		}
+		return;
+	}
+
+	if (m_IncomingData.empty())
+	{
+		m_IncomingDataTime = Now;
+	}
+	size_t Length = m_IncomingData.size();
+	for (size_t i = 0; i < a_NumChunks; i++)
+	{
+		Length += a_Chunks[i].m_Length;
+	}
+	m_IncomingData.reserve(Length);
+	for (size_t i = 0; i < a_NumChunks; i++)
+	{
+		m_IncomingData.append(a_Chunks[i].m_Data, a_Chunks[i].m_Length);
+	}
+	cRoot::Get()->GetServer()->QueueClientTick(*this);
 }
 
 
@@ -458,7 +647,7 @@ void cClientHandle::OnRemoteClosed(void)
 
 void cClientHandle::OnError(int a_ErrorCode, const AString & a_ErrorMsg)
 {
-	LOGD("An error has occurred on client link for %s @ %s: %d (%s). Client disconnected.",
+	FASTLOGD("An error has occurred on client link for %s @ %s: %d (%s). Client disconnected.",
 		m_Username.c_str(), m_IPString.c_str(), a_ErrorCode, a_ErrorMsg.c_str()
 	);
 	{
@@ -12,6 +12,7 @@
 #include "OSSupport/Network.h"
 #include "ByteBuffer.h"
 #include "json/json.h"
+#include "PresenceEngine.h"
 
 
 #include <array>
@@ -32,8 +33,10 @@ class cClientHandle  // tolua_export
 public:  // tolua_export
 
 
-	/** Creates a new client with the specified IP address in its description and the specified initial view distance. */
-	cClientHandle(const AString & a_IPString);
+	/** Creates a new client with the specified IP address in its description.
+	If a_ShouldDispatchImmediately is true, the incoming data is parsed directly in the network thread and the outgoing
+	data is sent right away, instead of waiting for the next ServerTick(). */
+	cClientHandle(const AString & a_IPString, bool a_ShouldDispatchImmediately);
 
 	virtual ~cClientHandle();
 
@@ -50,17 +53,32 @@ public:  // tolua_export
 	/** Authenticates the specified user, called by cAuthenticator */
 	void Authenticate(const AString & a_Name, const AString & a_UUID, const Json::Value & a_Properties);
 
-	void BroadcastUserInfo(const cClientHandle* pClient);
+	/** Sends the presence entries to the client, skipping the client's own entry.
+	If a_IsSnapshot is true, the entries are the full roster, replacing whatever the client knew before.
+	Returns the number of entries sent. */
+	size_t SendPresence(const cPresenceEntries & a_Entries, bool a_IsSnapshot);
 	//ת
-	void ForwardMedia(UInt32 from_id, UInt32 type);
-	void ForwardMediaMsg(UInt32 from_id, AString msg);
+	void ForwardMedia(UInt32 from_id, UInt32 type, std::chrono::steady_clock::time_point a_ReceivedTime);
+	void ForwardMediaMsg(UInt32 from_id, const AString & msg, std::chrono::steady_clock::time_point a_ReceivedTime);
+
+	/** Sends the UDP relay port allocated for relaying to / from the peer; zero if the relay is not available. */
+	void SendRelayAllocated(UInt32 a_PeerID, UInt16 a_Port);
+
+	/** Returns the time when the data currently being parsed by the protocol was received from the network.
+	Only valid while called from within the protocol's DataReceived(). */
+	std::chrono::steady_clock::time_point GetProcessingDataTime(void) const { return m_ProcessingDataTime; }
 
 	
 	inline bool IsLoggedIn(void) const { return (m_State >= csAuthenticating); }
 
 
-	/** Called while the client is being ticked from the cServer object */
-	void ServerTick(float a_Dt);
+	/** Called from the server tick thread when the client has been marked ready.
+	Processes the received data (unless dispatched immediately) and sends the queued outgoing data. */
+	void ServerTick(void);
+
+	/** Called from the server tick thread when the client's timer expires.
+	Sends the keepalive ping and kicks the client on timeout, if due. Returns the time of the next check. */
+	std::chrono::steady_clock::time_point CheckTimers(std::chrono::steady_clock::time_point a_Now);
 
 	void Destroy(void);
 	
@@ -107,7 +125,7 @@ public:  // tolua_export
 	
 private:
 
-	friend class cServer;  // Needs access to SetSelf()
+	friend class cServer;  // Needs access to SetSelf(), m_IsQueuedForTick and m_TickTimer
 
 
 	/** The type used for storing the names of registered plugin channels. */
@@ -127,17 +145,43 @@ private:
 	Protected by m_CSIncomingData. */
 	AString m_IncomingData;
 
+	/** Time when the oldest data in m_IncomingData was received.
+	Protected by m_CSIncomingData. */
+	std::chrono::steady_clock::time_point m_IncomingDataTime;
+
+	/** Time when the data currently being parsed was received.
+	Only accessed by the thread parsing the data (the tick thread, or the network thread in immediate dispatch mode). */
+	std::chrono::steady_clock::time_point m_ProcessingDataTime;
+
 	/** Protects m_OutgoingData against multithreaded access. */
 	cCriticalSection m_CSOutgoingData;
 
-	/** Buffer for storing outgoing data from any thread; will get sent in Tick() (to prevent deadlocks).
+	/** Chain of segments storing outgoing data from any thread; will get sent in Tick() (to prevent deadlocks).
+	Each segment holds whole packets, up to OUTGOING_SEGMENT_SIZE bytes (unless a single packet is larger);
+	the chain is handed over to the link as a whole, without concatenating the segments.
+	Protected by m_CSOutgoingData. */
+	cSendSegments m_OutgoingData;
+
+	/** Receive times of the relayed packets waiting in m_OutgoingData, for the relay latency statistics.
 	Protected by m_CSOutgoingData. */
-	AString m_OutgoingData;
+	std::vector<std::chrono::steady_clock::time_point> m_OutgoingRelayTimes;
+
+	/** If true, the incoming data is parsed in the network thread and the outgoing data is sent right away.
+	If false, both are postponed until ServerTick(). */
+	const bool m_ShouldDispatchImmediately;
 
 	bool m_HasSentDC;  ///< True if a Disconnect packet has been sent in either direction
 
-	/** Number of ticks since the last network packet was received (increased in Tick(), reset in OnReceivedData()) */
-	int m_TicksSinceLastPacket;
+	/** Time when the last network data was received, as steady_clock ticks since its epoch (set in OnReceivedData()).
+	Atomic, because it's set by the network thread and checked by the tick thread. */
+	std::atomic<std::chrono::steady_clock::rep> m_LastReceivedTime;
+
+	/** Set while the client is in the server's list of ready clients, so that it's added only once. */
+	std::atomic<bool> m_IsQueuedForTick;
+
+	/** The client's keepalive / timeout timer in the server's tick scheduler.
+	Only accessed from the tick thread, except for setting the callback before the client is added to the server. */
+	cTimerWheel::cTimer m_TickTimer;
 	
 	/** Duration of the last completed client ping. */
 	std::chrono::steady_clock::duration m_Ping;
@@ -166,7 +210,7 @@ private:
 	cCriticalSection m_CSDestroyingState;
 
 
-	static int s_ClientCount;
+	static std::atomic<int> s_ClientCount;
 	
 	/** ID used for identification during authenticating. Assigned sequentially for each new instance. */
 	int m_UniqueID;
@@ -179,9 +223,21 @@ private:
 	/** Called when the network socket has been closed. */
 	void SocketClosed(void);
 
+	/** Records the current time as the time of the last received data, postponing the timeout. */
+	void ResetTimeout(void);
+
+	/** Appends the data to the last segment of m_OutgoingData, starting a new segment if the last one is full.
+	The caller must hold m_CSOutgoingData. */
+	void AppendOutgoingData(const char * a_Data, size_t a_Size);
+
+	/** Called after a relayed packet has been queued through SendData().
+	Records the packet's relay latency, either right away if it has already been sent, or when it is sent in ServerTick(). */
+	void RelayQueued(std::chrono::steady_clock::time_point a_ReceivedTime);
+
 	// cTCPLink::cCallbacks overrides:
 	virtual void OnLinkCreated(cTCPLinkPtr a_Link) override;
 	virtual void OnReceivedData(const char * a_Data, size_t a_Length) override;
+	virtual void OnReceivedDataChunks(const cTCPLink::cReceivedChunk * a_Chunks, size_t a_NumChunks) override;
 	virtual void OnRemoteClosed(void) override;
 	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override;
 };  // tolua_export
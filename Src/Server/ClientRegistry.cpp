@@ -0,0 +1,155 @@
+
+// ClientRegistry.cpp
+
+// Implements the cClientRegistry class representing the set of clients connected to the server, sharded by their unique ID
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "ClientRegistry.h"
+#include "ClientHandle.h"
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cClientRegistry::cShardLock:
+
+cClientRegistry::cShardLock::cShardLock(cShard & a_Shard):
+	m_Shard(a_Shard)
+{
+	if (!m_Shard.m_CS.TryLock())
+	{
+		m_Shard.m_NumContended.fetch_add(1, std::memory_order_relaxed);
+		m_Shard.m_CS.Lock();
+	}
+	m_Shard.m_NumLocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+
+
+
+cClientRegistry::cShardLock::~cShardLock()
+{
+	m_Shard.m_CS.Unlock();
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cClientRegistry:
+
+void cClientRegistry::Add(const cClientHandlePtr & a_Client)
+{
+	auto & Shard = GetShard(a_Client->GetUniqueID());
+	cShardLock Lock(Shard);
+	Shard.m_Clients[a_Client->GetUniqueID()] = a_Client;
+}
+
+
+
+
+
+cClientHandlePtr cClientRegistry::Remove(int a_ClientID)
+{
+	auto & Shard = GetShard(a_ClientID);
+	cShardLock Lock(Shard);
+	auto itr = Shard.m_Clients.find(a_ClientID);
+	if (itr == Shard.m_Clients.end())
+	{
+		return nullptr;
+	}
+	auto Client = std::move(itr->second);
+	Shard.m_Clients.erase(itr);
+	return Client;
+}
+
+
+
+
+
+cClientHandlePtr cClientRegistry::Find(int a_ClientID)
+{
+	auto & Shard = GetShard(a_ClientID);
+	cShardLock Lock(Shard);
+	auto itr = Shard.m_Clients.find(a_ClientID);
+	if (itr == Shard.m_Clients.end())
+	{
+		return nullptr;
+	}
+	return itr->second;
+}
+
+
+
+
+
+void cClientRegistry::GetShardSnapshot(size_t a_ShardIdx, cClientHandlePtrs & a_Clients)
+{
+	ASSERT(a_ShardIdx < NUM_SHARDS);
+	auto & Shard = m_Shards[a_ShardIdx];
+	a_Clients.clear();
+	cShardLock Lock(Shard);
+	a_Clients.reserve(Shard.m_Clients.size());
+	for (const auto & Client : Shard.m_Clients)
+	{
+		a_Clients.push_back(Client.second);
+	}
+}
+
+
+
+
+
+void cClientRegistry::RemoveAll(cClientHandlePtrs & a_Removed)
+{
+	for (auto & Shard : m_Shards)
+	{
+		cShardLock Lock(Shard);
+		for (auto & Client : Shard.m_Clients)
+		{
+			a_Removed.push_back(std::move(Client.second));
+		}
+		Shard.m_Clients.clear();
+	}
+}
+
+
+
+
+
+size_t cClientRegistry::GetNumClients(void)
+{
+	size_t res = 0;
+	for (auto & Shard : m_Shards)
+	{
+		cShardLock Lock(Shard);
+		res += Shard.m_Clients.size();
+	}
+	return res;
+}
+
+
+
+
+
+cClientRegistry::cShardStats cClientRegistry::GetShardStats(size_t a_ShardIdx)
+{
+	ASSERT(a_ShardIdx < NUM_SHARDS);
+	auto & Shard = m_Shards[a_ShardIdx];
+	cShardStats res;
+	{
+		cShardLock Lock(Shard);
+		res.m_NumClients = Shard.m_Clients.size();
+	}
+	res.m_NumLocks = Shard.m_NumLocks.load(std::memory_order_relaxed);
+	res.m_NumContended = Shard.m_NumContended.load(std::memory_order_relaxed);
+	return res;
+}
+
+
+
+
@@ -0,0 +1,150 @@
+
+// ClientRegistry.h
+
+// Interfaces to the cClientRegistry class representing the set of clients connected to the server, sharded by their unique ID
+
+
+
+
+
+#pragma once
+
+#include <unordered_map>
+#include <atomic>
+
+
+
+
+
+// fwd:
+class cClientHandle;
+typedef std::shared_ptr<cClientHandle> cClientHandlePtr;
+typedef std::vector<cClientHandlePtr> cClientHandlePtrs;
+
+
+
+
+
+/** Container for all the clients connected to the server.
+The clients are distributed into NUM_SHARDS shards by their unique ID, each shard has its own lock, so that
+relaying between two clients never waits for an unrelated shard being ticked or broadcast to.
+No lock is ever held while calling into a client: the accessors copy the client pointers out of the shard
+(a read snapshot) and release the lock before the caller gets to use them. This also means that the
+callers may freely call back into the registry (eg. a client forwarding data to another client). */
+class cClientRegistry
+{
+public:
+	/** Number of shards the clients are distributed into. */
+	static const size_t NUM_SHARDS = 16;
+
+	/** Lock statistics for a single shard, as reported by GetShardStats(). */
+	struct cShardStats
+	{
+		/** Number of clients currently in the shard. */
+		size_t m_NumClients;
+
+		/** Number of times the shard lock has been acquired. */
+		UInt64 m_NumLocks;
+
+		/** Number of times the shard lock was held by another thread and the caller had to wait for it. */
+		UInt64 m_NumContended;
+	};
+
+
+	/** Adds the client to its shard. */
+	void Add(const cClientHandlePtr & a_Client);
+
+	/** Removes the specified client from its shard.
+	Returns the removed client (so that the caller may release it outside of any lock), or nullptr if not present. */
+	cClientHandlePtr Remove(int a_ClientID);
+
+	/** Returns the client with the specified unique ID, or nullptr if not present. */
+	cClientHandlePtr Find(int a_ClientID);
+
+	/** Replaces the contents of a_Clients with a snapshot of all the clients in the specified shard. */
+	void GetShardSnapshot(size_t a_ShardIdx, cClientHandlePtrs & a_Clients);
+
+	/** Calls a_Callback(const cClientHandlePtr &) for each client in the registry.
+	The shards are snapshotted one at a time, no lock is held while calling the callback.
+	Returns false if the callback aborted the enumeration by returning true, true otherwise. */
+	template <typename Callback>
+	bool ForEachClient(Callback a_Callback)
+	{
+		cClientHandlePtrs Snapshot;
+		for (size_t i = 0; i < NUM_SHARDS; i++)
+		{
+			GetShardSnapshot(i, Snapshot);
+			for (const auto & Client : Snapshot)
+			{
+				if (a_Callback(Client))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	/** Removes all clients from the registry, moving them into a_Removed. */
+	void RemoveAll(cClientHandlePtrs & a_Removed);
+
+	/** Returns the total number of clients in the registry. */
+	size_t GetNumClients(void);
+
+	/** Returns the lock statistics for the specified shard. */
+	cShardStats GetShardStats(size_t a_ShardIdx);
+
+protected:
+
+	typedef std::unordered_map<int, cClientHandlePtr> cClientHandleMap;
+
+	/** A single shard of the registry. */
+	struct cShard
+	{
+		/** Protects m_Clients against multithreaded access. */
+		cCriticalSection m_CS;
+
+		/** The clients in this shard, indexed by their unique ID. */
+		cClientHandleMap m_Clients;
+
+		/** Number of times m_CS has been acquired. */
+		std::atomic<UInt64> m_NumLocks;
+
+		/** Number of times m_CS was acquired only after waiting for another thread. */
+		std::atomic<UInt64> m_NumContended;
+
+		cShard(void):
+			m_NumLocks(0),
+			m_NumContended(0)
+		{
+		}
+	};
+
+
+	/** RAII lock for a single shard, counts the lock acquisitions and contention. */
+	class cShardLock
+	{
+	public:
+		cShardLock(cShard & a_Shard);
+		~cShardLock();
+
+	private:
+		cShard & m_Shard;
+
+		DISALLOW_COPY_AND_ASSIGN(cShardLock);
+	};
+
+
+	std::array<cShard, NUM_SHARDS> m_Shards;
+
+
+	/** Returns the shard into which the specified client ID belongs. */
+	cShard & GetShard(int a_ClientID)
+	{
+		return m_Shards[static_cast<unsigned>(a_ClientID) % NUM_SHARDS];
+	}
+};
+
+
+
+
@@ -9,6 +9,8 @@
 
 #pragma once
 
+#include "OSSupport/TimerWheel.h"
+
 
 
 
@@ -21,6 +23,9 @@ class cServerHandle;
 typedef std::shared_ptr<cServerHandle> cServerHandlePtr;
 typedef std::vector<cServerHandlePtr> cServerHandlePtrs;
 
+/** A chain of data blocks to be sent over a cTCPLink in a single call, see cTCPLink::Send(cSendSegments &&). */
+typedef std::vector<AString> cSendSegments;
+
 
 
 
@@ -31,6 +36,13 @@ class cTCPLink
 	friend class cNetwork;
 
 public:
+	/** A contiguous piece of the data received from the remote peer, as passed to cCallbacks::OnReceivedDataChunks(). */
+	struct cReceivedChunk
+	{
+		const char * m_Data;
+		size_t m_Length;
+	};
+
 	class cCallbacks
 	{
 	public:
@@ -44,6 +56,18 @@ public:
 		/** Called when there's data incoming from the remote peer. */
 		virtual void OnReceivedData(const char * a_Data, size_t a_Length) = 0;
 
+		/** Called when there's data incoming from the remote peer, with all the data currently received, as a_NumChunks
+		contiguous chunks pointing directly into the link's buffers. The chunks are only valid for the duration of the call.
+		The default implementation calls OnReceivedData() for each chunk; descendants may override it to process the
+		whole batch at once (take a lock only once etc.). */
+		virtual void OnReceivedDataChunks(const cReceivedChunk * a_Chunks, size_t a_NumChunks)
+		{
+			for (size_t i = 0; i < a_NumChunks; i++)
+			{
+				OnReceivedData(a_Chunks[i].m_Data, a_Chunks[i].m_Length);
+			}
+		}
+
 		/** Called when the remote end closes the connection.
 		The link is still available for connection information query (IP / port).
 		Sending data on the link is not an error, but the data won't be delivered. */
@@ -69,6 +93,22 @@ public:
 		return Send(a_Data.data(), a_Data.size());
 	}
 
+	/** Queues the specified chain of data blocks for sending to the remote peer, in order.
+	The link takes ownership of the blocks, so that it may pass them on to the OS without copying them.
+	Returns true on success, false on failure. Note that this success or failure only reports the queue status, not the actual data delivery.
+	The default implementation sends the blocks one by one through Send(). */
+	virtual bool Send(cSendSegments && a_Segments)
+	{
+		for (const auto & Segment : a_Segments)
+		{
+			if (!Send(Segment.data(), Segment.size()))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
 	/** Returns the IP address of the local endpoint of the connection. */
 	virtual AString GetLocalIP(void) const = 0;
 
@@ -134,6 +174,40 @@ public:
 class cUDPEndpoint
 {
 public:
+	/** A single datagram received by the endpoint, as passed to cCallbacks::OnReceivedBatch().
+	All the pointers are valid only for the duration of the callback. */
+	struct cDatagram
+	{
+		const char * m_Data;
+		size_t m_Size;
+
+		/** The remote host's IP address, as text. */
+		const char * m_RemoteHost;
+		UInt16 m_RemotePort;
+
+		/** The remote host's address, as received from the OS. */
+		const sockaddr * m_RemoteAddr;
+		socklen_t m_RemoteAddrLen;
+	};
+
+
+	/** A single datagram to be sent by SendBatch(). */
+	struct cOutgoingDatagram
+	{
+		AString m_Payload;
+		AString m_Host;
+		UInt16 m_Port;
+
+		cOutgoingDatagram(const AString & a_Payload, const AString & a_Host, UInt16 a_Port):
+			m_Payload(a_Payload),
+			m_Host(a_Host),
+			m_Port(a_Port)
+		{
+		}
+	};
+	typedef std::vector<cOutgoingDatagram> cOutgoingDatagrams;
+
+
 	/** Interface for the callbacks for events that can happen on the endpoint. */
 	class cCallbacks
 	{
@@ -146,6 +220,18 @@ public:
 
 		/** Called when there is an incoming datagram from a remote host. */
 		virtual void OnReceivedData(const char * a_Data, size_t a_Size, const AString & a_RemoteHost, UInt16 a_RemotePort) = 0;
+
+		/** Called with all the datagrams received in a single read event (at least one).
+		The default implementation calls OnReceivedData() for each datagram; descendants may override it to process
+		the whole batch at once, and to use the remote addresses without parsing them from the text. */
+		virtual void OnReceivedBatch(const cDatagram * a_Datagrams, size_t a_NumDatagrams)
+		{
+			for (size_t i = 0; i < a_NumDatagrams; i++)
+			{
+				const auto & Datagram = a_Datagrams[i];
+				OnReceivedData(Datagram.m_Data, Datagram.m_Size, Datagram.m_RemoteHost, Datagram.m_RemotePort);
+			}
+		}
 	};
 
 
@@ -166,6 +252,40 @@ public:
 	Note that in order to send to a broadcast address, you need to call EnableBroadcasts() first. */
 	virtual bool Send(const AString & a_Payload, const AString & a_Host, UInt16 a_Port) = 0;
 
+	/** Sends the specified data in a single UDP datagram to the specified address, such as cDatagram::m_RemoteAddr.
+	Unlike Send(), doesn't need to parse or resolve the address and doesn't allocate any memory. */
+	virtual bool SendTo(const char * a_Data, size_t a_Size, const sockaddr * a_Addr, socklen_t a_AddrLen) = 0;
+
+	/** Sends the data of each of the datagrams to the same address a_Addr, with as few OS calls as possible.
+	Used for relaying the received datagrams without copying them. Returns the number of datagrams sent. */
+	virtual size_t SendToBatch(const cDatagram * a_Datagrams, size_t a_NumDatagrams, const sockaddr * a_Addr, socklen_t a_AddrLen)
+	{
+		size_t res = 0;
+		for (size_t i = 0; i < a_NumDatagrams; i++)
+		{
+			if (SendTo(a_Datagrams[i].m_Data, a_Datagrams[i].m_Size, a_Addr, a_AddrLen))
+			{
+				res++;
+			}
+		}
+		return res;
+	}
+
+	/** Sends each of the datagrams, like Send(), but with as few OS calls as possible.
+	Returns the number of datagrams sent (or queued for sending after a hostname lookup). */
+	virtual size_t SendBatch(const cOutgoingDatagrams & a_Datagrams)
+	{
+		size_t res = 0;
+		for (const auto & Datagram : a_Datagrams)
+		{
+			if (Send(Datagram.m_Payload, Datagram.m_Host, Datagram.m_Port))
+			{
+				res++;
+			}
+		}
+		return res;
+	}
+
 	/** Marks the socket as capable of sending broadcast, using whatever OS API is needed.
 	Without this call, sending to a broadcast address using Send() may fail. */
 	virtual void EnableBroadcasts(void) = 0;
@@ -285,11 +405,15 @@ public:
 	/** Opens up the specified port for incoming connections.
 	Calls an OnAccepted callback for each incoming connection.
 	A cTCPLink with the specified link callbacks is created for each connection.
+	If a_NumSockets is more than 1, that many sockets listen on the port (using SO_REUSEPORT), each driven by
+	a different network thread (see SetNumThreads()), and the OS spreads the incoming connections among them;
+	the callbacks may then be called from several threads at once. Falls back to a single socket where unsupported.
 	Returns a cServerHandle that can be used to query the operation status and close the server.
 	Implemented in ServerHandleImpl.cpp. */
 	static cServerHandlePtr Listen(
 		UInt16 a_Port,
-		cListenCallbacksPtr a_ListenCallbacks
+		cListenCallbacksPtr a_ListenCallbacks,
+		unsigned a_NumSockets = 1
 	);
 
 
@@ -321,6 +445,29 @@ public:
 
 	/** Returns all local IP addresses for network interfaces currently available. */
 	static AStringVector EnumLocalIPAddresses(void);
+
+	/** Sets the number of threads (LibEvent loops) that drive the network I/O; at least one is always used.
+	The main thread handles the listening sockets, UDP endpoints, DNS and outgoing links; the accepted links are
+	spread over all the threads, each link staying on the thread it was assigned to for its whole lifetime.
+	Should be called before Listen(), the links accepted earlier are not moved. The number can only be increased while running.
+	Implemented in NetworkSingleton.cpp. */
+	static void SetNumThreads(unsigned a_NumThreads);
+
+	/** Sets whether the links accepted from now on are single-owner. A single-owner link's LibEvent handle has no locking;
+	sending, shutting down and closing from any other thread than the link's own network thread is queued to that thread
+	through a lock-free queue. This saves the locking on every LibEvent operation for the links that see most of their
+	traffic in their own thread, at the cost of a wake-up for the operations from other threads.
+	Outgoing links (Connect()) are always thread-safe. Implemented in NetworkSingleton.cpp. */
+	static void SetSingleOwnerLinks(bool a_ShouldUseSingleOwnerLinks);
+
+	/** Arms the timer in the main network thread's timer wheel; the timer's callback is then called from that thread.
+	Must be called from the main network thread (such as from the UDP endpoints' callbacks), and the timer must only be
+	cancelled or destroyed in that thread, too. Implemented in NetworkSingleton.cpp. */
+	static void ArmTimer(cTimerWheel::cTimer & a_Timer, std::chrono::steady_clock::time_point a_Deadline);
+
+	/** Queues the function to be called from the main network thread. Can be called from any thread.
+	Implemented in NetworkSingleton.cpp. */
+	static void RunInNetworkThread(std::function<void()> a_Function);
 };
 
 
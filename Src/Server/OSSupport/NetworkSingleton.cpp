@@ -18,8 +18,48 @@
 
 
 
+/** The granularity of the event loops' timer wheels. */
+static const std::chrono::milliseconds TIMER_GRANULARITY(10);
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cNetworkSingleton::cEventLoop:
+
+cNetworkSingleton::cEventLoop::cEventLoop(event_base * a_EventBase):
+	m_EventBase(a_EventBase),
+	m_NumLinks(0),
+	m_Timers(TIMER_GRANULARITY),
+	m_TimerEvent(event_new(a_EventBase, -1, 0, TimerCallback, this)),
+	m_IsTimerEventPending(false)
+{
+}
+
+
+
+
+
+cNetworkSingleton::cEventLoop::~cEventLoop()
+{
+	if (m_TimerEvent != nullptr)
+	{
+		event_free(m_TimerEvent);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cNetworkSingleton:
+
 cNetworkSingleton::cNetworkSingleton(void):
-	m_HasTerminated(false)
+	m_ShouldUseSingleOwnerLinks(false),
+	m_HasTerminated(false),
+	m_HaveLoopsStopped(false)
 {
 	// Windows: initialize networking:
 	#ifdef _WIN32
@@ -63,7 +103,8 @@ cNetworkSingleton::cNetworkSingleton(void):
 	}
 
 	// Create the event loop thread:
-	m_EventLoopThread = std::thread(RunEventLoop, this);
+	m_EventLoops.emplace_back(new cEventLoop(m_EventBase));
+	m_EventLoops.back()->m_Thread = std::thread(RunEventLoop, m_EventBase);
 }
 
 
@@ -94,9 +135,16 @@ void cNetworkSingleton::Terminate(void)
 {
 	ASSERT(!m_HasTerminated);
 
-	// Wait for the LibEvent event loop to terminate:
-	event_base_loopbreak(m_EventBase);
-	m_EventLoopThread.join();
+	// Wait for the LibEvent event loops to terminate:
+	for (auto & Loop : m_EventLoops)
+	{
+		event_base_loopbreak(Loop->m_EventBase);
+	}
+	for (auto & Loop : m_EventLoops)
+	{
+		Loop->m_Thread.join();
+	}
+	m_HaveLoopsStopped = true;
 
 	// Remove all objects:
 	{
@@ -107,9 +155,16 @@ void cNetworkSingleton::Terminate(void)
 		m_IPLookups.clear();
 	}
 
-	// Free the underlying LibEvent objects:
+	// Free the underlying LibEvent objects; the loops' timer events need to go before their event bases:
 	evdns_base_free(m_DNSBase, true);
-	event_base_free(m_EventBase);
+	for (auto & Loop : m_EventLoops)
+	{
+		auto EventBase = Loop->m_EventBase;
+		Loop.reset();
+		event_base_free(EventBase);
+	}
+	m_EventLoops.clear();
+	m_EventBase = nullptr;
 
 	libevent_global_shutdown();
 
@@ -142,9 +197,223 @@ void cNetworkSingleton::LogCallback(int a_Severity, const char * a_Msg)
 
 
 
-void cNetworkSingleton::RunEventLoop(cNetworkSingleton * a_Self)
+void cNetworkSingleton::RunEventLoop(event_base * a_EventBase)
+{
+	event_base_loop(a_EventBase, EVLOOP_NO_EXIT_ON_EMPTY);
+}
+
+
+
+
+
+cNetworkSingleton::cEventLoop & cNetworkSingleton::GetEventLoop(size_t a_LoopIdx)
+{
+	cCSLock Lock(m_CS);
+	ASSERT(a_LoopIdx < m_EventLoops.size());
+	return *m_EventLoops[a_LoopIdx];
+}
+
+
+
+
+
+void cNetworkSingleton::ScheduleTimerEvent(cEventLoop & a_Loop)
+{
+	cTimerWheel::cTimePoint NextExpiry;
+	if (!a_Loop.m_Timers.GetNextExpiry(NextExpiry))
+	{
+		// Nothing to expire; if the event is still pending, it just finds nothing to do
+		return;
+	}
+	if (a_Loop.m_IsTimerEventPending && (a_Loop.m_TimerEventTime <= NextExpiry))
+	{
+		return;
+	}
+
+	auto Delay = std::chrono::duration_cast<std::chrono::microseconds>(NextExpiry - std::chrono::steady_clock::now()).count();
+	timeval tv;
+	tv.tv_sec  = static_cast<long>(std::max<Int64>(Delay, 0) / 1000000);
+	tv.tv_usec = static_cast<long>(std::max<Int64>(Delay, 0) % 1000000);
+	if (event_add(a_Loop.m_TimerEvent, &tv) != 0)
+	{
+		LOGWARNING("Failed to schedule the network timers, they will only expire after another timer is armed.");
+		return;
+	}
+	a_Loop.m_IsTimerEventPending = true;
+	a_Loop.m_TimerEventTime = NextExpiry;
+}
+
+
+
+
+
+void cNetworkSingleton::TimerCallback(evutil_socket_t a_Socket, short a_What, void * a_Self)
+{
+	UNUSED(a_Socket);
+	UNUSED(a_What);
+	auto & Loop = *static_cast<cEventLoop *>(a_Self);
+	Loop.m_IsTimerEventPending = false;
+
+	// The callbacks may arm more timers; those schedule the event again, ScheduleTimerEvent() below takes care of the rest:
+	Loop.m_Timers.Advance(std::chrono::steady_clock::now());
+	ScheduleTimerEvent(Loop);
+}
+
+
+
+
+
+void cNetworkSingleton::RunInLoopCallback(evutil_socket_t a_Socket, short a_What, void * a_Function)
+{
+	UNUSED(a_Socket);
+	UNUSED(a_What);
+	std::unique_ptr<std::function<void()>> Function(static_cast<std::function<void()> *>(a_Function));
+	(*Function)();
+}
+
+
+
+
+
+event_base * cNetworkSingleton::GetEventBase(size_t a_LoopIdx)
+{
+	cCSLock Lock(m_CS);
+	ASSERT(a_LoopIdx < m_EventLoops.size());
+	return m_EventLoops[a_LoopIdx]->m_EventBase;
+}
+
+
+
+
+
+void cNetworkSingleton::SetNumEventLoops(size_t a_NumLoops)
+{
+	ASSERT(!m_HasTerminated);
+	cCSLock Lock(m_CS);
+	if (a_NumLoops < m_EventLoops.size())
+	{
+		LOGWARNING("Cannot reduce the number of network threads from %u to %u while running, the change will take effect after restart.",
+			static_cast<unsigned>(m_EventLoops.size()), static_cast<unsigned>(a_NumLoops)
+		);
+		return;
+	}
+	while (m_EventLoops.size() < a_NumLoops)
+	{
+		event_base * EventBase = event_base_new();
+		if (EventBase == nullptr)
+		{
+			LOGWARNING("Failed to create an additional LibEvent loop, continuing with %u network threads.", static_cast<unsigned>(m_EventLoops.size()));
+			return;
+		}
+		m_EventLoops.emplace_back(new cEventLoop(EventBase));
+		m_EventLoops.back()->m_Thread = std::thread(RunEventLoop, EventBase);
+	}
+}
+
+
+
+
+
+size_t cNetworkSingleton::GetNumEventLoops(void)
+{
+	cCSLock Lock(m_CS);
+	return m_EventLoops.size();
+}
+
+
+
+
+
+bool cNetworkSingleton::IsInLoopThread(size_t a_LoopIdx)
+{
+	if (m_HaveLoopsStopped)
+	{
+		return true;
+	}
+	cCSLock Lock(m_CS);
+	ASSERT(a_LoopIdx < m_EventLoops.size());
+	return (m_EventLoops[a_LoopIdx]->m_Thread.get_id() == std::this_thread::get_id());
+}
+
+
+
+
+
+std::thread::id cNetworkSingleton::GetLoopThreadID(size_t a_LoopIdx)
+{
+	cCSLock Lock(m_CS);
+	ASSERT(a_LoopIdx < m_EventLoops.size());
+	return m_EventLoops[a_LoopIdx]->m_Thread.get_id();
+}
+
+
+
+
+
+size_t cNetworkSingleton::AcquireEventLoop(size_t a_LoopIdx)
+{
+	ASSERT(!m_HasTerminated);
+	cCSLock Lock(m_CS);
+	if (a_LoopIdx != ANY_EVENT_LOOP)
+	{
+		ASSERT(a_LoopIdx < m_EventLoops.size());
+		m_EventLoops[a_LoopIdx]->m_NumLinks.fetch_add(1, std::memory_order_relaxed);
+		return a_LoopIdx;
+	}
+	size_t res = 0;
+	size_t MinLinks = m_EventLoops[0]->m_NumLinks.load(std::memory_order_relaxed);
+	for (size_t i = 1; i < m_EventLoops.size(); i++)
+	{
+		size_t NumLinks = m_EventLoops[i]->m_NumLinks.load(std::memory_order_relaxed);
+		if (NumLinks < MinLinks)
+		{
+			res = i;
+			MinLinks = NumLinks;
+		}
+	}
+	m_EventLoops[res]->m_NumLinks.fetch_add(1, std::memory_order_relaxed);
+	return res;
+}
+
+
+
+
+
+void cNetworkSingleton::ReleaseEventLoop(size_t a_LoopIdx)
+{
+	cCSLock Lock(m_CS);
+	if (a_LoopIdx < m_EventLoops.size())
+	{
+		m_EventLoops[a_LoopIdx]->m_NumLinks.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+
+
+
+
+void cNetworkSingleton::ArmTimer(size_t a_LoopIdx, cTimerWheel::cTimer & a_Timer, cTimerWheel::cTimePoint a_Deadline)
+{
+	ASSERT(!m_HasTerminated);
+	auto & Loop = GetEventLoop(a_LoopIdx);
+	Loop.m_Timers.Arm(a_Timer, a_Deadline);
+	ScheduleTimerEvent(Loop);
+}
+
+
+
+
+
+void cNetworkSingleton::RunInLoop(size_t a_LoopIdx, std::function<void()> a_Function)
 {
-	event_base_loop(a_Self->m_EventBase, EVLOOP_NO_EXIT_ON_EMPTY);
+	ASSERT(!m_HasTerminated);
+	auto Function = new std::function<void()>(std::move(a_Function));
+	timeval tv = {0, 0};
+	if (event_base_once(GetEventBase(a_LoopIdx), -1, EV_TIMEOUT, RunInLoopCallback, Function, &tv) != 0)
+	{
+		LOGWARNING("Failed to queue a function to the network thread.");
+		delete Function;
+	}
 }
 
 
@@ -266,3 +535,43 @@ void cNetworkSingleton::RemoveServer(const cServerHandleImpl * a_Server)
 
 
 
+
+////////////////////////////////////////////////////////////////////////////////
+// cNetwork API:
+
+void cNetwork::SetNumThreads(unsigned a_NumThreads)
+{
+	cNetworkSingleton::Get().SetNumEventLoops(std::max(a_NumThreads, 1u));
+}
+
+
+
+
+
+void cNetwork::SetSingleOwnerLinks(bool a_ShouldUseSingleOwnerLinks)
+{
+	cNetworkSingleton::Get().SetSingleOwnerLinks(a_ShouldUseSingleOwnerLinks);
+}
+
+
+
+
+
+void cNetwork::ArmTimer(cTimerWheel::cTimer & a_Timer, std::chrono::steady_clock::time_point a_Deadline)
+{
+	cNetworkSingleton::Get().ArmTimer(0, a_Timer, a_Deadline);
+}
+
+
+
+
+
+void cNetwork::RunInNetworkThread(std::function<void()> a_Function)
+{
+	cNetworkSingleton::Get().RunInLoop(0, std::move(a_Function));
+}
+
+
+
+
+
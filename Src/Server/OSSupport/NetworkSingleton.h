@@ -14,8 +14,10 @@
 #pragma once
 
 #include "Network.h"
+#include <event2/event.h>
 #include "CriticalSection.h"
 #include "Event.h"
+#include <atomic>
 
 
 
@@ -54,9 +56,50 @@ public:
 	MSVC runtime requires that the LibEvent networking be shut down before the main() function is exitted; this is the way to do it. */
 	void Terminate(void);
 
-	/** Returns the main LibEvent handle for event registering. */
+	/** Returns the main LibEvent handle for event registering.
+	The main loop drives the listening sockets, UDP endpoints, DNS lookups and outgoing links. */
 	event_base * GetEventBase(void) { return m_EventBase; }
 
+	/** Returns the LibEvent handle of the specified event loop. Loop 0 is the main loop. */
+	event_base * GetEventBase(size_t a_LoopIdx);
+
+	/** Starts additional event loops, so that there are (at least) a_NumLoops loops running in total.
+	The loops are only ever added, never removed before Terminate(). */
+	void SetNumEventLoops(size_t a_NumLoops);
+
+	/** Returns the number of event loops currently running, including the main one. */
+	size_t GetNumEventLoops(void);
+
+	/** Returns true if the caller may touch the specified loop's unlocked LibEvent objects directly:
+	it is running in the loop's own thread, or Terminate() has already stopped all the loops. */
+	bool IsInLoopThread(size_t a_LoopIdx);
+
+	/** Returns the ID of the thread running the specified event loop. */
+	std::thread::id GetLoopThreadID(size_t a_LoopIdx);
+
+	/** Value for AcquireEventLoop() to pick the least loaded loop. */
+	static const size_t ANY_EVENT_LOOP = static_cast<size_t>(-1);
+
+	/** Accounts a new incoming link to the specified event loop; if ANY_EVENT_LOOP, picks the loop with the fewest links.
+	Returns the index of the loop; the link must call ReleaseEventLoop() with it once it is destroyed. */
+	size_t AcquireEventLoop(size_t a_LoopIdx = ANY_EVENT_LOOP);
+
+	/** Removes a link from the specified event loop's accounting. */
+	void ReleaseEventLoop(size_t a_LoopIdx);
+
+	/** Arms the timer in the specified event loop's timer wheel; the timer's callback is then called from the loop's thread.
+	Must be called from the loop's own thread; the timer must only be cancelled or destroyed in that thread, too. */
+	void ArmTimer(size_t a_LoopIdx, cTimerWheel::cTimer & a_Timer, cTimerWheel::cTimePoint a_Deadline);
+
+	/** Queues the function to be called from the specified event loop's thread. Can be called from any thread. */
+	void RunInLoop(size_t a_LoopIdx, std::function<void()> a_Function);
+
+	/** Sets whether the newly accepted links should be single-owner (see cNetwork::SetSingleOwnerLinks()). */
+	void SetSingleOwnerLinks(bool a_ShouldUseSingleOwnerLinks) { m_ShouldUseSingleOwnerLinks = a_ShouldUseSingleOwnerLinks; }
+
+	/** Returns true if the newly accepted links should be single-owner. */
+	bool ShouldUseSingleOwnerLinks(void) const { return m_ShouldUseSingleOwnerLinks; }
+
 	/** Returns the LibEvent handle for DNS lookups. */
 	evdns_base * GetDNSBase(void) { return m_DNSBase; }
 
@@ -95,9 +138,41 @@ public:
 
 protected:
 
-	/** The main LibEvent container for driving the event loop. */
+	/** A single LibEvent loop with the thread that runs it. */
+	struct cEventLoop
+	{
+		/** The LibEvent container for driving the loop. */
+		event_base * m_EventBase;
+
+		/** The thread in which the loop runs. */
+		std::thread m_Thread;
+
+		/** Number of links currently assigned to this loop, used for picking the least loaded loop. */
+		std::atomic<size_t> m_NumLinks;
+
+		/** The timers driven by this loop. Only accessed from the loop's thread. */
+		cTimerWheel m_Timers;
+
+		/** The LibEvent timeout event that advances m_Timers. */
+		event * m_TimerEvent;
+
+		/** True if m_TimerEvent is pending, m_TimerEventTime is then the time it fires. Only accessed from the loop's thread. */
+		bool m_IsTimerEventPending;
+		cTimerWheel::cTimePoint m_TimerEventTime;
+
+		cEventLoop(event_base * a_EventBase);
+		~cEventLoop();
+	};
+	typedef std::unique_ptr<cEventLoop> cEventLoopPtr;
+
+
+	/** The main LibEvent container for driving the event loop; the same as m_EventLoops[0]->m_EventBase. */
 	event_base * m_EventBase;
 
+	/** All the event loops running, the main one being the first.
+	The vector only grows, in SetNumEventLoops(); protected by m_CS. */
+	std::vector<cEventLoopPtr> m_EventLoops;
+
 	/** The LibEvent handle for doing DNS lookups. */
 	evdns_base * m_DNSBase;
 
@@ -116,11 +191,14 @@ protected:
 	/** Mutex protecting all containers against multithreaded access. */
 	cCriticalSection m_CS;
 
+	/** If true, the accepted links are created as single-owner, without LibEvent locking. */
+	std::atomic<bool> m_ShouldUseSingleOwnerLinks;
+
 	/** Set to true if Terminate has been called. */
 	volatile bool m_HasTerminated;
 
-	/** The thread in which the main LibEvent loop runs. */
-	std::thread m_EventLoopThread;
+	/** Set by Terminate() once all the event loop threads have finished. */
+	std::atomic<bool> m_HaveLoopsStopped;
 
 
 	/** Initializes the LibEvent internals. */
@@ -130,7 +208,19 @@ protected:
 	static void LogCallback(int a_Severity, const char * a_Msg);
 
 	/** Implements the thread that runs LibEvent's event dispatcher loop. */
-	static void RunEventLoop(cNetworkSingleton * a_Self);
+	static void RunEventLoop(event_base * a_EventBase);
+
+	/** Returns the specified event loop. */
+	cEventLoop & GetEventLoop(size_t a_LoopIdx);
+
+	/** Adds the loop's timer event for the wheel's next expiry, unless it is already pending for an earlier time. */
+	static void ScheduleTimerEvent(cEventLoop & a_Loop);
+
+	/** Called by LibEvent when a loop's timer event fires, advances the loop's timer wheel. */
+	static void TimerCallback(evutil_socket_t a_Socket, short a_What, void * a_Self);
+
+	/** Called by LibEvent to run a function queued by RunInLoop(). */
+	static void RunInLoopCallback(evutil_socket_t a_Socket, short a_What, void * a_Function);
 };
 
 
@@ -15,6 +15,15 @@
 ////////////////////////////////////////////////////////////////////////////////
 // Globals:
 
+/** The length of the listening sockets' accept queue. The connections of a login storm arrive faster than a single
+event loop accepts them; with a short queue the OS drops the excess connection attempts and the clients only retry
+after their SYN timeout, a second or more later. */
+static const int LISTEN_BACKLOG = SOMAXCONN;
+
+
+
+
+
 static bool IsValidSocket(evutil_socket_t a_Socket)
 {
 	#ifdef _WIN32
@@ -28,6 +37,23 @@ static bool IsValidSocket(evutil_socket_t a_Socket)
 
 
 
+/** Allows several sockets to listen on the same port, with the OS spreading the incoming connections among them.
+Must be set on all the sockets before binding them. Returns false if not supported by the OS. */
+static bool MakeSocketPortShared(evutil_socket_t a_Socket)
+{
+	#ifdef SO_REUSEPORT
+		int One = 1;
+		return (setsockopt(a_Socket, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&One), sizeof(One)) == 0);
+	#else
+		UNUSED(a_Socket);
+		return false;
+	#endif
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // cServerHandleImpl:
 
@@ -54,6 +80,10 @@ cServerHandleImpl::~cServerHandleImpl()
 	{
 		evconnlistener_free(m_SecondaryConnListener);
 	}
+	for (auto & Shard : m_Shards)
+	{
+		evconnlistener_free(Shard->m_Listener);
+	}
 }
 
 
@@ -68,6 +98,10 @@ void cServerHandleImpl::Close(void)
 	{
 		evconnlistener_disable(m_SecondaryConnListener);
 	}
+	for (auto & Shard : m_Shards)
+	{
+		evconnlistener_disable(Shard->m_Listener);
+	}
 	m_IsListening = false;
 
 	// Shutdown all connections:
@@ -94,12 +128,13 @@ void cServerHandleImpl::Close(void)
 
 cServerHandleImplPtr cServerHandleImpl::Listen(
 	UInt16 a_Port,
-	cNetwork::cListenCallbacksPtr a_ListenCallbacks
+	cNetwork::cListenCallbacksPtr a_ListenCallbacks,
+	unsigned a_NumSockets
 )
 {
 	cServerHandleImplPtr res = cServerHandleImplPtr{new cServerHandleImpl(a_ListenCallbacks)};
 	res->m_SelfPtr = res;
-	if (res->Listen(a_Port))
+	if (res->Listen(a_Port, a_NumSockets))
 	{
 		cNetworkSingleton::Get().AddServer(res);
 	}
@@ -115,15 +150,26 @@ cServerHandleImplPtr cServerHandleImpl::Listen(
 
 
 
-bool cServerHandleImpl::Listen(UInt16 a_Port)
+bool cServerHandleImpl::Listen(UInt16 a_Port, unsigned a_NumSockets)
 {
 	// Make sure the cNetwork internals are innitialized:
 	cNetworkSingleton::Get();
 
+	// Share the port among several sockets, if requested and supported:
+	bool ShouldShard = (a_NumSockets > 1);
+	#ifndef SO_REUSEPORT
+		if (ShouldShard)
+		{
+			LOG("Sharing a port among several listening sockets is not supported on this platform, port %d will use a single socket.", a_Port);
+			ShouldShard = false;
+		}
+	#endif
+
 	// Set up the main socket:
 	// It should listen on IPv6 with IPv4 fallback, when available; IPv4 when IPv6 is not available.
 	bool NeedsTwoSockets = false;
 	int err;
+	int Family = AF_INET6;
 	evutil_socket_t MainSock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 
 	if (!IsValidSocket(MainSock))
@@ -131,6 +177,7 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 		// Failed to create IPv6 socket, create an IPv4 one instead:
 		err = EVUTIL_SOCKET_ERROR();
 		LOGD("Failed to create IPv6 MainSock: %d (%s)", err, evutil_socket_error_to_string(err));
+		Family = AF_INET;
 		MainSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 		if (!IsValidSocket(MainSock))
 		{
@@ -148,6 +195,12 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 			);
 			LOG("%s", m_ErrorMsg.c_str());
 		}
+		if (ShouldShard && !MakeSocketPortShared(MainSock))
+		{
+			err = EVUTIL_SOCKET_ERROR();
+			LOG("Port %d cannot be shared among several sockets: %d (%s). Using a single socket.", a_Port, err, evutil_socket_error_to_string(err));
+			ShouldShard = false;
+		}
 
 		// Bind to all interfaces:
 		sockaddr_in name;
@@ -184,6 +237,12 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 			);
 			LOG("%s", m_ErrorMsg.c_str());
 		}
+		if (ShouldShard && !MakeSocketPortShared(MainSock))
+		{
+			err = EVUTIL_SOCKET_ERROR();
+			LOG("Port %d cannot be shared among several sockets: %d (%s). Using a single socket.", a_Port, err, evutil_socket_error_to_string(err));
+			ShouldShard = false;
+		}
 
 		// Bind to all interfaces:
 		sockaddr_in6 name;
@@ -205,7 +264,7 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 		evutil_closesocket(MainSock);
 		return false;
 	}
-	if (listen(MainSock, 0) != 0)
+	if (listen(MainSock, LISTEN_BACKLOG) != 0)
 	{
 		m_ErrorCode = EVUTIL_SOCKET_ERROR();
 		Printf(m_ErrorMsg, "Cannot listen on port %d: %d (%s)", a_Port, m_ErrorCode, evutil_socket_error_to_string(m_ErrorCode));
@@ -215,6 +274,23 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 	m_ConnListener = evconnlistener_new(cNetworkSingleton::Get().GetEventBase(), Callback, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 0, MainSock);
 	m_IsListening = true;
 
+	// Add the sockets sharing the port, each driven by a different event loop; the main socket uses the main loop:
+	if (ShouldShard)
+	{
+		size_t NumLoops = cNetworkSingleton::Get().GetNumEventLoops();
+		if (NumLoops < a_NumSockets)
+		{
+			LOGWARNING("Port %d: %u listening sockets requested, but only %u network threads are running; some threads will serve several sockets.",
+				a_Port, a_NumSockets, static_cast<unsigned>(NumLoops)
+			);
+		}
+		for (unsigned i = 1; i < a_NumSockets; i++)
+		{
+			AddShard(a_Port, Family, i % NumLoops);
+		}
+		LOG("Port %d is served by %u listening sockets.", a_Port, static_cast<unsigned>(m_Shards.size() + 1));
+	}
+
 	if (!NeedsTwoSockets)
 	{
 		return true;
@@ -263,7 +339,7 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 		return true;  // Report as success, the primary socket is working
 	}
 
-	if (listen(SecondSock, 0) != 0)
+	if (listen(SecondSock, LISTEN_BACKLOG) != 0)
 	{
 		err = EVUTIL_SOCKET_ERROR();
 		LOGD("Cannot listen on secondary socket on port %d: %d (%s)", a_Port, err, evutil_socket_error_to_string(err));
@@ -279,12 +355,96 @@ bool cServerHandleImpl::Listen(UInt16 a_Port)
 
 
 
+bool cServerHandleImpl::AddShard(UInt16 a_Port, int a_Family, size_t a_EventLoopIdx)
+{
+	evutil_socket_t Sock = socket(a_Family, SOCK_STREAM, IPPROTO_TCP);
+	if (!IsValidSocket(Sock))
+	{
+		int err = EVUTIL_SOCKET_ERROR();
+		LOGWARNING("Cannot create an additional socket for port %d: %d (%s)", a_Port, err, evutil_socket_error_to_string(err));
+		return false;
+	}
+
+	// Set the same options as the main socket has:
+	sockaddr_storage name;
+	memset(&name, 0, sizeof(name));
+	socklen_t NameLen;
+	if (a_Family == AF_INET6)
+	{
+		UInt32 Zero = 0;
+		setsockopt(Sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&Zero), sizeof(Zero));
+		sockaddr_in6 * sin6 = reinterpret_cast<sockaddr_in6 *>(&name);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = ntohs(a_Port);
+		NameLen = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		sockaddr_in * sin = reinterpret_cast<sockaddr_in *>(&name);
+		sin->sin_family = AF_INET;
+		sin->sin_port = ntohs(a_Port);
+		NameLen = sizeof(sockaddr_in);
+	}
+	evutil_make_listen_socket_reuseable(Sock);
+	if (
+		!MakeSocketPortShared(Sock) ||
+		(bind(Sock, reinterpret_cast<const sockaddr *>(&name), NameLen) != 0) ||
+		(evutil_make_socket_nonblocking(Sock) != 0) ||
+		(listen(Sock, LISTEN_BACKLOG) != 0)
+	)
+	{
+		int err = EVUTIL_SOCKET_ERROR();
+		LOGWARNING("Cannot listen on an additional socket for port %d: %d (%s)", a_Port, err, evutil_socket_error_to_string(err));
+		evutil_closesocket(Sock);
+		return false;
+	}
+
+	cListenShardPtr Shard{new cListenShard};
+	Shard->m_Server = this;
+	Shard->m_EventLoopIdx = a_EventLoopIdx;
+	Shard->m_Listener = evconnlistener_new(cNetworkSingleton::Get().GetEventBase(a_EventLoopIdx), ShardCallback, Shard.get(), LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 0, Sock);
+	if (Shard->m_Listener == nullptr)
+	{
+		LOGWARNING("Cannot listen on an additional socket for port %d: LibEvent failed to create the listener", a_Port);
+		evutil_closesocket(Sock);
+		return false;
+	}
+	m_Shards.push_back(std::move(Shard));
+	return true;
+}
+
+
+
+
+
 void cServerHandleImpl::Callback(evconnlistener * a_Listener, evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, void * a_Self)
 {
 	// Cast to true self:
 	cServerHandleImpl * Self = reinterpret_cast<cServerHandleImpl *>(a_Self);
 	ASSERT(Self != nullptr);
-	ASSERT(Self->m_SelfPtr != nullptr);
+
+	// If the port is shared, the other sockets serve the other loops; keep this socket's links on the main loop:
+	Self->AcceptConnection(a_Socket, a_Addr, a_Len, Self->m_Shards.empty() ? cNetworkSingleton::ANY_EVENT_LOOP : 0);
+}
+
+
+
+
+
+void cServerHandleImpl::ShardCallback(evconnlistener * a_Listener, evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, void * a_Shard)
+{
+	cListenShard * Shard = reinterpret_cast<cListenShard *>(a_Shard);
+	ASSERT(Shard != nullptr);
+	Shard->m_Server->AcceptConnection(a_Socket, a_Addr, a_Len, Shard->m_EventLoopIdx);
+}
+
+
+
+
+
+void cServerHandleImpl::AcceptConnection(evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, size_t a_EventLoopIdx)
+{
+	ASSERT(m_SelfPtr != nullptr);
 
 	// Get the textual IP address and port number out of a_Addr:
 	char IPAddress[128];
@@ -308,7 +468,7 @@ void cServerHandleImpl::Callback(evconnlistener * a_Listener, evutil_socket_t a_
 	}
 
 	// Call the OnIncomingConnection callback to get the link callbacks to use:
-	cTCPLink::cCallbacksPtr LinkCallbacks = Self->m_ListenCallbacks->OnIncomingConnection(IPAddress, Port);
+	cTCPLink::cCallbacksPtr LinkCallbacks = m_ListenCallbacks->OnIncomingConnection(IPAddress, Port);
 	if (LinkCallbacks == nullptr)
 	{
 		// Drop the connection:
@@ -316,17 +476,21 @@ void cServerHandleImpl::Callback(evconnlistener * a_Listener, evutil_socket_t a_
 		return;
 	}
 
-	// Create a new cTCPLink for the incoming connection:
-	cTCPLinkImplPtr Link = std::make_shared<cTCPLinkImpl>(a_Socket, LinkCallbacks, Self->m_SelfPtr, a_Addr, static_cast<socklen_t>(a_Len));
+	// Create a new cTCPLink for the incoming connection, driven by the requested event loop:
+	size_t EventLoopIdx = cNetworkSingleton::Get().AcquireEventLoop(a_EventLoopIdx);
+	cTCPLinkImplPtr Link = std::make_shared<cTCPLinkImpl>(
+		a_Socket, LinkCallbacks, m_SelfPtr, a_Addr, static_cast<socklen_t>(a_Len),
+		EventLoopIdx, cNetworkSingleton::Get().ShouldUseSingleOwnerLinks()
+	);
 	{
-		cCSLock Lock(Self->m_CS);
-		Self->m_Connections.push_back(Link);
+		cCSLock Lock(m_CS);
+		m_Connections.push_back(Link);
 	}  // Lock(m_CS)
 	LinkCallbacks->OnLinkCreated(Link);
 	Link->Enable(Link);
 
 	// Call the OnAccepted callback:
-	Self->m_ListenCallbacks->OnAccepted(*Link);
+	m_ListenCallbacks->OnAccepted(*Link);
 }
 
 
@@ -355,10 +519,11 @@ void cServerHandleImpl::RemoveLink(const cTCPLinkImpl * a_Link)
 
 cServerHandlePtr cNetwork::Listen(
 	UInt16 a_Port,
-	cNetwork::cListenCallbacksPtr a_ListenCallbacks
+	cNetwork::cListenCallbacksPtr a_ListenCallbacks,
+	unsigned a_NumSockets
 )
 {
-	return cServerHandleImpl::Listen(a_Port, a_ListenCallbacks);
+	return cServerHandleImpl::Listen(a_Port, a_ListenCallbacks, a_NumSockets);
 }
 
 
@@ -46,7 +46,8 @@ public:
 	Always returns a server instance; in the event of a failure, the instance holds the error details. Use IsListening() to query success. */
 	static cServerHandleImplPtr Listen(
 		UInt16 a_Port,
-		cNetwork::cListenCallbacksPtr a_ListenCallbacks
+		cNetwork::cListenCallbacksPtr a_ListenCallbacks,
+		unsigned a_NumSockets
 	);
 
 	// cServerHandle overrides:
@@ -63,6 +64,20 @@ protected:
 	/** The LibEvent handle representing the secondary listening socket (only when side-by-side listening is needed, such as WinXP). */
 	evconnlistener * m_SecondaryConnListener;
 
+	/** An additional listening socket sharing the port with the main one (SO_REUSEPORT), driven by a single event loop.
+	The links accepted on it stay on the same loop, so the accepting and the link's callbacks happen in one thread. */
+	struct cListenShard
+	{
+		cServerHandleImpl * m_Server;
+		evconnlistener * m_Listener;
+		size_t m_EventLoopIdx;
+	};
+	typedef std::unique_ptr<cListenShard> cListenShardPtr;
+
+	/** The additional listening sockets, if the port is shared among several of them.
+	If non-empty, the main socket's links stay on the main event loop. Only modified in Listen(). */
+	std::vector<cListenShardPtr> m_Shards;
+
 	/** Set to true when the server is initialized successfully and is listening for incoming connections. */
 	bool m_IsListening;
 
@@ -87,13 +102,23 @@ protected:
 	Initializes the internals, but doesn't start listening yet. */
 	cServerHandleImpl(cNetwork::cListenCallbacksPtr a_ListenCallbacks);
 
-	/** Starts listening on the specified port.
+	/** Starts listening on the specified port, with a_NumSockets sockets sharing the port if supported.
 	Returns true if successful, false on failure. On failure, sets m_ErrorCode and m_ErrorMsg. */
-	bool Listen(UInt16 a_Port);
+	bool Listen(UInt16 a_Port, unsigned a_NumSockets);
+
+	/** Creates an additional socket listening on the port shared with the main socket, driven by the specified event loop.
+	a_Family is the address family of the main socket. Returns true if successful; failures are only logged. */
+	bool AddShard(UInt16 a_Port, int a_Family, size_t a_EventLoopIdx);
 
-	/** The callback called by LibEvent upon incoming connection. */
+	/** The callback called by LibEvent upon incoming connection on the main or secondary socket. */
 	static void Callback(evconnlistener * a_Listener, evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, void * a_Self);
 
+	/** The callback called by LibEvent upon incoming connection on a shard socket; a_Shard is the cListenShard. */
+	static void ShardCallback(evconnlistener * a_Listener, evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, void * a_Shard);
+
+	/** Creates a new link for the accepted socket, driven by the specified event loop (or the least loaded one, if ANY_EVENT_LOOP). */
+	void AcceptConnection(evutil_socket_t a_Socket, sockaddr * a_Addr, int a_Len, size_t a_EventLoopIdx);
+
 	/** Removes the specified link from m_Connections.
 	Called by cTCPLinkImpl when the link is terminated. */
 	void RemoveLink(const cTCPLinkImpl * a_Link);
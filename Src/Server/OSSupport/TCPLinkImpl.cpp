@@ -8,6 +8,22 @@
 #include "NetworkSingleton.h"
 #include "ServerHandleImpl.h"
 #include "event2/buffer.h"
+#include "BlockPool.h"
+
+
+
+
+
+/** Segments smaller than this are copied into the LibEvent buffer by Send(cSendSegments &&),
+referencing them wouldn't save anything over the copy. */
+static const size_t MIN_REFERENCED_SEGMENT_SIZE = 512;
+
+/** Maximum number of contiguous chunks handed to a single OnReceivedDataChunks() call by ReadCallback(). */
+static const int MAX_READ_CHUNKS = 16;
+
+/** The largest amount of data that ReadCallback() lets LibEvent read from a single link in one go.
+The links start with LibEvent's default (16 KiB) and grow towards this while their reads keep filling the allowance. */
+static const size_t MAX_SINGLE_READ_SIZE = 256 KiB;
 
 
 
@@ -18,10 +34,14 @@
 
 cTCPLinkImpl::cTCPLinkImpl(cTCPLink::cCallbacksPtr a_LinkCallbacks):
 	super(a_LinkCallbacks),
-	m_BufferEvent(bufferevent_socket_new(cNetworkSingleton::Get().GetEventBase(), -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE)),
+	m_BufferEvent(bufferevent_socket_new(cNetworkSingleton::Get().GetEventBase(), -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE | BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS)),
 	m_LocalPort(0),
 	m_RemotePort(0),
-	m_ShouldShutdown(false)
+	m_ShouldShutdown(false),
+	m_EventLoopIdx(0),
+	m_IsSingleOwner(false),
+	m_CommandEvent(nullptr),
+	m_IsCommandEventActive(false)
 {
 }
 
@@ -29,14 +49,30 @@ cTCPLinkImpl::cTCPLinkImpl(cTCPLink::cCallbacksPtr a_LinkCallbacks):
 
 
 
-cTCPLinkImpl::cTCPLinkImpl(evutil_socket_t a_Socket, cTCPLink::cCallbacksPtr a_LinkCallbacks, cServerHandleImplPtr a_Server, const sockaddr * a_Address, socklen_t a_AddrLen):
+cTCPLinkImpl::cTCPLinkImpl(
+	evutil_socket_t a_Socket, cTCPLink::cCallbacksPtr a_LinkCallbacks, cServerHandleImplPtr a_Server,
+	const sockaddr * a_Address, socklen_t a_AddrLen, size_t a_EventLoopIdx, bool a_IsSingleOwner
+):
 	super(a_LinkCallbacks),
-	m_BufferEvent(bufferevent_socket_new(cNetworkSingleton::Get().GetEventBase(), a_Socket, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE)),
+	m_BufferEvent(bufferevent_socket_new(
+		cNetworkSingleton::Get().GetEventBase(a_EventLoopIdx), a_Socket,
+		BEV_OPT_CLOSE_ON_FREE | (a_IsSingleOwner ? 0 : BEV_OPT_THREADSAFE) | BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS
+	)),
 	m_Server(a_Server),
 	m_LocalPort(0),
 	m_RemotePort(0),
-	m_ShouldShutdown(false)
+	m_ShouldShutdown(false),
+	m_EventLoopIdx(a_EventLoopIdx),
+	m_IsSingleOwner(a_IsSingleOwner),
+	m_CommandEvent(nullptr),
+	m_IsCommandEventActive(false)
 {
+	if (m_IsSingleOwner)
+	{
+		m_CommandEvent = event_new(cNetworkSingleton::Get().GetEventBase(a_EventLoopIdx), -1, 0, CommandCallback, this);
+		m_OwnerThreadID = cNetworkSingleton::Get().GetLoopThreadID(a_EventLoopIdx);
+	}
+
 	// Update the endpoint addresses:
 	UpdateLocalAddress();
 	UpdateAddress(a_Address, a_AddrLen, m_RemoteIP, m_RemotePort);
@@ -48,7 +84,34 @@ cTCPLinkImpl::cTCPLinkImpl(evutil_socket_t a_Socket, cTCPLink::cCallbacksPtr a_L
 
 cTCPLinkImpl::~cTCPLinkImpl()
 {
-	bufferevent_free(m_BufferEvent);
+	if (m_IsSingleOwner && !cNetworkSingleton::Get().IsInLoopThread(m_EventLoopIdx))
+	{
+		// The last reference has been dropped in another thread (such as the tick thread releasing a remotely closed link).
+		// The LibEvent objects have no locking, free them in the owning loop's thread; their callbacks have already been
+		// removed in ReleaseSelf(), so nothing refers to this object anymore:
+		auto BufferEvent = m_BufferEvent;
+		auto CommandEvent = m_CommandEvent;
+		cNetworkSingleton::Get().RunInLoop(m_EventLoopIdx, [BufferEvent, CommandEvent]()
+			{
+				event_free(CommandEvent);
+				bufferevent_free(BufferEvent);
+			}
+		);
+	}
+	else
+	{
+		if (m_CommandEvent != nullptr)
+		{
+			event_free(m_CommandEvent);
+		}
+		bufferevent_free(m_BufferEvent);
+	}
+
+	// Only the incoming links are accounted to their event loop:
+	if (m_Server != nullptr)
+	{
+		cNetworkSingleton::Get().ReleaseEventLoop(m_EventLoopIdx);
+	}
 }
 
 
@@ -110,9 +173,24 @@ cTCPLinkImplPtr cTCPLinkImpl::Connect(const AString & a_Host, UInt16 a_Port, cTC
 
 void cTCPLinkImpl::Enable(cTCPLinkImplPtr a_Self)
 {
+	if (m_IsSingleOwner)
+	{
+		// The command keeps a_Self, DoEnable() takes it over as m_Self:
+		QueueCommand(cCommand(cCommand::cmdEnable));
+		return;
+	}
+
 	// Take hold of a shared copy of self, to keep as long as the callbacks are coming:
 	m_Self = a_Self;
+	DoEnable();
+}
+
+
 
+
+
+void cTCPLinkImpl::DoEnable(void)
+{
 	// Set the LibEvent callbacks and enable processing:
 	bufferevent_setcb(m_BufferEvent, ReadCallback, WriteCallback, EventCallback, this);
 	bufferevent_enable(m_BufferEvent, EV_READ | EV_WRITE);
@@ -129,6 +207,13 @@ bool cTCPLinkImpl::Send(const void * a_Data, size_t a_Length)
 		LOGD("%s: Cannot send data, the link is already shut down.", __FUNCTION__);
 		return false;
 	}
+	if (m_IsSingleOwner && !CanSendDirectly())
+	{
+		cSendSegments Segments;
+		Segments.emplace_back(static_cast<const char *>(a_Data), a_Length);
+		QueueCommand(cCommand(cCommand::cmdSend, std::move(Segments)));
+		return true;
+	}
 	return (bufferevent_write(m_BufferEvent, a_Data, a_Length) == 0);
 }
 
@@ -136,7 +221,76 @@ bool cTCPLinkImpl::Send(const void * a_Data, size_t a_Length)
 
 
 
+bool cTCPLinkImpl::Send(cSendSegments && a_Segments)
+{
+	if (m_ShouldShutdown)
+	{
+		LOGD("%s: Cannot send data, the link is already shut down.", __FUNCTION__);
+		return false;
+	}
+	if (m_IsSingleOwner && !CanSendDirectly())
+	{
+		QueueCommand(cCommand(cCommand::cmdSend, std::move(a_Segments)));
+		return true;
+	}
+	return DoSend(a_Segments);
+}
+
+
+
+
+
+bool cTCPLinkImpl::DoSend(cSendSegments & a_Segments)
+{
+	// Add all the segments under a single lock, so that they don't get interleaved with data sent from other threads:
+	// (single-owner links have no lock, they're only ever accessed from one thread)
+	auto Output = bufferevent_get_output(m_BufferEvent);
+	bool res = true;
+	bufferevent_lock(m_BufferEvent);
+	for (auto & Segment : a_Segments)
+	{
+		if (Segment.size() < MIN_REFERENCED_SEGMENT_SIZE)
+		{
+			if (evbuffer_add(Output, Segment.data(), Segment.size()) != 0)
+			{
+				res = false;
+				break;
+			}
+			continue;
+		}
+
+		// Move the segment's data into a pooled object owned by LibEvent, freed in SegmentSentCallback():
+		auto Owned = new(GetSegmentPool().Allocate()) AString(std::move(Segment));
+		if (evbuffer_add_reference(Output, Owned->data(), Owned->size(), SegmentSentCallback, Owned) != 0)
+		{
+			SegmentSentCallback(nullptr, 0, Owned);
+			res = false;
+			break;
+		}
+	}
+	bufferevent_unlock(m_BufferEvent);
+	return res;
+}
+
+
+
+
+
 void cTCPLinkImpl::Shutdown(void)
+{
+	if (m_IsSingleOwner)
+	{
+		QueueCommand(cCommand(cCommand::cmdShutdown));
+		return;
+	}
+	DoShutdown();
+}
+
+
+
+
+
+void cTCPLinkImpl::DoShutdown(void)
 {
 	// If there's no outgoing data, shutdown the socket directly:
 	if (evbuffer_get_length(bufferevent_get_output(m_BufferEvent)) == 0)
@@ -154,6 +308,20 @@ void cTCPLinkImpl::Shutdown(void)
 
 
 void cTCPLinkImpl::Close(void)
+{
+	if (m_IsSingleOwner)
+	{
+		QueueCommand(cCommand(cCommand::cmdClose));
+		return;
+	}
+	DoClose();
+}
+
+
+
+
+
+void cTCPLinkImpl::DoClose(void)
 {
 	// Disable all events on the socket, but keep it alive:
 	bufferevent_disable(m_BufferEvent, EV_READ | EV_WRITE);
@@ -165,6 +333,22 @@ void cTCPLinkImpl::Close(void)
 	{
 		m_Server->RemoveLink(this);
 	}
+	ReleaseSelf();
+}
+
+
+
+
+
+void cTCPLinkImpl::ReleaseSelf(void)
+{
+	if (m_IsSingleOwner)
+	{
+		// The link may now get destroyed in any thread, and then its LibEvent objects are freed only later in this thread
+		// (see the destructor); make sure that no callback fires for the destroyed link in the meantime:
+		bufferevent_setcb(m_BufferEvent, nullptr, nullptr, nullptr, nullptr);
+		bufferevent_disable(m_BufferEvent, EV_READ | EV_WRITE);
+	}
 	m_Self.reset();
 }
 
@@ -179,12 +363,41 @@ void cTCPLinkImpl::ReadCallback(bufferevent * a_BufferEvent, void * a_Self)
 	cTCPLinkImpl * Self = static_cast<cTCPLinkImpl *>(a_Self);
 	ASSERT(Self->m_Callbacks != nullptr);
 
-	// Read all the incoming data, in 1024-Byte chunks:
-	char data[1024];
-	size_t length;
-	while ((length = bufferevent_read(a_BufferEvent, data, sizeof(data))) > 0)
+	// Keep the link alive even if the callback closes it, the buffer is still used after the callback returns:
+	cTCPLinkImplPtr KeepAlive = Self->m_Self;
+
+	// Hand all the incoming data to the callbacks directly from the LibEvent buffer, without copying it.
+	// The link is driven by a single event loop, so nothing else modifies the input buffer while the callback runs
+	// and no lock needs to be held (holding it could deadlock with the callback sending data to other links).
+	evbuffer * Input = bufferevent_get_input(a_BufferEvent);
+	size_t TotalLength = 0;
+	for (;;)
+	{
+		evbuffer_iovec Vecs[MAX_READ_CHUNKS];
+		int NumVecs = evbuffer_peek(Input, -1, nullptr, Vecs, MAX_READ_CHUNKS);
+		if (NumVecs <= 0)
+		{
+			break;
+		}
+		NumVecs = std::min(NumVecs, MAX_READ_CHUNKS);  // evbuffer_peek() returns the number of chunks needed, which may be more
+		cTCPLink::cReceivedChunk Chunks[MAX_READ_CHUNKS];
+		size_t Length = 0;
+		for (int i = 0; i < NumVecs; i++)
+		{
+			Chunks[i].m_Data = static_cast<const char *>(Vecs[i].iov_base);
+			Chunks[i].m_Length = Vecs[i].iov_len;
+			Length += Vecs[i].iov_len;
+		}
+		Self->m_Callbacks->OnReceivedDataChunks(Chunks, static_cast<size_t>(NumVecs));
+		evbuffer_drain(Input, Length);
+		TotalLength += Length;
+	}
+
+	// If the reads fill the whole allowance, there's probably more waiting in the socket; let the link read more at once:
+	auto MaxSingleRead = static_cast<size_t>(bufferevent_get_max_single_read(a_BufferEvent));
+	if ((TotalLength >= MaxSingleRead) && (MaxSingleRead < MAX_SINGLE_READ_SIZE))
 	{
-		Self->m_Callbacks->OnReceivedData(data, length);
+		bufferevent_set_max_single_read(a_BufferEvent, std::min(MaxSingleRead * 2, MAX_SINGLE_READ_SIZE));
 	}
 }
 
@@ -241,7 +454,7 @@ void cTCPLinkImpl::EventCallback(bufferevent * a_BufferEvent, short a_What, void
 				Self->m_Server->RemoveLink(Self.get());
 			}
 		}
-		Self->m_Self.reset();
+		Self->ReleaseSelf();
 		return;
 	}
 
@@ -271,7 +484,7 @@ void cTCPLinkImpl::EventCallback(bufferevent * a_BufferEvent, short a_What, void
 		{
 			cNetworkSingleton::Get().RemoveLink(Self.get());
 		}
-		Self->m_Self.reset();
+		Self->ReleaseSelf();
 		return;
 	}
 	
@@ -284,6 +497,96 @@ void cTCPLinkImpl::EventCallback(bufferevent * a_BufferEvent, short a_What, void
 
 
 
+void cTCPLinkImpl::CommandCallback(evutil_socket_t a_Socket, short a_What, void * a_Self)
+{
+	UNUSED(a_Socket);
+	UNUSED(a_What);
+	ASSERT(a_Self != nullptr);
+	auto Self = static_cast<cTCPLinkImpl *>(a_Self);
+
+	// Clear the flag before processing, so that any command queued from now on activates the event again:
+	Self->m_IsCommandEventActive.store(false);
+
+	// Each command holds a reference to the link. Keep the last one until all the commands have been processed,
+	// so that the link can only get destroyed at the very end of this callback:
+	cTCPLinkImplPtr KeepAlive;
+	cCommand Command;
+	while (Self->m_Commands.TryDequeue(Command))
+	{
+		KeepAlive = std::move(Command.m_Link);
+		switch (Command.m_Type)
+		{
+			case cCommand::cmdEnable:
+			{
+				Self->m_Self = KeepAlive;
+				Self->DoEnable();
+				break;
+			}
+			case cCommand::cmdSend:
+			{
+				Self->DoSend(Command.m_Segments);
+				Command.m_Segments.clear();
+				break;
+			}
+			case cCommand::cmdShutdown:
+			{
+				Self->DoShutdown();
+				break;
+			}
+			case cCommand::cmdClose:
+			{
+				Self->DoClose();
+				break;
+			}
+		}
+	}
+}
+
+
+
+
+
+void cTCPLinkImpl::QueueCommand(cCommand && a_Command)
+{
+	ASSERT(m_IsSingleOwner);
+	a_Command.m_Link = shared_from_this();
+	m_Commands.Enqueue(std::move(a_Command));
+
+	// Wake up the owning event loop, unless already woken up and not yet processing:
+	if (!m_IsCommandEventActive.exchange(true))
+	{
+		event_active(m_CommandEvent, 0, 0);
+	}
+}
+
+
+
+
+
+void cTCPLinkImpl::SegmentSentCallback(const void * a_Data, size_t a_Length, void * a_Segment)
+{
+	UNUSED(a_Data);
+	UNUSED(a_Length);
+	auto Segment = static_cast<AString *>(a_Segment);
+	Segment->~AString();
+	GetSegmentPool().Free(Segment);
+}
+
+
+
+
+
+cBlockPool & cTCPLinkImpl::GetSegmentPool(void)
+{
+	// The segments are usually added in the tick thread and freed in the network thread, the pool returns them cheaply:
+	static cBlockPool Pool("Send segments", sizeof(AString), 4096);
+	return Pool;
+}
+
+
+
+
+
 void cTCPLinkImpl::UpdateAddress(const sockaddr * a_Address, socklen_t a_AddrLen, AString & a_IP, UInt16 & a_Port)
 {
 	// Based on the family specified in the address, use the correct datastructure to convert to IP string:
@@ -14,6 +14,7 @@
 #include "Network.h"
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include "MPSCQueue.h"
 
 
 
@@ -21,6 +22,7 @@
 
 // fwd:
 class cServerHandleImpl;
+class cBlockPool;
 typedef std::shared_ptr<cServerHandleImpl> cServerHandleImplPtr;
 class cTCPLinkImpl;
 typedef std::shared_ptr<cTCPLinkImpl> cTCPLinkImplPtr;
@@ -31,7 +33,8 @@ typedef std::vector<cTCPLinkImplPtr> cTCPLinkImplPtrs;
 
 
 class cTCPLinkImpl:
-	public cTCPLink
+	public cTCPLink,
+	public std::enable_shared_from_this<cTCPLinkImpl>
 {
 	typedef cTCPLink super;
 
@@ -39,10 +42,18 @@ public:
 	/** Creates a new link based on the given socket.
 	Used for connections accepted in a server using cNetwork::Listen().
 	a_Address and a_AddrLen describe the remote peer that has connected.
+	a_EventLoopIdx is the event loop that drives the link, as returned by cNetworkSingleton::AcquireEventLoop();
+	all the link's callbacks are called from that loop's thread.
+	If a_IsSingleOwner is true, the LibEvent handle is created without locking and all the operations requested
+	from other threads are passed to the loop's thread through a command queue (see m_Commands).
 	The link is created disabled, you need to call Enable() to start the regular communication. */
-	cTCPLinkImpl(evutil_socket_t a_Socket, cCallbacksPtr a_LinkCallbacks, cServerHandleImplPtr a_Server, const sockaddr * a_Address, socklen_t a_AddrLen);
+	cTCPLinkImpl(
+		evutil_socket_t a_Socket, cCallbacksPtr a_LinkCallbacks, cServerHandleImplPtr a_Server,
+		const sockaddr * a_Address, socklen_t a_AddrLen, size_t a_EventLoopIdx, bool a_IsSingleOwner
+	);
 
-	/** Destroys the LibEvent handle representing the link. */
+	/** Destroys the LibEvent handle representing the link and releases the link's event loop.
+	A single-owner link destroyed outside its event loop's thread has its LibEvent objects freed later in that thread. */
 	~cTCPLinkImpl();
 
 	/** Queues a connection request to the specified host.
@@ -58,6 +69,7 @@ public:
 
 	// cTCPLink overrides:
 	virtual bool Send(const void * a_Data, size_t a_Length) override;
+	virtual bool Send(cSendSegments && a_Segments) override;
 	virtual AString GetLocalIP(void) const override { return m_LocalIP; }
 	virtual UInt16 GetLocalPort(void) const override { return m_LocalPort; }
 	virtual AString GetRemoteIP(void) const override { return m_RemoteIP; }
@@ -91,7 +103,7 @@ protected:
 	UInt16 m_RemotePort;
 
 	/** std::shared_ptr to self, used to keep this object alive as long as the callbacks are coming.
-	Initialized in Enable(), cleared in Close() and EventCallback(RemoteClosed). */
+	Initialized in Enable(), cleared by ReleaseSelf() in Close() and EventCallback(RemoteClosed). */
 	cTCPLinkImplPtr m_Self;
 
 	/** If true, Shutdown() has been called and is in queue.
@@ -99,6 +111,58 @@ protected:
 	data is sent to the OS TCP stack, the socket gets shut down. */
 	bool m_ShouldShutdown;
 
+	/** Index of the cNetworkSingleton event loop that drives this link.
+	Incoming links are spread over the loops, outgoing links always use the main loop (0), where the DNS lookups run. */
+	size_t m_EventLoopIdx;
+
+	/** An operation requested on a single-owner link, to be executed in the owning event loop's thread. */
+	struct cCommand
+	{
+		enum eType
+		{
+			cmdEnable,
+			cmdSend,
+			cmdShutdown,
+			cmdClose,
+		};
+
+		eType m_Type;
+
+		/** The data to send, for cmdSend. */
+		cSendSegments m_Segments;
+
+		/** Keeps the link alive until the command is executed. */
+		cTCPLinkImplPtr m_Link;
+
+		cCommand(void):
+			m_Type(cmdSend)
+		{
+		}
+
+		cCommand(eType a_Type, cSendSegments && a_Segments = cSendSegments()):
+			m_Type(a_Type),
+			m_Segments(std::move(a_Segments))
+		{
+		}
+	};
+
+	/** If true, m_BufferEvent is not thread-safe and may only be touched from the owning event loop's thread;
+	the operations requested from the other threads are queued in m_Commands. */
+	bool m_IsSingleOwner;
+
+	/** The operations queued for the owning event loop's thread. Only used for single-owner links. */
+	cMPSCQueue<cCommand> m_Commands;
+
+	/** The LibEvent event activated to make the owning event loop execute m_Commands. Only used for single-owner links. */
+	event * m_CommandEvent;
+
+	/** Set when m_CommandEvent has been activated and its callback hasn't started processing the commands yet,
+	so that a burst of commands activates the event only once. */
+	std::atomic<bool> m_IsCommandEventActive;
+
+	/** The thread of the owning event loop, for single-owner links. Sends from this thread skip m_Commands. */
+	std::thread::id m_OwnerThreadID;
+
 
 	/** Creates a new link to be queued to connect to a specified host:port.
 	Used for outgoing connections created using cNetwork::Connect().
@@ -115,6 +179,41 @@ protected:
 	/** Callback that LibEvent calls when there's a non-data-related event on the socket. */
 	static void EventCallback(bufferevent * a_BufferEvent, short a_What, void * a_Self);
 
+	/** Callback that LibEvent calls when a single-owner link's m_CommandEvent is activated. Executes all the queued commands. */
+	static void CommandCallback(evutil_socket_t a_Socket, short a_What, void * a_Self);
+
+	/** Adds the command to m_Commands and wakes up the owning event loop to execute it. */
+	void QueueCommand(cCommand && a_Command);
+
+	/** Returns true if a single-owner link's send may go to m_BufferEvent directly: the caller is the owning event loop's
+	thread, and no command queued earlier is waiting (so the data isn't reordered before the data sent by those). */
+	bool CanSendDirectly(void) const
+	{
+		return ((std::this_thread::get_id() == m_OwnerThreadID) && !m_IsCommandEventActive.load());
+	}
+
+	/** Sets the LibEvent callbacks and enables the processing; the actual implementation of Enable(). */
+	void DoEnable(void);
+
+	/** Adds the segments to the LibEvent output buffer; the actual implementation of Send(cSendSegments &&). */
+	bool DoSend(cSendSegments & a_Segments);
+
+	/** The actual implementation of Shutdown(). */
+	void DoShutdown(void);
+
+	/** The actual implementation of Close(). */
+	void DoClose(void);
+
+	/** Drops m_Self, so that the link gets destroyed once its users let go of it. For single-owner links, also removes
+	the LibEvent callbacks first. Must be called from the owning event loop's thread. */
+	void ReleaseSelf(void);
+
+	/** Callback that LibEvent calls when a segment added by Send(cSendSegments &&) has been fully written. Frees the segment. */
+	static void SegmentSentCallback(const void * a_Data, size_t a_Length, void * a_Segment);
+
+	/** Returns the pool of the segments handed over to LibEvent by DoSend(). */
+	static cBlockPool & GetSegmentPool(void);
+
 	/** Sets a_IP and a_Port to values read from a_Address, based on the correct address family. */
 	static void UpdateAddress(const sockaddr * a_Address, socklen_t a_AddrLen, AString & a_IP, UInt16 & a_Port);
 
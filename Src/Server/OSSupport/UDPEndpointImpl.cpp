@@ -7,6 +7,21 @@
 #include "UDPEndpointImpl.h"
 #include "NetworkSingleton.h"
 
+#if defined(__linux__)
+	// recvmmsg() and sendmmsg() are available for batching the datagrams
+	#define HAS_MMSG
+#endif
+
+
+
+
+
+/** The maximum number of datagrams received in a single read event / sent in a single OS call. */
+static const size_t UDP_BATCH_SIZE = 16;
+
+/** The size of a single receive slot, large enough for any UDP datagram. */
+static const size_t UDP_SLOT_SIZE = 64 KiB;
+
 
 
 
@@ -27,6 +42,34 @@ static bool IsValidSocket(evutil_socket_t a_Socket)
 
 
 
+/** Converts a_Addr to the textual IP address in a_Host and the port number in a_Port.
+Returns false if the address family is not supported. */
+static bool FormatAddress(const sockaddr_storage & a_Addr, char * a_Host, size_t a_HostSize, UInt16 & a_Port)
+{
+	switch (a_Addr.ss_family)
+	{
+		case AF_INET:
+		{
+			auto sin = reinterpret_cast<const sockaddr_in *>(&a_Addr);
+			evutil_inet_ntop(AF_INET, &sin->sin_addr, a_Host, a_HostSize);
+			a_Port = ntohs(sin->sin_port);
+			return true;
+		}
+		case AF_INET6:
+		{
+			auto sin = reinterpret_cast<const sockaddr_in6 *>(&a_Addr);
+			evutil_inet_ntop(AF_INET6, &sin->sin6_addr, a_Host, a_HostSize);
+			a_Port = ntohs(sin->sin6_port);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+
+
 /** Converts a_SrcAddr in IPv4 format to a_DstAddr in IPv6 format (using IPv4-mapped IPv6). */
 static void ConvertIPv4ToMappedIPv6(sockaddr_in & a_SrcAddr, sockaddr_in6 & a_DstAddr)
 {
@@ -262,57 +305,233 @@ bool cUDPEndpointImpl::Send(const AString & a_Payload, const AString & a_Host, U
 {
 	// If a_Host is an IP address, send the data directly:
 	sockaddr_storage sa;
-	int salen = static_cast<int>(sizeof(sa));
-	memset(&sa, 0, sizeof(sa));
-	if (evutil_parse_sockaddr_port(a_Host.c_str(), reinterpret_cast<sockaddr *>(&sa), &salen) != 0)
+	socklen_t salen;
+	evutil_socket_t Sock;
+	if (!PrepareAddress(a_Host, a_Port, sa, salen, Sock))
 	{
 		// a_Host is a hostname, we need to do a lookup first:
 		auto queue = std::make_shared<cUDPSendAfterLookup>(a_Payload, a_Port, m_MainSock, m_SecondarySock, m_IsMainSockIPv6);
 		return cNetwork::HostnameToIP(a_Host, queue);
 	}
-
-	// a_Host is an IP address and has been parsed into "sa"
-	// Insert the correct port and send data:
-	int NumSent;
-	switch (sa.ss_family)
+	if (!IsValidSocket(Sock))
 	{
-		case AF_INET:
+		LOGD("UDP sendto: Invalid address family for address \"%s\".", a_Host.c_str());
+		return false;
+	}
+	auto NumSent = sendto(Sock, a_Payload.data(), static_cast<socklen_t>(a_Payload.size()), 0, reinterpret_cast<const sockaddr *>(&sa), salen);
+	return (NumSent > 0);
+}
+
+
+
+
+
+size_t cUDPEndpointImpl::SendBatch(const cOutgoingDatagrams & a_Datagrams)
+{
+	#ifndef HAS_MMSG
+		return super::SendBatch(a_Datagrams);
+	#else
+		// Collect the consecutive datagrams going out through the same socket and send them with a single sendmmsg() call:
+		std::array<mmsghdr, UDP_BATCH_SIZE> Msgs;
+		std::array<iovec, UDP_BATCH_SIZE> Iovs;
+		std::array<sockaddr_storage, UDP_BATCH_SIZE> Addrs;
+		unsigned NumMsgs = 0;
+		evutil_socket_t BatchSock = -1;
+		size_t res = 0;
+		auto Flush = [&]()
 		{
-			reinterpret_cast<sockaddr_in *>(&sa)->sin_port = htons(a_Port);
-			if (m_IsMainSockIPv6)
+			unsigned NumDone = 0;
+			while (NumDone < NumMsgs)
 			{
-				if (IsValidSocket(m_SecondarySock))
+				int NumSent = sendmmsg(BatchSock, Msgs.data() + NumDone, NumMsgs - NumDone, 0);
+				if (NumSent <= 0)
 				{
-					// The secondary socket, which is always IPv4, is present:
-					NumSent = static_cast<int>(sendto(m_SecondarySock, a_Payload.data(), static_cast<socklen_t>(a_Payload.size()), 0, reinterpret_cast<const sockaddr *>(&sa), static_cast<socklen_t>(salen)));
+					// Drop the rest of the batch, same as a failed sendto() in Send() would:
+					int err = EVUTIL_SOCKET_ERROR();
+					UNUSED_VAR(err);  // Only used by LOGD(), which is empty in release builds
+					LOGD("UDP sendmmsg failed on port %d: %d (%s)", m_Port, err, evutil_socket_error_to_string(err));
+					break;
 				}
-				else
+				NumDone += static_cast<unsigned>(NumSent);
+			}
+			res += NumDone;
+			NumMsgs = 0;
+		};
+
+		for (const auto & Datagram : a_Datagrams)
+		{
+			sockaddr_storage sa;
+			socklen_t salen;
+			evutil_socket_t Sock;
+			if (!PrepareAddress(Datagram.m_Host, Datagram.m_Port, sa, salen, Sock))
+			{
+				// A hostname, needs a lookup; Send() queues it:
+				if (Send(Datagram.m_Payload, Datagram.m_Host, Datagram.m_Port))
 				{
-					// Need to convert IPv4 to IPv6 address before sending:
-					sockaddr_in6 IPv6;
-					ConvertIPv4ToMappedIPv6(*reinterpret_cast<sockaddr_in *>(&sa), IPv6);
-					NumSent = static_cast<int>(sendto(m_MainSock, a_Payload.data(), static_cast<socklen_t>(a_Payload.size()), 0, reinterpret_cast<const sockaddr *>(&IPv6), static_cast<socklen_t>(sizeof(IPv6))));
+					res++;
 				}
+				continue;
 			}
-			else
+			if (!IsValidSocket(Sock))
+			{
+				LOGD("UDP sendmmsg: Invalid address family for address \"%s\".", Datagram.m_Host.c_str());
+				continue;
+			}
+			if ((NumMsgs > 0) && ((Sock != BatchSock) || (NumMsgs == UDP_BATCH_SIZE)))
 			{
-				NumSent = static_cast<int>(sendto(m_MainSock, a_Payload.data(), static_cast<socklen_t>(a_Payload.size()), 0, reinterpret_cast<const sockaddr *>(&sa), static_cast<socklen_t>(salen)));
+				Flush();
 			}
-			break;
+			BatchSock = Sock;
+			Addrs[NumMsgs] = sa;
+			Iovs[NumMsgs].iov_base = const_cast<char *>(Datagram.m_Payload.data());
+			Iovs[NumMsgs].iov_len = Datagram.m_Payload.size();
+			memset(&Msgs[NumMsgs], 0, sizeof(Msgs[NumMsgs]));
+			Msgs[NumMsgs].msg_hdr.msg_name = &Addrs[NumMsgs];
+			Msgs[NumMsgs].msg_hdr.msg_namelen = salen;
+			Msgs[NumMsgs].msg_hdr.msg_iov = &Iovs[NumMsgs];
+			Msgs[NumMsgs].msg_hdr.msg_iovlen = 1;
+			NumMsgs++;
+		}
+		if (NumMsgs > 0)
+		{
+			Flush();
 		}
+		return res;
+	#endif
+}
 
-		case AF_INET6:
+
+
+
+
+size_t cUDPEndpointImpl::SendToBatch(const cDatagram * a_Datagrams, size_t a_NumDatagrams, const sockaddr * a_Addr, socklen_t a_AddrLen)
+{
+	#ifndef HAS_MMSG
+		return super::SendToBatch(a_Datagrams, a_NumDatagrams, a_Addr, a_AddrLen);
+	#else
+		if (static_cast<size_t>(a_AddrLen) > sizeof(sockaddr_storage))
 		{
-			reinterpret_cast<sockaddr_in6 *>(&sa)->sin6_port = htons(a_Port);
-			NumSent = static_cast<int>(sendto(m_MainSock, a_Payload.data(), static_cast<socklen_t>(a_Payload.size()), 0, reinterpret_cast<const sockaddr *>(&sa), static_cast<socklen_t>(salen)));
-			break;
+			return 0;
 		}
-		default:
+		sockaddr_storage sa;
+		memcpy(&sa, a_Addr, static_cast<size_t>(a_AddrLen));
+		socklen_t salen = a_AddrLen;
+		evutil_socket_t Sock = PickSocket(sa, salen);
+		if (!IsValidSocket(Sock))
 		{
-			LOGD("UDP sendto: Invalid address family for address \"%s\".", a_Host.c_str());
-			return false;
+			return 0;
 		}
+
+		// All the datagrams share the address, send them in chunks of up to UDP_BATCH_SIZE:
+		std::array<mmsghdr, UDP_BATCH_SIZE> Msgs;
+		std::array<iovec, UDP_BATCH_SIZE> Iovs;
+		size_t res = 0;
+		while (res < a_NumDatagrams)
+		{
+			unsigned NumMsgs = static_cast<unsigned>(std::min(a_NumDatagrams - res, UDP_BATCH_SIZE));
+			memset(Msgs.data(), 0, sizeof(Msgs[0]) * NumMsgs);
+			for (unsigned i = 0; i < NumMsgs; i++)
+			{
+				Iovs[i].iov_base = const_cast<char *>(a_Datagrams[res + i].m_Data);
+				Iovs[i].iov_len = a_Datagrams[res + i].m_Size;
+				Msgs[i].msg_hdr.msg_name = &sa;
+				Msgs[i].msg_hdr.msg_namelen = salen;
+				Msgs[i].msg_hdr.msg_iov = &Iovs[i];
+				Msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int NumSent = sendmmsg(Sock, Msgs.data(), NumMsgs, 0);
+			if (NumSent <= 0)
+			{
+				// Drop the rest, same as a failed sendto() in SendTo() would:
+				int err = EVUTIL_SOCKET_ERROR();
+				UNUSED_VAR(err);  // Only used by LOGD(), which is empty in release builds
+				LOGD("UDP sendmmsg failed on port %d: %d (%s)", m_Port, err, evutil_socket_error_to_string(err));
+				break;
+			}
+			res += static_cast<size_t>(NumSent);
+		}
+		return res;
+	#endif
+}
+
+
+
+
+
+bool cUDPEndpointImpl::PrepareAddress(const AString & a_Host, UInt16 a_Port, sockaddr_storage & a_Addr, socklen_t & a_AddrLen, evutil_socket_t & a_Socket)
+{
+	int salen = static_cast<int>(sizeof(a_Addr));
+	memset(&a_Addr, 0, sizeof(a_Addr));
+	if (evutil_parse_sockaddr_port(a_Host.c_str(), reinterpret_cast<sockaddr *>(&a_Addr), &salen) != 0)
+	{
+		return false;
 	}
+
+	// Insert the correct port and pick the socket:
+	a_AddrLen = static_cast<socklen_t>(salen);
+	switch (a_Addr.ss_family)
+	{
+		case AF_INET:  reinterpret_cast<sockaddr_in *>(&a_Addr)->sin_port = htons(a_Port);   break;
+		case AF_INET6: reinterpret_cast<sockaddr_in6 *>(&a_Addr)->sin6_port = htons(a_Port); break;
+	}
+	a_Socket = PickSocket(a_Addr, a_AddrLen);
+	return true;
+}
+
+
+
+
+
+evutil_socket_t cUDPEndpointImpl::PickSocket(sockaddr_storage & a_Addr, socklen_t & a_AddrLen)
+{
+	switch (a_Addr.ss_family)
+	{
+		case AF_INET:
+		{
+			if (!m_IsMainSockIPv6)
+			{
+				return m_MainSock;
+			}
+			if (IsValidSocket(m_SecondarySock))
+			{
+				// The secondary socket, which is always IPv4, is present:
+				return m_SecondarySock;
+			}
+
+			// Need to convert IPv4 to IPv6 address before sending:
+			sockaddr_in6 IPv6;
+			ConvertIPv4ToMappedIPv6(*reinterpret_cast<sockaddr_in *>(&a_Addr), IPv6);
+			memcpy(&a_Addr, &IPv6, sizeof(IPv6));
+			a_AddrLen = static_cast<socklen_t>(sizeof(IPv6));
+			return m_MainSock;
+		}
+		case AF_INET6:
+		{
+			return m_MainSock;
+		}
+	}
+	return -1;
+}
+
+
+
+
+
+bool cUDPEndpointImpl::SendTo(const char * a_Data, size_t a_Size, const sockaddr * a_Addr, socklen_t a_AddrLen)
+{
+	if (static_cast<size_t>(a_AddrLen) > sizeof(sockaddr_storage))
+	{
+		return false;
+	}
+	sockaddr_storage sa;
+	memcpy(&sa, a_Addr, static_cast<size_t>(a_AddrLen));
+	socklen_t salen = a_AddrLen;
+	evutil_socket_t Sock = PickSocket(sa, salen);
+	if (!IsValidSocket(Sock))
+	{
+		return false;
+	}
+	auto NumSent = sendto(Sock, a_Data, static_cast<socklen_t>(a_Size), 0, reinterpret_cast<const sockaddr *>(&sa), salen);
 	return (NumSent > 0);
 }
 
@@ -557,46 +776,91 @@ void cUDPEndpointImpl::RawCallback(evutil_socket_t a_Socket, short a_What, void
 
 
 
+char * cUDPEndpointImpl::GetRecvBuffer(void)
+{
+	static thread_local std::vector<char> RecvBuffer;
+	if (RecvBuffer.empty())
+	{
+		RecvBuffer.resize(UDP_BATCH_SIZE * UDP_SLOT_SIZE);
+	}
+	return RecvBuffer.data();
+}
+
+
+
+
+
 void cUDPEndpointImpl::Callback(evutil_socket_t a_Socket, short a_What)
 {
-	if ((a_What & EV_READ) != 0)
+	if ((a_What & EV_READ) == 0)
 	{
-		// Receive datagram from the socket:
-		char buf[64 KiB];
-		socklen_t buflen = static_cast<socklen_t>(sizeof(buf));
-		sockaddr_storage sa;
-		socklen_t salen = static_cast<socklen_t>(sizeof(sa));
-		auto len = recvfrom(a_Socket, buf, buflen, 0, reinterpret_cast<sockaddr *>(&sa), &salen);
-		if (len >= 0)
+		return;
+	}
+	char * RecvBuffer = GetRecvBuffer();
+
+	// Receive as many datagrams as are available, up to a batch:
+	std::array<sockaddr_storage, UDP_BATCH_SIZE> Addrs;
+	std::array<socklen_t, UDP_BATCH_SIZE> AddrLens;
+	std::array<size_t, UDP_BATCH_SIZE> Sizes;
+	size_t NumReceived = 0;
+	#ifdef HAS_MMSG
+		std::array<mmsghdr, UDP_BATCH_SIZE> Msgs;
+		std::array<iovec, UDP_BATCH_SIZE> Iovs;
+		memset(Msgs.data(), 0, sizeof(Msgs));
+		for (size_t i = 0; i < UDP_BATCH_SIZE; i++)
+		{
+			Iovs[i].iov_base = RecvBuffer + i * UDP_SLOT_SIZE;
+			Iovs[i].iov_len = UDP_SLOT_SIZE;
+			Msgs[i].msg_hdr.msg_name = &Addrs[i];
+			Msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(sizeof(Addrs[i]));
+			Msgs[i].msg_hdr.msg_iov = &Iovs[i];
+			Msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int NumMsgs = recvmmsg(a_Socket, Msgs.data(), static_cast<unsigned>(UDP_BATCH_SIZE), MSG_DONTWAIT, nullptr);
+		for (int i = 0; i < NumMsgs; i++)
 		{
-			// Convert the remote IP address to a string:
-			char RemoteHost[128];
-			UInt16 RemotePort;
-			switch (sa.ss_family)
+			AddrLens[i] = Msgs[i].msg_hdr.msg_namelen;
+			Sizes[i] = Msgs[i].msg_len;
+		}
+		NumReceived = (NumMsgs > 0) ? static_cast<size_t>(NumMsgs) : 0;
+	#else
+		for (; NumReceived < UDP_BATCH_SIZE; NumReceived++)
+		{
+			AddrLens[NumReceived] = static_cast<socklen_t>(sizeof(Addrs[NumReceived]));
+			auto len = recvfrom(
+				a_Socket, RecvBuffer + NumReceived * UDP_SLOT_SIZE, static_cast<socklen_t>(UDP_SLOT_SIZE), 0,
+				reinterpret_cast<sockaddr *>(&Addrs[NumReceived]), &AddrLens[NumReceived]
+			);
+			if (len < 0)
 			{
-				case AF_INET:
-				{
-					auto sin = reinterpret_cast<sockaddr_in *>(&sa);
-					evutil_inet_ntop(sa.ss_family, &sin->sin_addr, RemoteHost, sizeof(RemoteHost));
-					RemotePort = ntohs(sin->sin_port);
-					break;
-				}
-				case AF_INET6:
-				{
-					auto sin = reinterpret_cast<sockaddr_in6 *>(&sa);
-					evutil_inet_ntop(sa.ss_family, &sin->sin6_addr, RemoteHost, sizeof(RemoteHost));
-					RemotePort = ntohs(sin->sin6_port);
-					break;
-				}
-				default:
-				{
-					return;
-				}
+				// No more datagrams waiting (the socket is non-blocking)
+				break;
 			}
+			Sizes[NumReceived] = static_cast<size_t>(len);
+		}
+	#endif
 
-			// Call the callback:
-			m_Callbacks.OnReceivedData(buf, static_cast<size_t>(len), RemoteHost, RemotePort);
+	// Convert the remote addresses and report the datagrams:
+	std::array<cDatagram, UDP_BATCH_SIZE> Datagrams;
+	char RemoteHosts[UDP_BATCH_SIZE][128];
+	size_t NumDatagrams = 0;
+	for (size_t i = 0; i < NumReceived; i++)
+	{
+		auto & Datagram = Datagrams[NumDatagrams];
+		if (!FormatAddress(Addrs[i], RemoteHosts[NumDatagrams], sizeof(RemoteHosts[NumDatagrams]), Datagram.m_RemotePort))
+		{
+			continue;
 		}
+		Datagram.m_Data = RecvBuffer + i * UDP_SLOT_SIZE;
+		Datagram.m_Size = Sizes[i];
+		Datagram.m_RemoteHost = RemoteHosts[NumDatagrams];
+		Datagram.m_RemoteAddr = reinterpret_cast<const sockaddr *>(&Addrs[i]);
+		Datagram.m_RemoteAddrLen = AddrLens[i];
+		NumDatagrams++;
+	}
+	if (NumDatagrams > 0)
+	{
+		m_Callbacks.OnReceivedBatch(Datagrams.data(), NumDatagrams);
 	}
 }
 
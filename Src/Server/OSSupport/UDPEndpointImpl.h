@@ -42,6 +42,9 @@ public:
 	virtual bool IsOpen(void) const override;
 	virtual UInt16 GetPort(void) const override;
 	virtual bool Send(const AString & a_Payload, const AString & a_Host, UInt16 a_Port) override;
+	virtual bool SendTo(const char * a_Data, size_t a_Size, const sockaddr * a_Addr, socklen_t a_AddrLen) override;
+	virtual size_t SendBatch(const cOutgoingDatagrams & a_Datagrams) override;
+	virtual size_t SendToBatch(const cDatagram * a_Datagrams, size_t a_NumDatagrams, const sockaddr * a_Addr, socklen_t a_AddrLen) override;
 	virtual void EnableBroadcasts(void) override;
 
 protected:
@@ -64,7 +67,6 @@ protected:
 	/** The LibEvent handle for the secondary socket. */
 	event * m_SecondaryEvent;
 
-
 	/** Creates and opens the socket on the specified port.
 	If a_Port is 0, the OS is free to assign any port number it likes to the endpoint.
 	If the opening fails, the OnError() callback is called and the endpoint is left "closed" (IsOpen() returns false). */
@@ -74,8 +76,24 @@ protected:
 	Calls Callback() on a_Self. */
 	static void RawCallback(evutil_socket_t a_Socket, short a_What, void * a_Self);
 
-	/** The callback that is called when an event occurs on one of the sockets. */
+	/** Returns the buffer into which the datagrams are received, a slot of the maximum datagram size for each datagram in a batch.
+	The buffer is shared by all the endpoints serviced by the calling thread, so that the memory doesn't grow with
+	the number of endpoints; the received data is only valid until the callbacks return anyway.
+	Allocated on the first read in each thread. */
+	static char * GetRecvBuffer(void);
+
+	/** The callback that is called when an event occurs on one of the sockets.
+	Receives all the datagrams available, up to a batch, and reports them through OnReceivedBatch(). */
 	void Callback(evutil_socket_t a_Socket, short a_What);
+
+	/** Parses a_Host as an IP address and picks the socket through which to send to it, converting the address if needed.
+	Returns false if a_Host is not an IP address (a hostname lookup is needed).
+	If the address family is not supported, a_Socket is set to an invalid socket. */
+	bool PrepareAddress(const AString & a_Host, UInt16 a_Port, sockaddr_storage & a_Addr, socklen_t & a_AddrLen, evutil_socket_t & a_Socket);
+
+	/** Returns the socket through which to send to a_Addr, converting the address if needed (IPv4 to IPv4-mapped IPv6).
+	Returns an invalid socket if the address family is not supported. */
+	evutil_socket_t PickSocket(sockaddr_storage & a_Addr, socklen_t & a_AddrLen);
 };
 
 
@@ -0,0 +1,163 @@
+
+// PresenceEngine.cpp
+
+// Implements the cPresenceEngine class that batches the users' presence changes and broadcasts them once per tick
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "PresenceEngine.h"
+#include "ClientRegistry.h"
+#include "ClientHandle.h"
+
+
+
+
+
+/** The highest presence state that is considered online (cClientHandle::csWorking); the clients use the same limit. */
+static const UInt32 MAX_ONLINE_STATE = 3;
+
+
+
+
+
+cPresenceEngine::cPresenceEngine(void):
+	m_NumChanges(0),
+	m_NumCoalesced(0),
+	m_NumDropped(0),
+	m_NumDeltaPackets(0),
+	m_NumDeltaEntries(0),
+	m_NumSnapshots(0),
+	m_NumSnapshotEntries(0),
+	m_RosterSize(0)
+{
+}
+
+
+
+
+
+void cPresenceEngine::UserChanged(UInt32 a_ID, const AString & a_Name, UInt32 a_State)
+{
+	m_NumChanges.fetch_add(1, std::memory_order_relaxed);
+
+	cCSLock Lock(m_CS);
+	auto itr = m_PendingChanges.find(a_ID);
+	if (itr != m_PendingChanges.end())
+	{
+		// Replace the change not sent yet, the clients only need the latest one:
+		itr->second = cPresenceEntry(a_ID, a_Name, a_State);
+		m_NumCoalesced.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	m_PendingChanges.emplace(a_ID, cPresenceEntry(a_ID, a_Name, a_State));
+}
+
+
+
+
+
+void cPresenceEngine::Tick(cClientRegistry & a_Clients)
+{
+	cEntryMap Changes;
+	{
+		cCSLock Lock(m_CS);
+		if (m_PendingChanges.empty())
+		{
+			return;
+		}
+		std::swap(Changes, m_PendingChanges);
+	}
+
+	// Apply the changes to the roster, collect the ones the clients need to know about:
+	cPresenceEntries Delta;
+	std::set<UInt32> NewUsers;
+	for (const auto & Change : Changes)
+	{
+		const auto & Entry = Change.second;
+		auto itr = m_Roster.find(Entry.m_ID);
+		if (Entry.m_State <= MAX_ONLINE_STATE)
+		{
+			if (itr == m_Roster.end())
+			{
+				m_Roster.emplace(Entry.m_ID, Entry);
+				NewUsers.insert(Entry.m_ID);
+			}
+			else
+			{
+				itr->second = Entry;
+			}
+		}
+		else
+		{
+			if (itr == m_Roster.end())
+			{
+				// Nobody has seen this user online, no need to tell anyone they're gone
+				m_NumDropped.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			m_Roster.erase(itr);
+		}
+		Delta.push_back(Entry);
+	}
+	m_RosterSize = m_Roster.size();
+	if (Delta.empty())
+	{
+		return;
+	}
+
+	// The new users will need the full roster:
+	if (!NewUsers.empty())
+	{
+		m_RosterSnapshot.clear();
+		m_RosterSnapshot.reserve(m_Roster.size());
+		for (const auto & Entry : m_Roster)
+		{
+			m_RosterSnapshot.push_back(Entry.second);
+		}
+	}
+
+	// Send the roster to the new users and the delta to everyone else in the roster:
+	a_Clients.ForEachClient([&](const cClientHandlePtr & a_Client)
+		{
+			auto ID = static_cast<UInt32>(a_Client->GetUniqueID());
+			if (NewUsers.find(ID) != NewUsers.end())
+			{
+				auto NumEntries = a_Client->SendPresence(m_RosterSnapshot, true);
+				m_NumSnapshots.fetch_add(1, std::memory_order_relaxed);
+				m_NumSnapshotEntries.fetch_add(NumEntries, std::memory_order_relaxed);
+			}
+			else if (m_Roster.find(ID) != m_Roster.end())
+			{
+				auto NumEntries = a_Client->SendPresence(Delta, false);
+				if (NumEntries > 0)
+				{
+					m_NumDeltaPackets.fetch_add(1, std::memory_order_relaxed);
+					m_NumDeltaEntries.fetch_add(NumEntries, std::memory_order_relaxed);
+				}
+			}
+			return false;
+		}
+	);
+}
+
+
+
+
+
+cPresenceEngine::cStats cPresenceEngine::GetStats(void)
+{
+	cStats res;
+	res.m_NumChanges         = m_NumChanges.load(std::memory_order_relaxed);
+	res.m_NumCoalesced       = m_NumCoalesced.load(std::memory_order_relaxed);
+	res.m_NumDropped         = m_NumDropped.load(std::memory_order_relaxed);
+	res.m_NumDeltaPackets    = m_NumDeltaPackets.load(std::memory_order_relaxed);
+	res.m_NumDeltaEntries    = m_NumDeltaEntries.load(std::memory_order_relaxed);
+	res.m_NumSnapshots       = m_NumSnapshots.load(std::memory_order_relaxed);
+	res.m_NumSnapshotEntries = m_NumSnapshotEntries.load(std::memory_order_relaxed);
+	res.m_RosterSize         = m_RosterSize.load(std::memory_order_relaxed);
+	return res;
+}
+
+
+
+
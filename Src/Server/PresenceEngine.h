@@ -0,0 +1,122 @@
+
+// PresenceEngine.h
+
+// Interfaces to the cPresenceEngine class that batches the users' presence changes and broadcasts them once per tick
+
+
+
+
+
+#pragma once
+
+#include <atomic>
+
+
+
+
+
+// fwd:
+class cClientRegistry;
+
+
+
+
+
+/** A single user's presence, as sent to the clients. */
+struct cPresenceEntry
+{
+	UInt32 m_ID;
+	AString m_Name;
+
+	/** The cClientHandle::eState of the user; the clients treat anything above csWorking as offline. */
+	UInt32 m_State;
+
+	cPresenceEntry(UInt32 a_ID, const AString & a_Name, UInt32 a_State):
+		m_ID(a_ID),
+		m_Name(a_Name),
+		m_State(a_State)
+	{
+	}
+};
+
+typedef std::vector<cPresenceEntry> cPresenceEntries;
+
+
+
+
+
+/** Collects the users' presence changes from any thread and sends them out in batches from the tick thread.
+Each tick, every user that already has the roster receives a single delta packet with all the changes since the
+last tick (several changes of the same user coalesced into the last one); each newly authenticated user receives
+a single roster snapshot instead. This keeps a login storm of N users at O(N) packets per tick instead of O(N^2). */
+class cPresenceEngine
+{
+public:
+	/** Counters describing the engine's work, as reported by GetStats(). */
+	struct cStats
+	{
+		/** Number of presence changes reported through UserChanged(). */
+		UInt64 m_NumChanges;
+
+		/** Number of changes that replaced a not-yet-sent change of the same user. */
+		UInt64 m_NumCoalesced;
+
+		/** Number of changes that were dropped because nobody has seen the user online (logged in and out within a tick). */
+		UInt64 m_NumDropped;
+
+		/** Number of delta packets sent and the total number of entries in them. */
+		UInt64 m_NumDeltaPackets;
+		UInt64 m_NumDeltaEntries;
+
+		/** Number of roster snapshots sent and the total number of entries in them. */
+		UInt64 m_NumSnapshots;
+		UInt64 m_NumSnapshotEntries;
+
+		/** Number of users currently in the roster. */
+		size_t m_RosterSize;
+	};
+
+
+	cPresenceEngine(void);
+
+	/** Records a change in the user's presence, to be sent in the next Tick(). Can be called from any thread. */
+	void UserChanged(UInt32 a_ID, const AString & a_Name, UInt32 a_State);
+
+	/** Sends the changes recorded since the last call to the clients in a_Clients.
+	Must be called from a single thread only (the tick thread). */
+	void Tick(cClientRegistry & a_Clients);
+
+	/** Returns the current counters. */
+	cStats GetStats(void);
+
+protected:
+
+	typedef std::map<UInt32, cPresenceEntry> cEntryMap;
+
+	/** Protects m_PendingChanges against multithreaded access. */
+	cCriticalSection m_CS;
+
+	/** The changes recorded since the last Tick(), by user ID. Only the latest change of each user is kept.
+	Protected by m_CS. */
+	cEntryMap m_PendingChanges;
+
+	/** The users that are online, as last sent to the clients. A client is sent deltas only if it is in the roster itself.
+	Only accessed from the tick thread. */
+	cEntryMap m_Roster;
+
+	/** The roster as a vector, for sending the snapshots; rebuilt whenever new users join. Only accessed from the tick thread. */
+	cPresenceEntries m_RosterSnapshot;
+
+	std::atomic<UInt64> m_NumChanges;
+	std::atomic<UInt64> m_NumCoalesced;
+	std::atomic<UInt64> m_NumDropped;
+	std::atomic<UInt64> m_NumDeltaPackets;
+	std::atomic<UInt64> m_NumDeltaEntries;
+	std::atomic<UInt64> m_NumSnapshots;
+	std::atomic<UInt64> m_NumSnapshotEntries;
+	std::atomic<size_t> m_RosterSize;
+};
+
+
+
+
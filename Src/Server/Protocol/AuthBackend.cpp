@@ -0,0 +1,334 @@
+
+// AuthBackend.cpp
+
+// Implements the cAuthBackend descendants representing the credential stores
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "AuthBackend.h"
+#include "ErrorCode.h"
+#include "../md5.h"
+#include "../SettingsRepositoryInterface.h"
+#include <unordered_map>
+
+
+
+
+
+/** Returns the lowercase hex MD5 hash of the string. */
+static AString MD5Hex(const AString & a_Data)
+{
+	MD5 md5;
+	md5.reset();
+	md5.update(a_Data.data(), a_Data.length());
+	return StrToLower(md5.toString());
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cAuthBackendUsernameHash:
+
+/** A stand-in backend that accepts any user whose credentials are the MD5 hash of the username.
+Provides no security at all, usable only for testing.
+Each batch may be delayed, simulating the round trip to a remote credential store (for the benchmarks).
+The delayed asynchronous batches are completed by the backend's own thread, the way a remote store's client library
+would complete them once the answers arrive; all batches take the same time, so they complete in the order they started. */
+class cAuthBackendUsernameHash :
+	public cAuthBackend
+{
+public:
+	cAuthBackendUsernameHash(std::chrono::milliseconds a_SimulatedLatency) :
+		m_SimulatedLatency(a_SimulatedLatency),
+		m_ShouldTerminate(false)
+	{
+		if (m_SimulatedLatency.count() > 0)
+		{
+			m_Thread = std::thread(&cAuthBackendUsernameHash::CompleteDelayedBatches, this);
+		}
+	}
+
+
+	virtual ~cAuthBackendUsernameHash() override
+	{
+		if (!m_Thread.joinable())
+		{
+			return;
+		}
+		{
+			cCSLock Lock(m_CS);
+			m_ShouldTerminate = true;
+		}
+		m_BatchAdded.Set();
+		m_Thread.join();
+	}
+
+
+	virtual void VerifyBatch(cRequests & a_Requests) override
+	{
+		if (m_SimulatedLatency.count() > 0)
+		{
+			std::this_thread::sleep_for(m_SimulatedLatency);
+		}
+		Verify(a_Requests);
+	}
+
+
+	virtual void VerifyBatchAsync(cRequests && a_Requests, cCompletionHandler a_Handler) override
+	{
+		if (!m_Thread.joinable())
+		{
+			Verify(a_Requests);
+			a_Handler(a_Requests);
+			return;
+		}
+		{
+			cCSLock Lock(m_CS);
+			m_DelayedBatches.push_back(cDelayedBatch{std::chrono::steady_clock::now() + m_SimulatedLatency, std::move(a_Requests), std::move(a_Handler)});
+		}
+		m_BatchAdded.Set();
+	}
+
+protected:
+
+	/** A batch started by VerifyBatchAsync(), waiting for its simulated round trip to pass. */
+	struct cDelayedBatch
+	{
+		std::chrono::steady_clock::time_point m_CompletionTime;
+		cRequests m_Requests;
+		cCompletionHandler m_Handler;
+	};
+
+
+	/** The time each batch waits before being verified. */
+	std::chrono::milliseconds m_SimulatedLatency;
+
+	/** Protects m_DelayedBatches and m_ShouldTerminate. */
+	cCriticalSection m_CS;
+
+	/** The asynchronous batches not yet completed, in the order of their completion time. */
+	std::deque<cDelayedBatch> m_DelayedBatches;
+
+	/** Set in the destructor to make m_Thread complete the remaining batches and terminate. */
+	bool m_ShouldTerminate;
+
+	/** Set whenever a batch is added to m_DelayedBatches, and on termination. */
+	cEvent m_BatchAdded;
+
+	/** The thread completing the asynchronous batches; only running if there is a simulated latency. */
+	std::thread m_Thread;
+
+
+	/** Fills in the results of the requests. */
+	static void Verify(cRequests & a_Requests)
+	{
+		for (auto & Request : a_Requests)
+		{
+			Request.m_Result = (MD5Hex(Request.m_UserName) == Request.m_Password) ? ERROR_CODE_ACCOUNT_AUTH_OK : ERROR_CODE_ACCOUNT_NOT_MATCH;
+		}
+	}
+
+
+	/** Completes the delayed batches once their time comes. Runs in m_Thread until m_ShouldTerminate is set;
+	the batches still waiting at that point are completed right away, so that no caller waits forever. */
+	void CompleteDelayedBatches(void)
+	{
+		cCSLock Lock(m_CS);
+		for (;;)
+		{
+			if (m_DelayedBatches.empty())
+			{
+				if (m_ShouldTerminate)
+				{
+					return;
+				}
+				cCSUnlock Unlock(Lock);
+				m_BatchAdded.Wait();
+				continue;
+			}
+			auto Wait = m_DelayedBatches.front().m_CompletionTime - std::chrono::steady_clock::now();
+			if (!m_ShouldTerminate && (Wait.count() > 0))
+			{
+				cCSUnlock Unlock(Lock);
+				std::this_thread::sleep_for(Wait);
+				continue;
+			}
+			auto Batch = std::move(m_DelayedBatches.front());
+			m_DelayedBatches.pop_front();
+			cCSUnlock Unlock(Lock);
+			Verify(Batch.m_Requests);
+			Batch.m_Handler(Batch.m_Requests);
+		}
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cAuthBackendFile:
+
+/** A backend storing the users in a local CSV file, a stand-in for the users table of a database.
+The file is named after the [Authentication] Table setting, with ".csv" appended. Its first line names the columns;
+the columns named by the [Authentication] Username, Password and Salt settings are used, plus an optional "uuid" column.
+The Password column holds the lowercase hex MD5 hash of the client's credentials followed by the salt.
+Usernames are matched case-insensitively.
+The file is loaded once, when the backend is created; the loaded users are only read afterwards, so VerifyBatch()
+needs no locking. */
+class cAuthBackendFile :
+	public cAuthBackend
+{
+public:
+	cAuthBackendFile(const AString & a_FileName, const AString & a_UserNameColumn, const AString & a_PasswordColumn, const AString & a_SaltColumn)
+	{
+		Load(a_FileName, a_UserNameColumn, a_PasswordColumn, a_SaltColumn);
+	}
+
+
+	virtual void VerifyBatch(cRequests & a_Requests) override
+	{
+		for (auto & Request : a_Requests)
+		{
+			auto itr = m_Users.find(StrToLower(Request.m_UserName));
+			if (itr == m_Users.end())
+			{
+				Request.m_Result = ERROR_CODE_ACCOUNT_NOT_EXIST;
+				continue;
+			}
+			const auto & User = itr->second;
+			if (MD5Hex(Request.m_Password + User.m_Salt) != User.m_PasswordHash)
+			{
+				Request.m_Result = ERROR_CODE_ACCOUNT_NOT_MATCH;
+				continue;
+			}
+			Request.m_Result = ERROR_CODE_ACCOUNT_AUTH_OK;
+			Request.m_UserName = User.m_UserName;
+			Request.m_UUID = User.m_UUID;
+		}
+	}
+
+protected:
+
+	struct cUser
+	{
+		/** The username, as written in the file (the case-corrected name). */
+		AString m_UserName;
+
+		/** The lowercase hex MD5 of the credentials followed by the salt. */
+		AString m_PasswordHash;
+
+		AString m_Salt;
+		AString m_UUID;
+	};
+
+	/** The users, by their lowercased username. */
+	std::unordered_map<AString, cUser> m_Users;
+
+
+	/** Loads the users from the specified file. Logs a warning if the file cannot be read. */
+	void Load(const AString & a_FileName, const AString & a_UserNameColumn, const AString & a_PasswordColumn, const AString & a_SaltColumn)
+	{
+		AString Contents = cFile::ReadWholeFile(a_FileName);
+		if (Contents.empty())
+		{
+			LOGWARNING("Cannot read the users file \"%s\", nobody will be able to log in.", a_FileName.c_str());
+			return;
+		}
+		AStringVector Lines = StringSplit(Contents, "\n");
+
+		// Find the columns in the header line:
+		AStringVector Header = StringSplitAndTrim(Lines[0], ",");
+		size_t UserNameCol = FindColumn(Header, a_UserNameColumn);
+		size_t PasswordCol = FindColumn(Header, a_PasswordColumn);
+		size_t SaltCol = FindColumn(Header, a_SaltColumn);
+		size_t UUIDCol = FindColumn(Header, "uuid");
+		if ((UserNameCol == AString::npos) || (PasswordCol == AString::npos))
+		{
+			LOGWARNING("The users file \"%s\" doesn't have the \"%s\" and \"%s\" columns, nobody will be able to log in.",
+				a_FileName.c_str(), a_UserNameColumn.c_str(), a_PasswordColumn.c_str()
+			);
+			return;
+		}
+
+		for (size_t i = 1; i < Lines.size(); i++)
+		{
+			AStringVector Values = StringSplitAndTrim(Lines[i], ",");
+			if ((Values.size() <= UserNameCol) || (Values.size() <= PasswordCol) || Values[UserNameCol].empty())
+			{
+				// An empty or malformed line
+				continue;
+			}
+			cUser User;
+			User.m_UserName = Values[UserNameCol];
+			User.m_PasswordHash = StrToLower(Values[PasswordCol]);
+			if (SaltCol < Values.size())
+			{
+				User.m_Salt = Values[SaltCol];
+			}
+			if (UUIDCol < Values.size())
+			{
+				User.m_UUID = Values[UUIDCol];
+			}
+			m_Users[StrToLower(User.m_UserName)] = std::move(User);
+		}
+		LOG("Loaded %u users from \"%s\"", static_cast<unsigned>(m_Users.size()), a_FileName.c_str());
+	}
+
+
+	/** Returns the index of the column of the specified name (case-insensitive), or AString::npos if not present. */
+	static size_t FindColumn(const AStringVector & a_Header, const AString & a_Name)
+	{
+		for (size_t i = 0; i < a_Header.size(); i++)
+		{
+			if (NoCaseCompare(a_Header[i], a_Name) == 0)
+			{
+				return i;
+			}
+		}
+		return AString::npos;
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cAuthBackend:
+
+void cAuthBackend::VerifyBatchAsync(cRequests && a_Requests, cCompletionHandler a_Handler)
+{
+	VerifyBatch(a_Requests);
+	a_Handler(a_Requests);
+}
+
+
+
+
+
+std::unique_ptr<cAuthBackend> cAuthBackend::Create(cSettingsRepositoryInterface & a_Settings)
+{
+	AString Backend = a_Settings.GetValueSet("Authentication", "Backend", "UsernameHash");
+	if (NoCaseCompare(Backend, "UsernameHash") == 0)
+	{
+		LOGWARNING("Authentication uses the UsernameHash backend, which provides no security. Set [Authentication] Backend=File for real accounts.");
+		auto SimulatedLatency = std::chrono::milliseconds(std::max(a_Settings.GetValueSetI("Authentication", "SimulatedLatencyMsec", 0), 0));
+		return std::unique_ptr<cAuthBackend>(new cAuthBackendUsernameHash(SimulatedLatency));
+	}
+	if (NoCaseCompare(Backend, "File") != 0)
+	{
+		LOGWARNING("Unknown authentication backend \"%s\", using the File backend.", Backend.c_str());
+	}
+	AString Table    = a_Settings.GetValueSet("Authentication", "Table", "tb_users");
+	AString UserName = a_Settings.GetValueSet("Authentication", "Username", "username");
+	AString Password = a_Settings.GetValueSet("Authentication", "Password", "password");
+	AString Salt     = a_Settings.GetValueSet("Authentication", "Salt", "salt");
+	return std::unique_ptr<cAuthBackend>(new cAuthBackendFile(Table + ".csv", UserName, Password, Salt));
+}
+
+
+
+
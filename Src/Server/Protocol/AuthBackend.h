@@ -0,0 +1,88 @@
+
+// AuthBackend.h
+
+// Interfaces to the cAuthBackend class representing the credential store against which cAuthenticator verifies the users
+
+
+
+
+
+#pragma once
+
+#include "json/json.h"
+#include <functional>
+
+
+
+
+
+// fwd:
+class cSettingsRepositoryInterface;
+
+
+
+
+
+/** The interface to a credential store.
+The backend verifies the requests in batches, so that a remote store can verify all the users waiting for
+authentication in a single round trip. VerifyBatchAsync() only starts the verification and lets a completion handler
+finish the batch, so that a single caller may have several round trips in flight; VerifyBatch() blocks until the whole
+batch is verified. Both are called from the authenticator's worker threads, possibly from several of them at once,
+so the implementations must be thread-safe. */
+class cAuthBackend
+{
+public:
+	/** A single user to be verified. */
+	struct cRequest
+	{
+		/** The username, as sent by the client; the backend may replace it with the case-corrected name. */
+		AString m_UserName;
+
+		/** The credentials, as sent by the client. */
+		AString m_Password;
+
+		/** The ERROR_CODE_XXX result of the verification, filled in by the backend. */
+		int m_Result;
+
+		/** The user's UUID and properties, filled in by the backend for the successfully verified users. */
+		AString m_UUID;
+		Json::Value m_Properties;
+
+		cRequest(const AString & a_UserName, const AString & a_Password) :
+			m_UserName(a_UserName),
+			m_Password(a_Password),
+			m_Result(0)
+		{
+		}
+	};
+
+	typedef std::vector<cRequest> cRequests;
+
+	/** Called once a batch started by VerifyBatchAsync() is verified, with its requests filled in. */
+	typedef std::function<void(cRequests & a_Requests)> cCompletionHandler;
+
+
+	// Force a virtual destructor in all descendants:
+	virtual ~cAuthBackend() {}
+
+	/** Verifies all the requests, filling in their m_Result (and the user's details on success). Blocks until done. */
+	virtual void VerifyBatch(cRequests & a_Requests) = 0;
+
+	/** Starts verifying the requests and calls a_Handler with them once they are verified.
+	A remote store returns right away and calls the handler from its own thread once the answer arrives;
+	the handler may also be called before this function returns.
+	The default implementation verifies the batch synchronously through VerifyBatch(). */
+	virtual void VerifyBatchAsync(cRequests && a_Requests, cCompletionHandler a_Handler);
+
+	/** Creates the backend selected by the [Authentication] Backend setting:
+	"File" - the users are stored in a CSV file (see the cAuthBackendFile class for details);
+	"UsernameHash" - the credentials must be the MD5 hash of the username (for testing only); each batch is delayed
+	by the [Authentication] SimulatedLatencyMsec setting, simulating a remote store's round trip; the asynchronous
+	batches complete on the backend's own thread, so that they don't block the caller meanwhile.
+	Unknown values fall back to "File". */
+	static std::unique_ptr<cAuthBackend> Create(cSettingsRepositoryInterface & a_Settings);
+};
+
+
+
+
@@ -0,0 +1,215 @@
+
+// AuthCache.cpp
+
+// Implements the cAuthCache class representing a bounded LRU cache of the users' authentication results
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "AuthCache.h"
+#include "ErrorCode.h"
+#include "../md5.h"
+
+
+
+
+
+cAuthCache::cAuthCache(void) :
+	m_MaxSize(10000),
+	m_PositiveTTL(std::chrono::seconds(300)),
+	m_NegativeTTL(std::chrono::seconds(30)),
+	m_Generation(0),
+	m_ClearedGeneration(0),
+	m_NumHits(0),
+	m_NumMisses(0),
+	m_NumExpired(0),
+	m_NumEvictions(0),
+	m_NumOutdated(0)
+{
+}
+
+
+
+
+
+void cAuthCache::SetLimits(size_t a_MaxSize, std::chrono::seconds a_PositiveTTL, std::chrono::seconds a_NegativeTTL)
+{
+	cCSLock Lock(m_CS);
+	m_MaxSize = a_MaxSize;
+	m_PositiveTTL = a_PositiveTTL;
+	m_NegativeTTL = a_NegativeTTL;
+	EvictDownTo(m_MaxSize);
+}
+
+
+
+
+
+bool cAuthCache::Lookup(const AString & a_UserName, const AString & a_Password, cResult & a_Result, UInt64 & a_Generation)
+{
+	AString Key = MakeKey(a_UserName, a_Password);
+	cCSLock Lock(m_CS);
+	a_Generation = m_Generation;
+	auto itr = m_Index.find(Key);
+	if (itr == m_Index.end())
+	{
+		m_NumMisses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	auto Entry = itr->second;
+	if (Entry->m_ExpireTime < std::chrono::steady_clock::now())
+	{
+		m_Index.erase(itr);
+		m_Entries.erase(Entry);
+		m_NumExpired.fetch_add(1, std::memory_order_relaxed);
+		m_NumMisses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Move the entry to the front, as the most recently used:
+	m_Entries.splice(m_Entries.begin(), m_Entries, Entry);
+	a_Result = Entry->m_Result;
+	m_NumHits.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+
+
+
+
+bool cAuthCache::Store(const AString & a_UserName, const AString & a_Password, const cResult & a_Result, UInt64 a_Generation)
+{
+	AString Key = MakeKey(a_UserName, a_Password);
+	AString LowerUserName = StrToLower(a_UserName);
+	cCSLock Lock(m_CS);
+	if (m_MaxSize == 0)
+	{
+		return false;
+	}
+
+	// Drop the result if the user has been invalidated while it was being checked:
+	auto Invalidated = m_InvalidatedGenerations.find(LowerUserName);
+	if (
+		(a_Generation < m_ClearedGeneration) ||
+		((Invalidated != m_InvalidatedGenerations.end()) && (a_Generation < Invalidated->second))
+	)
+	{
+		m_NumOutdated.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	auto TTL = (a_Result.m_Result == ERROR_CODE_ACCOUNT_AUTH_OK) ? m_PositiveTTL : m_NegativeTTL;
+	auto ExpireTime = std::chrono::steady_clock::now() + TTL;
+
+	auto itr = m_Index.find(Key);
+	if (itr != m_Index.end())
+	{
+		// Replace the existing entry (another worker checked the same credentials at the same time, or the result changed):
+		auto Entry = itr->second;
+		Entry->m_Result = a_Result;
+		Entry->m_ExpireTime = ExpireTime;
+		m_Entries.splice(m_Entries.begin(), m_Entries, Entry);
+		return true;
+	}
+
+	EvictDownTo(m_MaxSize - 1);
+	m_Entries.emplace_front();
+	auto & Entry = m_Entries.front();
+	Entry.m_Key = Key;
+	Entry.m_UserName = a_UserName;
+	Entry.m_Result = a_Result;
+	Entry.m_ExpireTime = ExpireTime;
+	m_Index[std::move(Key)] = m_Entries.begin();
+	return true;
+}
+
+
+
+
+
+size_t cAuthCache::Invalidate(const AString & a_UserName)
+{
+	AString LowerUserName = StrToLower(a_UserName);
+	cCSLock Lock(m_CS);
+	m_Generation += 1;
+	m_InvalidatedGenerations[LowerUserName] = m_Generation;
+	size_t res = 0;
+	for (auto itr = m_Entries.begin(); itr != m_Entries.end();)
+	{
+		if (NoCaseCompare(itr->m_UserName, a_UserName) == 0)
+		{
+			m_Index.erase(itr->m_Key);
+			itr = m_Entries.erase(itr);
+			res += 1;
+		}
+		else
+		{
+			++itr;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+void cAuthCache::Clear(void)
+{
+	cCSLock Lock(m_CS);
+	m_Generation += 1;
+	m_ClearedGeneration = m_Generation;
+	m_InvalidatedGenerations.clear();
+	m_Index.clear();
+	m_Entries.clear();
+}
+
+
+
+
+
+cAuthCache::cStats cAuthCache::GetStats(void)
+{
+	cStats res;
+	res.m_NumHits      = m_NumHits.load(std::memory_order_relaxed);
+	res.m_NumMisses    = m_NumMisses.load(std::memory_order_relaxed);
+	res.m_NumExpired   = m_NumExpired.load(std::memory_order_relaxed);
+	res.m_NumEvictions = m_NumEvictions.load(std::memory_order_relaxed);
+	res.m_NumOutdated  = m_NumOutdated.load(std::memory_order_relaxed);
+	cCSLock Lock(m_CS);
+	res.m_Size = m_Entries.size();
+	res.m_MaxSize = m_MaxSize;
+	return res;
+}
+
+
+
+
+
+AString cAuthCache::MakeKey(const AString & a_UserName, const AString & a_Password)
+{
+	// The username can't contain a NUL, so the key is unambiguous:
+	MD5 md5(a_Password);
+	AString res(a_UserName);
+	res.push_back('\0');
+	res.append(reinterpret_cast<const char *>(md5.digest()), 16);
+	return res;
+}
+
+
+
+
+
+void cAuthCache::EvictDownTo(size_t a_MaxSize)
+{
+	ASSERT(m_CS.IsLockedByCurrentThread());
+
+	while (m_Entries.size() > a_MaxSize)
+	{
+		m_Index.erase(m_Entries.back().m_Key);
+		m_Entries.pop_back();
+		m_NumEvictions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+
+
+
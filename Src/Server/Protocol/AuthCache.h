@@ -0,0 +1,149 @@
+
+// AuthCache.h
+
+// Interfaces to the cAuthCache class representing a bounded LRU cache of the users' authentication results
+
+
+
+
+
+#pragma once
+
+#include "json/json.h"
+#include <list>
+#include <unordered_map>
+#include <atomic>
+
+
+
+
+
+/** Remembers the results of the credential checks, so that a client reconnecting with the same credentials
+doesn't need another round trip to the credential store.
+The entries are keyed by the username and a digest of the credentials, so a changed password never hits a stale entry.
+Both the positive and the negative results are cached, each with its own time-to-live; when the cache is full,
+the least recently used entry is evicted.
+A check that was started before its user got invalidated must not store its (possibly stale) result afterwards;
+Lookup() therefore hands out the cache's generation, and Store() drops the result if the user has been invalidated
+(or the cache cleared) in a later generation.
+All the functions are thread-safe, the authenticator's workers use the cache concurrently. */
+class cAuthCache
+{
+public:
+	/** The cached result of a single credential check, as returned by the credential backend. */
+	struct cResult
+	{
+		/** The ERROR_CODE_XXX result of the check. */
+		int m_Result;
+
+		/** The case-corrected username, the UUID and the properties, valid only for a successful check. */
+		AString m_UserName;
+		AString m_UUID;
+		Json::Value m_Properties;
+	};
+
+	/** Counters describing the cache's work, as reported by GetStats(). */
+	struct cStats
+	{
+		UInt64 m_NumHits;
+		UInt64 m_NumMisses;
+
+		/** Number of lookups that found an entry, but it had already expired. Included in m_NumMisses. */
+		UInt64 m_NumExpired;
+
+		/** Number of entries evicted to make room for new ones. */
+		UInt64 m_NumEvictions;
+
+		/** Number of results not stored, because their user had been invalidated while they were being checked. */
+		UInt64 m_NumOutdated;
+
+		/** Number of entries currently cached, and the maximum. */
+		size_t m_Size;
+		size_t m_MaxSize;
+	};
+
+
+	cAuthCache(void);
+
+	/** Sets the maximum number of entries and their time-to-live. A zero a_MaxSize disables the cache.
+	Entries over the new limit are evicted right away. */
+	void SetLimits(size_t a_MaxSize, std::chrono::seconds a_PositiveTTL, std::chrono::seconds a_NegativeTTL);
+
+	/** Looks up the result for the specified credentials. Returns true and fills a_Result if found and not expired.
+	a_Generation receives the cache's current generation, to be passed to Store() once the credentials are checked. */
+	bool Lookup(const AString & a_UserName, const AString & a_Password, cResult & a_Result, UInt64 & a_Generation);
+
+	/** Stores the result of the check of the specified credentials, replacing any previous result.
+	a_Generation is the one returned by the Lookup() done before the check; if the user has been invalidated
+	or the cache cleared since then, the result is outdated and is dropped. Returns true if stored. */
+	bool Store(const AString & a_UserName, const AString & a_Password, const cResult & a_Result, UInt64 a_Generation);
+
+	/** Removes all the entries of the specified user (for any credentials). Returns the number of entries removed. */
+	size_t Invalidate(const AString & a_UserName);
+
+	/** Removes all the entries. */
+	void Clear(void);
+
+	/** Returns the current counters. */
+	cStats GetStats(void);
+
+protected:
+
+	struct cEntry
+	{
+		/** The key under which the entry is stored in m_Index. */
+		AString m_Key;
+
+		/** The username, for Invalidate(). */
+		AString m_UserName;
+
+		cResult m_Result;
+
+		std::chrono::steady_clock::time_point m_ExpireTime;
+	};
+
+	/** The entries, the most recently used first. */
+	typedef std::list<cEntry> cEntries;
+
+	typedef std::unordered_map<AString, cEntries::iterator> cIndex;
+
+
+	/** Protects all the members against multithreaded access (except the atomic counters). */
+	cCriticalSection m_CS;
+
+	cEntries m_Entries;
+
+	/** The entries by their key. */
+	cIndex m_Index;
+
+	size_t m_MaxSize;
+	std::chrono::steady_clock::duration m_PositiveTTL;
+	std::chrono::steady_clock::duration m_NegativeTTL;
+
+	/** The current generation, advanced by each Invalidate() and Clear(). */
+	UInt64 m_Generation;
+
+	/** The generation in which each user was last invalidated, by the lowercased username.
+	Only the users invalidated since the last Clear() are listed. */
+	std::unordered_map<AString, UInt64> m_InvalidatedGenerations;
+
+	/** The generation in which the cache was last cleared. */
+	UInt64 m_ClearedGeneration;
+
+	std::atomic<UInt64> m_NumHits;
+	std::atomic<UInt64> m_NumMisses;
+	std::atomic<UInt64> m_NumExpired;
+	std::atomic<UInt64> m_NumEvictions;
+	std::atomic<UInt64> m_NumOutdated;
+
+
+	/** Returns the key for the specified credentials: the username and the MD5 digest of the password. */
+	static AString MakeKey(const AString & a_UserName, const AString & a_Password);
+
+	/** Removes the least recently used entries until there are at most a_MaxSize entries. The caller must hold m_CS. */
+	void EvictDownTo(size_t a_MaxSize);
+};
+
+
+
+
@@ -7,12 +7,27 @@
 #include "../Root.h"
 #include "../Server.h"
 #include "../ClientHandle.h"
-#include "../md5.h"
 #include "../IniFile.h"
 
 
+/** The time a worker waits for a request before checking for termination again. */
+static const unsigned WORKER_WAIT_MSEC = 1000;
+
+
+
+
+
 cAuthenticator::cAuthenticator(void) :
-	super("cAuthenticator")
+	m_MaxQueueSize(1024),
+	m_NumWorkers(4),
+	m_BatchSize(32),
+	m_MaxBatchesInFlight(1),
+	m_ShouldTerminate(false),
+	m_NumRequests(0),
+	m_NumRejected(0),
+	m_NumSucceeded(0),
+	m_NumFailed(0),
+	m_MaxQueueSizeSeen(0)
 {
 }
 
@@ -31,22 +46,37 @@ cAuthenticator::~cAuthenticator()
 
 void cAuthenticator::ReadSettings(cSettingsRepositoryInterface & a_Settings)
 {
-
-	m_Table		= a_Settings.GetValueSet("Authentication", "Table", "tb_users");
-	m_Username	= a_Settings.GetValueSet("Authentication", "sername", "username");
-	m_Password	= a_Settings.GetValueSet("Authentication", "Password", "password");
-	m_Salt      = a_Settings.GetValueSet("Authentication", "Salt", "salt");
+	m_Backend = cAuthBackend::Create(a_Settings);
+	m_BatchSize    = static_cast<size_t>(std::max(a_Settings.GetValueSetI("Authentication", "BatchSize", 32), 1));
+	m_NumWorkers   = static_cast<size_t>(std::max(a_Settings.GetValueSetI("Authentication", "Workers", 4), 1));
+	m_MaxBatchesInFlight = static_cast<size_t>(std::max(a_Settings.GetValueSetI("Authentication", "BatchesInFlight", 1), 1));
+	m_MaxQueueSize = static_cast<size_t>(std::max(a_Settings.GetValueSetI("Authentication", "MaxQueueSize", 1024), 1));
+	m_Cache.SetLimits(
+		static_cast<size_t>(std::max(a_Settings.GetValueSetI("Authentication", "CacheSize", 10000), 0)),
+		std::chrono::seconds(std::max(a_Settings.GetValueSetI("Authentication", "CacheTTL", 300), 0)),
+		std::chrono::seconds(std::max(a_Settings.GetValueSetI("Authentication", "CacheNegativeTTL", 30), 0))
+	);
 }
 
 
 
 
 
-void cAuthenticator::Authenticate(int a_ClientID, const AString & a_UserName, const AString & a_PassWord)
+bool cAuthenticator::Authenticate(int a_ClientID, const AString & a_UserName, const AString & a_PassWord)
 {
-	cCSLock LOCK(m_CS);
-	m_Queue.push_back(cUser(a_ClientID, a_UserName, a_PassWord));
+	{
+		cCSLock LOCK(m_CS);
+		if (m_Queue.size() >= m_MaxQueueSize)
+		{
+			m_NumRejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		m_Queue.push_back(cUser(a_ClientID, a_UserName, a_PassWord));
+		m_MaxQueueSizeSeen = std::max(m_MaxQueueSizeSeen, m_Queue.size());
+	}
+	m_NumRequests.fetch_add(1, std::memory_order_relaxed);
 	m_QueueNonempty.Set();
+	return true;
 }
 
 
@@ -57,7 +87,12 @@ void cAuthenticator::Start(cSettingsRepositoryInterface & a_Settings)
 {
 	ReadSettings(a_Settings);
 	m_ShouldTerminate = false;
-	super::Start();
+	for (size_t i = 0; i < m_NumWorkers; i++)
+	{
+		m_Workers.emplace_back(new cWorker(*this));
+		m_Workers.back()->Start();
+	}
+	LOGD("Authenticator started with %u workers", static_cast<unsigned>(m_NumWorkers));
 }
 
 
@@ -67,48 +102,133 @@ void cAuthenticator::Start(cSettingsRepositoryInterface & a_Settings)
 void cAuthenticator::Stop(void)
 {
 	m_ShouldTerminate = true;
-	m_QueueNonempty.Set();
-	Wait();
+	m_QueueNonempty.SetAll();
+	for (auto & Worker : m_Workers)
+	{
+		Worker->Wait();
+	}
+	m_Workers.clear();
+}
+
+
+
+
+
+cAuthenticator::cStats cAuthenticator::GetStats(void)
+{
+	cStats res;
+	res.m_NumRequests  = m_NumRequests.load(std::memory_order_relaxed);
+	res.m_NumRejected  = m_NumRejected.load(std::memory_order_relaxed);
+	res.m_NumSucceeded = m_NumSucceeded.load(std::memory_order_relaxed);
+	res.m_NumFailed    = m_NumFailed.load(std::memory_order_relaxed);
+	res.m_NumWorkers   = m_NumWorkers;
+	cCSLock Lock(m_CS);
+	res.m_QueueSize = m_Queue.size();
+	res.m_MaxQueueSizeSeen = m_MaxQueueSizeSeen;
+	return res;
+}
+
+
+
+
+
+void cAuthenticator::ResetStats(void)
+{
+	m_QueueLatency.Reset();
+	m_CheckLatency.Reset();
+	m_TotalLatency.Reset();
+	cCSLock Lock(m_CS);
+	m_MaxQueueSizeSeen = m_Queue.size();
 }
 
 
 
 
 
-void cAuthenticator::Execute(void)
+void cAuthenticator::ProcessQueue(void)
 {
+	// The batches this worker has started and the backend hasn't finished yet. The worker doesn't return before all
+	// its batches are finished, because their completion handlers use the authenticator; the counter and event are shared
+	// with the handlers, since the last handler still signals the event after the worker sees the counter drop to zero:
+	struct cInFlight
+	{
+		std::atomic<size_t> m_Count;
+		cEvent m_BatchFinished;
+		cInFlight(void) : m_Count(0) {}
+	};
+	auto InFlight = std::make_shared<cInFlight>();
+
 	for (;;)
 	{
+		// Wait for the backend to finish a batch, if this worker has too many in flight:
+		while (InFlight->m_Count.load() >= m_MaxBatchesInFlight)
+		{
+			InFlight->m_BatchFinished.Wait(WORKER_WAIT_MSEC);
+		}
+
+		// Take up to a batch of requests from the queue:
 		cCSLock Lock(m_CS);
 		while (!m_ShouldTerminate && (m_Queue.size() == 0))
 		{
 			cCSUnlock Unlock(Lock);
-			m_QueueNonempty.Wait();
+			m_QueueNonempty.Wait(WORKER_WAIT_MSEC);
 		}
 		if (m_ShouldTerminate)
 		{
+			Lock.Unlock();
+			while (InFlight->m_Count.load() > 0)
+			{
+				InFlight->m_BatchFinished.Wait(WORKER_WAIT_MSEC);
+			}
 			return;
 		}
 		ASSERT(!m_Queue.empty());
-
-		cAuthenticator::cUser & User = m_Queue.front();
-		int ClientID = User.m_ClientID;
-		AString UserName = User.m_Username;
-		AString Password = User.m_Password;
-		m_Queue.pop_front();
+		auto Batch = std::make_shared<cBatch>();
+		while (!m_Queue.empty() && (Batch->m_Users.size() < m_BatchSize))
+		{
+			Batch->m_Users.push_back(std::move(m_Queue.front()));
+			m_Queue.pop_front();
+		}
+		bool HasMore = !m_Queue.empty();
 		Lock.Unlock();
 
-		AString UUID;
-		Json::Value Properties;
-		int ret = AuthFromDBPoll(UserName, Password, UUID, Properties);
-		if (ret == ERROR_CODE_ACCOUNT_AUTH_OK)
+		// Several requests may have been queued while all the workers were busy, but the event only releases
+		// a single worker; pass the wakeup on to another worker:
+		if (HasMore)
 		{
-			cRoot::Get()->AuthenticateUser(ClientID, UserName, UUID, Properties);
+			m_QueueNonempty.Set();
 		}
-		else
+
+		// Use the cached results, if the same credentials have been checked recently; collect the rest for the backend:
+		auto & Users = Batch->m_Users;
+		Batch->m_CheckStart = std::chrono::steady_clock::now();
+		Batch->m_Results.resize(Users.size());
+		Batch->m_Generations.resize(Users.size());
+		cAuthBackend::cRequests Requests;
+		for (size_t i = 0; i < Users.size(); i++)
 		{
-			cRoot::Get()->KickUser(ClientID, ret);
+			m_QueueLatency.Add(Batch->m_CheckStart - Users[i].m_QueuedTime);
+			if (!m_Cache.Lookup(Users[i].m_Username, Users[i].m_Password, Batch->m_Results[i], Batch->m_Generations[i]))
+			{
+				Requests.emplace_back(Users[i].m_Username, Users[i].m_Password);
+				Batch->m_RequestUsers.push_back(i);
+			}
 		}
+		if (Requests.empty())
+		{
+			FinishBatch(*Batch, Requests);
+			continue;
+		}
+
+		// Verify all the uncached credentials in a single backend call; the backend finishes the batch when it's done:
+		InFlight->m_Count += 1;
+		m_Backend->VerifyBatchAsync(std::move(Requests), [this, Batch, InFlight](cAuthBackend::cRequests & a_Requests)
+			{
+				FinishBatch(*Batch, a_Requests);
+				InFlight->m_Count -= 1;
+				InFlight->m_BatchFinished.Set();
+			}
+		);
 	}  // for (-ever)
 }
 
@@ -116,53 +236,63 @@ void cAuthenticator::Execute(void)
 
 
 
-int cAuthenticator::AuthFromDBPoll(AString & a_UserName, const AString & a_PassWord, AString & a_UUID, Json::Value & a_Properties)
+void cAuthenticator::FinishBatch(cBatch & a_Batch, cAuthBackend::cRequests & a_Requests)
 {
- 	LOGD("Trying to authenticate user %s", a_UserName.c_str());
-
-
-	MD5 md5;
-	md5.reset();
-	md5.update((const void *)a_UserName.c_str(), a_UserName.length());
-	AString strPassWord = md5.toString();
-
-	std::transform(strPassWord.begin(), strPassWord.end(), strPassWord.begin(), ::tolower);
-
-	return strPassWord == a_PassWord;
-
-
-// 	CDBConn* pDBConn = CDBManager::Instance()->GetDBConn();
-// 	if (pDBConn)
-// 	{
-// 		AString strSql = Printf("select * from %s where %s = '%s'", 
-// 			m_Table.c_str(), m_Username.c_str(), a_UserName.c_str());
-// 		CResultSet* pResultSet = pDBConn->ExecuteQuery(strSql.c_str());
-// 		if (pResultSet)
-// 		{
-// 			while (pResultSet->Next()) {
-// 				AString strPassword = pResultSet->GetString(m_Password);
-// 				AString strSalt = pResultSet->GetString(m_Salt);
-// 
-// 				AString newStr = a_PassWord + strSalt;
-// 
-// 				MD5 md5;
-// 				md5.reset();
-// 				md5.update(newStr.c_str(), newStr.length());
-// 				newStr = md5.toString();
-// 				if (newStr.compare(strPassword) == 0)
-// 				{
-// 					return ERROR_CODE_ACCOUNT_AUTH_OK;
-// 				}
-// 				else
-// 				{
-// 					return ERROR_CODE_ACCOUNT_NOT_MATCH;
-// 				}
-// 				
-// 			}
-// 		}
-// 	}
-// 
-// 	return ERROR_CODE_ACCOUNT_NOT_EXIST;//˺Ų
+	ASSERT(a_Requests.size() == a_Batch.m_RequestUsers.size());
+	auto CheckEnd = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < a_Requests.size(); i++)
+	{
+		m_CheckLatency.Add(CheckEnd - a_Batch.m_CheckStart);
+		auto UserIdx = a_Batch.m_RequestUsers[i];
+		auto & Result = a_Batch.m_Results[UserIdx];
+		Result.m_Result = a_Requests[i].m_Result;
+		Result.m_UserName = std::move(a_Requests[i].m_UserName);
+		Result.m_UUID = std::move(a_Requests[i].m_UUID);
+		Result.m_Properties = std::move(a_Requests[i].m_Properties);
+		const auto & User = a_Batch.m_Users[UserIdx];
+		m_Cache.Store(User.m_Username, User.m_Password, Result, a_Batch.m_Generations[UserIdx]);
+	}
+
+	// Let the users in, or kick them:
+	for (size_t i = 0; i < a_Batch.m_Users.size(); i++)
+	{
+		const auto & Result = a_Batch.m_Results[i];
+		if (Result.m_Result == ERROR_CODE_ACCOUNT_AUTH_OK)
+		{
+			m_NumSucceeded.fetch_add(1, std::memory_order_relaxed);
+			cRoot::Get()->AuthenticateUser(a_Batch.m_Users[i].m_ClientID, Result.m_UserName, Result.m_UUID, Result.m_Properties);
+		}
+		else
+		{
+			m_NumFailed.fetch_add(1, std::memory_order_relaxed);
+			cRoot::Get()->KickUser(a_Batch.m_Users[i].m_ClientID, Result.m_Result);
+		}
+		m_TotalLatency.AddSince(a_Batch.m_Users[i].m_QueuedTime);
+	}
 }
 
 
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cAuthenticator::cWorker:
+
+cAuthenticator::cWorker::cWorker(cAuthenticator & a_Authenticator) :
+	super("cAuthenticator worker"),
+	m_Authenticator(a_Authenticator)
+{
+}
+
+
+
+
+
+void cAuthenticator::cWorker::Execute(void)
+{
+	m_Authenticator.ProcessQueue();
+}
+
+
+
+
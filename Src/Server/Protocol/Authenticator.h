@@ -1,10 +1,10 @@
 
 // cAuthenticator.h
 
-// Interfaces to the cAuthenticator class representing the thread that authenticates users against the official MC server
+// Interfaces to the cAuthenticator class representing the worker threads that authenticate users against the official MC server
 // Authentication prevents "hackers" from joining with an arbitrary username (possibly impersonating the server admins)
 // For more info, see http://wiki.vg/Session#Server_operation
-// In MCS, authentication is implemented as a single thread that receives queued auth requests and dispatches them one by one.
+// The requests are queued into a bounded queue and processed in parallel by a pool of worker threads.
 
 
 
@@ -13,6 +13,9 @@
 #pragma once
 
 #include "../OSSupport/IsThread.h"
+#include "LatencyHistogram.h"
+#include "AuthCache.h"
+#include "AuthBackend.h"
 
 class cSettingsRepositoryInterface;
 
@@ -30,26 +33,64 @@ namespace Json
 
 
 
-class cAuthenticator :
-	public cIsThread
+class cAuthenticator
 {
-	typedef cIsThread super;
-
 public:
+	/** Counters describing the authenticator's work, as reported by GetStats(). */
+	struct cStats
+	{
+		/** Number of requests accepted into the queue. */
+		UInt64 m_NumRequests;
+
+		/** Number of requests rejected because the queue was full. */
+		UInt64 m_NumRejected;
+
+		/** Number of requests that finished with the user authenticated, and with the user kicked. */
+		UInt64 m_NumSucceeded;
+		UInt64 m_NumFailed;
+
+		/** Number of requests currently in the queue, and the most there have been at once. */
+		size_t m_QueueSize;
+		size_t m_MaxQueueSizeSeen;
+
+		/** Number of worker threads. */
+		size_t m_NumWorkers;
+	};
+
+
 	cAuthenticator(void);
 	~cAuthenticator();
 
-	/** (Re-)read server and address from INI: */
+	/** (Re-)reads the settings from INI and creates the credential backend. Must not be called while the workers are running. */
 	void ReadSettings(cSettingsRepositoryInterface & a_Settings);
 
-	/** Queues a request for authenticating a user. If the auth fails, the user will be kicked */
-	void Authenticate(int a_ClientID, const AString & a_UserName, const AString & a_ServerHash);
+	/** Queues a request for authenticating a user. If the auth fails, the user will be kicked.
+	Returns false if the queue is full and the request has been rejected; the caller should ask the user to retry later. */
+	bool Authenticate(int a_ClientID, const AString & a_UserName, const AString & a_ServerHash);
 
-	/** Starts the authenticator thread. The thread may be started and stopped repeatedly */
+	/** Starts the worker threads. The authenticator may be started and stopped repeatedly */
 	void Start(cSettingsRepositoryInterface & a_Settings);
 
-	/** Stops the authenticator thread. The thread may be started and stopped repeatedly */
+	/** Stops the worker threads. The authenticator may be started and stopped repeatedly */
 	void Stop(void);
+
+	/** Returns the current counters. */
+	cStats GetStats(void);
+
+	/** Returns the histogram of the time the requests spent waiting in the queue. */
+	const cLatencyHistogram & GetQueueLatency(void) const { return m_QueueLatency; }
+
+	/** Returns the histogram of the time spent checking the credentials. */
+	const cLatencyHistogram & GetCheckLatency(void) const { return m_CheckLatency; }
+
+	/** Returns the histogram of the whole time from queueing the request until the user was let in or kicked. */
+	const cLatencyHistogram & GetTotalLatency(void) const { return m_TotalLatency; }
+
+	/** Resets the latency histograms and the peak queue size. */
+	void ResetStats(void);
+
+	/** Returns the cache of the credential checks' results. */
+	cAuthCache & GetCache(void) { return m_Cache; }
 	
 private:
 
@@ -60,37 +101,116 @@ private:
 		AString m_Username;
 		AString m_Password;
 
+		/** The time when the request was queued, for the latency statistics. */
+		std::chrono::steady_clock::time_point m_QueuedTime;
+
 		cUser(int a_ClientID, const AString & a_Username, const AString & a_Password) :
 			m_ClientID(a_ClientID),
 			m_Username(a_Username),
-			m_Password(a_Password)
+			m_Password(a_Password),
+			m_QueuedTime(std::chrono::steady_clock::now())
 		{
 		}
 	};
 
 	typedef std::deque<cUser> cUserList;
 
+
+	/** The requests a worker has taken from the queue at once, kept until the backend verifies them. */
+	struct cBatch
+	{
+		std::vector<cUser> m_Users;
+
+		/** The result for each user, from the cache or from the backend. */
+		std::vector<cAuthCache::cResult> m_Results;
+
+		/** The cache generation for each user, as returned by the cache lookup. */
+		std::vector<UInt64> m_Generations;
+
+		/** Index into m_Users for each request sent to the backend. */
+		std::vector<size_t> m_RequestUsers;
+
+		/** The time when the worker started checking the batch, for the latency statistics. */
+		std::chrono::steady_clock::time_point m_CheckStart;
+	};
+
+
+	/** A single thread of the worker pool, taking the requests from the shared queue. */
+	class cWorker :
+		public cIsThread
+	{
+		typedef cIsThread super;
+
+	public:
+		cWorker(cAuthenticator & a_Authenticator);
+
+	protected:
+		cAuthenticator & m_Authenticator;
+
+		// cIsThread override:
+		virtual void Execute(void) override;
+	};
+
+	typedef std::vector<std::unique_ptr<cWorker>> cWorkers;
+
+
 	cCriticalSection m_CS;
+
+	/** The requests waiting for a worker. Protected by m_CS. */
 	cUserList        m_Queue;
+
+	/** Set whenever a request is queued, releases a single waiting worker. */
 	cEvent           m_QueueNonempty;
 
+	/** The maximum number of requests in m_Queue; further requests are rejected until the workers catch up. */
+	size_t m_MaxQueueSize;
+
+	/** The worker threads. Only accessed from the thread calling Start() and Stop(). */
+	cWorkers m_Workers;
+
+	/** Number of worker threads to start in Start(). */
+	size_t m_NumWorkers;
+
+	/** The maximum number of requests a worker takes from the queue and verifies at once. */
+	size_t m_BatchSize;
+
+	/** The maximum number of batches each worker may have started in the backend and not yet finished.
+	Only an asynchronous backend lets a worker have more than one batch in flight. */
+	size_t m_MaxBatchesInFlight;
+
+	/** The credential store. Created in ReadSettings(), used by all the workers. */
+	std::unique_ptr<cAuthBackend> m_Backend;
 
-	AString m_PropertiesAddress;
+	/** Set by Stop() to make all the workers terminate. */
+	std::atomic<bool> m_ShouldTerminate;
 
-	AString m_Table;
-	AString m_Username;
-	AString m_Password;
-	AString m_Salt;
 
+	std::atomic<UInt64> m_NumRequests;
+	std::atomic<UInt64> m_NumRejected;
+	std::atomic<UInt64> m_NumSucceeded;
+	std::atomic<UInt64> m_NumFailed;
 
-	/** cIsThread override: */
-	virtual void Execute(void) override;
+	/** The most requests there have been in m_Queue at once. Protected by m_CS. */
+	size_t m_MaxQueueSizeSeen;
 
-	/** Returns true if the user authenticated okay, false on error
-	Returns the case-corrected username, UUID, and properties (eg. skin). */
-	int AuthFromDBPoll(AString & a_UserName, const AString & a_PassWord, AString & a_UUID, Json::Value & a_Properties);
+	cLatencyHistogram m_QueueLatency;
+	cLatencyHistogram m_CheckLatency;
+	cLatencyHistogram m_TotalLatency;
+
+	/** The results of the recent credential checks, consulted before checking the credentials again. */
+	cAuthCache m_Cache;
+
+
+	/** Takes the requests from the queue in batches and starts verifying them against m_Backend, until m_ShouldTerminate
+	is set; then waits for the worker's batches still in flight. Runs in each worker thread. */
+	void ProcessQueue(void);
+
+	/** Stores the backend's results of the batch into the cache, lets the users in or kicks them.
+	Called from the thread on which the backend completes the batch. */
+	void FinishBatch(cBatch & a_Batch, cAuthBackend::cRequests & a_Requests);
 };
 
 
 
 
+
@@ -0,0 +1,447 @@
+
+// CommCapture.cpp
+
+// Implements the cCommCapture class representing a binary capture of the protocol frames of all the clients
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "CommCapture.h"
+#include "../OSSupport/Socket.h"
+
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
+
+
+
+
+
+const char cCommCapture::MAGIC[8] = {'P', '2', 'P', 'C', 'A', 'P', 0, 0};
+
+/** The alignment of the records in the capture file. */
+static const size_t RECORD_ALIGNMENT = 8;
+
+
+
+
+
+/** Rounds the size up to the record alignment. */
+static size_t AlignRecordSize(size_t a_Size)
+{
+	return (a_Size + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+}
+
+
+
+
+
+/** Returns the current time in microseconds since the Unix epoch. */
+static UInt64 GetTimestamp(void)
+{
+	return static_cast<UInt64>(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count());
+}
+
+
+
+
+
+cCommCapture::cCommCapture(void) :
+	#ifdef _WIN32
+		m_File(INVALID_HANDLE_VALUE),
+		m_Mapping(nullptr),
+	#else
+		m_File(-1),
+	#endif
+	m_Data(nullptr),
+	m_Capacity(0),
+	m_WritePos(0),
+	m_NumRecords(0),
+	m_NumDropped(0)
+{
+	static_assert(sizeof(cFileHeader) == 16, "The file header must be packed");
+	static_assert(sizeof(cRecordHeader) == 24, "The record header must be packed");
+}
+
+
+
+
+
+cCommCapture::~cCommCapture()
+{
+	Close();
+}
+
+
+
+
+
+bool cCommCapture::Open(const AString & a_FileName, size_t a_Capacity)
+{
+	ASSERT(!IsOpen());
+	if (a_Capacity < sizeof(cFileHeader) + sizeof(cRecordHeader))
+	{
+		LOGWARNING("The comm capture file size %u is too small", static_cast<unsigned>(a_Capacity));
+		return false;
+	}
+
+	#ifdef _WIN32
+		m_File = CreateFileA(a_FileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_File == INVALID_HANDLE_VALUE)
+		{
+			LOGWARNING("Cannot create the comm capture file \"%s\": %d", a_FileName.c_str(), static_cast<int>(GetLastError()));
+			return false;
+		}
+		LARGE_INTEGER Size;
+		Size.QuadPart = static_cast<LONGLONG>(a_Capacity);
+		m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READWRITE, static_cast<DWORD>(Size.HighPart), Size.LowPart, nullptr);
+		if (m_Mapping != nullptr)
+		{
+			m_Data = static_cast<char *>(MapViewOfFile(m_Mapping, FILE_MAP_WRITE, 0, 0, a_Capacity));
+		}
+		if (m_Data == nullptr)
+		{
+			LOGWARNING("Cannot map the comm capture file \"%s\": %d", a_FileName.c_str(), static_cast<int>(GetLastError()));
+			if (m_Mapping != nullptr)
+			{
+				CloseHandle(m_Mapping);
+				m_Mapping = nullptr;
+			}
+			CloseHandle(m_File);
+			m_File = INVALID_HANDLE_VALUE;
+			return false;
+		}
+	#else
+		m_File = open(a_FileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (m_File < 0)
+		{
+			LOGWARNING("Cannot create the comm capture file \"%s\": %d (%s)", a_FileName.c_str(), errno, GetOSErrorString(errno).c_str());
+			return false;
+		}
+		void * Data = MAP_FAILED;
+		if (ftruncate(m_File, static_cast<off_t>(a_Capacity)) == 0)
+		{
+			Data = mmap(nullptr, a_Capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_File, 0);
+		}
+		if (Data == MAP_FAILED)
+		{
+			LOGWARNING("Cannot map the comm capture file \"%s\": %d (%s)", a_FileName.c_str(), errno, GetOSErrorString(errno).c_str());
+			close(m_File);
+			m_File = -1;
+			return false;
+		}
+		m_Data = static_cast<char *>(Data);
+	#endif
+
+	// The newly created file is all zeroes, which marks the end of the records; only the header needs writing:
+	cFileHeader Header;
+	memcpy(Header.m_Magic, MAGIC, sizeof(Header.m_Magic));
+	Header.m_Version = VERSION;
+	Header.m_HeaderSize = sizeof(Header);
+	memcpy(m_Data, &Header, sizeof(Header));
+
+	m_FileName = a_FileName;
+	m_Capacity = a_Capacity;
+	m_WritePos = sizeof(Header);
+	m_NumRecords = 0;
+	m_NumDropped = 0;
+	return true;
+}
+
+
+
+
+
+void cCommCapture::Close(void)
+{
+	if (!IsOpen())
+	{
+		return;
+	}
+	size_t Used = std::min(m_WritePos.load(), m_Capacity);
+
+	#ifdef _WIN32
+		FlushViewOfFile(m_Data, Used);
+		UnmapViewOfFile(m_Data);
+		CloseHandle(m_Mapping);
+		m_Mapping = nullptr;
+		LARGE_INTEGER Size;
+		Size.QuadPart = static_cast<LONGLONG>(Used);
+		if (SetFilePointerEx(m_File, Size, nullptr, FILE_BEGIN))
+		{
+			SetEndOfFile(m_File);
+		}
+		CloseHandle(m_File);
+		m_File = INVALID_HANDLE_VALUE;
+	#else
+		munmap(m_Data, m_Capacity);
+		if (ftruncate(m_File, static_cast<off_t>(Used)) != 0)
+		{
+			LOGWARNING("Cannot truncate the comm capture file \"%s\": %d (%s)", m_FileName.c_str(), errno, GetOSErrorString(errno).c_str());
+		}
+		close(m_File);
+		m_File = -1;
+	#endif
+
+	m_Data = nullptr;
+	LOG("Comm capture \"%s\" closed: %llu frames, %llu dropped",
+		m_FileName.c_str(), static_cast<unsigned long long>(m_NumRecords.load()), static_cast<unsigned long long>(m_NumDropped.load())
+	);
+}
+
+
+
+
+
+void cCommCapture::Capture(UInt32 a_ClientID, eDirection a_Direction, const char * a_Data, size_t a_Size)
+{
+	if (!IsOpen())
+	{
+		return;
+	}
+
+	// Reserve the space for the record:
+	size_t RecordSize = AlignRecordSize(sizeof(cRecordHeader) + a_Size);
+	size_t Pos = m_WritePos.fetch_add(RecordSize, std::memory_order_relaxed);
+	if ((Pos > m_Capacity) || (m_Capacity - Pos < RecordSize))
+	{
+		// The file is full. The space is left unwritten, its zero m_Size terminates the records for the readers.
+		m_NumDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// Write everything but the size:
+	cRecordHeader Header;
+	Header.m_Size = 0;
+	Header.m_ClientID = a_ClientID;
+	Header.m_Timestamp = GetTimestamp();
+	Header.m_DataSize = static_cast<UInt32>(a_Size);
+	Header.m_Direction = static_cast<UInt8>(a_Direction);
+	memset(Header.m_Reserved, 0, sizeof(Header.m_Reserved));
+	char * Dst = m_Data + Pos;
+	memcpy(Dst, &Header, sizeof(Header));
+	memcpy(Dst + sizeof(Header), a_Data, a_Size);
+
+	// Commit the record by writing its size:
+	UInt32 Size = static_cast<UInt32>(RecordSize);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(Dst, &Size, sizeof(Size));
+	m_NumRecords.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+
+
+
+cCommCapture::cStats cCommCapture::GetStats(void) const
+{
+	cStats res;
+	res.m_NumRecords = m_NumRecords.load(std::memory_order_relaxed);
+	res.m_NumDropped = m_NumDropped.load(std::memory_order_relaxed);
+	res.m_Used = std::min(m_WritePos.load(std::memory_order_relaxed), m_Capacity);
+	res.m_Capacity = m_Capacity;
+	return res;
+}
+
+
+
+
+
+int cCommCapture::Dump(const AString & a_FileName, const cFilter & a_Filter)
+{
+	AString Contents;
+	size_t Offset = ReadCaptureFile(a_FileName, Contents);
+	if (Offset == 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	size_t NumRecords = 0;
+	for (const cRecordHeader * Record = GetRecord(Contents, Offset); Record != nullptr; Record = GetRecord(Contents, Offset))
+	{
+		Offset += Record->m_Size;
+		if (!a_Filter.Matches(*Record))
+		{
+			continue;
+		}
+		NumRecords += 1;
+
+		// Decode the packet type, a VarInt at the start of the frame:
+		const Byte * Data = reinterpret_cast<const Byte *>(Record) + sizeof(cRecordHeader);
+		UInt32 PacketType = 0;
+		for (size_t i = 0; (i < Record->m_DataSize) && (i < 5); i++)
+		{
+			PacketType |= static_cast<UInt32>(Data[i] & 0x7f) << (7 * i);
+			if ((Data[i] & 0x80) == 0)
+			{
+				break;
+			}
+		}
+
+		time_t Seconds = static_cast<time_t>(Record->m_Timestamp / 1000000);
+		struct tm TimeInfo;
+		#ifdef _MSC_VER
+			localtime_s(&TimeInfo, &Seconds);
+		#else
+			localtime_r(&Seconds, &TimeInfo);
+		#endif
+		printf("%02d:%02d:%02d.%06u  client %6u  %s  type 0x%02x  %6u bytes\n",
+			TimeInfo.tm_hour, TimeInfo.tm_min, TimeInfo.tm_sec, static_cast<unsigned>(Record->m_Timestamp % 1000000),
+			Record->m_ClientID, (Record->m_Direction == dirIn) ? "C->S" : "S->C", PacketType, Record->m_DataSize
+		);
+	}
+	printf("%u records\n", static_cast<unsigned>(NumRecords));
+	return EXIT_SUCCESS;
+}
+
+
+
+
+
+int cCommCapture::Replay(const AString & a_FileName, const cFilter & a_Filter, const AString & a_Host, UInt16 a_Port, double a_Speed)
+{
+	AString Contents;
+	size_t Offset = ReadCaptureFile(a_FileName, Contents);
+	if (Offset == 0)
+	{
+		return EXIT_FAILURE;
+	}
+	cSocket::WSAStartup();
+
+	// Only the client-to-server frames can be replayed:
+	cFilter Filter(a_Filter);
+	Filter.m_Direction = dirIn;
+
+	std::map<UInt32, cSocket> Connections;
+	size_t NumFrames = 0, NumBytes = 0;
+	UInt64 FirstTimestamp = 0;
+	auto StartTime = std::chrono::steady_clock::now();
+	char Discard[16 KiB];
+	AString Frame;
+	for (const cRecordHeader * Record = GetRecord(Contents, Offset); Record != nullptr; Record = GetRecord(Contents, Offset))
+	{
+		Offset += Record->m_Size;
+		if (!Filter.Matches(*Record))
+		{
+			continue;
+		}
+
+		// Keep the original timing, if requested:
+		if (NumFrames == 0)
+		{
+			FirstTimestamp = Record->m_Timestamp;
+		}
+		else if ((a_Speed > 0) && (Record->m_Timestamp > FirstTimestamp))
+		{
+			auto Delay = std::chrono::microseconds(static_cast<Int64>(static_cast<double>(Record->m_Timestamp - FirstTimestamp) / a_Speed));
+			std::this_thread::sleep_until(StartTime + Delay);
+		}
+
+		// Open a new connection for each captured client:
+		auto itr = Connections.find(Record->m_ClientID);
+		if (itr == Connections.end())
+		{
+			cSocket Socket = cSocket::CreateSocket(cSocket::IPv4);
+			if (!Socket.IsValid() || !Socket.ConnectIPv4(a_Host, a_Port))
+			{
+				fprintf(stderr, "Cannot connect to %s:%u: %s\n", a_Host.c_str(), static_cast<unsigned>(a_Port), cSocket::GetLastErrorString().c_str());
+				Socket.CloseSocket();
+				break;
+			}
+			Socket.SetNonBlocking();
+			itr = Connections.emplace(Record->m_ClientID, Socket).first;
+		}
+
+		// Put the length prefix back in front of the frame and send it; the server's responses are discarded:
+		Frame.clear();
+		UInt32 Length = Record->m_DataSize;
+		do
+		{
+			Frame.push_back(static_cast<char>((Length & 0x7f) | ((Length > 0x7f) ? 0x80 : 0)));
+			Length >>= 7;
+		} while (Length > 0);
+		Frame.append(reinterpret_cast<const char *>(Record) + sizeof(cRecordHeader), Record->m_DataSize);
+		size_t Sent = 0;
+		while (Sent < Frame.size())
+		{
+			while (itr->second.Receive(Discard, sizeof(Discard), 0) > 0)
+			{
+			}
+			int res = itr->second.Send(Frame.data() + Sent, Frame.size() - Sent);
+			if (res > 0)
+			{
+				Sent += static_cast<size_t>(res);
+			}
+			else if (cSocket::GetLastError() == cSocket::ErrWouldBlock)
+			{
+				std::this_thread::yield();
+			}
+			else
+			{
+				fprintf(stderr, "The server closed the connection of client %u\n", Record->m_ClientID);
+				break;
+			}
+		}
+		NumFrames += 1;
+		NumBytes += Frame.size();
+	}
+
+	double Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - StartTime).count();
+	for (auto & Connection: Connections)
+	{
+		Connection.second.CloseSocket();
+	}
+	printf("Replayed %u frames (%u bytes) of %u clients in %.3f s, %.0f frames/s\n",
+		static_cast<unsigned>(NumFrames), static_cast<unsigned>(NumBytes), static_cast<unsigned>(Connections.size()),
+		Elapsed, (Elapsed > 0) ? (static_cast<double>(NumFrames) / Elapsed) : 0.0
+	);
+	return EXIT_SUCCESS;
+}
+
+
+
+
+
+size_t cCommCapture::ReadCaptureFile(const AString & a_FileName, AString & a_Contents)
+{
+	a_Contents = cFile::ReadWholeFile(a_FileName);
+	cFileHeader Header;
+	if (a_Contents.size() < sizeof(Header))
+	{
+		fprintf(stderr, "Cannot read the capture file \"%s\"\n", a_FileName.c_str());
+		return 0;
+	}
+	memcpy(&Header, a_Contents.data(), sizeof(Header));
+	if ((memcmp(Header.m_Magic, MAGIC, sizeof(MAGIC)) != 0) || (Header.m_Version != VERSION) || (Header.m_HeaderSize < sizeof(Header)))
+	{
+		fprintf(stderr, "\"%s\" is not a comm capture file, or it has an unsupported version\n", a_FileName.c_str());
+		return 0;
+	}
+	return Header.m_HeaderSize;
+}
+
+
+
+
+
+const cCommCapture::cRecordHeader * cCommCapture::GetRecord(const AString & a_Contents, size_t a_Offset)
+{
+	if ((a_Offset > a_Contents.size()) || (a_Contents.size() - a_Offset < sizeof(cRecordHeader)))
+	{
+		return nullptr;
+	}
+	auto Record = reinterpret_cast<const cRecordHeader *>(a_Contents.data() + a_Offset);
+	if (
+		(Record->m_Size < sizeof(cRecordHeader) + Record->m_DataSize) ||  // Also catches the zero terminator
+		(Record->m_Size > a_Contents.size() - a_Offset)
+	)
+	{
+		return nullptr;
+	}
+	return Record;
+}
+
+
+
+
@@ -0,0 +1,178 @@
+
+// CommCapture.h
+
+// Interfaces to the cCommCapture class representing a binary capture of the protocol frames of all the clients
+
+// All the clients' frames go into a single file, which is memory-mapped and preallocated to its maximum size.
+// The writers reserve space for their records by atomically advancing the write position, so capturing a frame
+// takes no lock and no syscall. When the file is full, further records are dropped (and counted).
+//
+// The capture file format (the numbers are little-endian):
+//  - File header: cFileHeader, 16 bytes: the magic "P2PCAP\0\0", UInt32 version (1), UInt32 size of the file header
+//  - Records, each aligned to 8 bytes: cRecordHeader (24 bytes) followed by the frame data and the padding.
+//    A record whose m_Size is zero marks the end of the valid records (the rest of the file was never written).
+// The frame data is the packet as parsed by cProtocol_impl: the packet type and the payload, without the length prefix.
+
+
+
+
+
+#pragma once
+
+#include <atomic>
+
+
+
+
+
+class cCommCapture
+{
+public:
+	/** The direction of a captured frame. */
+	enum eDirection
+	{
+		dirIn  = 0,  ///< Client to server
+		dirOut = 1,  ///< Server to client
+	};
+
+
+	struct cFileHeader
+	{
+		char m_Magic[8];
+		UInt32 m_Version;
+		UInt32 m_HeaderSize;
+	};
+
+
+	struct cRecordHeader
+	{
+		/** Size of the whole record, including this header and the padding. Written last, when the record is complete. */
+		UInt32 m_Size;
+
+		/** The unique ID of the client (cClientHandle::GetUniqueID()). */
+		UInt32 m_ClientID;
+
+		/** The time of the capture, in microseconds since the Unix epoch. */
+		UInt64 m_Timestamp;
+
+		/** Size of the frame data following this header. */
+		UInt32 m_DataSize;
+
+		/** One of eDirection. */
+		UInt8 m_Direction;
+
+		UInt8 m_Reserved[3];
+	};
+
+
+	/** Selects the records processed by the offline tools. */
+	struct cFilter
+	{
+		/** Only the records of this client are processed; -1 for all the clients. */
+		Int64 m_ClientID;
+
+		/** Only the records in this direction are processed; -1 for both directions. */
+		int m_Direction;
+
+		cFilter(void) :
+			m_ClientID(-1),
+			m_Direction(-1)
+		{
+		}
+
+		bool Matches(const cRecordHeader & a_Record) const
+		{
+			return (
+				((m_ClientID < 0) || (static_cast<Int64>(a_Record.m_ClientID) == m_ClientID)) &&
+				((m_Direction < 0) || (static_cast<int>(a_Record.m_Direction) == m_Direction))
+			);
+		}
+	};
+
+
+	/** Counters describing the capture, as reported by GetStats(). */
+	struct cStats
+	{
+		UInt64 m_NumRecords;
+
+		/** Number of frames dropped because the file was full. */
+		UInt64 m_NumDropped;
+
+		/** Number of bytes of the file used so far, and the file's maximum size. */
+		size_t m_Used;
+		size_t m_Capacity;
+	};
+
+
+	cCommCapture(void);
+	~cCommCapture();
+
+	/** Creates the capture file of the specified maximum size and maps it into memory. Returns true on success. */
+	bool Open(const AString & a_FileName, size_t a_Capacity);
+
+	/** Unmaps the capture file and truncates it to the used size. There mustn't be any Capture() calls in-flight. */
+	void Close(void);
+
+	/** Returns true if the capture file is open. */
+	bool IsOpen(void) const { return (m_Data != nullptr); }
+
+	/** Returns the name of the capture file. */
+	const AString & GetFileName(void) const { return m_FileName; }
+
+	/** Appends the frame to the capture file. Can be called from any thread, takes no lock. */
+	void Capture(UInt32 a_ClientID, eDirection a_Direction, const char * a_Data, size_t a_Size);
+
+	/** Returns the current counters. */
+	cStats GetStats(void) const;
+
+	/** Offline tool: prints the records of the capture file matching the filter to stdout.
+	Returns the exit code for the process. */
+	static int Dump(const AString & a_FileName, const cFilter & a_Filter);
+
+	/** Offline tool: sends the client-to-server frames of the capture file matching the filter to the server at the
+	specified address, over one connection per captured client. The original timing is kept, sped up by a_Speed;
+	a_Speed <= 0 sends the frames as fast as possible. Prints the throughput to stdout.
+	Returns the exit code for the process. */
+	static int Replay(const AString & a_FileName, const cFilter & a_Filter, const AString & a_Host, UInt16 a_Port, double a_Speed);
+
+protected:
+
+	/** The magic at the start of each capture file. */
+	static const char MAGIC[8];
+
+	static const UInt32 VERSION = 1;
+
+
+	AString m_FileName;
+
+	#ifdef _WIN32
+		HANDLE m_File;
+		HANDLE m_Mapping;
+	#else
+		int m_File;
+	#endif
+
+	/** The mapped capture file, nullptr if not open. */
+	char * m_Data;
+
+	/** The size of the mapped file. */
+	size_t m_Capacity;
+
+	/** The position in m_Data where the next record will be written. May go past m_Capacity once the file is full. */
+	std::atomic<size_t> m_WritePos;
+
+	std::atomic<UInt64> m_NumRecords;
+	std::atomic<UInt64> m_NumDropped;
+
+
+	/** Reads the whole capture file into a_Contents and checks its header.
+	Returns the offset of the first record, or 0 if the file is not a valid capture (an error is printed). */
+	static size_t ReadCaptureFile(const AString & a_FileName, AString & a_Contents);
+
+	/** Returns the header of the record at the specified offset in a_Contents, or nullptr if there are no more records. */
+	static const cRecordHeader * GetRecord(const AString & a_Contents, size_t a_Offset);
+};
+
+
+
+
@@ -62,6 +62,23 @@ cPacketizer::~cPacketizer()
 
 
 
+void cPacketizer::FinishPacket(const char *& a_Data, size_t & a_Size)
+{
+	ASSERT(m_Out.size() >= MAX_HEADER_SIZE);
+	char Header[MAX_HEADER_SIZE];
+	size_t HeaderSize = EncodeVarInt32(static_cast<UInt32>(m_Out.size() - MAX_HEADER_SIZE), Header);
+
+	// Put the length right in front of the packet data:
+	size_t Start = MAX_HEADER_SIZE - HeaderSize;
+	memcpy(&m_Out[Start], Header, HeaderSize);
+	a_Data = m_Out.data() + Start;
+	a_Size = m_Out.size() - Start;
+}
+
+
+
+
+
 void cPacketizer::WriteByteAngle(double a_Angle)
 {
 	WriteBEInt8(static_cast<Int8>(255 * a_Angle / 360));
@@ -92,7 +109,7 @@ void cPacketizer::WriteUUID(const AString & a_UUID)
 	for (size_t i = 0; i < 32; i += 2)
 	{
 		auto val = static_cast<UInt8>(HexDigitValue(a_UUID[i]) << 4 | HexDigitValue(a_UUID[i + 1]));
-		VERIFY(m_Out.WriteBEUInt8(val));
+		WriteBEUInt8(val);
 	}
 }
 
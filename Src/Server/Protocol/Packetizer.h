@@ -11,16 +11,23 @@
 #pragma once
 
 #include "Protocol.h"
-#include "../ByteBuffer.h"
+#include "../Endianness.h"
+#include "VarInt.h"
 
 
 
 
 
-/** Composes an individual packet in the protocol's m_OutPacketBuffer; sends it just before being destructed. */
+/** Composes an individual packet in the protocol's m_OutPacketBuffer; sends it just before being destructed.
+The packet is composed with MAX_HEADER_SIZE bytes reserved in front of it; when the packet is finished, its length
+is written right in front of the packet data, so that the whole packet can be sent from the buffer without any copying. */
 class cPacketizer
 {
 public:
+	/** Number of bytes reserved in front of the packet for its length. */
+	static const size_t MAX_HEADER_SIZE = MAX_VARINT32_SIZE;
+
+
 	/** Starts serializing a new packet into the protocol's m_OutPacketBuffer.
 	Locks the protocol's m_CSPacket to avoid multithreading issues. */
 	cPacketizer(cProtocol & a_Protocol, UInt32 a_PacketType) :
@@ -29,7 +36,9 @@ public:
 		m_Lock(a_Protocol.m_CSPacket),
 		m_PacketType(a_PacketType)  // Used for logging purposes
 	{
-		m_Out.WriteVarInt32(a_PacketType);
+		// Keep the buffer's allocation, only reset its contents:
+		m_Out.assign(MAX_HEADER_SIZE, '\0');
+		WriteVarInt32(a_PacketType);
 	}
 
 	/** Sends the packet via the contained protocol's SendPacket() function. */
@@ -37,91 +46,106 @@ public:
 
 	inline void WriteBool(bool a_Value)
 	{
-		VERIFY(m_Out.WriteBool(a_Value));
+		m_Out.push_back(a_Value ? 1 : 0);
 	}
 
 	inline void WriteBEUInt8(UInt8 a_Value)
 	{
-		VERIFY(m_Out.WriteBEUInt8(a_Value));
+		m_Out.push_back(static_cast<char>(a_Value));
 	}
 
 
 	inline void WriteBEInt8(Int8 a_Value)
 	{
-		VERIFY(m_Out.WriteBEInt8(a_Value));
+		m_Out.push_back(static_cast<char>(a_Value));
 	}
 
 
 	inline void WriteBEInt16(Int16 a_Value)
 	{
-		VERIFY(m_Out.WriteBEInt16(a_Value));
+		UInt16 val;
+		memcpy(&val, &a_Value, 2);
+		WriteBEUInt16(val);
 	}
 
 
 	inline void WriteBEUInt16(UInt16 a_Value)
 	{
-		VERIFY(m_Out.WriteBEUInt16(a_Value));
+		a_Value = htons(a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&a_Value), 2);
 	}
 
 
 	inline void WriteBEInt32(Int32 a_Value)
 	{
-		VERIFY(m_Out.WriteBEInt32(a_Value));
+		UInt32 Converted = HostToNetwork4(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 4);
 	}
 
 
 	inline void WriteBEUInt32(UInt32 a_Value)
 	{
-		VERIFY(m_Out.WriteBEUInt32(a_Value));
+		UInt32 Converted = HostToNetwork4(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 4);
 	}
 
 
 	inline void WriteBEInt64(Int64 a_Value)
 	{
-		VERIFY(m_Out.WriteBEInt64(a_Value));
+		UInt64 Converted = HostToNetwork8(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 8);
 	}
 
 
 	inline void WriteBEUInt64(UInt64 a_Value)
 	{
-		VERIFY(m_Out.WriteBEUInt64(a_Value));
+		UInt64 Converted = HostToNetwork8(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 8);
 	}
 
 
 	inline void WriteBEFloat(float a_Value)
 	{
-		VERIFY(m_Out.WriteBEFloat(a_Value));
+		UInt32 Converted = HostToNetwork4(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 4);
 	}
 
 
 	inline void WriteBEDouble(double a_Value)
 	{
-		VERIFY(m_Out.WriteBEDouble(a_Value));
+		UInt64 Converted = HostToNetwork8(&a_Value);
+		m_Out.append(reinterpret_cast<const char *>(&Converted), 8);
 	}
 
 
 	inline void WriteVarInt32(UInt32 a_Value)
 	{
-		VERIFY(m_Out.WriteVarInt32(a_Value));
+		char Buf[MAX_HEADER_SIZE];
+		m_Out.append(Buf, EncodeVarInt32(a_Value, Buf));
 	}
 
 
 	inline void WriteString(const AString & a_Value)
 	{
-		VERIFY(m_Out.WriteVarUTF8String(a_Value));
+		WriteVarInt32(static_cast<UInt32>(a_Value.size()));
+		m_Out.append(a_Value);
 	}
 
 
 	inline void WriteBuf(const char * a_Data, size_t a_Size)
 	{
-		VERIFY(m_Out.Write(a_Data, a_Size));
+		m_Out.append(a_Data, a_Size);
 	}
 
 
 	/** Writes the specified block position as a single encoded 64-bit BigEndian integer. */
 	inline void WritePosition64(int a_BlockX, int a_BlockY, int a_BlockZ)
 	{
-		VERIFY(m_Out.WritePosition64(a_BlockX, a_BlockY, a_BlockZ));
+		WriteBEInt64(
+			(static_cast<Int64>(a_BlockX & 0x3FFFFFF) << 38) |
+			(static_cast<Int64>(a_BlockY & 0xFFF) << 26) |
+			(static_cast<Int64>(a_BlockZ & 0x3FFFFFF))
+		);
 	}
 
 	/** Writes the specified angle using a single Byte. */
@@ -135,12 +159,17 @@ public:
 
 	UInt32 GetPacketType(void) const { return m_PacketType; }
 
+	/** Writes the packet length into the space reserved in front of the packet data.
+	Sets a_Data and a_Size to the complete packet (length, type and data), stored in the protocol's m_OutPacketBuffer.
+	Called by the protocol's SendPacket(). */
+	void FinishPacket(const char *& a_Data, size_t & a_Size);
+
 protected:
 	/** The protocol instance in which the packet is being constructed. */
 	cProtocol & m_Protocol;
 
-	/** The protocol's buffer for the constructed packet data. */
-	cByteBuffer & m_Out;
+	/** The protocol's buffer for the constructed packet data, starting with MAX_HEADER_SIZE bytes reserved for the length. */
+	AString & m_Out;
 
 	/** The RAII lock preventing multithreaded access to the protocol buffer while constructing the packet. */
 	cCSLock m_Lock;
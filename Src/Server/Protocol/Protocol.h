@@ -12,6 +12,7 @@
 
 #include "../Endianness.h"
 #include "../ByteBuffer.h"
+#include "../PresenceEngine.h"
 
 #include <array>
 
@@ -30,9 +31,7 @@ class cProtocol
 {
 public:
 	cProtocol(cClientHandle * a_Client) :
-		m_Client(a_Client),
-		m_OutPacketBuffer(64 KiB),
-		m_OutPacketLenBuffer(20)  // 20 bytes is more than enough for one VarInt
+		m_Client(a_Client)
 	{
 	}
 
@@ -44,9 +43,13 @@ public:
 	virtual void SendDisconnect(const int & a_Reason) = 0;
 	virtual void SendLoginSuccess(void) = 0;
 	virtual void SendKeepAlive(UInt32 a_PingID) = 0;
-	virtual void BroadcastUserInfo(const UInt32 a_Id, const AString &a_Name, const UInt32 a_State) = 0;
+	/** Sends the presence entries, except the one for a_SkipID, to the client.
+	If a_IsSnapshot is true, the entries form the full roster. Returns the number of entries sent. */
+	virtual size_t SendPresence(const cPresenceEntries & a_Entries, UInt32 a_SkipID, bool a_IsSnapshot) = 0;
 	virtual void ForwardMedia(UInt32 from_id, UInt32 type) = 0;
-	virtual void ForwardMediaMsg(UInt32 from_id, AString msg) = 0;
+	virtual void ForwardMediaMsg(UInt32 from_id, const AString & msg) = 0;
+	/** Sends the UDP relay port allocated for relaying to / from the peer; zero if the relay is not available. */
+	virtual void SendRelayAllocated(UInt32 a_PeerID, UInt16 a_Port) = 0;
 	virtual AString GetName() = 0;
 	virtual AString GetIPString() = 0;
 
@@ -62,11 +65,10 @@ protected:
 	Automated via cPacketizer class. */
 	cCriticalSection m_CSPacket;
 
-	/** Buffer for composing the outgoing packets, through cPacketizer */
-	cByteBuffer m_OutPacketBuffer;
-	
-	/** Buffer for composing packet length (so that each cPacketizer instance doesn't allocate a new cPacketBuffer) */
-	cByteBuffer m_OutPacketLenBuffer;
+	/** Buffer for composing the outgoing packets, through cPacketizer.
+	Reused for all packets, so that composing a packet doesn't need any allocation once the buffer has grown large enough.
+	Protected by m_CSPacket. */
+	AString m_OutPacketBuffer;
 	
 	/** A generic data-sending routine, all outgoing packet data needs to be routed through this so that descendants may override it. */
 	virtual void SendData(const char * a_Data, size_t a_Size) = 0;
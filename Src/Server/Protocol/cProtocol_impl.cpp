@@ -49,6 +49,9 @@ static const Int16 SLOT_NUM_OUTSIDE = -999;
 
 const int MAX_ENC_LEN = 512;  // Maximum size of the encrypted message; should be 128, but who knows...
 
+/** Maximum size of the entries in a single presence packet; longer lists are split into multiple packets. */
+static const size_t MAX_PRESENCE_PACKET_SIZE = 32 KiB;
+
 
 
 
@@ -65,21 +68,19 @@ extern bool g_ShouldLogCommIn, g_ShouldLogCommOut;
 
 cProtocol_impl::cProtocol_impl(cClientHandle * a_Client) 
 	: super(a_Client)
-	, m_ReceivedData(64 KiB)
+	, m_ReceivedData(cRoot::Get()->GetServer()->GetMaxReceiveBufferSize())
 	, m_State(1)
+	, m_CommCapture(nullptr)
 {
 	// BungeeCord handling:
 	// If BC is setup with ip_forward == true, it sends additional data in the login packet's ServerAddress field:
 	// hostname\00ip-address\00uuid\00profile-properties-as-json
 	AStringVector Params;
 	
-	// Create the comm log file, if so requested:
-	if (g_ShouldLogCommIn || g_ShouldLogCommOut)
+	// Capture the comm into the shared capture file, if so requested:
+	if ((g_ShouldLogCommIn || g_ShouldLogCommOut) && cRoot::Get()->GetCommCapture().IsOpen())
 	{
-		static int sCounter = 0;
-		cFile::CreateFolder("CommLogs");
-		AString FileName = Printf("CommLogs/%x_%d__%s.log", static_cast<unsigned>(time(nullptr)), sCounter++, a_Client->GetIPString().c_str());
-		m_CommLogFile.Open(FileName, cFile::fmWrite);
+		m_CommCapture = &cRoot::Get()->GetCommCapture();
 	}
 }
 
@@ -89,7 +90,7 @@ cProtocol_impl::~cProtocol_impl()
 }
 
 
-bool cProtocol_impl::HandlePacket(cByteBuffer & a_ByteBuffer, UInt32 a_PacketType)
+bool cProtocol_impl::HandlePacket(cByteBufferView & a_ByteBuffer, UInt32 a_PacketType)
 {
 	switch (m_State)
 	{
@@ -121,6 +122,7 @@ bool cProtocol_impl::HandlePacket(cByteBuffer & a_ByteBuffer, UInt32 a_PacketTyp
 		case 0x00: HandlePacketKeepAlive(a_ByteBuffer); return true;
 		case 0x11: HandlePacketMedia(a_ByteBuffer); return true;
 		case 0x12: HandlePacketMediaMsg(a_ByteBuffer); return true;
+		case 0x13: HandlePacketRelayRequest(a_ByteBuffer); return true;
 		}
 		break;
 	}
@@ -148,7 +150,7 @@ bool cProtocol_impl::HandlePacket(cByteBuffer & a_ByteBuffer, UInt32 a_PacketTyp
 	return false;
 }
 
-void cProtocol_impl::HandlePacketStatusRequest(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketStatusRequest(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, appName);
 	HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, server);
@@ -168,7 +170,7 @@ void cProtocol_impl::HandlePacketStatusRequest(cByteBuffer & a_ByteBuffer)
 
 }
 
-void cProtocol_impl::HandlePacketStatusPing(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketStatusPing(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadBEInt64, Int64, Timestamp);
 
@@ -176,7 +178,7 @@ void cProtocol_impl::HandlePacketStatusPing(cByteBuffer & a_ByteBuffer)
 	Pkt.WriteBEInt64(Timestamp);
 }
 
-void cProtocol_impl::HandlePacketLoginInfo(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketLoginInfo(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, username);
 	HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, password);
@@ -184,28 +186,43 @@ void cProtocol_impl::HandlePacketLoginInfo(cByteBuffer & a_ByteBuffer)
 
 }
 
-void cProtocol_impl::HandlePacketKeepAlive(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketKeepAlive(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, KeepAliveID);
 	m_Client->HandleKeepAlive(KeepAliveID);
 }
 
-void cProtocol_impl::HandlePacketMedia(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketMedia(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, peer_id);
 	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, type);
 
 	cServer *server = cRoot::Get()->GetServer();
-	server->ForwardMedia(peer_id, m_Client->GetUniqueID(), type);
+	server->ForwardMedia(peer_id, m_Client->GetUniqueID(), type, m_Client->GetProcessingDataTime());
 }
 
-void cProtocol_impl::HandlePacketMediaMsg(cByteBuffer & a_ByteBuffer)
+void cProtocol_impl::HandlePacketMediaMsg(cByteBufferView & a_ByteBuffer)
 {
 	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, peer_id);
 	HANDLE_READ(a_ByteBuffer, ReadVarUTF8String, AString, strMsg);
 
 	cServer *server = cRoot::Get()->GetServer();
-	server->ForwardMediaMsg(peer_id, m_Client->GetUniqueID(), strMsg);
+	server->ForwardMediaMsg(peer_id, m_Client->GetUniqueID(), strMsg, m_Client->GetProcessingDataTime());
+}
+
+void cProtocol_impl::HandlePacketRelayRequest(cByteBufferView & a_ByteBuffer)
+{
+	HANDLE_READ(a_ByteBuffer, ReadVarInt32, UInt32, peer_id);
+
+	// The client's own UDP port is optional, older clients don't send it:
+	UInt16 udp_port = 0;
+	if (a_ByteBuffer.CanReadBytes(2))
+	{
+		VERIFY(a_ByteBuffer.ReadBEUInt16(udp_port));
+	}
+
+	cServer *server = cRoot::Get()->GetServer();
+	server->RequestRelay(static_cast<UInt32>(m_Client->GetUniqueID()), peer_id, udp_port);
 }
 
 void cProtocol_impl::SendKeepAlive(UInt32 a_PingID)
@@ -221,12 +238,60 @@ void cProtocol_impl::SendKeepAlive(UInt32 a_PingID)
 	Pkt.WriteVarInt32(a_PingID);
 }
 
-void cProtocol_impl::BroadcastUserInfo(const UInt32 a_Id, const AString &a_Name, const UInt32 a_State)
+size_t cProtocol_impl::SendPresence(const cPresenceEntries & a_Entries, UInt32 a_SkipID, bool a_IsSnapshot)
 {
-	cPacketizer Pkt(*this, 0x01);
-	Pkt.WriteVarInt32(a_Id);
-	Pkt.WriteString(a_Name);
-	Pkt.WriteVarInt32(a_State);
+	// Drop the packet if the protocol is not in the Game state yet, the client wouldn't understand it:
+	if (m_State != 3)
+	{
+		return 0;
+	}
+
+	// The first packet of a snapshot is a Roster packet (0x03), replacing the client's user list (even if empty);
+	// the rest, and all packets of a delta, are Presence packets (0x02), updating the list:
+	size_t NumSent = 0;
+	bool ShouldSendRoster = a_IsSnapshot;
+	auto itr = a_Entries.cbegin(), end = a_Entries.cend();
+	while ((itr != end) || ShouldSendRoster)
+	{
+		// Find how many entries fit into a single packet:
+		UInt32 Count = 0;
+		size_t Size = 0;
+		auto last = itr;
+		for (; last != end; ++last)
+		{
+			if (last->m_ID == a_SkipID)
+			{
+				continue;
+			}
+			size_t EntrySize = 20 + last->m_Name.size();  // At most 5 bytes for each VarInt, plus the name itself
+			if ((Count > 0) && (Size + EntrySize > MAX_PRESENCE_PACKET_SIZE))
+			{
+				break;
+			}
+			Size += EntrySize;
+			Count += 1;
+		}
+		if ((Count == 0) && !ShouldSendRoster)
+		{
+			break;
+		}
+
+		cPacketizer Pkt(*this, ShouldSendRoster ? 0x03 : 0x02);
+		Pkt.WriteVarInt32(Count);
+		for (; itr != last; ++itr)
+		{
+			if (itr->m_ID == a_SkipID)
+			{
+				continue;
+			}
+			Pkt.WriteVarInt32(itr->m_ID);
+			Pkt.WriteString(itr->m_Name);
+			Pkt.WriteVarInt32(itr->m_State);
+		}
+		NumSent += Count;
+		ShouldSendRoster = false;
+	}
+	return NumSent;
 }
 
 void cProtocol_impl::ForwardMedia(UInt32 from_id, UInt32 type)
@@ -236,13 +301,26 @@ void cProtocol_impl::ForwardMedia(UInt32 from_id, UInt32 type)
 	pkg.WriteVarInt32(type);		//type
 }
 
-void cProtocol_impl::ForwardMediaMsg(UInt32 from_id, AString msg)
+void cProtocol_impl::ForwardMediaMsg(UInt32 from_id, const AString & msg)
 {
 	cPacketizer pkg(*this, 0x12);//media packet
 	pkg.WriteVarInt32(from_id);		//id
 	pkg.WriteString(msg);
 }
 
+void cProtocol_impl::SendRelayAllocated(UInt32 a_PeerID, UInt16 a_Port)
+{
+	// Drop the packet if the protocol is not in the Game state, the client wouldn't understand it:
+	if (m_State != 3)
+	{
+		return;
+	}
+
+	cPacketizer Pkt(*this, 0x13);  // Relay allocated packet
+	Pkt.WriteVarInt32(a_PeerID);
+	Pkt.WriteBEUInt16(a_Port);
+}
+
 void cProtocol_impl::SendData(const char * a_Data, size_t a_Size)
 {
 	m_Client->SendData(a_Data, a_Size);
@@ -250,22 +328,27 @@ void cProtocol_impl::SendData(const char * a_Data, size_t a_Size)
 
 void cProtocol_impl::SendPacket(cPacketizer & a_Packet)
 {
-	AString LenToSend;
-	AString DataToSend;
-
-	// Send the packet length
-	UInt32 PacketLen = static_cast<UInt32>(m_OutPacketBuffer.GetUsedSpace());
-
-	m_OutPacketLenBuffer.WriteVarInt32(PacketLen);
-	m_OutPacketLenBuffer.ReadAll(LenToSend);
-	m_OutPacketLenBuffer.CommitRead();
-
-	// Send the packet data:
-	m_OutPacketBuffer.ReadAll(DataToSend);
+	// Prefix the packet with its length, in place, and send it right out of the packet buffer:
+	const char * Data;
+	size_t Size;
+	a_Packet.FinishPacket(Data, Size);
+	if ((m_CommCapture != nullptr) && g_ShouldLogCommOut)
+	{
+		// Capture the frame without its length prefix, same as the inbound frames:
+		size_t PrefixSize = 1;
+		while ((PrefixSize < Size) && ((static_cast<Byte>(Data[PrefixSize - 1]) & 0x80) != 0))
+		{
+			PrefixSize += 1;
+		}
+		m_CommCapture->Capture(static_cast<UInt32>(m_Client->GetUniqueID()), cCommCapture::dirOut, Data + PrefixSize, Size - PrefixSize);
+	}
+	SendData(Data, Size);
 
-	DataToSend = LenToSend + DataToSend;
-	SendData(DataToSend.data(), DataToSend.size());
-	m_OutPacketBuffer.CommitRead();
+	// Don't let a single large packet pin its buffer for the rest of the connection:
+	if (m_OutPacketBuffer.capacity() > cSegmentedByteBuffer::CHUNK_SIZE)
+	{
+		AString().swap(m_OutPacketBuffer);
+	}
 }
 
 void cProtocol_impl::SendDisconnect(const int & a_Reason)
@@ -319,21 +402,34 @@ void cProtocol_impl::AddReceivedData(const char * a_Data, size_t a_Size)
 			m_ReceivedData.ResetRead();
 			break;
 		}
-		cByteBuffer bb(PacketLen + 1);
-		VERIFY(m_ReceivedData.ReadToByteBuffer(bb, static_cast<size_t>(PacketLen)));
-		m_ReceivedData.CommitRead();
+
+		// Parse the packet in place if it is contiguous in the buffer, copy it out only if it spans several chunks.
+		// The in-place data lives in a receive chunk that CommitRead() returns to the pool once drained, so the read
+		// is only committed after the packet has been captured and handled.
+		const char * PacketData;
+		if (m_ReceivedData.PeekContiguous(PacketData, static_cast<size_t>(PacketLen)))
+		{
+			VERIFY(m_ReceivedData.SkipRead(static_cast<size_t>(PacketLen)));
+		}
+		else
+		{
+			VERIFY(m_ReceivedData.ReadString(m_WrappedPacket, static_cast<size_t>(PacketLen)));
+			PacketData = m_WrappedPacket.data();
+		}
+		if ((m_CommCapture != nullptr) && g_ShouldLogCommIn)
+		{
+			m_CommCapture->Capture(static_cast<UInt32>(m_Client->GetUniqueID()), cCommCapture::dirIn, PacketData, static_cast<size_t>(PacketLen));
+		}
+		cByteBufferView bb(PacketData, static_cast<size_t>(PacketLen));
 
 		UInt32 PacketType;
 		if (!bb.ReadVarInt(PacketType))
 		{
 			// Not enough data
+			m_ReceivedData.CommitRead();
 			break;
 		}
 
-		// Write one NUL extra, so that we can detect over-reads
-		bb.Write("\0", 1);
-
-
 		if (!HandlePacket(bb, PacketType))
 		{
 			// Unknown packet, already been reported, but without the length. Log the length here:
@@ -344,17 +440,15 @@ void cProtocol_impl::AddReceivedData(const char * a_Data, size_t a_Size)
 			bb.ResetRead();
 			AString Packet;
 			bb.ReadAll(Packet);
-			Packet.resize(Packet.size() - 1);  // Drop the final NUL pushed there for over-read detection
 			AString Out;
 			CreateHexDump(Out, Packet.data(), Packet.size(), 24);
 			LOGD("Packet contents:\n%s", Out.c_str());
 #endif  // _DEBUG
 
-
+			m_ReceivedData.CommitRead();
 			return;
 		}
-		int sizes = bb.GetReadableSpace();
-		if (sizes != 1)
+		if (bb.GetReadableSpace() != 0)
 		{
 			// Read more or less than packet length, report as error
 			LOGWARNING("Protocol: Wrong number of bytes read for packet 0x%x, state %d. Read " SIZE_T_FMT " bytes, packet contained %u bytes",
@@ -364,6 +458,7 @@ void cProtocol_impl::AddReceivedData(const char * a_Data, size_t a_Size)
 			ASSERT(!"Read wrong number of bytes!");
 			m_Client->PacketError(PacketType);
 		}
+		m_ReceivedData.CommitRead();
 	}  // for (ever)
 
 }
@@ -6,7 +6,9 @@
 #pragma once
 
 #include "Protocol.h"
-#include "../ByteBuffer.h"
+#include "../SegmentedByteBuffer.h"
+#include "../ByteBufferView.h"
+#include "CommCapture.h"
 
 #ifdef _MSC_VER
 	#pragma warning(push)
@@ -49,30 +51,32 @@ public:
 	/** Reads and handles the packet. The packet length and type have already been read.
 	Returns true if the packet was understood, false if it was an unknown packet
 	*/
-	bool HandlePacket(cByteBuffer & a_ByteBuffer, UInt32 a_PacketType);
+	bool HandlePacket(cByteBufferView & a_ByteBuffer, UInt32 a_PacketType);
 	/** Called when client sends some data: */
 	virtual void DataReceived(const char * a_Data, size_t a_Size) override;
 	/** Sending stuff to clients (alphabetically sorted): */
 	virtual void SendDisconnect(const int & a_Reason);
 	virtual void SendLoginSuccess(void);
 	virtual void SendKeepAlive(UInt32 a_PingID);
-	virtual void BroadcastUserInfo(const UInt32 a_Id, const AString &a_Name, const UInt32 a_State);
+	virtual size_t SendPresence(const cPresenceEntries & a_Entries, UInt32 a_SkipID, bool a_IsSnapshot);
 	//ת
 	virtual void ForwardMedia(UInt32 from_id, UInt32 type);
-	virtual void ForwardMediaMsg(UInt32 from_id, AString msg);
+	virtual void ForwardMediaMsg(UInt32 from_id, const AString & msg);
+	virtual void SendRelayAllocated(UInt32 a_PeerID, UInt16 a_Port);
 	virtual AString GetName();
 	virtual AString GetIPString();
 	
 protected:
 	// Packet handlers while in the Status state (m_State == 1):
-	void HandlePacketStatusRequest(cByteBuffer & a_ByteBuffer);
-	void HandlePacketStatusPing(cByteBuffer & a_ByteBuffer);	
+	void HandlePacketStatusRequest(cByteBufferView & a_ByteBuffer);
+	void HandlePacketStatusPing(cByteBufferView & a_ByteBuffer);	
 	// Packet handlers while in the Login state (m_State == 2):
-	void HandlePacketLoginInfo(cByteBuffer & a_ByteBuffer);
+	void HandlePacketLoginInfo(cByteBufferView & a_ByteBuffer);
 	// Packet handlers while in the Game state (m_State == 3):
-	void HandlePacketKeepAlive(cByteBuffer & a_ByteBuffer);
-	void HandlePacketMedia(cByteBuffer & a_ByteBuffer);
-	void HandlePacketMediaMsg(cByteBuffer & a_ByteBuffer);
+	void HandlePacketKeepAlive(cByteBufferView & a_ByteBuffer);
+	void HandlePacketMedia(cByteBufferView & a_ByteBuffer);
+	void HandlePacketMediaMsg(cByteBufferView & a_ByteBuffer);
+	void HandlePacketRelayRequest(cByteBufferView & a_ByteBuffer);
 
 private:
 	
@@ -89,11 +93,15 @@ protected:
 	/** State of the protocol. 1 = status, 2 = login, 3 = work */
 	UInt32 m_State;
 
-	/** Buffer for the received data */
-	cByteBuffer m_ReceivedData;
+	/** Buffer for the received data. Holds no memory while the client is idle, grows up to the server's MaxReceiveBuffer setting. */
+	cSegmentedByteBuffer m_ReceivedData;
 
-	/** The logfile where the comm is logged, when g_ShouldLogComm is true */
-	cFile m_CommLogFile;
+	/** Scratch space for a packet that spans several chunks of m_ReceivedData and thus cannot be parsed in place.
+	Kept between packets so that its allocation is reused. */
+	AString m_WrappedPacket;
+
+	/** The capture into which the comm is logged, when g_ShouldLogCommIn / g_ShouldLogCommOut is true; nullptr otherwise. */
+	cCommCapture * m_CommCapture;
 } ;
 
 
@@ -0,0 +1,501 @@
+
+// RelayEngine.cpp
+
+// Implements the cRelayEngine class that relays the UDP media between pairs of clients that cannot reach each other directly
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "RelayEngine.h"
+#include "ClientRegistry.h"
+#include "ClientHandle.h"
+
+
+
+
+
+/** The maximum number of datagrams handed to the OS in a single SendToBatch() call. */
+static const size_t RELAY_BATCH_SIZE = 16;
+
+
+
+
+
+/** Returns true if both addresses are the same IP address and port. */
+static bool IsSameAddress(const sockaddr * a_Addr1, const sockaddr * a_Addr2)
+{
+	if (a_Addr1->sa_family != a_Addr2->sa_family)
+	{
+		return false;
+	}
+	switch (a_Addr1->sa_family)
+	{
+		case AF_INET:
+		{
+			auto sin1 = reinterpret_cast<const sockaddr_in *>(a_Addr1);
+			auto sin2 = reinterpret_cast<const sockaddr_in *>(a_Addr2);
+			return (sin1->sin_port == sin2->sin_port) && (sin1->sin_addr.s_addr == sin2->sin_addr.s_addr);
+		}
+		case AF_INET6:
+		{
+			auto sin1 = reinterpret_cast<const sockaddr_in6 *>(a_Addr1);
+			auto sin2 = reinterpret_cast<const sockaddr_in6 *>(a_Addr2);
+			return (sin1->sin6_port == sin2->sin6_port) && (memcmp(&sin1->sin6_addr, &sin2->sin6_addr, sizeof(sin1->sin6_addr)) == 0);
+		}
+	}
+	return false;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cRelayEngine::cAllocation:
+
+/** A pair of UDP ports relaying the datagrams between two clients. */
+class cRelayEngine::cAllocation
+{
+public:
+	cAllocation(UInt32 a_ClientID1, const AString & a_IP1, UInt32 a_ClientID2, const AString & a_IP2):
+		m_IsClosed(false),
+		m_NumDropped(0)
+	{
+		m_Sides[0].Init(*this, 0, a_ClientID1, a_IP1);
+		m_Sides[1].Init(*this, 1, a_ClientID2, a_IP2);
+	}
+
+
+	/** Opens the UDP ports for both sides. Returns true on success. */
+	bool Open(void)
+	{
+		for (auto & Side : m_Sides)
+		{
+			Side.m_Endpoint = cNetwork::CreateUDPEndpoint(0, Side);
+			if (!Side.m_Endpoint->IsOpen())
+			{
+				Close();
+				return false;
+			}
+			Side.m_Port = Side.m_Endpoint->GetPort();
+		}
+		return true;
+	}
+
+
+	/** Stops relaying and closes the UDP ports. */
+	void Close(void)
+	{
+		// Mark as closed first, so that the network thread doesn't send through an endpoint being closed.
+		// The endpoints must not be closed while holding m_CS, closing waits for the callbacks in progress:
+		{
+			cCSLock Lock(m_CS);
+			m_IsClosed = true;
+		}
+		for (auto & Side : m_Sides)
+		{
+			if (Side.m_Endpoint != nullptr)
+			{
+				Side.m_Endpoint->Close();
+				Side.m_Endpoint.reset();
+			}
+		}
+	}
+
+
+	/** Returns the client ID on the specified side. */
+	UInt32 GetClientID(size_t a_Side) const { return m_Sides[a_Side].m_ClientID; }
+
+	/** Returns the UDP port assigned to the client on the specified side. */
+	UInt16 GetPort(size_t a_Side) const { return m_Sides[a_Side].m_Port; }
+
+
+	/** Returns the side of the specified client. */
+	size_t GetSide(UInt32 a_ClientID) const { return (m_Sides[0].m_ClientID == a_ClientID) ? 0 : 1; }
+
+
+	/** Sets the UDP port from which the client on the specified side is going to send, as reported by the client.
+	Only a datagram from the client's IP address and this port may then latch the client's address.
+	Ignored once the client's address is latched. */
+	void SetExpectedPort(size_t a_Side, UInt16 a_Port)
+	{
+		cCSLock Lock(m_CS);
+		auto & Side = m_Sides[a_Side];
+		if (!Side.m_IsLatched)
+		{
+			Side.m_ExpectedPort = a_Port;
+		}
+	}
+
+
+	/** Returns the current counters. */
+	cAllocationStats GetStats(void)
+	{
+		cCSLock Lock(m_CS);
+		cAllocationStats res;
+		for (size_t i = 0; i < 2; i++)
+		{
+			res.m_ClientIDs[i]  = m_Sides[i].m_ClientID;
+			res.m_Ports[i]      = m_Sides[i].m_Port;
+			res.m_IsLatched[i]  = m_Sides[i].m_IsLatched;
+			res.m_NumPackets[i] = m_Sides[i].m_NumPackets;
+			res.m_NumBytes[i]   = m_Sides[i].m_NumBytes;
+		}
+		res.m_NumDropped = m_NumDropped;
+		return res;
+	}
+
+protected:
+
+	/** One client's side of the allocation: the UDP port assigned to the client and the client's latched address. */
+	class cSide:
+		public cUDPEndpoint::cCallbacks
+	{
+	public:
+		cAllocation * m_Allocation;
+
+		/** Index of this side in m_Allocation->m_Sides. */
+		size_t m_Index;
+
+		UInt32 m_ClientID;
+
+		/** The IP address of the client's TCP link; only datagrams from this IP address may latch the client's address. */
+		AString m_IP;
+
+		/** The UDP port reported by the client; if nonzero, only datagrams from this port may latch the client's address.
+		Protected by m_Allocation->m_CS. */
+		UInt16 m_ExpectedPort;
+
+		/** The endpoint receiving the client's datagrams and sending the peer's datagrams to the client. */
+		cUDPEndpointPtr m_Endpoint;
+
+		/** The local port of m_Endpoint, kept for reporting after the endpoint is closed. */
+		UInt16 m_Port;
+
+		/** The client's UDP address, valid only if m_IsLatched is true. Protected by m_Allocation->m_CS. */
+		sockaddr_storage m_Addr;
+		socklen_t m_AddrLen;
+		bool m_IsLatched;
+
+		/** Number of datagrams and bytes received from the client and relayed to the peer. Protected by m_Allocation->m_CS. */
+		UInt64 m_NumPackets;
+		UInt64 m_NumBytes;
+
+
+		cSide(void):
+			m_Allocation(nullptr),
+			m_Index(0),
+			m_ClientID(0),
+			m_ExpectedPort(0),
+			m_Port(0),
+			m_AddrLen(0),
+			m_IsLatched(false),
+			m_NumPackets(0),
+			m_NumBytes(0)
+		{
+		}
+
+
+		void Init(cAllocation & a_Allocation, size_t a_Index, UInt32 a_ClientID, const AString & a_IP)
+		{
+			m_Allocation = &a_Allocation;
+			m_Index = a_Index;
+			m_ClientID = a_ClientID;
+			m_IP = a_IP;
+		}
+
+		// cUDPEndpoint::cCallbacks overrides:
+		virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+		{
+			LOGWARNING("Relay port for client %u: %d (%s)", m_ClientID, a_ErrorCode, a_ErrorMsg.c_str());
+		}
+
+		virtual void OnReceivedData(const char * a_Data, size_t a_Size, const AString & a_RemoteHost, UInt16 a_RemotePort) override
+		{
+			// Not used, the endpoint always reports the datagrams through OnReceivedBatch()
+			UNUSED(a_Data);
+			UNUSED(a_Size);
+			UNUSED(a_RemoteHost);
+			UNUSED(a_RemotePort);
+		}
+
+		virtual void OnReceivedBatch(const cUDPEndpoint::cDatagram * a_Datagrams, size_t a_NumDatagrams) override
+		{
+			m_Allocation->Relay(m_Index, a_Datagrams, a_NumDatagrams);
+		}
+	};
+
+
+	/** Protects the latched addresses and the counters, and serializes relaying against closing. */
+	cCriticalSection m_CS;
+
+	/** Set when the allocation is being closed, no more datagrams are relayed. Protected by m_CS. */
+	bool m_IsClosed;
+
+	cSide m_Sides[2];
+
+	/** Number of datagrams dropped in either direction. Protected by m_CS. */
+	UInt64 m_NumDropped;
+
+
+	/** Relays the datagrams received from the client on side a_From to the client on the other side.
+	The datagrams are sent right out of the buffer they were received into, in batches. Called in the network thread. */
+	void Relay(size_t a_From, const cUDPEndpoint::cDatagram * a_Datagrams, size_t a_NumDatagrams)
+	{
+		cCSLock Lock(m_CS);
+		if (m_IsClosed)
+		{
+			return;
+		}
+		auto & Src = m_Sides[a_From];
+		auto & Dst = m_Sides[1 - a_From];
+
+		cUDPEndpoint::cDatagram Accepted[RELAY_BATCH_SIZE];
+		size_t NumAccepted = 0;
+		size_t NumBytes = 0;
+		auto Flush = [&]()
+		{
+			size_t NumSent = Dst.m_Endpoint->SendToBatch(Accepted, NumAccepted, reinterpret_cast<const sockaddr *>(&Dst.m_Addr), Dst.m_AddrLen);
+			Src.m_NumPackets += NumSent;
+			Src.m_NumBytes += NumBytes;
+			m_NumDropped += NumAccepted - NumSent;
+			NumAccepted = 0;
+			NumBytes = 0;
+		};
+
+		for (size_t i = 0; i < a_NumDatagrams; i++)
+		{
+			const auto & Datagram = a_Datagrams[i];
+			if (!Src.m_IsLatched)
+			{
+				// The first datagram from the client's IP address (and port, if the client reported it) latches the client's UDP address:
+				if (
+					(Src.m_IP != Datagram.m_RemoteHost) ||
+					((Src.m_ExpectedPort != 0) && (Src.m_ExpectedPort != Datagram.m_RemotePort)) ||
+					(static_cast<size_t>(Datagram.m_RemoteAddrLen) > sizeof(Src.m_Addr))
+				)
+				{
+					m_NumDropped += 1;
+					continue;
+				}
+				memcpy(&Src.m_Addr, Datagram.m_RemoteAddr, static_cast<size_t>(Datagram.m_RemoteAddrLen));
+				Src.m_AddrLen = Datagram.m_RemoteAddrLen;
+				Src.m_IsLatched = true;
+				LOGD("Relay port %d latched client %u at %s:%d", Src.m_Port, Src.m_ClientID, Datagram.m_RemoteHost, Datagram.m_RemotePort);
+			}
+			else if (!IsSameAddress(reinterpret_cast<const sockaddr *>(&Src.m_Addr), Datagram.m_RemoteAddr))
+			{
+				m_NumDropped += 1;
+				continue;
+			}
+			if (!Dst.m_IsLatched)
+			{
+				// The peer hasn't sent anything yet, its address is unknown:
+				m_NumDropped += 1;
+				continue;
+			}
+			Accepted[NumAccepted++] = Datagram;
+			NumBytes += Datagram.m_Size;
+			if (NumAccepted == RELAY_BATCH_SIZE)
+			{
+				Flush();
+			}
+		}
+		if (NumAccepted > 0)
+		{
+			Flush();
+		}
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cRelayEngine:
+
+cRelayEngine::cRelayEngine(cClientRegistry & a_Clients):
+	m_Clients(a_Clients),
+	m_MaxAllocations(1000)
+{
+}
+
+
+
+
+
+bool cRelayEngine::Allocate(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_ClientPort)
+{
+	cAllocationKey Key(std::min(a_ClientID, a_PeerID), std::max(a_ClientID, a_PeerID));
+	cAllocationPtr Allocation;
+	AString IPs[2];
+	{
+		cCSLock Lock(m_CS);
+		auto itr = m_Allocations.find(Key);
+		if (itr != m_Allocations.end())
+		{
+			// Already allocated (the peer asked first, or the request is repeated), only re-send the ports:
+			Allocation = itr->second;
+		}
+		else
+		{
+			auto Client = m_Clients.Find(static_cast<int>(Key.first));
+			auto Peer = m_Clients.Find(static_cast<int>(Key.second));
+			if (
+				(a_ClientID == a_PeerID) ||
+				(m_Allocations.size() >= m_MaxAllocations) ||
+				(Client == nullptr) || !Client->IsWorking() ||
+				(Peer == nullptr) || !Peer->IsWorking()
+			)
+			{
+				Lock.Unlock();
+				NotifyClient(a_ClientID, a_PeerID, 0);
+				return false;
+			}
+			IPs[0] = Client->GetIPString();
+			IPs[1] = Peer->GetIPString();
+		}
+	}
+
+	if (Allocation == nullptr)
+	{
+		// Open the ports outside the lock, so that the other clients' requests aren't held up by the OS calls:
+		auto NewAllocation = std::make_shared<cAllocation>(Key.first, IPs[0], Key.second, IPs[1]);
+		if (!NewAllocation->Open())
+		{
+			LOGWARNING("Cannot open the relay ports for clients %u and %u", Key.first, Key.second);
+			NotifyClient(a_ClientID, a_PeerID, 0);
+			return false;
+		}
+		{
+			cCSLock Lock(m_CS);
+			auto itr = m_Allocations.find(Key);
+			if (itr != m_Allocations.end())
+			{
+				// The peer's request has been allocated meanwhile, use that one:
+				Allocation = itr->second;
+			}
+			else if (m_Allocations.size() < m_MaxAllocations)
+			{
+				m_Allocations[Key] = NewAllocation;
+				Allocation = NewAllocation;
+			}
+		}
+		if (Allocation != NewAllocation)
+		{
+			NewAllocation->Close();
+			if (Allocation == nullptr)
+			{
+				NotifyClient(a_ClientID, a_PeerID, 0);
+				return false;
+			}
+		}
+		else
+		{
+			LOGD("Relay allocated for clients %u (port %d) and %u (port %d)",
+				Key.first, Allocation->GetPort(0), Key.second, Allocation->GetPort(1)
+			);
+		}
+	}
+
+	if (a_ClientPort != 0)
+	{
+		Allocation->SetExpectedPort(Allocation->GetSide(a_ClientID), a_ClientPort);
+	}
+
+	// Tell each client its own port:
+	NotifyClient(Allocation->GetClientID(0), Allocation->GetClientID(1), Allocation->GetPort(0));
+	NotifyClient(Allocation->GetClientID(1), Allocation->GetClientID(0), Allocation->GetPort(1));
+	return true;
+}
+
+
+
+
+
+void cRelayEngine::ReleaseClient(UInt32 a_ClientID)
+{
+	std::vector<cAllocationPtr> Released;
+	{
+		cCSLock Lock(m_CS);
+		for (auto itr = m_Allocations.begin(); itr != m_Allocations.end();)
+		{
+			if ((itr->first.first == a_ClientID) || (itr->first.second == a_ClientID))
+			{
+				Released.push_back(itr->second);
+				itr = m_Allocations.erase(itr);
+			}
+			else
+			{
+				++itr;
+			}
+		}
+	}
+
+	// Close the allocations and notify the peers outside the lock:
+	for (const auto & Allocation : Released)
+	{
+		Allocation->Close();
+		size_t PeerSide = (Allocation->GetClientID(0) == a_ClientID) ? 1 : 0;
+		NotifyClient(Allocation->GetClientID(PeerSide), a_ClientID, 0);
+	}
+}
+
+
+
+
+
+void cRelayEngine::ReleaseAll(void)
+{
+	cAllocations Released;
+	{
+		cCSLock Lock(m_CS);
+		std::swap(Released, m_Allocations);
+	}
+	for (const auto & Allocation : Released)
+	{
+		Allocation.second->Close();
+	}
+}
+
+
+
+
+
+cRelayEngine::cAllocationStatsList cRelayEngine::GetAllocationStats(void)
+{
+	// Copy the allocations out first, so that the engine isn't locked while waiting for the allocations' locks:
+	std::vector<cAllocationPtr> Allocations;
+	{
+		cCSLock Lock(m_CS);
+		Allocations.reserve(m_Allocations.size());
+		for (const auto & Allocation : m_Allocations)
+		{
+			Allocations.push_back(Allocation.second);
+		}
+	}
+	cAllocationStatsList res;
+	res.reserve(Allocations.size());
+	for (const auto & Allocation : Allocations)
+	{
+		res.push_back(Allocation->GetStats());
+	}
+	return res;
+}
+
+
+
+
+
+void cRelayEngine::NotifyClient(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_Port)
+{
+	auto Client = m_Clients.Find(static_cast<int>(a_ClientID));
+	if (Client != nullptr)
+	{
+		Client->SendRelayAllocated(a_PeerID, a_Port);
+	}
+}
+
+
+
+
@@ -0,0 +1,111 @@
+
+// RelayEngine.h
+
+// Interfaces to the cRelayEngine class that relays the UDP media between pairs of clients that cannot reach each other directly
+
+// When the UDP hole punching fails, one of the clients asks for a relay allocation through the TCP link
+// (RelayRequest packet, 0x13). The server opens a pair of UDP ports, one for each client, and tells each client
+// its own port (RelayAllocated packet, 0x13). Each client then sends its media to its port; the first datagram
+// that comes from the client's IP address latches the client's UDP address, further datagrams from other addresses
+// are dropped. The RelayRequest may also carry the UDP port the client sends from; the latching datagram then has to
+// come from that port too, so that another host behind the same NAT cannot take the client's place. Datagrams received on one port are sent out of the other port to the peer's latched address,
+// so each client sees the media coming from the same port it is sending to.
+// The allocation is released when either of the clients disconnects.
+
+
+
+
+
+#pragma once
+
+#include "OSSupport/Network.h"
+#include <map>
+
+
+
+
+
+// fwd:
+class cClientRegistry;
+
+
+
+
+
+class cRelayEngine
+{
+public:
+	/** Counters describing a single allocation, as reported by GetAllocationStats(). Index 0 and 1 are the two sides. */
+	struct cAllocationStats
+	{
+		/** The clients' IDs. */
+		UInt32 m_ClientIDs[2];
+
+		/** The local UDP ports assigned to the clients. */
+		UInt16 m_Ports[2];
+
+		/** True if the client's UDP address is already known. */
+		bool m_IsLatched[2];
+
+		/** Number of datagrams and bytes relayed from the client to its peer. */
+		UInt64 m_NumPackets[2];
+		UInt64 m_NumBytes[2];
+
+		/** Number of datagrams dropped because they came from a wrong address, or the peer's address wasn't known yet. */
+		UInt64 m_NumDropped;
+	};
+
+	typedef std::vector<cAllocationStats> cAllocationStatsList;
+
+
+	cRelayEngine(cClientRegistry & a_Clients);
+
+	/** Sets the maximum number of allocations that may exist at the same time. */
+	void SetMaxAllocations(size_t a_MaxAllocations) { m_MaxAllocations = a_MaxAllocations; }
+
+	/** Creates the allocation between the two clients, unless it already exists, and sends each client its relay port.
+	Both clients need to be logged in. If the allocation cannot be created, the requesting client is sent a zero port.
+	a_ClientPort is the UDP port the requesting client sends from, as reported in its request; zero if not known.
+	Returns true if the allocation exists after the call. */
+	bool Allocate(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_ClientPort = 0);
+
+	/** Releases all the allocations of the specified client. The peers are notified by a zero port.
+	Must not be called from the network thread. */
+	void ReleaseClient(UInt32 a_ClientID);
+
+	/** Releases all the allocations, without notifying the clients. */
+	void ReleaseAll(void);
+
+	/** Returns the counters of all the current allocations. */
+	cAllocationStatsList GetAllocationStats(void);
+
+protected:
+
+	class cAllocation;
+	typedef std::shared_ptr<cAllocation> cAllocationPtr;
+
+	/** The allocations are keyed by the client IDs, the lower one first. */
+	typedef std::pair<UInt32, UInt32> cAllocationKey;
+	typedef std::map<cAllocationKey, cAllocationPtr> cAllocations;
+
+
+	/** The clients connected to the server, used for verifying and notifying the clients. */
+	cClientRegistry & m_Clients;
+
+	/** Protects m_Allocations against multithreaded access. */
+	cCriticalSection m_CS;
+
+	/** All the current allocations. Protected by m_CS. */
+	cAllocations m_Allocations;
+
+	/** The maximum number of allocations that may exist at the same time. */
+	size_t m_MaxAllocations;
+
+
+	/** Sends the relay port to the specified client, if it is still connected. */
+	void NotifyClient(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_Port);
+};
+
+
+
+
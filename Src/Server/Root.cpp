@@ -5,6 +5,7 @@
 #include "Server.h"
 #include "CommandOutput.h"
 #include "LoggerListeners.h"
+#include "BinaryLogFile.h"
 #include "IniFile.h"
 #include "SettingsRepositoryInterface.h"
 #include "OverridesSettingsRepository.h"
@@ -24,6 +25,13 @@
 
 
 
+// fwd: main.cpp:
+extern bool g_ShouldLogCommIn, g_ShouldLogCommOut;
+
+
+
+
+
 cRoot * cRoot::s_Root = nullptr;
 bool cRoot::m_ShouldStop = false;
 
@@ -101,7 +109,7 @@ void cRoot::Start(std::unique_ptr<cSettingsRepositoryInterface> overridesRepo)
 		LOGERROR("Failed to open log file, aborting");
 		return;
 	}
-	auto fileAttachment = cLogger::GetInstance().AttachListener(std::move(fileLogListenerRet.second));
+	auto fileAttachment = cpp14::make_unique<cLogger::cAttachment>(cLogger::GetInstance().AttachListener(std::move(fileLogListenerRet.second)));
 
 	LOG("--- Started Log ---");
 
@@ -114,6 +122,52 @@ void cRoot::Start(std::unique_ptr<cSettingsRepositoryInterface> overridesRepo)
 }
 	auto settingsRepo = cpp14::make_unique<cOverridesSettingsRepository>(std::move(IniFile), std::move(overridesRepo));
 
+	// Move the listeners' I/O off the logging threads:
+	if (settingsRepo->GetValueSetB("Logging", "Async", true))
+	{
+		int QueueSize = settingsRepo->GetValueSetI("Logging", "QueueSize", 16384);
+		AString Overflow = settingsRepo->GetValueSet("Logging", "Overflow", "Block");
+		cLogger::eOverflowPolicy Policy = cLogger::opBlock;
+		if (NoCaseCompare(Overflow, "Drop") == 0)
+		{
+			Policy = cLogger::opDrop;
+		}
+		else if (NoCaseCompare(Overflow, "Block") != 0)
+		{
+			LOGWARNING("Unknown [Logging] Overflow policy \"%s\", using Block", Overflow.c_str());
+		}
+		cLogger::GetInstance().StartAsync(static_cast<size_t>(std::max(QueueSize, 1)), Policy);
+	}
+
+	// Replace the text log file with the binary one, if requested; the deferred messages then aren't formatted at all,
+	// unless the console shows them:
+	if (settingsRepo->GetValueSetB("Logging", "Binary", false))
+	{
+		AString FileName = Printf("%slogs/LOG_%d.bin", FILE_IO_PREFIX, static_cast<int>(time(nullptr)));
+		std::unique_ptr<cBinaryLogFile> BinaryLog(new cBinaryLogFile);
+		if (BinaryLog->Open(FileName))
+		{
+			LOG("Logging into the binary file \"%s\", decode it with --log-decode", FileName.c_str());
+			fileAttachment.reset(new cLogger::cAttachment(cLogger::GetInstance().AttachListener(std::move(BinaryLog))));
+		}
+		else
+		{
+			LOGWARNING("Cannot open the binary log file \"%s\", logging into the text file", FileName.c_str());
+		}
+	}
+
+	// Open the comm capture, if requested on the command line:
+	if (g_ShouldLogCommIn || g_ShouldLogCommOut)
+	{
+		int CaptureSizeMiB = settingsRepo->GetValueSetI("Capture", "MaxSizeMiB", 256);
+		cFile::CreateFolder("CommLogs");
+		AString FileName = Printf("CommLogs/capture_%x.bin", static_cast<unsigned>(time(nullptr)));
+		if (m_CommCapture.Open(FileName, static_cast<size_t>(std::max(CaptureSizeMiB, 1)) MiB))
+		{
+			LOG("Capturing the client communication into \"%s\"", FileName.c_str());
+		}
+	}
+
 	m_ShouldStop = false;
 	while (!m_ShouldStop)
 	{
@@ -197,7 +251,13 @@ void cRoot::Start(std::unique_ptr<cSettingsRepositoryInterface> overridesRepo)
 
 	settingsRepo->Flush();
 
+	// All the clients are gone by now, nothing captures anymore:
+	m_CommCapture.Close();
+
 	LOG("--- Stopped Log ---");
+
+	// Write out the queued messages before the listeners are detached:
+	cLogger::GetInstance().StopAsync();
 }
 
 
@@ -2,6 +2,7 @@
 #pragma once
 
 #include "Protocol/Authenticator.h"
+#include "Protocol/CommCapture.h"
 #include <thread>
 
 
@@ -55,6 +56,7 @@ public:
 	/** The current time where the startup of the server has been completed */
 	std::chrono::steady_clock::time_point m_StartTime;
 	cAuthenticator &   GetAuthenticator  (void) { return m_Authenticator; }
+	cCommCapture &     GetCommCapture    (void) { return m_CommCapture; }
 
 	/** Queues a console command for execution through the cServer class.
 	The command will be executed in the tick thread
@@ -115,6 +117,9 @@ private:
 
 	cAuthenticator     m_Authenticator;
 
+	/** The capture of the clients' protocol frames, open only if requested on the command line (--log-comm). */
+	cCommCapture m_CommCapture;
+
 	bool m_bRestart;
 
 
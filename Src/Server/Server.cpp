@@ -6,6 +6,8 @@
 #include "ClientHandle.h"
 #include "Root.h"
 #include "CommandOutput.h"
+#include "Logger.h"
+#include "SegmentedByteBuffer.h"
 
 #include "IniFile.h"
 
@@ -93,22 +95,33 @@ cServer::cTickThread::cTickThread(cServer & a_Server) :
 void cServer::cTickThread::Execute(void)
 {
 	auto LastTime = std::chrono::steady_clock::now();
+	auto NextTickTime = LastTime;
 	static const auto msPerTick = std::chrono::milliseconds(50);
 
 	while (!m_ShouldTerminate)
 	{
 		auto NowTime = std::chrono::steady_clock::now();
-		auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(NowTime - LastTime).count();
-		m_ShouldTerminate = !m_Server.Tick(static_cast<float>(msec));
-		auto TickTime = std::chrono::steady_clock::now() - NowTime;
-
-		if (TickTime < msPerTick)
+		if (NowTime >= NextTickTime)
+		{
+			auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(NowTime - LastTime).count();
+			m_ShouldTerminate = !m_Server.Tick(static_cast<float>(msec));
+			LastTime = NowTime;
+			NextTickTime = NowTime + msPerTick;
+		}
+		else
 		{
-			// Stretch tick time until it's at least msPerTick
-			std::this_thread::sleep_for(msPerTick - TickTime);
+			// Woken up before the tick by a client that has data to process:
+			m_Server.TickReadyClients();
 		}
 
-		LastTime = NowTime;
+		// Sleep until the next tick, unless a client becomes ready sooner:
+		auto WaitTime = NextTickTime - std::chrono::steady_clock::now();
+		if (WaitTime.count() > 0)
+		{
+			// Round up, so that the thread doesn't spin through the last fraction of a millisecond:
+			auto WaitMSec = std::chrono::duration_cast<std::chrono::milliseconds>(WaitTime).count() + 1;
+			m_WakeUpEvent.Wait(static_cast<unsigned>(WaitMSec));
+		}
 	}
 }
 
@@ -120,11 +133,20 @@ void cServer::cTickThread::Execute(void)
 // cServer:
 
 cServer::cServer(void) :
+	m_StunServer(m_Clients),
+	m_Relays(m_Clients),
 	m_PlayerCount(0),
 	m_PlayerCountDiff(0),
 	m_bIsConnected(false),
 	m_bRestarting(false),
-	m_TickThread(*this)
+	m_TickThread(*this),
+	m_NumListenSockets(1),
+	m_ShouldDispatchImmediately(false),
+	m_MaxReceiveBufferSize(1 MiB),
+	m_ShouldStartStun(true),
+	m_StunPort(3478),
+	m_StunRegistrationTimeout(120),
+	m_IsRelayEnabled(true)
 {
 }
 
@@ -153,6 +175,18 @@ bool cServer::InitServer(cSettingsRepositoryInterface & a_Settings, bool a_Shoul
 	}
 
 	m_Port = a_Settings.GetValueSetI("Server", "Port", 6666);
+	m_ShouldDispatchImmediately = a_Settings.GetValueSetB("Server", "ImmediateDispatch", false);
+	cNetwork::SetNumThreads(static_cast<unsigned>(std::max(a_Settings.GetValueSetI("Network", "Threads", 1), 1)));
+	m_NumListenSockets = static_cast<unsigned>(std::max(a_Settings.GetValueSetI("Network", "ListenSockets", 1), 1));
+	cNetwork::SetSingleOwnerLinks(a_Settings.GetValueSetB("Network", "SingleOwnerLinks", false));
+	m_MaxReceiveBufferSize = static_cast<size_t>(std::max(a_Settings.GetValueSetI("Network", "MaxReceiveBufferKiB", 1024), 1)) * 1024;
+	cSegmentedByteBuffer::SetMaxPooledChunks(static_cast<size_t>(std::max(a_Settings.GetValueSetI("Network", "BufferPoolChunks", 1024), 0)));
+	m_ShouldStartStun = a_Settings.GetValueSetB("STUN", "Enabled", true);
+	m_StunPort = static_cast<UInt16>(a_Settings.GetValueSetI("STUN", "Port", 3478));
+	m_StunRegistrationTimeout = std::chrono::seconds(std::max(a_Settings.GetValueSetI("STUN", "RegistrationTimeout", 120), 1));
+	m_IsRelayEnabled = a_Settings.GetValueSetB("Relay", "Enabled", true);
+	m_Relays.SetMaxAllocations(static_cast<size_t>(std::max(a_Settings.GetValueSetI("Relay", "MaxAllocations", 1000), 0)));
+	m_RelayLatency.Reset();
 
 	m_bIsConnected = true;
 
@@ -175,15 +209,11 @@ int cServer::GetNumPlayers(void) const
 
 bool cServer::IsPlayerInQueue(AString a_Username)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto client : m_Clients)
-	{
-		if ((client->GetUsername()).compare(a_Username) == 0)
+	return !m_Clients.ForEachClient([&](const cClientHandlePtr & a_Client)
 		{
-			return true;
+			return (a_Client->GetUsername().compare(a_Username) == 0);
 		}
-	}
-	return false;
+	);
 }
 
 
@@ -193,10 +223,18 @@ bool cServer::IsPlayerInQueue(AString a_Username)
 
 cTCPLink::cCallbacksPtr cServer::OnConnectionAccepted(const AString & a_RemoteIPAddress)
 {
-	LOGD("Client \"%s\" connected!", a_RemoteIPAddress.c_str());
-	cClientHandlePtr NewHandle = std::make_shared<cClientHandle>(a_RemoteIPAddress);
-	cCSLock Lock(m_CSClients);
-	m_Clients.push_back(NewHandle);
+	FASTLOGD("Client \"%s\" connected!", a_RemoteIPAddress.c_str());
+	cClientHandlePtr NewHandle = std::make_shared<cClientHandle>(a_RemoteIPAddress, m_ShouldDispatchImmediately);
+	int ClientID = NewHandle->GetUniqueID();
+	NewHandle->m_TickTimer.SetCallback([this, ClientID]()
+		{
+			OnClientTimerExpired(ClientID);
+		}
+	);
+	m_Clients.Add(NewHandle);
+
+	// Let the tick thread schedule the client's timeout:
+	QueueClientTick(*NewHandle);
 	return NewHandle;
 }
 
@@ -219,8 +257,12 @@ bool cServer::Tick(float a_Dt)
 	// Let the Root process all the queued commands:
 	cRoot::Get()->TickCommands();
 
-	// Tick all clients not yet assigned to a world:
-	TickClients(a_Dt);
+	// Process the clients that have data pending or a timer expired:
+	TickReadyClients();
+	TickClientTimers();
+
+	// Send out the presence changes collected since the last tick:
+	m_Presence.Tick(m_Clients);
 
 	if (!m_bRestarting)
 	{
@@ -238,43 +280,94 @@ bool cServer::Tick(float a_Dt)
 
 
 
-void cServer::TickClients(float a_Dt)
+void cServer::QueueClientTick(cClientHandle & a_Client)
 {
-	cClientHandlePtrs RemoveClients;
+	if (a_Client.m_IsQueuedForTick.exchange(true))
+	{
+		// Already queued, the tick thread hasn't got to it yet
+		return;
+	}
+	if (m_TickScheduler.AddReady(a_Client.GetUniqueID()))
 	{
-		cCSLock Lock(m_CSClients);
+		m_TickThread.WakeUp();
+	}
+}
+
+
 
-		// Remove clients that have moved to a world (the world will be ticking them from now on)
-		for (auto itr = m_ClientsToRemove.begin(), end = m_ClientsToRemove.end(); itr != end; ++itr)
+
+
+void cServer::TickReadyClients(void)
+{
+	// The clients are looked up in m_Clients, no lock is held while they're processed, so that the network
+	// and authenticator threads can keep relaying to and from them:
+	m_TickScheduler.TakeReady(m_ReadyClients);
+	for (auto ClientID : m_ReadyClients)
+	{
+		auto Client = m_Clients.Find(ClientID);
+		if (Client == nullptr)
 		{
-			for (auto itrC = m_Clients.begin(), endC = m_Clients.end(); itrC != endC; ++itrC)
-			{
-				if (itrC->get() == *itr)
-				{
-					m_Clients.erase(itrC);
-					break;
-				}
-			}
-		}  // for itr - m_ClientsToRemove[]
-		m_ClientsToRemove.clear();
-
-		// Tick the remaining clients, take out those that have been destroyed into RemoveClients
-		for (auto itr = m_Clients.begin(); itr != m_Clients.end();)
+			// Already removed
+			continue;
+		}
+
+		// Clear the flag before processing, so that any data arriving meanwhile queues the client again:
+		Client->m_IsQueuedForTick = false;
+		if (Client->IsDestroyed())
 		{
-			if ((*itr)->IsDestroyed())
-			{
-				// Delete the client later, when CS is not held, to avoid deadlock: http://forum.mc-server.org/showthread.php?tid=374
-				RemoveClients.push_back(*itr);
-				itr = m_Clients.erase(itr);
-				continue;
-			}
-			(*itr)->ServerTick(a_Dt);
-			++itr;
-		}  // for itr - m_Clients[]
+			RemoveClient(*Client);
+			continue;
+		}
+		Client->ServerTick();
+
+		// Re-arm the timer, the client may have just connected, become working or received data postponing its timeout:
+		m_TickScheduler.Schedule(Client->m_TickTimer, Client->CheckTimers(std::chrono::steady_clock::now()));
+	}  // for ClientID - m_ReadyClients[]
+}
+
+
+
+
+
+void cServer::TickClientTimers(void)
+{
+	// Calls OnClientTimerExpired() for each expired timer:
+	m_TickScheduler.Advance(std::chrono::steady_clock::now());
+}
+
+
+
+
+
+void cServer::OnClientTimerExpired(int a_ClientID)
+{
+	// Hold a reference while processing, RemoveClient() may release the last other one:
+	auto Client = m_Clients.Find(a_ClientID);
+	if (Client == nullptr)
+	{
+		// The timer is cancelled when the client is removed, so this shouldn't happen
+		ASSERT(!"Timer expired for a removed client");
+		return;
 	}
+	if (Client->IsDestroyed())
+	{
+		RemoveClient(*Client);
+		return;
+	}
+	m_TickScheduler.Schedule(Client->m_TickTimer, Client->CheckTimers(std::chrono::steady_clock::now()));
+}
+
+
+
+
 
-	// Delete the clients that have been destroyed
-	RemoveClients.clear();
+void cServer::RemoveClient(cClientHandle & a_Client)
+{
+	// The caller still holds a reference, the client gets deleted when it's released, outside of any lock:
+	// http://forum.mc-server.org/showthread.php?tid=374
+	m_TickScheduler.Cancel(a_Client.m_TickTimer);
+	m_Clients.Remove(a_Client.GetUniqueID());
+	m_Relays.ReleaseClient(static_cast<UInt32>(a_Client.GetUniqueID()));
 }
 
 
@@ -283,7 +376,7 @@ void cServer::TickClients(float a_Dt)
 
 bool cServer::Start(void)
 {
-	auto Handle = cNetwork::Listen(m_Port, std::make_shared<cServerListenCallbacks>(*this, m_Port));
+	auto Handle = cNetwork::Listen(m_Port, std::make_shared<cServerListenCallbacks>(*this, m_Port), m_NumListenSockets);
 	if (Handle->IsListening())
 	{
 		m_ServerHandle = Handle;
@@ -293,6 +386,11 @@ bool cServer::Start(void)
 		LOGERROR("Couldn't open port. Aborting the server");
 		return false;
 	}
+	if (m_ShouldStartStun && !m_StunServer.Start(m_StunPort, m_StunRegistrationTimeout))
+	{
+		// The clients can still connect and relay through the server, only the hole punching is unavailable
+		LOGWARNING("Couldn't open the STUN port %d, the STUN server is disabled", m_StunPort);
+	}
 	if (!m_TickThread.Start())
 	{
 		return false;
@@ -329,6 +427,108 @@ void cServer::ExecuteConsoleCommand(const AString & a_Cmd, cCommandOutputCallbac
 		a_Output.Finished();
 		return;
 	}
+	else if (split[0] == "lockstats")
+	{
+		PrintLockStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "presence")
+	{
+		PrintPresenceStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "relaystats")
+	{
+		if ((split.size() > 1) && (split[1] == "reset"))
+		{
+			m_RelayLatency.Reset();
+			a_Output.Out("Relay latency statistics reset");
+		}
+		else
+		{
+			PrintRelayStats(a_Output);
+		}
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "stun")
+	{
+		PrintStunStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "relays")
+	{
+		PrintRelays(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "authstats")
+	{
+		if ((split.size() > 1) && (split[1] == "reset"))
+		{
+			cRoot::Get()->GetAuthenticator().ResetStats();
+			a_Output.Out("Authentication latency statistics reset");
+		}
+		else
+		{
+			PrintAuthStats(a_Output);
+		}
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "authcache")
+	{
+		auto & Cache = cRoot::Get()->GetAuthenticator().GetCache();
+		if ((split.size() > 2) && (split[1] == "clear"))
+		{
+			size_t NumRemoved = Cache.Invalidate(split[2]);
+			a_Output.Out(Printf("Removed %u cached results of user %s", static_cast<unsigned>(NumRemoved), split[2].c_str()));
+		}
+		else if ((split.size() > 1) && (split[1] == "clear"))
+		{
+			Cache.Clear();
+			a_Output.Out("Authentication cache cleared");
+		}
+		else
+		{
+			PrintAuthCacheStats(a_Output);
+		}
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "logstats")
+	{
+		PrintLogStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "capture")
+	{
+		PrintCaptureStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "buffers")
+	{
+		PrintBufferStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "pools")
+	{
+		PrintPoolStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
+	else if (split[0] == "tickstats")
+	{
+		PrintTickStats(a_Output);
+		a_Output.Finished();
+		return;
+	}
 
 
 	a_Output.Out("Unknown command, type 'help' for all commands.");
@@ -348,26 +548,273 @@ void cServer::PrintHelp(const AStringVector & a_Split, cCommandOutputCallback &
 
 
 
+
+
+void cServer::PrintLockStats(cCommandOutputCallback & a_Output)
+{
+	size_t TotalClients = 0;
+	UInt64 TotalLocks = 0, TotalContended = 0;
+	for (size_t i = 0; i < cClientRegistry::NUM_SHARDS; i++)
+	{
+		auto Stats = m_Clients.GetShardStats(i);
+		a_Output.Out(Printf("Shard %2u: %6u clients, %10llu locks, %8llu contended",
+			static_cast<unsigned>(i), static_cast<unsigned>(Stats.m_NumClients),
+			static_cast<unsigned long long>(Stats.m_NumLocks), static_cast<unsigned long long>(Stats.m_NumContended)
+		));
+		TotalClients += Stats.m_NumClients;
+		TotalLocks += Stats.m_NumLocks;
+		TotalContended += Stats.m_NumContended;
+	}
+	a_Output.Out(Printf("Total:    %6u clients, %10llu locks, %8llu contended",
+		static_cast<unsigned>(TotalClients),
+		static_cast<unsigned long long>(TotalLocks), static_cast<unsigned long long>(TotalContended)
+	));
+}
+
+
+
+
+
+void cServer::PrintPresenceStats(cCommandOutputCallback & a_Output)
+{
+	auto Stats = m_Presence.GetStats();
+	a_Output.Out(Printf("Roster size: %u users", static_cast<unsigned>(Stats.m_RosterSize)));
+	a_Output.Out(Printf("Changes: %llu reported, %llu coalesced, %llu dropped",
+		static_cast<unsigned long long>(Stats.m_NumChanges),
+		static_cast<unsigned long long>(Stats.m_NumCoalesced),
+		static_cast<unsigned long long>(Stats.m_NumDropped)
+	));
+	a_Output.Out(Printf("Deltas sent: %llu packets, %llu entries",
+		static_cast<unsigned long long>(Stats.m_NumDeltaPackets),
+		static_cast<unsigned long long>(Stats.m_NumDeltaEntries)
+	));
+	a_Output.Out(Printf("Snapshots sent: %llu packets, %llu entries",
+		static_cast<unsigned long long>(Stats.m_NumSnapshots),
+		static_cast<unsigned long long>(Stats.m_NumSnapshotEntries)
+	));
+}
+
+
+
+
+
+void cServer::PrintRelayStats(cCommandOutputCallback & a_Output)
+{
+	a_Output.Out(Printf("Dispatch mode: %s", m_ShouldDispatchImmediately ? "immediate" : "tick"));
+	a_Output.Out(Printf("Relay latency: %s", m_RelayLatency.Format().c_str()));
+}
+
+
+
+
+
+void cServer::PrintStunStats(cCommandOutputCallback & a_Output)
+{
+	if (!m_StunServer.IsRunning())
+	{
+		a_Output.Out("STUN server is not running");
+		return;
+	}
+	auto Stats = m_StunServer.GetStats();
+	a_Output.Out(Printf("STUN port: %d", m_StunPort));
+	a_Output.Out(Printf("Requests: %llu bindings, %llu registrations, %llu lookups",
+		static_cast<unsigned long long>(Stats.m_NumBindings),
+		static_cast<unsigned long long>(Stats.m_NumRegistrations),
+		static_cast<unsigned long long>(Stats.m_NumLookups)
+	));
+	a_Output.Out(Printf("Errors sent: %llu, invalid datagrams dropped: %llu",
+		static_cast<unsigned long long>(Stats.m_NumErrors),
+		static_cast<unsigned long long>(Stats.m_NumInvalid)
+	));
+	a_Output.Out(Printf("Registered clients: %u", static_cast<unsigned>(Stats.m_NumRegistered)));
+}
+
+
+
+
+
+void cServer::PrintRelays(cCommandOutputCallback & a_Output)
+{
+	auto Allocations = m_Relays.GetAllocationStats();
+	UInt64 TotalPackets = 0, TotalBytes = 0, TotalDropped = 0;
+	for (const auto & Alloc : Allocations)
+	{
+		a_Output.Out(Printf("Clients %u <-> %u, ports %d / %d%s: %llu / %llu packets, %llu / %llu bytes, %llu dropped",
+			Alloc.m_ClientIDs[0], Alloc.m_ClientIDs[1], Alloc.m_Ports[0], Alloc.m_Ports[1],
+			(Alloc.m_IsLatched[0] && Alloc.m_IsLatched[1]) ? "" : " (waiting)",
+			static_cast<unsigned long long>(Alloc.m_NumPackets[0]), static_cast<unsigned long long>(Alloc.m_NumPackets[1]),
+			static_cast<unsigned long long>(Alloc.m_NumBytes[0]), static_cast<unsigned long long>(Alloc.m_NumBytes[1]),
+			static_cast<unsigned long long>(Alloc.m_NumDropped)
+		));
+		TotalPackets += Alloc.m_NumPackets[0] + Alloc.m_NumPackets[1];
+		TotalBytes += Alloc.m_NumBytes[0] + Alloc.m_NumBytes[1];
+		TotalDropped += Alloc.m_NumDropped;
+	}
+	a_Output.Out(Printf("Total: %u allocations, %llu packets, %llu bytes, %llu dropped",
+		static_cast<unsigned>(Allocations.size()), static_cast<unsigned long long>(TotalPackets),
+		static_cast<unsigned long long>(TotalBytes), static_cast<unsigned long long>(TotalDropped)
+	));
+}
+
+
+
+void cServer::PrintAuthStats(cCommandOutputCallback & a_Output)
+{
+	auto & Authenticator = cRoot::Get()->GetAuthenticator();
+	auto Stats = Authenticator.GetStats();
+	a_Output.Out(Printf("Workers: %u, queue: %u (peak %u)",
+		static_cast<unsigned>(Stats.m_NumWorkers), static_cast<unsigned>(Stats.m_QueueSize), static_cast<unsigned>(Stats.m_MaxQueueSizeSeen)
+	));
+	a_Output.Out(Printf("Requests: %llu queued, %llu rejected (queue full), %llu succeeded, %llu failed",
+		static_cast<unsigned long long>(Stats.m_NumRequests), static_cast<unsigned long long>(Stats.m_NumRejected),
+		static_cast<unsigned long long>(Stats.m_NumSucceeded), static_cast<unsigned long long>(Stats.m_NumFailed)
+	));
+	a_Output.Out(Printf("Queue wait: %s", Authenticator.GetQueueLatency().Format().c_str()));
+	a_Output.Out(Printf("Credential check: %s", Authenticator.GetCheckLatency().Format().c_str()));
+	a_Output.Out(Printf("Total: %s", Authenticator.GetTotalLatency().Format().c_str()));
+}
+
+
+
+void cServer::PrintAuthCacheStats(cCommandOutputCallback & a_Output)
+{
+	auto Stats = cRoot::Get()->GetAuthenticator().GetCache().GetStats();
+	UInt64 NumLookups = Stats.m_NumHits + Stats.m_NumMisses;
+	a_Output.Out(Printf("Entries: %u / %u", static_cast<unsigned>(Stats.m_Size), static_cast<unsigned>(Stats.m_MaxSize)));
+	a_Output.Out(Printf("Lookups: %llu hits, %llu misses (%llu expired), hit rate %.1f %%",
+		static_cast<unsigned long long>(Stats.m_NumHits), static_cast<unsigned long long>(Stats.m_NumMisses),
+		static_cast<unsigned long long>(Stats.m_NumExpired),
+		(NumLookups > 0) ? (100.0 * static_cast<double>(Stats.m_NumHits) / static_cast<double>(NumLookups)) : 0.0
+	));
+	a_Output.Out(Printf("Evictions: %llu", static_cast<unsigned long long>(Stats.m_NumEvictions)));
+	a_Output.Out(Printf("Outdated results dropped: %llu", static_cast<unsigned long long>(Stats.m_NumOutdated)));
+}
+
+
+
+
+
+void cServer::PrintLogStats(cCommandOutputCallback & a_Output)
+{
+	auto Stats = cLogger::GetInstance().GetAsyncStats();
+	if (!Stats.m_IsAsync)
+	{
+		a_Output.Out("Logging is synchronous");
+		return;
+	}
+	a_Output.Out(Printf("Queue: %u / %u messages", static_cast<unsigned>(Stats.m_QueueSize), static_cast<unsigned>(Stats.m_MaxQueueSize)));
+	a_Output.Out(Printf("Written: %llu messages in %llu batches",
+		static_cast<unsigned long long>(Stats.m_NumWritten), static_cast<unsigned long long>(Stats.m_NumBatches)
+	));
+	a_Output.Out(Printf("Overflows: %llu dropped, %llu blocked",
+		static_cast<unsigned long long>(Stats.m_NumDropped), static_cast<unsigned long long>(Stats.m_NumBlocked)
+	));
+}
+
+
+
+
+
+void cServer::PrintCaptureStats(cCommandOutputCallback & a_Output)
+{
+	auto & Capture = cRoot::Get()->GetCommCapture();
+	if (!Capture.IsOpen())
+	{
+		a_Output.Out("The comm capture is not running, start the server with --log-comm to capture");
+		return;
+	}
+	auto Stats = Capture.GetStats();
+	a_Output.Out(Printf("Capture file: %s", Capture.GetFileName().c_str()));
+	a_Output.Out(Printf("Used: %u / %u KiB", static_cast<unsigned>(Stats.m_Used / 1024), static_cast<unsigned>(Stats.m_Capacity / 1024)));
+	a_Output.Out(Printf("Frames: %llu captured, %llu dropped",
+		static_cast<unsigned long long>(Stats.m_NumRecords), static_cast<unsigned long long>(Stats.m_NumDropped)
+	));
+}
+
+
+
+void cServer::PrintBufferStats(cCommandOutputCallback & a_Output)
+{
+	auto Stats = cSegmentedByteBuffer::GetPoolStats();
+	size_t NumClients = m_Clients.GetNumClients();
+	a_Output.Out(Printf("Receive buffer limit: %u KiB per client", static_cast<unsigned>(m_MaxReceiveBufferSize / 1024)));
+	a_Output.Out(Printf("Chunks in use: %u (%u KiB), pooled: %u (depot limit %u), allocated so far: %llu",
+		static_cast<unsigned>(Stats.m_NumInUse), static_cast<unsigned>(Stats.m_NumInUse * cSegmentedByteBuffer::CHUNK_SIZE / 1024),
+		static_cast<unsigned>(Stats.m_NumCached), static_cast<unsigned>(Stats.m_MaxCached),
+		static_cast<unsigned long long>(Stats.m_NumHeapAllocations)
+	));
+	if (NumClients > 0)
+	{
+		a_Output.Out(Printf("Clients: %u, buffered bytes per client: %u",
+			static_cast<unsigned>(NumClients), static_cast<unsigned>(Stats.m_NumInUse * cSegmentedByteBuffer::CHUNK_SIZE / NumClients)
+		));
+	}
+}
+
+
+
+
+
+void cServer::PrintPoolStats(cCommandOutputCallback & a_Output)
+{
+	for (const auto & Stats : cBlockPool::GetAllStats())
+	{
+		a_Output.Out(Printf("%s (%u-byte blocks): %u in use, high-water %u, %u cached (depot limit %u), %u threads",
+			Stats.m_Name.c_str(), static_cast<unsigned>(Stats.m_BlockSize),
+			static_cast<unsigned>(Stats.m_NumInUse), static_cast<unsigned>(Stats.m_HighWater),
+			static_cast<unsigned>(Stats.m_NumCached), static_cast<unsigned>(Stats.m_MaxCached), static_cast<unsigned>(Stats.m_NumThreads)
+		));
+		a_Output.Out(Printf("  allocations: %llu, of which from the heap: %llu, cross-thread frees: %llu",
+			static_cast<unsigned long long>(Stats.m_NumAllocations), static_cast<unsigned long long>(Stats.m_NumHeapAllocations),
+			static_cast<unsigned long long>(Stats.m_NumRemoteFrees)
+		));
+	}
+}
+
+
+
+
+
+void cServer::PrintTickStats(cCommandOutputCallback & a_Output)
+{
+	auto Stats = m_TickScheduler.GetStats();
+	a_Output.Out(Printf("Clients: %u, pending timers: %u",
+		static_cast<unsigned>(m_Clients.GetNumClients()), static_cast<unsigned>(Stats.m_NumTimers)
+	));
+	a_Output.Out(Printf("Timers scheduled: %llu, expired: %llu; clients marked ready: %llu",
+		static_cast<unsigned long long>(Stats.m_NumScheduled), static_cast<unsigned long long>(Stats.m_NumExpired),
+		static_cast<unsigned long long>(Stats.m_NumReady)
+	));
+}
+
+
+
+
+
 void cServer::Shutdown(void)
 {
 	// Stop listening on all sockets:
 	m_ServerHandle->Close();
 	m_ServerHandle.reset();
+	m_StunServer.Stop();
+	m_Relays.ReleaseAll();
 
 // 	LOGD("Shutting down database pool...");
 // 	CDBManager::UnInstance();
 
 	// Notify the tick thread and wait for it to terminate:
 	m_bRestarting = true;
+	m_TickThread.WakeUp();
 	m_RestartEvent.Wait();
 
-	// Remove all clients:
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	// Remove all clients; the tick thread has finished, so their timers can be cancelled here:
+	cClientHandlePtrs RemoveClients;
+	m_Clients.RemoveAll(RemoveClients);
+	for (const auto & Client : RemoveClients)
 	{
-		(*itr)->Destroy();
+		m_TickScheduler.Cancel(Client->m_TickTimer);
+		Client->Destroy();
 	}
-	m_Clients.clear();
 }
 
 
@@ -376,14 +823,11 @@ void cServer::Shutdown(void)
 
 void cServer::KickUser(int a_ClientID, const int & a_Reason)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	auto Client = m_Clients.Find(a_ClientID);
+	if (Client != nullptr)
 	{
-		if ((*itr)->GetUniqueID() == a_ClientID)
-		{
-			(*itr)->Kick(a_Reason);
-		}
-	}  // for itr - m_Clients[]
+		Client->Kick(a_Reason);
+	}
 }
 
 
@@ -392,57 +836,48 @@ void cServer::KickUser(int a_ClientID, const int & a_Reason)
 
 void cServer::AuthenticateUser(int a_ClientID, const AString & a_Name, const AString & a_Password, const Json::Value & a_Properties)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	auto Client = m_Clients.Find(a_ClientID);
+	if (Client != nullptr)
 	{
-		if ((*itr)->GetUniqueID() == a_ClientID)
-		{
-			(*itr)->Authenticate(a_Name, a_Password, a_Properties);
-			return;
-		}
-	}  // for itr - m_Clients[]
+		Client->Authenticate(a_Name, a_Password, a_Properties);
+	}
 }
 
 void cServer::BroadcastUserInfo(cClientHandle* pClient)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	m_Presence.UserChanged(static_cast<UInt32>(pClient->GetUniqueID()), pClient->GetUsername(), static_cast<UInt32>(pClient->m_State.load()));
+}
+
+void cServer::ForwardMedia(UInt32 to_id, UInt32 from_id, UInt32 type, std::chrono::steady_clock::time_point a_ReceivedTime)
+{
+	auto Client = m_Clients.Find(static_cast<int>(to_id));
+	if (Client != nullptr)
 	{
-		if ((*itr)->GetUniqueID() != pClient->GetUniqueID())
-		{
-			(*itr)->BroadcastUserInfo(pClient);
-			if (pClient->IsLoggedIn())
-			{
-				pClient->BroadcastUserInfo((*itr).get());
-			}
-		}
-	}  // for itr - m_Clients[]
+		Client->ForwardMedia(from_id, type, a_ReceivedTime);
+	}
 }
 
-void cServer::ForwardMedia(UInt32 to_id, UInt32 from_id, UInt32 type)
+void cServer::ForwardMediaMsg(UInt32 to_id, UInt32 from_id, const AString & msg, std::chrono::steady_clock::time_point a_ReceivedTime)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	auto Client = m_Clients.Find(static_cast<int>(to_id));
+	if (Client != nullptr)
 	{
-		if ((*itr)->GetUniqueID() == to_id)
-		{
-			(*itr)->ForwardMedia(from_id, type);
-			return;
-		}
-	}  // for itr - m_Clients[]
+		Client->ForwardMediaMsg(from_id, msg, a_ReceivedTime);
+	}
 }
 
-void cServer::ForwardMediaMsg(UInt32 to_id, UInt32 from_id, AString msg)
+void cServer::RequestRelay(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_ClientPort)
 {
-	cCSLock Lock(m_CSClients);
-	for (auto itr = m_Clients.begin(); itr != m_Clients.end(); ++itr)
+	if (!m_IsRelayEnabled)
 	{
-		if ((*itr)->GetUniqueID() == to_id)
+		auto Client = m_Clients.Find(static_cast<int>(a_ClientID));
+		if (Client != nullptr)
 		{
-			(*itr)->ForwardMediaMsg(from_id, msg);
-			return;
+			Client->SendRelayAllocated(a_PeerID, 0);
 		}
-	}  // for itr - m_Clients[]
+		return;
+	}
+	m_Relays.Allocate(a_ClientID, a_PeerID, a_ClientPort);
 }
 
 
@@ -11,6 +11,12 @@
 
 #include "OSSupport/IsThread.h"
 #include "OSSupport/Network.h"
+#include "ClientRegistry.h"
+#include "PresenceEngine.h"
+#include "StunServer.h"
+#include "RelayEngine.h"
+#include "LatencyHistogram.h"
+#include "TickScheduler.h"
 
 #ifdef _MSC_VER
 	#pragma warning(push)
@@ -31,9 +37,6 @@
 
 // fwd:
 class cClientHandle;
-typedef std::shared_ptr<cClientHandle> cClientHandlePtr;
-typedef std::list<cClientHandlePtr> cClientHandlePtrs;
-typedef std::list<cClientHandle *> cClientHandles;
 class cCommandOutputCallback;
 class cSettingsRepositoryInterface;
 
@@ -79,15 +82,37 @@ public:
 	//㲥
 	void BroadcastUserInfo(cClientHandle* pClient);
 	//ת
-	void ForwardMedia(UInt32 to_id, UInt32 from_id, UInt32 type);
-	void ForwardMediaMsg(UInt32 to_id, UInt32 from_id, AString msg);
+	/** Forwards the media packet to the specified client.
+	a_ReceivedTime is the time the packet was received from the network, used for the relay latency statistics. */
+	void ForwardMedia(UInt32 to_id, UInt32 from_id, UInt32 type, std::chrono::steady_clock::time_point a_ReceivedTime);
+	void ForwardMediaMsg(UInt32 to_id, UInt32 from_id, const AString & msg, std::chrono::steady_clock::time_point a_ReceivedTime);
+
+	/** Allocates a UDP relay between the two clients, if enabled, and sends the relay ports to both of them.
+	a_ClientPort is the UDP port the requesting client sends from, zero if the client didn't report it. */
+	void RequestRelay(UInt32 a_ClientID, UInt32 a_PeerID, UInt16 a_ClientPort);
+
+	/** Returns true if the clients should parse and relay their data directly in the network thread,
+	rather than in the tick thread. */
+	bool ShouldDispatchImmediately(void) const { return m_ShouldDispatchImmediately; }
+
+	/** Returns the maximum number of bytes of received data buffered per client. */
+	size_t GetMaxReceiveBufferSize(void) const { return m_MaxReceiveBufferSize; }
+
+	/** Returns the histogram of the time from receiving a relayed packet until it is handed over to the recipient's link. */
+	cLatencyHistogram & GetRelayLatency(void) { return m_RelayLatency; }
+
+	/** Marks the client as ready, to be processed by the tick thread as soon as possible.
+	Called whenever the client has received data or queued data for sending, and when it has been destroyed.
+	Can be called from any thread. */
+	void QueueClientTick(cClientHandle & a_Client);
 	
 private:
 
 	friend class cRoot;  // so cRoot can create and destroy cServer
 	friend class cServerListenCallbacks;  // Accessing OnConnectionAccepted()
 	
-	/** The server tick thread takes care of the players who aren't yet spawned in a world */
+	/** The server tick thread processes the ready clients as soon as they're marked, and runs the server's Tick()
+	(the console commands, the presence changes and the expired client timers) at a fixed cadence. */
 	class cTickThread :
 		public cIsThread
 	{
@@ -95,9 +120,15 @@ private:
 		
 	public:
 		cTickThread(cServer & a_Server);
+
+		/** Wakes the thread up to process the ready clients. Can be called from any thread. */
+		void WakeUp(void) { m_WakeUpEvent.Set(); }
 		
 	protected:
 		cServer & m_Server;
+
+		/** Set when there are ready clients to process. */
+		cEvent m_WakeUpEvent;
 		
 		// cIsThread overrides:
 		virtual void Execute(void) override;
@@ -107,14 +138,26 @@ private:
 	/** The network sockets listening for client connections. */
 	cServerHandlePtr m_ServerHandle;
 		
-	/** Protects m_Clients and m_ClientsToRemove against multithreaded access. */
-	cCriticalSection m_CSClients;
+	/** Clients that are connected to the server, sharded by their unique ID.
+	The registry is internally synchronized, no external lock is needed. */
+	cClientRegistry m_Clients;
+
+	/** Keeps the ready clients and the clients' keepalive / timeout timers, so that the tick thread processes only
+	the clients that need it instead of all of them every tick. */
+	cTickScheduler m_TickScheduler;
+
+	/** The ready clients taken from m_TickScheduler, reused between ticks to avoid reallocations.
+	Only accessed from the tick thread. */
+	std::vector<int> m_ReadyClients;
 
-	/** Clients that are connected to the server and not yet assigned to a cWorld. */
-	cClientHandlePtrs m_Clients;
+	/** Batches the users' presence changes and sends them to the clients once per tick. */
+	cPresenceEngine m_Presence;
 
-	/** Clients that have just been moved into a world and are to be removed from m_Clients in the next Tick(). */
-	cClientHandles m_ClientsToRemove;
+	/** Answers the STUN binding requests and exchanges the clients' UDP addresses for hole punching. */
+	cStunServer m_StunServer;
+
+	/** Relays the UDP media between the clients that cannot reach each other directly. */
+	cRelayEngine m_Relays;
 	
 	/** Protects m_PlayerCount against multithreaded access. */
 	mutable cCriticalSection m_CSPlayerCount;
@@ -147,6 +190,33 @@ private:
 	Initialized in InitServer(), used in Start(). */
 	int m_Port;
 
+	/** Number of sockets sharing m_Port, each served by a different network thread. Initialized in InitServer(). */
+	unsigned m_NumListenSockets;
+
+	/** If true, the clients parse their incoming data and relay it to the recipients directly in the network thread;
+	the tick thread only handles keepalives and timeouts.
+	If false, the data is processed in the tick thread. Initialized in InitServer(). */
+	bool m_ShouldDispatchImmediately;
+
+	/** The maximum number of bytes of received data buffered per client; a client sending more than that
+	without completing a packet is kicked. Initialized in InitServer(). */
+	size_t m_MaxReceiveBufferSize;
+
+	/** If true, the STUN server is started together with the server. Initialized in InitServer(). */
+	bool m_ShouldStartStun;
+
+	/** The UDP port on which the STUN server listens. Initialized in InitServer(). */
+	UInt16 m_StunPort;
+
+	/** The STUN registrations not refreshed for this long are forgotten. Initialized in InitServer(). */
+	std::chrono::seconds m_StunRegistrationTimeout;
+
+	/** If true, the clients may ask for UDP relay allocations. Initialized in InitServer(). */
+	bool m_IsRelayEnabled;
+
+	/** Latency of the relayed packets, from receiving them from the network until handing them to the recipient's link. */
+	cLatencyHistogram m_RelayLatency;
+
 	cServer(void);
 
 
@@ -156,8 +226,53 @@ private:
 	
 	bool Tick(float a_Dt);
 	
-	/** Ticks the clients in m_Clients, manages the list in respect to removing clients */
-	void TickClients(float a_Dt);
+	/** Processes the clients marked ready by QueueClientTick() since the last call; removes the destroyed ones. */
+	void TickReadyClients(void);
+
+	/** Processes the clients whose timer has expired; removes the destroyed ones. */
+	void TickClientTimers(void);
+
+	/** Called from the tick thread when the client's timer expires; checks the client's timers and re-arms it. */
+	void OnClientTimerExpired(int a_ClientID);
+
+	/** Removes the destroyed client from m_Clients, cancels its timer and releases its relays. */
+	void RemoveClient(cClientHandle & a_Client);
+
+	/** Outputs the per-shard client counts and lock contention counters of m_Clients. */
+	void PrintLockStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the presence engine's counters. */
+	void PrintPresenceStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the dispatch mode and the relay latency histogram. */
+	void PrintRelayStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the STUN server's counters. */
+	void PrintStunStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the UDP relay allocations and their counters. */
+	void PrintRelays(cCommandOutputCallback & a_Output);
+
+	/** Outputs the authenticator's counters and per-stage latency histograms. */
+	void PrintAuthStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the authentication cache's counters. */
+	void PrintAuthCacheStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the asynchronous logging's counters. */
+	void PrintLogStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the comm capture's counters. */
+	void PrintCaptureStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the receive buffers' memory usage and the chunk pool's counters. */
+	void PrintBufferStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the counters of all the block pools. */
+	void PrintPoolStats(cCommandOutputCallback & a_Output);
+
+	/** Outputs the tick scheduler's counters. */
+	void PrintTickStats(cCommandOutputCallback & a_Output);
 };  // tolua_export
 
 
@@ -0,0 +1,581 @@
+
+// StunServer.cpp
+
+// Implements the cStunServer class implementing the STUN binding responder and the peers' address exchange
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "StunServer.h"
+#include "ClientRegistry.h"
+#include "ClientHandle.h"
+#include <event2/util.h>
+
+
+
+
+
+static const size_t STUN_HEADER_SIZE = 20;
+static const UInt32 STUN_MAGIC_COOKIE = 0x2112a442;
+
+// Message classes:
+static const UInt16 STUN_CLASS_REQUEST = 0;
+static const UInt16 STUN_CLASS_SUCCESS = 2;
+static const UInt16 STUN_CLASS_ERROR   = 3;
+
+// Methods:
+static const UInt16 STUN_METHOD_BINDING  = 0x001;
+static const UInt16 STUN_METHOD_REGISTER = 0x801;  // Private: register own reflexive address
+static const UInt16 STUN_METHOD_LOOKUP   = 0x802;  // Private: ask for a registered peer's address
+
+// Attributes:
+static const UInt16 STUN_ATTR_ERROR_CODE         = 0x0009;
+static const UInt16 STUN_ATTR_XOR_PEER_ADDRESS   = 0x0012;
+static const UInt16 STUN_ATTR_XOR_MAPPED_ADDRESS = 0x0020;
+static const UInt16 STUN_ATTR_PEER_ID            = 0x8050;  // Private: UInt32 user ID of the registered / looked up peer
+static const UInt16 STUN_ATTR_OWN_ID             = 0x8051;  // Private: UInt32 user ID of the client sending a lookup
+
+
+
+
+
+/** Reads a big-endian UInt16 from the buffer. */
+static inline UInt16 ReadUInt16(const Byte * a_Data)
+{
+	return static_cast<UInt16>((a_Data[0] << 8) | a_Data[1]);
+}
+
+
+
+
+
+/** Reads a big-endian UInt32 from the buffer. */
+static inline UInt32 ReadUInt32(const Byte * a_Data)
+{
+	return (
+		(static_cast<UInt32>(a_Data[0]) << 24) |
+		(static_cast<UInt32>(a_Data[1]) << 16) |
+		(static_cast<UInt32>(a_Data[2]) << 8) |
+		static_cast<UInt32>(a_Data[3])
+	);
+}
+
+
+
+
+
+/** Writes a big-endian UInt16 into the buffer. */
+static inline void WriteUInt16(Byte * a_Data, UInt16 a_Value)
+{
+	a_Data[0] = static_cast<Byte>(a_Value >> 8);
+	a_Data[1] = static_cast<Byte>(a_Value);
+}
+
+
+
+
+
+/** Writes a big-endian UInt32 into the buffer. */
+static inline void WriteUInt32(Byte * a_Data, UInt32 a_Value)
+{
+	a_Data[0] = static_cast<Byte>(a_Value >> 24);
+	a_Data[1] = static_cast<Byte>(a_Value >> 16);
+	a_Data[2] = static_cast<Byte>(a_Value >> 8);
+	a_Data[3] = static_cast<Byte>(a_Value);
+}
+
+
+
+
+
+/** Returns true if both addresses are the same IP address and port. */
+static bool IsSameAddress(const sockaddr * a_Addr1, const sockaddr * a_Addr2)
+{
+	if (a_Addr1->sa_family != a_Addr2->sa_family)
+	{
+		return false;
+	}
+	switch (a_Addr1->sa_family)
+	{
+		case AF_INET:
+		{
+			auto sin1 = reinterpret_cast<const sockaddr_in *>(a_Addr1);
+			auto sin2 = reinterpret_cast<const sockaddr_in *>(a_Addr2);
+			return (sin1->sin_port == sin2->sin_port) && (sin1->sin_addr.s_addr == sin2->sin_addr.s_addr);
+		}
+		case AF_INET6:
+		{
+			auto sin1 = reinterpret_cast<const sockaddr_in6 *>(a_Addr1);
+			auto sin2 = reinterpret_cast<const sockaddr_in6 *>(a_Addr2);
+			return (sin1->sin6_port == sin2->sin6_port) && (memcmp(&sin1->sin6_addr, &sin2->sin6_addr, sizeof(sin1->sin6_addr)) == 0);
+		}
+	}
+	return false;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cStunServer:
+
+cStunServer::cStunServer(cClientRegistry & a_Clients):
+	m_Clients(a_Clients),
+	m_RegistrationTimeout(std::chrono::seconds(120)),
+	m_ResponseSize(0),
+	m_NumBindings(0),
+	m_NumRegistrations(0),
+	m_NumLookups(0),
+	m_NumErrors(0),
+	m_NumInvalid(0),
+	m_NumRegistered(0)
+{
+}
+
+
+
+
+
+bool cStunServer::Start(UInt16 a_Port, std::chrono::seconds a_RegistrationTimeout)
+{
+	m_RegistrationTimeout = a_RegistrationTimeout;
+	auto Endpoint = cNetwork::CreateUDPEndpoint(a_Port, *this);
+	if (!Endpoint->IsOpen())
+	{
+		return false;
+	}
+	std::atomic_store(&m_Endpoint, Endpoint);
+	LOG("STUN server listening on UDP port %d", Endpoint->GetPort());
+	return true;
+}
+
+
+
+
+
+void cStunServer::Stop(void)
+{
+	if (std::atomic_load(&m_Endpoint) == nullptr)
+	{
+		return;
+	}
+
+	// The network thread sends the responses through the endpoint and owns the registrations' timers; close and drop
+	// all of it there, after any callback still in-flight. The event is shared, cEvent::Set() still touches it after
+	// the waiting thread may have been released:
+	auto Dropped = std::make_shared<cEvent>();
+	cNetwork::RunInNetworkThread([this, Dropped]()
+		{
+			auto Endpoint = std::atomic_exchange(&m_Endpoint, cUDPEndpointPtr());
+			if (Endpoint != nullptr)
+			{
+				Endpoint->Close();
+			}
+			m_Registrations.clear();
+			m_NumRegistered.store(0, std::memory_order_relaxed);
+			Dropped->Set();
+		}
+	);
+	Dropped->Wait();
+}
+
+
+
+
+
+bool cStunServer::IsRunning(void) const
+{
+	auto Endpoint = std::atomic_load(&m_Endpoint);
+	return (Endpoint != nullptr) && Endpoint->IsOpen();
+}
+
+
+
+
+
+cStunServer::cStats cStunServer::GetStats(void) const
+{
+	cStats res;
+	res.m_NumBindings      = m_NumBindings.load(std::memory_order_relaxed);
+	res.m_NumRegistrations = m_NumRegistrations.load(std::memory_order_relaxed);
+	res.m_NumLookups       = m_NumLookups.load(std::memory_order_relaxed);
+	res.m_NumErrors        = m_NumErrors.load(std::memory_order_relaxed);
+	res.m_NumInvalid       = m_NumInvalid.load(std::memory_order_relaxed);
+	res.m_NumRegistered    = m_NumRegistered.load(std::memory_order_relaxed);
+	return res;
+}
+
+
+
+
+
+void cStunServer::HandleDatagram(const cUDPEndpoint::cDatagram & a_Datagram)
+{
+	// Check that this is a STUN request:
+	auto Data = reinterpret_cast<const Byte *>(a_Datagram.m_Data);
+	if ((a_Datagram.m_Size < STUN_HEADER_SIZE) || ((Data[0] & 0xc0) != 0))
+	{
+		m_NumInvalid.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	UInt16 Type = ReadUInt16(Data);
+	size_t BodySize = ReadUInt16(Data + 2);
+	if (
+		(ReadUInt32(Data + 4) != STUN_MAGIC_COOKIE) ||
+		(BodySize + STUN_HEADER_SIZE != a_Datagram.m_Size) ||
+		((BodySize % 4) != 0)
+	)
+	{
+		m_NumInvalid.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// The message type interleaves the class bits (C1 at bit 8, C0 at bit 4) with the method bits:
+	UInt16 Class = static_cast<UInt16>(((Type >> 7) & 0x02) | ((Type >> 4) & 0x01));
+	UInt16 Method = static_cast<UInt16>((Type & 0x000f) | ((Type >> 1) & 0x0070) | ((Type >> 2) & 0x0f80));
+	if (Class != STUN_CLASS_REQUEST)
+	{
+		// Indications and responses need no answer
+		m_NumInvalid.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	const Byte * TransactionID = Data + 8;
+	const Byte * Body = Data + STUN_HEADER_SIZE;
+
+	switch (Method)
+	{
+		case STUN_METHOD_BINDING:
+		{
+			m_NumBindings.fetch_add(1, std::memory_order_relaxed);
+			StartResponse(Method, STUN_CLASS_SUCCESS, TransactionID);
+			AddXorAddress(STUN_ATTR_XOR_MAPPED_ADDRESS, a_Datagram.m_RemoteAddr, TransactionID);
+			SendResponse(a_Datagram);
+			return;
+		}
+		case STUN_METHOD_REGISTER:
+		{
+			m_NumRegistrations.fetch_add(1, std::memory_order_relaxed);
+			HandleRegister(a_Datagram, Body, BodySize, TransactionID);
+			return;
+		}
+		case STUN_METHOD_LOOKUP:
+		{
+			m_NumLookups.fetch_add(1, std::memory_order_relaxed);
+			HandleLookup(a_Datagram, Body, BodySize, TransactionID);
+			return;
+		}
+	}
+	SendError(a_Datagram, Method, TransactionID, 400, "Bad Request");
+}
+
+
+
+
+
+void cStunServer::HandleRegister(const cUDPEndpoint::cDatagram & a_Datagram, const Byte * a_Body, size_t a_BodySize, const Byte * a_TransactionID)
+{
+	UInt32 PeerID;
+	if (!FindUInt32Attribute(a_Body, a_BodySize, STUN_ATTR_PEER_ID, PeerID))
+	{
+		SendError(a_Datagram, STUN_METHOD_REGISTER, a_TransactionID, 400, "Bad Request");
+		return;
+	}
+
+	// Only a logged in client may register its ID, and only from the IP address it is connected from:
+	auto Client = m_Clients.Find(static_cast<int>(PeerID));
+	if ((Client == nullptr) || !Client->IsWorking() || (Client->GetIPString() != a_Datagram.m_RemoteHost))
+	{
+		SendError(a_Datagram, STUN_METHOD_REGISTER, a_TransactionID, 403, "Forbidden");
+		return;
+	}
+
+	auto & Registration = m_Registrations[PeerID];
+	memcpy(&Registration.m_Addr, a_Datagram.m_RemoteAddr, std::min(sizeof(Registration.m_Addr), static_cast<size_t>(a_Datagram.m_RemoteAddrLen)));
+	Registration.m_AddrLen = a_Datagram.m_RemoteAddrLen;
+	Registration.m_Time = std::chrono::steady_clock::now();
+	if (!Registration.m_ExpiryTimer.IsArmed())
+	{
+		// A new registration (the expired ones are removed):
+		Registration.m_ExpiryTimer.SetCallback([this, PeerID]()
+			{
+				ExpireRegistration(PeerID);
+			}
+		);
+	}
+	cNetwork::ArmTimer(Registration.m_ExpiryTimer, Registration.m_Time + m_RegistrationTimeout);
+	m_NumRegistered.store(m_Registrations.size(), std::memory_order_relaxed);
+
+	StartResponse(STUN_METHOD_REGISTER, STUN_CLASS_SUCCESS, a_TransactionID);
+	AddXorAddress(STUN_ATTR_XOR_MAPPED_ADDRESS, a_Datagram.m_RemoteAddr, a_TransactionID);
+	SendResponse(a_Datagram);
+}
+
+
+
+
+
+void cStunServer::HandleLookup(const cUDPEndpoint::cDatagram & a_Datagram, const Byte * a_Body, size_t a_BodySize, const Byte * a_TransactionID)
+{
+	UInt32 OwnID, PeerID;
+	if (
+		!FindUInt32Attribute(a_Body, a_BodySize, STUN_ATTR_OWN_ID, OwnID) ||
+		!FindUInt32Attribute(a_Body, a_BodySize, STUN_ATTR_PEER_ID, PeerID)
+	)
+	{
+		SendError(a_Datagram, STUN_METHOD_LOOKUP, a_TransactionID, 400, "Bad Request");
+		return;
+	}
+
+	// Only the registered clients may look up others, from their registered address:
+	auto Now = std::chrono::steady_clock::now();
+	auto Own = m_Registrations.find(OwnID);
+	if (
+		(Own == m_Registrations.end()) ||
+		(Own->second.m_Time + m_RegistrationTimeout < Now) ||
+		!IsSameAddress(reinterpret_cast<const sockaddr *>(&Own->second.m_Addr), a_Datagram.m_RemoteAddr)
+	)
+	{
+		SendError(a_Datagram, STUN_METHOD_LOOKUP, a_TransactionID, 403, "Forbidden");
+		return;
+	}
+
+	// The peer must be registered and still connected:
+	auto Peer = m_Registrations.find(PeerID);
+	if ((Peer == m_Registrations.end()) || (Peer->second.m_Time + m_RegistrationTimeout < Now))
+	{
+		SendError(a_Datagram, STUN_METHOD_LOOKUP, a_TransactionID, 404, "Not Found");
+		return;
+	}
+	auto PeerClient = m_Clients.Find(static_cast<int>(PeerID));
+	if ((PeerClient == nullptr) || !PeerClient->IsWorking())
+	{
+		SendError(a_Datagram, STUN_METHOD_LOOKUP, a_TransactionID, 404, "Not Found");
+		return;
+	}
+
+	StartResponse(STUN_METHOD_LOOKUP, STUN_CLASS_SUCCESS, a_TransactionID);
+	AddXorAddress(STUN_ATTR_XOR_PEER_ADDRESS, reinterpret_cast<const sockaddr *>(&Peer->second.m_Addr), a_TransactionID);
+	AddXorAddress(STUN_ATTR_XOR_MAPPED_ADDRESS, a_Datagram.m_RemoteAddr, a_TransactionID);
+	SendResponse(a_Datagram);
+}
+
+
+
+
+
+void cStunServer::ExpireRegistration(UInt32 a_PeerID)
+{
+	// The registration's timer is the one calling, it may be destroyed with the registration:
+	m_Registrations.erase(a_PeerID);
+	m_NumRegistered.store(m_Registrations.size(), std::memory_order_relaxed);
+}
+
+
+
+
+
+void cStunServer::StartResponse(UInt16 a_Method, UInt16 a_Class, const Byte * a_TransactionID)
+{
+	UInt16 Type = static_cast<UInt16>(
+		(a_Method & 0x000f) | ((a_Method & 0x0070) << 1) | ((a_Method & 0x0f80) << 2) |
+		((a_Class & 0x01) << 4) | ((a_Class & 0x02) << 7)
+	);
+	WriteUInt16(m_Response, Type);
+	WriteUInt16(m_Response + 2, 0);  // Length, filled in SendResponse()
+	WriteUInt32(m_Response + 4, STUN_MAGIC_COOKIE);
+	memcpy(m_Response + 8, a_TransactionID, 12);
+	m_ResponseSize = STUN_HEADER_SIZE;
+}
+
+
+
+
+
+void cStunServer::AddAttribute(UInt16 a_Type, const Byte * a_Value, size_t a_Length)
+{
+	size_t PaddedLength = (a_Length + 3) & ~static_cast<size_t>(3);
+	ASSERT(m_ResponseSize + 4 + PaddedLength <= MAX_RESPONSE_SIZE);
+	Byte * Attr = m_Response + m_ResponseSize;
+	WriteUInt16(Attr, a_Type);
+	WriteUInt16(Attr + 2, static_cast<UInt16>(a_Length));
+	memcpy(Attr + 4, a_Value, a_Length);
+	memset(Attr + 4 + a_Length, 0, PaddedLength - a_Length);
+	m_ResponseSize += 4 + PaddedLength;
+}
+
+
+
+
+
+void cStunServer::AddXorAddress(UInt16 a_Type, const sockaddr * a_Addr, const Byte * a_TransactionID)
+{
+	// The port and address are XOR-ed with the magic cookie (and the transaction ID for IPv6):
+	Byte XorBytes[16];
+	WriteUInt32(XorBytes, STUN_MAGIC_COOKIE);
+	memcpy(XorBytes + 4, a_TransactionID, 12);
+
+	Byte Value[20];
+	Value[0] = 0;
+	switch (a_Addr->sa_family)
+	{
+		case AF_INET:
+		{
+			auto sin = reinterpret_cast<const sockaddr_in *>(a_Addr);
+			Value[1] = 0x01;
+			WriteUInt16(Value + 2, static_cast<UInt16>(ntohs(sin->sin_port) ^ (STUN_MAGIC_COOKIE >> 16)));
+			auto Addr = reinterpret_cast<const Byte *>(&sin->sin_addr);
+			for (size_t i = 0; i < 4; i++)
+			{
+				Value[4 + i] = Addr[i] ^ XorBytes[i];
+			}
+			AddAttribute(a_Type, Value, 8);
+			return;
+		}
+		case AF_INET6:
+		{
+			auto sin6 = reinterpret_cast<const sockaddr_in6 *>(a_Addr);
+			WriteUInt16(Value + 2, static_cast<UInt16>(ntohs(sin6->sin6_port) ^ (STUN_MAGIC_COOKIE >> 16)));
+			auto Addr = reinterpret_cast<const Byte *>(&sin6->sin6_addr);
+			static const Byte MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+			if (memcmp(Addr, MappedPrefix, sizeof(MappedPrefix)) == 0)
+			{
+				// An IPv4 client received on the dual-stack socket, report the IPv4 address:
+				Value[1] = 0x01;
+				for (size_t i = 0; i < 4; i++)
+				{
+					Value[4 + i] = Addr[12 + i] ^ XorBytes[i];
+				}
+				AddAttribute(a_Type, Value, 8);
+				return;
+			}
+			Value[1] = 0x02;
+			for (size_t i = 0; i < 16; i++)
+			{
+				Value[4 + i] = Addr[i] ^ XorBytes[i];
+			}
+			AddAttribute(a_Type, Value, 20);
+			return;
+		}
+	}
+}
+
+
+
+
+
+void cStunServer::AddErrorCode(int a_Code, const char * a_Reason)
+{
+	Byte Value[64];
+	size_t ReasonLength = std::min(strlen(a_Reason), sizeof(Value) - 4);
+	Value[0] = 0;
+	Value[1] = 0;
+	Value[2] = static_cast<Byte>(a_Code / 100);
+	Value[3] = static_cast<Byte>(a_Code % 100);
+	memcpy(Value + 4, a_Reason, ReasonLength);
+	AddAttribute(STUN_ATTR_ERROR_CODE, Value, 4 + ReasonLength);
+}
+
+
+
+
+
+void cStunServer::SendResponse(const cUDPEndpoint::cDatagram & a_Datagram)
+{
+	WriteUInt16(m_Response + 2, static_cast<UInt16>(m_ResponseSize - STUN_HEADER_SIZE));
+	auto Endpoint = std::atomic_load(&m_Endpoint);
+	if (Endpoint != nullptr)
+	{
+		Endpoint->SendTo(reinterpret_cast<const char *>(m_Response), m_ResponseSize, a_Datagram.m_RemoteAddr, a_Datagram.m_RemoteAddrLen);
+	}
+}
+
+
+
+
+
+void cStunServer::SendError(const cUDPEndpoint::cDatagram & a_Datagram, UInt16 a_Method, const Byte * a_TransactionID, int a_Code, const char * a_Reason)
+{
+	m_NumErrors.fetch_add(1, std::memory_order_relaxed);
+	StartResponse(a_Method, STUN_CLASS_ERROR, a_TransactionID);
+	AddErrorCode(a_Code, a_Reason);
+	SendResponse(a_Datagram);
+}
+
+
+
+
+
+bool cStunServer::FindUInt32Attribute(const Byte * a_Body, size_t a_BodySize, UInt16 a_Type, UInt32 & a_Value)
+{
+	size_t Pos = 0;
+	while (Pos + 4 <= a_BodySize)
+	{
+		UInt16 Type = ReadUInt16(a_Body + Pos);
+		size_t Length = ReadUInt16(a_Body + Pos + 2);
+		if (Pos + 4 + Length > a_BodySize)
+		{
+			return false;
+		}
+		if ((Type == a_Type) && (Length == 4))
+		{
+			a_Value = ReadUInt32(a_Body + Pos + 4);
+			return true;
+		}
+		Pos += 4 + ((Length + 3) & ~static_cast<size_t>(3));
+	}
+	return false;
+}
+
+
+
+
+
+void cStunServer::OnError(int a_ErrorCode, const AString & a_ErrorMsg)
+{
+	LOGWARNING("STUN server: %d (%s)", a_ErrorCode, a_ErrorMsg.c_str());
+}
+
+
+
+
+
+void cStunServer::OnReceivedData(const char * a_Data, size_t a_Size, const AString & a_RemoteHost, UInt16 a_RemotePort)
+{
+	// Only called by endpoints that don't report batches; convert the textual address back:
+	sockaddr_storage sa;
+	int salen = static_cast<int>(sizeof(sa));
+	memset(&sa, 0, sizeof(sa));
+	if (evutil_parse_sockaddr_port(a_RemoteHost.c_str(), reinterpret_cast<sockaddr *>(&sa), &salen) != 0)
+	{
+		return;
+	}
+	switch (sa.ss_family)
+	{
+		case AF_INET:  reinterpret_cast<sockaddr_in *>(&sa)->sin_port = htons(a_RemotePort);   break;
+		case AF_INET6: reinterpret_cast<sockaddr_in6 *>(&sa)->sin6_port = htons(a_RemotePort); break;
+	}
+	cUDPEndpoint::cDatagram Datagram;
+	Datagram.m_Data = a_Data;
+	Datagram.m_Size = a_Size;
+	Datagram.m_RemoteHost = a_RemoteHost.c_str();
+	Datagram.m_RemotePort = a_RemotePort;
+	Datagram.m_RemoteAddr = reinterpret_cast<const sockaddr *>(&sa);
+	Datagram.m_RemoteAddrLen = static_cast<socklen_t>(salen);
+	OnReceivedBatch(&Datagram, 1);
+}
+
+
+
+
+
+void cStunServer::OnReceivedBatch(const cUDPEndpoint::cDatagram * a_Datagrams, size_t a_NumDatagrams)
+{
+	for (size_t i = 0; i < a_NumDatagrams; i++)
+	{
+		HandleDatagram(a_Datagrams[i]);
+	}
+}
+
+
+
+
@@ -0,0 +1,164 @@
+
+// StunServer.h
+
+// Interfaces to the cStunServer class implementing the STUN binding responder and the peers' address exchange
+
+// The server answers the standard STUN Binding requests (RFC 5389), so that the clients can discover their
+// server-reflexive address without an external STUN server. On top of that, it implements two private methods
+// for the UDP hole-punching rendezvous:
+//  - Register (0x801): a logged-in client registers its reflexive address under its user ID (PEER-ID attribute).
+//    The request is accepted only if it comes from the same IP address as the client's TCP connection.
+//  - Lookup (0x802): a registered client (OWN-ID attribute) asks for the reflexive address of another client (PEER-ID);
+//    the address is returned in an XOR-PEER-ADDRESS attribute.
+// The attributes not listed above are ignored; no authentication or FINGERPRINT is used.
+
+
+
+
+
+#pragma once
+
+#include "OSSupport/Network.h"
+#include <atomic>
+#include <unordered_map>
+
+
+
+
+
+// fwd:
+class cClientRegistry;
+
+
+
+
+
+class cStunServer:
+	public cUDPEndpoint::cCallbacks
+{
+public:
+	/** Counters describing the server's work, as reported by GetStats(). */
+	struct cStats
+	{
+		/** Number of valid STUN requests received, by method. */
+		UInt64 m_NumBindings;
+		UInt64 m_NumRegistrations;
+		UInt64 m_NumLookups;
+
+		/** Number of error responses sent. */
+		UInt64 m_NumErrors;
+
+		/** Number of datagrams that were not valid STUN requests and were dropped. */
+		UInt64 m_NumInvalid;
+
+		/** Number of clients currently registered. */
+		size_t m_NumRegistered;
+	};
+
+
+	cStunServer(cClientRegistry & a_Clients);
+
+	/** Opens the UDP endpoint on the specified port and starts answering the requests.
+	The registrations older than a_RegistrationTimeout are forgotten. Returns true on success. */
+	bool Start(UInt16 a_Port, std::chrono::seconds a_RegistrationTimeout);
+
+	/** Closes the UDP endpoint and drops all the registrations. Both is done in the network thread and waited for,
+	so this must not be called from the network thread itself. */
+	void Stop(void);
+
+	/** Returns true if the server has been started successfully and not stopped yet. */
+	bool IsRunning(void) const;
+
+	/** Returns the current counters. */
+	cStats GetStats(void) const;
+
+protected:
+
+	/** A client's address registered through the Register method. */
+	struct cRegistration
+	{
+		sockaddr_storage m_Addr;
+		socklen_t m_AddrLen;
+		std::chrono::steady_clock::time_point m_Time;
+
+		/** Removes the registration once it hasn't been renewed for m_RegistrationTimeout. Armed in the main network thread's wheel. */
+		cTimerWheel::cTimer m_ExpiryTimer;
+	};
+
+	typedef std::unordered_map<UInt32, cRegistration> cRegistrations;
+
+	/** The size of the largest response the server sends. */
+	static const size_t MAX_RESPONSE_SIZE = 128;
+
+
+	/** The clients connected to the server, used for verifying the registrations. */
+	cClientRegistry & m_Clients;
+
+	/** The UDP endpoint receiving the requests.
+	Read by the network thread and the console, so it is only accessed through std::atomic_load() / std::atomic_exchange(). */
+	cUDPEndpointPtr m_Endpoint;
+
+	/** The registrations older than this are treated as nonexistent. */
+	std::chrono::steady_clock::duration m_RegistrationTimeout;
+
+	/** The registered clients' addresses, by their user ID. Only accessed from the endpoint's event loop thread. */
+	cRegistrations m_Registrations;
+
+	/** The response being built; reused for all the responses so that no memory is allocated per request.
+	Only accessed from the event loop thread. */
+	Byte m_Response[MAX_RESPONSE_SIZE];
+
+	/** The number of bytes used in m_Response. */
+	size_t m_ResponseSize;
+
+	std::atomic<UInt64> m_NumBindings;
+	std::atomic<UInt64> m_NumRegistrations;
+	std::atomic<UInt64> m_NumLookups;
+	std::atomic<UInt64> m_NumErrors;
+	std::atomic<UInt64> m_NumInvalid;
+	std::atomic<size_t> m_NumRegistered;
+
+
+	/** Processes a single received datagram, sends the response. */
+	void HandleDatagram(const cUDPEndpoint::cDatagram & a_Datagram);
+
+	/** Handles the Register request; a_Body is the attributes part of the request. */
+	void HandleRegister(const cUDPEndpoint::cDatagram & a_Datagram, const Byte * a_Body, size_t a_BodySize, const Byte * a_TransactionID);
+
+	/** Handles the Lookup request; a_Body is the attributes part of the request. */
+	void HandleLookup(const cUDPEndpoint::cDatagram & a_Datagram, const Byte * a_Body, size_t a_BodySize, const Byte * a_TransactionID);
+
+	/** Removes the registration whose expiry timer has fired. */
+	void ExpireRegistration(UInt32 a_PeerID);
+
+	/** Starts building a response with the specified method and class into m_Response. */
+	void StartResponse(UInt16 a_Method, UInt16 a_Class, const Byte * a_TransactionID);
+
+	/** Adds an attribute to the response in m_Response, padded to 4 bytes. */
+	void AddAttribute(UInt16 a_Type, const Byte * a_Value, size_t a_Length);
+
+	/** Adds an XOR-ed address attribute (XOR-MAPPED-ADDRESS, XOR-PEER-ADDRESS) for a_Addr to the response.
+	IPv4-mapped IPv6 addresses are reported as IPv4. */
+	void AddXorAddress(UInt16 a_Type, const sockaddr * a_Addr, const Byte * a_TransactionID);
+
+	/** Adds an ERROR-CODE attribute to the response. */
+	void AddErrorCode(int a_Code, const char * a_Reason);
+
+	/** Fills in the length in m_Response and sends it to the datagram's sender. */
+	void SendResponse(const cUDPEndpoint::cDatagram & a_Datagram);
+
+	/** Sends an error response with the specified code to the datagram's sender. */
+	void SendError(const cUDPEndpoint::cDatagram & a_Datagram, UInt16 a_Method, const Byte * a_TransactionID, int a_Code, const char * a_Reason);
+
+	/** Finds the UInt32 attribute of the specified type in the request's attributes. Returns true if found. */
+	static bool FindUInt32Attribute(const Byte * a_Body, size_t a_BodySize, UInt16 a_Type, UInt32 & a_Value);
+
+	// cUDPEndpoint::cCallbacks overrides:
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override;
+	virtual void OnReceivedData(const char * a_Data, size_t a_Size, const AString & a_RemoteHost, UInt16 a_RemotePort) override;
+	virtual void OnReceivedBatch(const cUDPEndpoint::cDatagram * a_Datagrams, size_t a_NumDatagrams) override;
+};
+
+
+
+
@@ -0,0 +1,110 @@
+// TickScheduler.cpp
+
+// Implements the cTickScheduler class that decides which clients the server tick thread needs to process
+
+#include "stdafx.h"  // NOTE: MSVC stupidness requires this to be the same across all modules
+
+#include "TickScheduler.h"
+
+
+
+
+
+const std::chrono::milliseconds cTickScheduler::SLOT_DURATION(50);
+
+
+
+
+
+cTickScheduler::cTickScheduler(void):
+	m_Timers(SLOT_DURATION),
+	m_NumTimers(0),
+	m_NumScheduled(0),
+	m_NumExpired(0),
+	m_NumReady(0)
+{
+}
+
+
+
+
+
+bool cTickScheduler::AddReady(int a_ClientID)
+{
+	m_NumReady.fetch_add(1, std::memory_order_relaxed);
+	cCSLock Lock(m_CS);
+	m_Ready.push_back(a_ClientID);
+	return (m_Ready.size() == 1);
+}
+
+
+
+
+
+void cTickScheduler::TakeReady(std::vector<int> & a_ClientIDs)
+{
+	// Swap the vectors, so that both keep their capacity and the ready list doesn't need to reallocate:
+	a_ClientIDs.clear();
+	cCSLock Lock(m_CS);
+	std::swap(a_ClientIDs, m_Ready);
+}
+
+
+
+
+
+void cTickScheduler::Schedule(cTimerWheel::cTimer & a_Timer, cTimePoint a_Deadline)
+{
+	m_Timers.Arm(a_Timer, a_Deadline);
+	UpdateStats();
+}
+
+
+
+
+
+void cTickScheduler::Cancel(cTimerWheel::cTimer & a_Timer)
+{
+	a_Timer.Cancel();
+	UpdateStats();
+}
+
+
+
+
+
+void cTickScheduler::Advance(cTimePoint a_Now)
+{
+	m_Timers.Advance(a_Now);
+	UpdateStats();
+}
+
+
+
+
+
+cTickScheduler::cStats cTickScheduler::GetStats(void) const
+{
+	cStats Stats;
+	Stats.m_NumTimers    = m_NumTimers.load(std::memory_order_relaxed);
+	Stats.m_NumScheduled = m_NumScheduled.load(std::memory_order_relaxed);
+	Stats.m_NumExpired   = m_NumExpired.load(std::memory_order_relaxed);
+	Stats.m_NumReady     = m_NumReady.load(std::memory_order_relaxed);
+	return Stats;
+}
+
+
+
+
+
+void cTickScheduler::UpdateStats(void)
+{
+	auto Stats = m_Timers.GetStats();
+	m_NumTimers.store(Stats.m_NumArmed, std::memory_order_relaxed);
+	m_NumScheduled.store(Stats.m_NumArms, std::memory_order_relaxed);
+	m_NumExpired.store(Stats.m_NumExpired, std::memory_order_relaxed);
+}
+
+
+
+
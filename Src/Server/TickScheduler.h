@@ -0,0 +1,97 @@
+// TickScheduler.h
+
+// Interfaces to the cTickScheduler class that decides which clients the server tick thread needs to process
+
+
+
+
+
+#pragma once
+
+#include <atomic>
+#include "OSSupport/TimerWheel.h"
+
+
+
+
+
+/** Keeps track of the clients that need processing in the tick thread, so that the tick thread doesn't have to
+visit every connected client each tick.
+A client needs processing either when it becomes ready (it has received data or has data queued for sending;
+any thread may mark a client ready), or when its timer expires (keepalive ping due, or the timeout check).
+Each client owns a single timer, armed in a cTimerWheel with SLOT_DURATION granularity; rescheduling re-arms it.
+A timer never expires early; its callback is called from the first Advance() call after the end of its slot.
+The timer functions must be called from a single thread only (the tick thread); GetStats() can be called from any thread. */
+class cTickScheduler
+{
+public:
+	typedef std::chrono::steady_clock::time_point cTimePoint;
+
+	/** Counters describing the scheduler's work, as reported by GetStats(). */
+	struct cStats
+	{
+		/** Number of timers currently armed. */
+		size_t m_NumTimers;
+
+		/** Number of times a timer has been scheduled (armed or re-armed) so far. */
+		UInt64 m_NumScheduled;
+
+		/** Number of timers that have expired so far. */
+		UInt64 m_NumExpired;
+
+		/** Number of times a client has been marked ready. */
+		UInt64 m_NumReady;
+	};
+
+
+	/** The granularity of the timers, same as the tick length. */
+	static const std::chrono::milliseconds SLOT_DURATION;
+
+
+	cTickScheduler(void);
+
+	/** Adds the client to the list of ready clients. Can be called from any thread.
+	Returns true if the list was empty before, the tick thread needs to be woken up then. */
+	bool AddReady(int a_ClientID);
+
+	/** Replaces the contents of a_ClientIDs with the clients marked ready since the last call, and clears the list. */
+	void TakeReady(std::vector<int> & a_ClientIDs);
+
+	/** Arms the client's timer, replacing its previous deadline; if the deadline has already passed, the timer expires in the next slot. */
+	void Schedule(cTimerWheel::cTimer & a_Timer, cTimePoint a_Deadline);
+
+	/** Disarms the client's timer, if armed. */
+	void Cancel(cTimerWheel::cTimer & a_Timer);
+
+	/** Calls the callbacks of all the timers whose deadline is at or before a_Now, disarming them. */
+	void Advance(cTimePoint a_Now);
+
+	/** Returns the current counters. */
+	cStats GetStats(void) const;
+
+protected:
+
+	/** Protects m_Ready against multithreaded access. */
+	cCriticalSection m_CS;
+
+	/** The clients marked ready since the last TakeReady(). Protected by m_CS. */
+	std::vector<int> m_Ready;
+
+	/** The clients' timers. Only accessed from the tick thread. */
+	cTimerWheel m_Timers;
+
+	/** Copies of the counters, so that GetStats() doesn't need to access m_Timers from other threads. */
+	std::atomic<size_t> m_NumTimers;
+	std::atomic<UInt64> m_NumScheduled;
+	std::atomic<UInt64> m_NumExpired;
+
+	std::atomic<UInt64> m_NumReady;
+
+
+	/** Updates the atomic copies of m_Timers' counters. */
+	void UpdateStats(void);
+};
+
+
+
+
@@ -15,6 +15,8 @@
 #include "OSSupport/NetworkSingleton.h"
 
 #include "MemorySettingsRepository.h"
+#include "Protocol/CommCapture.h"
+#include "BinaryLogFile.h"
 
 
 
@@ -30,6 +32,24 @@ bool g_ShouldLogCommIn;
 /** If set to true, the protocols will log each player's outgoing (S->C) communication to a per-connection logfile */
 bool g_ShouldLogCommOut;
 
+/** If not empty, this binary log file is printed as text and the server is not started (--log-decode) */
+static AString g_LogDecodeFile;
+
+/** If not empty, the records of this comm capture file are printed and the server is not started (--capture-dump) */
+static AString g_CaptureDumpFile;
+
+/** If not empty, this comm capture file is replayed against g_ReplayServer and the server is not started (--capture-replay) */
+static AString g_CaptureReplayFile;
+
+/** Selects the records of the comm capture file that are dumped or replayed */
+static cCommCapture::cFilter g_CaptureFilter;
+
+/** The address of the server, as "host:port", against which the comm capture file is replayed */
+static AString g_ReplayServer;
+
+/** The speed-up of the capture's original timing used for the replay; 0 replays as fast as possible */
+static double g_ReplaySpeed = 0;
+
 /** If set to true, binary will attempt to run as a service on Windows */
 bool cRoot::m_RunAsService = false;
 
@@ -77,6 +97,7 @@ void NonCtrlHandler(int a_Signal)
 		case SIGSEGV:
 		{
 			std::signal(SIGSEGV, SIG_DFL);
+			StopAsyncLogging();  // The diagnostics must be written out before abort(), not queued
 			LOGERROR("  D:    | MCServer has encountered an error and needs to close");
 			LOGERROR("Details | SIGSEGV: Segmentation fault");
 			#ifdef BUILD_ID
@@ -92,6 +113,7 @@ void NonCtrlHandler(int a_Signal)
 		#endif
 		{
 			std::signal(a_Signal, SIG_DFL);
+			StopAsyncLogging();
 			LOGERROR("  D:    | MCServer has encountered an error and needs to close");
 			LOGERROR("Details | SIGABRT: Server self-terminated due to an internal fault");
 			#ifdef BUILD_ID
@@ -375,6 +397,12 @@ std::unique_ptr<cMemorySettingsRepository> parseArguments(int argc, char **argv)
 		TCLAP::SwitchArg crashDumpGlobals("",  "crash-dump-globals",  "Crashdumps created by the server will contain the global variables' values", cmd);
 		TCLAP::SwitchArg noBufArg        ("",  "no-output-buffering", "Disable output buffering", cmd);
 		TCLAP::SwitchArg runAsServiceArg ("d", "service",             "Run as a service on Windows, or daemon on UNIX like systems", cmd);
+		TCLAP::ValueArg<std::string> logDecodeArg    ("", "log-decode",     "Print the binary log file as text and exit", false, "", "file", cmd);
+		TCLAP::ValueArg<std::string> captureDumpArg  ("", "capture-dump",   "Print the records of the comm capture file and exit", false, "", "file", cmd);
+		TCLAP::ValueArg<std::string> captureReplayArg("", "capture-replay", "Replay the client frames of the comm capture file against a running server and exit", false, "", "file", cmd);
+		TCLAP::ValueArg<int> captureClientArg        ("", "capture-client", "Dump or replay only the frames of the client with this ID", false, -1, "id", cmd);
+		TCLAP::ValueArg<std::string> replayServerArg ("", "replay-server",  "The server to replay the capture against", false, "localhost:6666", "host:port", cmd);
+		TCLAP::ValueArg<double> replaySpeedArg       ("", "replay-speed",   "Speed up the capture's original timing by this factor, 0 to replay as fast as possible", false, 0, "factor", cmd);
 		cmd.parse(argc, argv);
 
 		// Copy the parsed args' values into a settings repository:
@@ -401,6 +429,12 @@ std::unique_ptr<cMemorySettingsRepository> parseArguments(int argc, char **argv)
 			g_ShouldLogCommIn = commLogInArg.getValue();
 			g_ShouldLogCommOut = commLogOutArg.getValue();
 		}
+		g_LogDecodeFile = logDecodeArg.getValue();
+		g_CaptureDumpFile = captureDumpArg.getValue();
+		g_CaptureReplayFile = captureReplayArg.getValue();
+		g_CaptureFilter.m_ClientID = captureClientArg.getValue();
+		g_ReplayServer = replayServerArg.getValue();
+		g_ReplaySpeed = replaySpeedArg.getValue();
 		if (noBufArg.getValue())
 		{
 			setvbuf(stdout, nullptr, _IONBF, 0);
@@ -438,6 +472,34 @@ std::unique_ptr<cMemorySettingsRepository> parseArguments(int argc, char **argv)
 
 
 
+/** Runs the offline comm capture tool selected on the command line. Returns the exit code for the process. */
+static int RunCaptureTool(void)
+{
+	if (!g_CaptureDumpFile.empty())
+	{
+		return cCommCapture::Dump(g_CaptureDumpFile, g_CaptureFilter);
+	}
+
+	// Split the server address into the host and port:
+	AString Host = g_ReplayServer;
+	int Port = 6666;
+	auto Colon = g_ReplayServer.rfind(':');
+	if (Colon != AString::npos)
+	{
+		Host = g_ReplayServer.substr(0, Colon);
+		if (!StringToInteger(g_ReplayServer.substr(Colon + 1), Port) || (Port <= 0) || (Port > 65535))
+		{
+			printf("Invalid replay server address \"%s\"\n", g_ReplayServer.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	return cCommCapture::Replay(g_CaptureReplayFile, g_CaptureFilter, Host, static_cast<UInt16>(Port), g_ReplaySpeed);
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // main:
 
@@ -486,6 +548,16 @@ int main(int argc, char **argv)
 
 	auto argsRepo = parseArguments(argc, argv);
 
+	// Run the offline tools instead of the server, if requested:
+	if (!g_LogDecodeFile.empty())
+	{
+		return cBinaryLogFile::Dump(g_LogDecodeFile);
+	}
+	if (!g_CaptureDumpFile.empty() || !g_CaptureReplayFile.empty())
+	{
+		return RunCaptureTool();
+	}
+
 	// Attempt to run as a service
 	if (cRoot::m_RunAsService)
 	{
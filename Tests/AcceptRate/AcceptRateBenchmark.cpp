@@ -0,0 +1,87 @@
+
+// AcceptRateBenchmark.cpp
+
+// Measures the rate at which the server accepts new connections, with a single listening socket and with several
+// SO_REUSEPORT listening sockets, each on its own event loop
+
+// The local connection generator runs a number of threads, each connecting, exchanging a status ping with the server
+// (so that the connection is known to have been accepted and handed to a client handle) and disconnecting, as fast
+// as possible, like the clients reconnecting after a network blip.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+
+
+
+
+
+/** Number of the generator's threads connecting at the same time. */
+static const int NUM_GENERATORS = 8;
+
+/** Number of connections each generator thread makes in a single measurement. */
+static const int NUM_CONNECTIONS = 2000;
+
+
+
+
+
+/** Runs the generator against a server with the specified number of network threads and listening sockets,
+prints the accept rate. */
+static void MeasureAcceptRate(int a_NumThreads, int a_NumListenSockets)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	Settings->AddValue("Network", "Threads", static_cast<Int64>(a_NumThreads));
+	Settings->AddValue("Network", "ListenSockets", static_cast<Int64>(a_NumListenSockets));
+	cTestServer Server(Printf("AcceptRate%d", a_NumListenSockets), std::move(Settings));
+
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_GENERATORS; i++)
+	{
+		Threads.emplace_back([&Server]()
+			{
+				cTestClient Client;
+				UInt32 PacketType;
+				AString Body;
+				for (int j = 0; j < NUM_CONNECTIONS; j++)
+				{
+					TEST_CHECK(Client.Connect(Server.GetPort()));
+					TEST_CHECK(Client.SendPacket(0x01, AString(8, '\0')));  // Status ping
+					TEST_CHECK(Client.ReceivePacket(PacketType, Body) && (PacketType == 0x01));
+					Client.Close();
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	double NumConnections = static_cast<double>(NUM_GENERATORS) * NUM_CONNECTIONS;
+	printf("Network threads: %d, listening sockets: %d, %7.0f connections/sec (%.0f connections in %.3f s)\n",
+		a_NumThreads, a_NumListenSockets, NumConnections / Elapsed, NumConnections, Elapsed
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Connecting %d times from each of %d threads:\n", NUM_CONNECTIONS, NUM_GENERATORS);
+
+	// The network threads cannot be reduced while the process runs, so start with the fewest:
+	MeasureAcceptRate(1, 1);
+	MeasureAcceptRate(4, 1);
+	MeasureAcceptRate(4, 4);
+	return EXIT_SUCCESS;
+}
+
+
+
+
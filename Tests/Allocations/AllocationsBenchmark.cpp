@@ -0,0 +1,318 @@
+
+// AllocationsBenchmark.cpp
+
+// Counts the heap allocations of the server's hot paths, with and without the block pools
+
+// The benchmark replaces the global operator new, so it counts every C++ allocation in the process; LibEvent's
+// own mallocs are not counted.
+// The first part hands blocks of the pooled sizes from one thread to another, which frees them, the way the tick
+// thread hands the send segments to the network threads: once allocated by new / delete, once from a cBlockPool.
+// The second part relays MediaMsg packets between pairs of clients through the whole server. The clients' buffers
+// have been grown by a warm-up round, so the allocations counted in the measured round are the server's own.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "BlockPool.h"
+#include "SegmentedByteBuffer.h"
+#include <atomic>
+#include <new>
+
+
+
+
+
+/** Number of calls to the global operator new. */
+static std::atomic<UInt64> g_NumNews(0);
+
+
+
+
+
+void * operator new(size_t a_Size)
+{
+	g_NumNews.fetch_add(1, std::memory_order_relaxed);
+	void * res = malloc((a_Size > 0) ? a_Size : 1);
+	if (res == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return res;
+}
+
+
+
+
+
+void operator delete(void * a_Ptr) noexcept
+{
+	free(a_Ptr);
+}
+
+
+
+
+
+void operator delete(void * a_Ptr, size_t a_Size) noexcept
+{
+	UNUSED(a_Size);
+	free(a_Ptr);
+}
+
+
+
+
+
+/** Number of blocks handed between the threads in each measurement of the first part. */
+static const size_t NUM_BLOCKS = 2000000;
+
+/** Number of blocks the allocating thread may be ahead of the freeing one. */
+static const size_t QUEUE_SIZE = 1024;
+
+/** Number of client pairs relaying the messages in the second part, each pair has its own sender and receiver thread. */
+static const int NUM_PAIRS = 4;
+
+/** Number of messages each sender sends in a single round of the second part. */
+static const int NUM_MESSAGES = 50000;
+
+/** Number of messages the senders compose into a single write. */
+static const int BATCH_SIZE = 100;
+
+/** The most messages a sender may have sent ahead of its receiver, so that the server doesn't kick it. */
+static const int WINDOW_SIZE = 2000;
+
+
+
+
+
+/** A single-producer single-consumer queue of block pointers, allocating nothing while in use. */
+class cBlockQueue
+{
+public:
+	cBlockQueue(void):
+		m_Blocks(QUEUE_SIZE),
+		m_Head(0),
+		m_Tail(0)
+	{
+	}
+
+	void Push(void * a_Block)
+	{
+		size_t Tail = m_Tail.load(std::memory_order_relaxed);
+		while (Tail - m_Head.load(std::memory_order_acquire) >= QUEUE_SIZE)
+		{
+			std::this_thread::yield();
+		}
+		m_Blocks[Tail % QUEUE_SIZE] = a_Block;
+		m_Tail.store(Tail + 1, std::memory_order_release);
+	}
+
+	void * Pop(void)
+	{
+		size_t Head = m_Head.load(std::memory_order_relaxed);
+		while (m_Tail.load(std::memory_order_acquire) == Head)
+		{
+			std::this_thread::yield();
+		}
+		void * res = m_Blocks[Head % QUEUE_SIZE];
+		m_Head.store(Head + 1, std::memory_order_release);
+		return res;
+	}
+
+protected:
+	std::vector<void *> m_Blocks;
+	std::atomic<size_t> m_Head;
+	std::atomic<size_t> m_Tail;
+};
+
+
+
+
+
+/** Allocates NUM_BLOCKS blocks using a_Allocate in this thread and frees them using a_Free in another thread,
+prints the heap allocations per block and the rate. */
+template <typename AllocateFn, typename FreeFn>
+static void MeasureHandOver(const char * a_Name, AllocateFn a_Allocate, FreeFn a_Free)
+{
+	cBlockQueue Queue;
+	UInt64 NumNewsBefore = g_NumNews.load();
+	auto Start = std::chrono::steady_clock::now();
+	std::thread Freer([&]()
+		{
+			for (size_t i = 0; i < NUM_BLOCKS; i++)
+			{
+				a_Free(Queue.Pop());
+			}
+		}
+	);
+	for (size_t i = 0; i < NUM_BLOCKS; i++)
+	{
+		Queue.Push(a_Allocate());
+	}
+	Freer.join();
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	UInt64 NumNews = g_NumNews.load() - NumNewsBefore - 1;  // The thread's own state
+	printf("%-34s %8.4f heap allocations per block, %6.2f M blocks/sec\n",
+		a_Name, static_cast<double>(NumNews) / NUM_BLOCKS, NUM_BLOCKS / Elapsed / 1e6
+	);
+}
+
+
+
+
+
+/** Returns the number of blocks allocated from all the pools so far. */
+static UInt64 GetNumPoolAllocations(void)
+{
+	UInt64 res = 0;
+	for (const auto & Stats : cBlockPool::GetAllStats())
+	{
+		res += Stats.m_NumAllocations;
+	}
+	return res;
+}
+
+
+
+
+
+/** A pair of logged-in clients, the sender relays messages to the receiver through the server. */
+struct cPair
+{
+	cTestClient m_Sender;
+	cTestClient m_Receiver;
+
+	/** The data the sender sends in each write: BATCH_SIZE MediaMsg packets addressed to the receiver. */
+	AString m_Batch;
+
+	/** Number of messages the receiver has received in the current round. */
+	std::atomic<int> m_NumReceived;
+};
+
+
+
+
+
+/** Relays NUM_MESSAGES messages through each pair at once. */
+static void RelayRound(std::vector<std::unique_ptr<cPair>> & a_Pairs)
+{
+	std::vector<std::thread> Threads;
+	for (auto & Pair : a_Pairs)
+	{
+		auto & ThePair = *Pair;
+		ThePair.m_NumReceived = 0;
+		Threads.emplace_back([&ThePair]()
+			{
+				for (int NumSent = 0; NumSent < NUM_MESSAGES; NumSent += BATCH_SIZE)
+				{
+					while (NumSent - ThePair.m_NumReceived.load() > WINDOW_SIZE)
+					{
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+					}
+					TEST_CHECK(ThePair.m_Sender.SendRaw(ThePair.m_Batch.data(), ThePair.m_Batch.size()));
+				}
+			}
+		);
+		Threads.emplace_back([&ThePair]()
+			{
+				UInt32 PacketType;
+				AString Body;
+				while (ThePair.m_NumReceived < NUM_MESSAGES)
+				{
+					TEST_CHECK(ThePair.m_Receiver.ReceivePacket(PacketType, Body));
+					if (PacketType == 0x12)
+					{
+						ThePair.m_NumReceived += 1;
+					}
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+}
+
+
+
+
+
+/** Relays the messages through the server, prints the heap allocations and the pooled blocks per relayed message. */
+static void MeasureRelay(void)
+{
+	cTestServer Server("Allocations", cTestServer::DefaultSettings());
+	std::vector<std::unique_ptr<cPair>> Pairs;
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		Pairs.emplace_back(new cPair);
+		auto & Pair = *Pairs.back();
+		AString ReceiverName = Printf("receiver%d", i);
+		TEST_CHECK(Pair.m_Sender.Connect(Server.GetPort()) && Pair.m_Sender.Login(Printf("sender%d", i)));
+		TEST_CHECK(Pair.m_Receiver.Connect(Server.GetPort()) && Pair.m_Receiver.Login(ReceiverName));
+		int ReceiverID = Pair.m_Sender.WaitForUser(ReceiverName);
+		TEST_CHECK(ReceiverID > 0);
+		auto Packet = cTestClient::MediaMsgBody(static_cast<UInt32>(ReceiverID), AString(64, 'm'));
+		for (int j = 0; j < BATCH_SIZE; j++)
+		{
+			cTestClient::AppendPacket(Pair.m_Batch, 0x12, Packet);
+		}
+	}
+
+	// Warm up the clients' buffers and the pools' caches, then measure:
+	RelayRound(Pairs);
+	UInt64 NumNewsBefore = g_NumNews.load();
+	UInt64 NumPooledBefore = GetNumPoolAllocations();
+	auto Start = std::chrono::steady_clock::now();
+	RelayRound(Pairs);
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	double NumMessages = static_cast<double>(NUM_PAIRS) * NUM_MESSAGES;
+	double NumNews = static_cast<double>(g_NumNews.load() - NumNewsBefore);
+	double NumPooled = static_cast<double>(GetNumPoolAllocations() - NumPooledBefore);
+	printf("Relaying %.0f messages: %.3f heap allocations and %.3f pooled blocks per message, %.0f msgs/sec\n",
+		NumMessages, NumNews / NumMessages, NumPooled / NumMessages, NumMessages / Elapsed
+	);
+	printf("Without the pools, each pooled block would be another heap allocation: %.3f per message\n",
+		(NumNews + NumPooled) / NumMessages
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Handing %u blocks from one thread to another, which frees them:\n", static_cast<unsigned>(NUM_BLOCKS));
+	static cBlockPool SegmentPool("Benchmark segments", sizeof(AString), 4096);
+	static cBlockPool ChunkPool("Benchmark chunks", cSegmentedByteBuffer::CHUNK_SIZE, 1024);
+	MeasureHandOver("Send segments, new / delete",
+		[]() { return new AString; },
+		[](void * a_Segment) { delete static_cast<AString *>(a_Segment); }
+	);
+	MeasureHandOver("Send segments, cBlockPool",
+		[]() { return new(SegmentPool.Allocate()) AString; },
+		[](void * a_Segment)
+		{
+			static_cast<AString *>(a_Segment)->~AString();
+			SegmentPool.Free(a_Segment);
+		}
+	);
+	MeasureHandOver("Receive chunks, new / delete",
+		[]() { return new char[cSegmentedByteBuffer::CHUNK_SIZE]; },
+		[](void * a_Chunk) { delete[] static_cast<char *>(a_Chunk); }
+	);
+	MeasureHandOver("Receive chunks, cBlockPool",
+		[]() { return ChunkPool.Allocate(); },
+		[](void * a_Chunk) { ChunkPool.Free(a_Chunk); }
+	);
+
+	MeasureRelay();
+	return EXIT_SUCCESS;
+}
+
+
+
+
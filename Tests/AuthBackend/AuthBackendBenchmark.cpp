@@ -0,0 +1,189 @@
+
+// AuthBackendBenchmark.cpp
+
+// Measures the logins per second against the File authentication backend holding 100k synthetic accounts
+
+// The accounts are generated into a fresh users file, with a per-user salt. The backend is first measured alone,
+// verifying all the accounts through its batched asynchronous API in the authenticator's default batch size;
+// then every account logs in to the server once, from many client threads at once, so that the authenticator's
+// cache never answers the requests and each login goes through the backend.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "Root.h"
+#include "Authenticator.h"
+#include "AuthBackend.h"
+#include "ErrorCode.h"
+#include "md5.h"
+
+
+
+
+
+/** Number of synthetic accounts in the users file. */
+static const int NUM_ACCOUNTS = 100000;
+
+/** Number of requests verified in a single backend call, the authenticator's default batch size. */
+static const size_t BATCH_SIZE = 32;
+
+/** Number of client threads logging in at the same time. */
+static const int NUM_CLIENT_THREADS = 32;
+
+/** The folder in which the server runs, holding the users file. */
+static const char FOLDER_NAME[] = "AuthBackend";
+
+
+
+
+
+/** Returns the lowercase hex MD5 hash of the string. */
+static AString MD5Hex(const AString & a_Data)
+{
+	MD5 Hash;
+	Hash.update(a_Data.data(), a_Data.size());
+	return StrToLower(Hash.toString());
+}
+
+
+
+
+
+/** Returns the username of the synthetic account of the specified index. */
+static AString UserName(int a_Index)
+{
+	return Printf("user%d", a_Index);
+}
+
+
+
+
+
+/** Writes NUM_ACCOUNTS accounts into the users file in FOLDER_NAME. The credentials of each account are the ones
+cTestClient::Login() sends, the MD5 hash of the username. */
+static void WriteUsersFile(void)
+{
+	cFile::CreateFolder(FOLDER_NAME);
+	FILE * f = fopen(Printf("%s/tb_users.csv", FOLDER_NAME).c_str(), "w");
+	TEST_CHECK(f != nullptr);
+	fprintf(f, "username,password,salt,uuid\n");
+	for (int i = 0; i < NUM_ACCOUNTS; i++)
+	{
+		AString Name = UserName(i);
+		AString Salt = Printf("%08x", static_cast<unsigned>(i) * 2654435761u);
+		fprintf(f, "%s,%s,%s,%08d-0000-0000-0000-000000000000\n",
+			Name.c_str(), MD5Hex(MD5Hex(Name) + Salt).c_str(), Salt.c_str(), i
+		);
+	}
+	fclose(f);
+}
+
+
+
+
+
+/** Verifies all the accounts directly through the backend, in batches of BATCH_SIZE, prints the verifications per second. */
+static void MeasureBackend(void)
+{
+	cMemorySettingsRepository Settings;
+	Settings.AddValue("Authentication", "Backend", AString("File"));
+	Settings.AddValue("Authentication", "Table", Printf("%s/tb_users", FOLDER_NAME));
+	auto LoadStart = std::chrono::steady_clock::now();
+	auto Backend = cAuthBackend::Create(Settings);
+	auto LoadElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - LoadStart).count();
+
+	// Compose all the batches up front, so that only the verification is measured:
+	std::vector<cAuthBackend::cRequests> Batches;
+	for (int i = 0; i < NUM_ACCOUNTS; i++)
+	{
+		if ((Batches.empty()) || (Batches.back().size() == BATCH_SIZE))
+		{
+			Batches.emplace_back();
+		}
+		AString Name = UserName(i);
+		Batches.back().emplace_back(Name, MD5Hex(Name));
+	}
+
+	int NumVerified = 0;
+	auto Start = std::chrono::steady_clock::now();
+	for (auto & Batch : Batches)
+	{
+		Backend->VerifyBatchAsync(std::move(Batch), [&NumVerified](cAuthBackend::cRequests & a_Requests)
+			{
+				for (const auto & Request : a_Requests)
+				{
+					TEST_CHECK(Request.m_Result == ERROR_CODE_ACCOUNT_AUTH_OK);
+					NumVerified += 1;
+				}
+			}
+		);
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	TEST_CHECK(NumVerified == NUM_ACCOUNTS);
+	printf("Backend alone: %9.0f verifications/sec (%d accounts in %.3f s, batch %u; loading the file took %.3f s)\n",
+		NUM_ACCOUNTS / Elapsed, NUM_ACCOUNTS, Elapsed, static_cast<unsigned>(BATCH_SIZE), LoadElapsed
+	);
+}
+
+
+
+
+
+/** Logs every account in to the server once, prints the logins per second. */
+static void MeasureLogins(void)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	Settings->DeleteValue("Authentication", "Backend");
+	Settings->AddValue("Authentication", "Backend", AString("File"));
+	cTestServer Server(FOLDER_NAME, std::move(Settings));
+	UInt16 Port = Server.GetPort();
+
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_CLIENT_THREADS; i++)
+	{
+		Threads.emplace_back([i, Port]()
+			{
+				for (int j = i; j < NUM_ACCOUNTS; j += NUM_CLIENT_THREADS)
+				{
+					cTestClient Client;
+					TEST_CHECK(Client.Connect(Port) && Client.Login(UserName(j)));
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+	auto & Authenticator = cRoot::Get()->GetAuthenticator();
+	auto Stats = Authenticator.GetStats();
+	TEST_CHECK(Stats.m_NumSucceeded == static_cast<UInt64>(NUM_ACCOUNTS));
+	printf("End to end:    %9.1f logins/sec (%d logins in %.3f s from %d client threads, %llu rejected, check p50 %llu us, total p50 %llu us)\n",
+		NUM_ACCOUNTS / Elapsed, NUM_ACCOUNTS, Elapsed, NUM_CLIENT_THREADS,
+		static_cast<unsigned long long>(Stats.m_NumRejected),
+		static_cast<unsigned long long>(Authenticator.GetCheckLatency().GetPercentileUsec(50)),
+		static_cast<unsigned long long>(Authenticator.GetTotalLatency().GetPercentileUsec(50))
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	WriteUsersFile();
+	MeasureBackend();
+	MeasureLogins();
+	printf("The latencies are the upper bounds of the histograms' power-of-two buckets.\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,156 @@
+
+// AuthCacheTest.cpp
+
+// Tests the cAuthCache class, especially that an invalidated user never gets a stale result cached afterwards
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "AuthCache.h"
+#include "ErrorCode.h"
+#include <atomic>
+
+
+
+
+
+/** Returns a cached result representing a check done when the user's credentials were at the specified version.
+The version is kept in the UUID, so that the readers can tell how old a cached result is. */
+static cAuthCache::cResult MakeResult(int a_Version)
+{
+	cAuthCache::cResult res;
+	res.m_Result = ERROR_CODE_ACCOUNT_AUTH_OK;
+	res.m_UserName = "user";
+	res.m_UUID = Printf("%d", a_Version);
+	return res;
+}
+
+
+
+
+
+/** Tests the single-threaded ordering of Lookup(), Store(), Invalidate() and Clear(). */
+static void TestSequential(void)
+{
+	cAuthCache Cache;
+	cAuthCache::cResult Result;
+	UInt64 Generation;
+
+	// A plain miss, store and hit:
+	TEST_CHECK(!Cache.Lookup("user", "pass", Result, Generation));
+	TEST_CHECK(Cache.Store("user", "pass", MakeResult(1), Generation));
+	TEST_CHECK(Cache.Lookup("user", "pass", Result, Generation));
+	TEST_CHECK(Result.m_UUID == "1");
+
+	// Invalidating removes the entry; a check started before the invalidation doesn't get stored:
+	TEST_CHECK(Cache.Invalidate("USER") == 1);
+	TEST_CHECK(!Cache.Lookup("user", "pass", Result, Generation));
+	UInt64 OldGeneration = Generation;
+	TEST_CHECK(Cache.Invalidate("user") == 0);
+	TEST_CHECK(!Cache.Store("user", "pass", MakeResult(2), OldGeneration));
+	TEST_CHECK(!Cache.Lookup("user", "pass", Result, Generation));
+
+	// A check started after the invalidation does get stored, and other users are not affected:
+	TEST_CHECK(Cache.Store("user", "pass", MakeResult(3), Generation));
+	TEST_CHECK(Cache.Store("other", "pass", MakeResult(3), OldGeneration));
+	TEST_CHECK(Cache.Lookup("user", "pass", Result, Generation));
+	TEST_CHECK(Result.m_UUID == "3");
+
+	// Clearing outdates all the checks in progress:
+	Cache.Clear();
+	TEST_CHECK(!Cache.Store("other", "pass", MakeResult(4), Generation));
+	TEST_CHECK(!Cache.Lookup("other", "pass", Result, Generation));
+	TEST_CHECK(Cache.Store("other", "pass", MakeResult(5), Generation));
+
+	auto Stats = Cache.GetStats();
+	TEST_CHECK(Stats.m_NumOutdated == 2);
+	TEST_CHECK(Stats.m_Size == 1);
+}
+
+
+
+
+
+/** Runs several workers checking the credentials through the cache concurrently with an admin changing the credentials
+and invalidating the user. Once Invalidate() has returned, no lookup may return a result older than the change. */
+static void TestConcurrentInvalidation(void)
+{
+	static const int NUM_WORKERS = 4;
+	static const int NUM_CHANGES = 1000;
+
+	cAuthCache Cache;
+
+	// The version of the user's credentials in the credential store, and the version that has been invalidated in the cache:
+	std::atomic<int> StoreVersion(0);
+	std::atomic<int> InvalidatedVersion(0);
+	std::atomic<bool> ShouldStop(false);
+	std::atomic<int> NumStale(0);
+	std::atomic<UInt64> NumLookups(0);
+
+	std::vector<std::thread> Workers;
+	for (int i = 0; i < NUM_WORKERS; i++)
+	{
+		Workers.emplace_back([&]()
+			{
+				while (!ShouldStop)
+				{
+					int MinVersion = InvalidatedVersion.load();
+					cAuthCache::cResult Result;
+					UInt64 Generation;
+					NumLookups += 1;
+					if (Cache.Lookup("user", "pass", Result, Generation))
+					{
+						if (atoi(Result.m_UUID.c_str()) < MinVersion)
+						{
+							NumStale += 1;
+						}
+						continue;
+					}
+
+					// Check the credentials in the store, slowly enough for the admin to change them meanwhile:
+					int Version = StoreVersion.load();
+					std::this_thread::yield();
+					Cache.Store("user", "pass", MakeResult(Version), Generation);
+				}
+			}
+		);
+	}
+
+	for (int i = 1; i <= NUM_CHANGES; i++)
+	{
+		StoreVersion.store(i);
+		Cache.Invalidate("user");
+		InvalidatedVersion.store(i);
+
+		// Let the workers cache the new credentials and hit them for a while:
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	ShouldStop = true;
+	for (auto & Worker : Workers)
+	{
+		Worker.join();
+	}
+
+	auto Stats = Cache.GetStats();
+	printf("Concurrent invalidation: %llu lookups, %llu hits, %llu outdated results dropped, %d stale hits\n",
+		static_cast<unsigned long long>(NumLookups.load()), static_cast<unsigned long long>(Stats.m_NumHits),
+		static_cast<unsigned long long>(Stats.m_NumOutdated), NumStale.load()
+	);
+	TEST_CHECK(NumStale == 0);
+}
+
+
+
+
+
+int main(void)
+{
+	TestSequential();
+	TestConcurrentInvalidation();
+	printf("AuthCache tests passed\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,103 @@
+
+// AuthWorkersBenchmark.cpp
+
+// Measures the logins per second with a slow credential store, for an increasing number of authentication workers
+
+// The server uses the UsernameHash backend with a simulated round trip per batch, standing in for a remote store.
+// The batches are limited to a single request and each worker has at most one round trip in flight, so that the
+// throughput only scales with the number of workers; the last measurements show a single worker pipelining several
+// round trips through the backend's asynchronous API, and the default batching, for comparison.
+// The logins are generated by many client threads at once, each logging in a series of unique users, so that the
+// authenticator's queue stays full and its cache never answers the requests.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "Root.h"
+#include "Authenticator.h"
+
+
+
+
+
+/** The simulated round trip of each backend call. */
+static const int SIMULATED_LATENCY_MSEC = 10;
+
+/** Number of client threads logging in at the same time; more than the most workers measured. */
+static const int NUM_CLIENT_THREADS = 32;
+
+/** Number of logins each client thread does in a single measurement. */
+static const int NUM_LOGINS_PER_THREAD = 25;
+
+
+
+
+
+/** Runs the logins against a server with the specified number of workers, batch size and batches in flight per worker,
+prints the logins per second. */
+static void MeasureLogins(int a_NumWorkers, int a_BatchSize, int a_BatchesInFlight = 1)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	Settings->AddValue("Authentication", "SimulatedLatencyMsec", static_cast<Int64>(SIMULATED_LATENCY_MSEC));
+	Settings->AddValue("Authentication", "Workers", static_cast<Int64>(a_NumWorkers));
+	Settings->AddValue("Authentication", "BatchSize", static_cast<Int64>(a_BatchSize));
+	Settings->AddValue("Authentication", "BatchesInFlight", static_cast<Int64>(a_BatchesInFlight));
+	cTestServer Server(Printf("AuthWorkers%d_%d", a_NumWorkers, a_BatchesInFlight), std::move(Settings));
+	UInt16 Port = Server.GetPort();
+
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_CLIENT_THREADS; i++)
+	{
+		Threads.emplace_back([i, Port]()
+			{
+				for (int j = 0; j < NUM_LOGINS_PER_THREAD; j++)
+				{
+					cTestClient Client;
+					TEST_CHECK(Client.Connect(Port) && Client.Login(Printf("user%d_%d", i, j)));
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+	auto & Authenticator = cRoot::Get()->GetAuthenticator();
+	auto Stats = Authenticator.GetStats();
+	TEST_CHECK(Stats.m_NumFailed == 0);
+	int NumLogins = NUM_CLIENT_THREADS * NUM_LOGINS_PER_THREAD;
+	printf("%2d workers, batch %2d, %2d in flight: %7.1f logins/sec (%d logins in %.3f s, %llu rejected, queue p50 %llu us, check p50 %llu us)\n",
+		a_NumWorkers, a_BatchSize, a_BatchesInFlight, NumLogins / Elapsed, NumLogins, Elapsed,
+		static_cast<unsigned long long>(Stats.m_NumRejected),
+		static_cast<unsigned long long>(Authenticator.GetQueueLatency().GetPercentileUsec(50)),
+		static_cast<unsigned long long>(Authenticator.GetCheckLatency().GetPercentileUsec(50))
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Logging in %d users from %d client threads, the backend takes %d ms per call:\n",
+		NUM_CLIENT_THREADS * NUM_LOGINS_PER_THREAD, NUM_CLIENT_THREADS, SIMULATED_LATENCY_MSEC
+	);
+	for (int NumWorkers : {1, 2, 4, 8, 16})
+	{
+		MeasureLogins(NumWorkers, 1);
+	}
+	MeasureLogins(1, 1, 16);
+	MeasureLogins(4, 32);
+	printf("The latencies are the upper bounds of the histograms' power-of-two buckets.\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
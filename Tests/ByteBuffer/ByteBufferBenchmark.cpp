@@ -0,0 +1,263 @@
+
+// ByteBufferBenchmark.cpp
+
+// Measures the values/sec of writing and reading the VarInts, BE integers and VarUTF8 strings through cByteBuffer,
+// and of reading them through cByteBufferView
+
+// The values are written into a 64 KiB ringbuffer until it is full, then read back and committed, over and over,
+// so the data wraps around the ringbuffer end the same as in a client's buffer and a few values take the slow path.
+// The "byte by byte" rows measure the VarInt codec that cByteBuffer used before the contiguous fast path, for comparison.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "ByteBuffer.h"
+#include "ByteBufferView.h"
+#include "VarInt.h"
+#include <random>
+
+
+
+
+
+/** Number of values written and read in each measurement. */
+static const size_t NUM_VALUES = 10000000;
+
+/** Size of the ringbuffer, same as the clients' buffers had. */
+static const size_t BUFFER_SIZE = 64 KiB;
+
+
+
+
+
+/** Writes the VarInt the way cByteBuffer did before the contiguous fast path: encoded into a temporary array,
+then copied into the ringbuffer. */
+static bool WriteVarInt32ByteByByte(cByteBuffer & a_Buffer, UInt32 a_Value)
+{
+	unsigned char b[5];
+	size_t idx = 0;
+	do
+	{
+		b[idx] = (a_Value & 0x7f) | ((a_Value > 0x7f) ? 0x80 : 0x00);
+		a_Value = a_Value >> 7;
+		idx++;
+	} while (a_Value > 0);
+	return a_Buffer.WriteBuf(b, idx);
+}
+
+
+
+
+
+/** Reads the VarInt the way cByteBuffer did before the contiguous fast path: a full checked read per byte. */
+static bool ReadVarInt32ByteByByte(cByteBuffer & a_Buffer, UInt32 & a_Value)
+{
+	UInt32 Value = 0;
+	int Shift = 0;
+	UInt8 b = 0;
+	do
+	{
+		if (!a_Buffer.ReadBEUInt8(b))
+		{
+			return false;
+		}
+		Value = Value | ((static_cast<UInt32>(b) & 0x7f) << Shift);
+		Shift += 7;
+	} while ((b & 0x80) != 0);
+	a_Value = Value;
+	return true;
+}
+
+
+
+
+
+/** Returns NUM_VALUES random values whose encoded VarInt lengths are evenly distributed from 1 to a_MaxBytes. */
+template <typename T>
+static std::vector<T> CreateVarIntValues(size_t a_MaxBytes)
+{
+	std::minstd_rand Random(1);
+	std::uniform_int_distribution<size_t> NumBits(0, 7 * a_MaxBytes - 1);
+	std::vector<T> res;
+	res.reserve(NUM_VALUES);
+	for (size_t i = 0; i < NUM_VALUES; i++)
+	{
+		size_t Bits = std::min(NumBits(Random), sizeof(T) * 8 - 1);
+		UInt64 Value = (static_cast<UInt64>(Random()) << 31) ^ Random();
+		res.push_back(static_cast<T>(Value & ((UInt64(2) << Bits) - 1)));
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns NUM_VALUES random integers of the specified type. */
+template <typename T>
+static std::vector<T> CreateIntValues(void)
+{
+	std::minstd_rand Random(2);
+	std::vector<T> res;
+	res.reserve(NUM_VALUES);
+	for (size_t i = 0; i < NUM_VALUES; i++)
+	{
+		UInt64 Value = (static_cast<UInt64>(Random()) << 33) ^ (static_cast<UInt64>(Random()) << 2) ^ Random();
+		res.push_back(static_cast<T>(Value));
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns a_Count strings of the specified length, each with a different content. */
+static std::vector<AString> CreateStrings(size_t a_Count, size_t a_Length)
+{
+	std::vector<AString> res;
+	res.reserve(a_Count);
+	for (size_t i = 0; i < a_Count; i++)
+	{
+		res.emplace_back(a_Length, static_cast<char>('a' + i % 26));
+	}
+	return res;
+}
+
+
+
+
+
+/** Writes the values into a ringbuffer using a_Write until it is full, then reads them back using a_Read and checks them,
+until all the values have been written and read. a_MaxSize is the maximum encoded size of a single value.
+Prints the writes and reads per second. */
+template <typename T, typename WriteFn, typename ReadFn>
+static void Measure(const char * a_Name, const std::vector<T> & a_Values, size_t a_MaxSize, WriteFn a_Write, ReadFn a_Read)
+{
+	cByteBuffer Buffer(BUFFER_SIZE);
+	std::chrono::steady_clock::duration WriteTime(0), ReadTime(0);
+	size_t NumBytes = 0;
+	size_t Idx = 0;
+	T Value;
+	while (Idx < a_Values.size())
+	{
+		size_t Start = Idx;
+		auto WriteStart = std::chrono::steady_clock::now();
+		while ((Idx < a_Values.size()) && Buffer.CanWriteBytes(a_MaxSize))
+		{
+			TEST_CHECK(a_Write(Buffer, a_Values[Idx]));
+			Idx++;
+		}
+		auto ReadStart = std::chrono::steady_clock::now();
+		NumBytes += Buffer.GetReadableSpace();
+		for (size_t i = Start; i < Idx; i++)
+		{
+			TEST_CHECK(a_Read(Buffer, Value) && (Value == a_Values[i]));
+		}
+		Buffer.CommitRead();
+		auto ReadEnd = std::chrono::steady_clock::now();
+		WriteTime += ReadStart - WriteStart;
+		ReadTime += ReadEnd - ReadStart;
+	}
+
+	auto WriteSec = std::chrono::duration<double>(WriteTime).count();
+	auto ReadSec = std::chrono::duration<double>(ReadTime).count();
+	printf("%-34s write %7.1f M/sec, read %7.1f M/sec (%.1f bytes per value)\n",
+		a_Name, a_Values.size() / WriteSec / 1e6, a_Values.size() / ReadSec / 1e6,
+		static_cast<double>(NumBytes) / a_Values.size()
+	);
+}
+
+
+
+
+
+/** Writes the values into a single block using a_Write, then reads them back through a cByteBufferView using a_Read
+and checks them. a_MaxSize is the maximum encoded size of a single value. Prints the reads per second. */
+template <typename T, typename WriteFn, typename ReadFn>
+static void MeasureView(const char * a_Name, const std::vector<T> & a_Values, size_t a_MaxSize, WriteFn a_Write, ReadFn a_Read)
+{
+	// Encode all the values through a ringbuffer large enough to hold them all:
+	AString Data;
+	{
+		cByteBuffer Buffer(a_Values.size() * a_MaxSize + 1);
+		for (const auto & Value : a_Values)
+		{
+			TEST_CHECK(a_Write(Buffer, Value));
+		}
+		Buffer.ReadAll(Data);
+	}
+
+	cByteBufferView View(Data.data(), Data.size());
+	T Value;
+	auto Start = std::chrono::steady_clock::now();
+	for (const auto & Expected : a_Values)
+	{
+		TEST_CHECK(a_Read(View, Value) && (Value == Expected));
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	TEST_CHECK(View.GetReadableSpace() == 0);
+	printf("%-34s                      read %7.1f M/sec\n", a_Name, a_Values.size() / Elapsed / 1e6);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Writing and reading %u values through a %u KiB ringbuffer:\n",
+		static_cast<unsigned>(NUM_VALUES), static_cast<unsigned>(BUFFER_SIZE / 1024)
+	);
+
+	auto WriteVarInt32 = [](cByteBuffer & a_Buffer, UInt32 a_Value) { return a_Buffer.WriteVarInt32(a_Value); };
+	auto ReadVarInt32 = [](cByteBuffer & a_Buffer, UInt32 & a_Value) { return a_Buffer.ReadVarInt32(a_Value); };
+	auto SmallValues = CreateVarIntValues<UInt32>(1);
+	auto Values32 = CreateVarIntValues<UInt32>(MAX_VARINT32_SIZE);
+	auto Values64 = CreateVarIntValues<UInt64>(MAX_VARINT64_SIZE);
+	Measure("VarInt32, 1 byte", SmallValues, MAX_VARINT32_SIZE, WriteVarInt32, ReadVarInt32);
+	Measure("VarInt32, 1 byte, byte by byte", SmallValues, MAX_VARINT32_SIZE, WriteVarInt32ByteByByte, ReadVarInt32ByteByByte);
+	Measure("VarInt32, 1-5 bytes", Values32, MAX_VARINT32_SIZE, WriteVarInt32, ReadVarInt32);
+	Measure("VarInt32, 1-5 bytes, byte by byte", Values32, MAX_VARINT32_SIZE, WriteVarInt32ByteByByte, ReadVarInt32ByteByByte);
+	Measure("VarInt64, 1-10 bytes", Values64, MAX_VARINT64_SIZE,
+		[](cByteBuffer & a_Buffer, UInt64 a_Value) { return a_Buffer.WriteVarInt64(a_Value); },
+		[](cByteBuffer & a_Buffer, UInt64 & a_Value) { return a_Buffer.ReadVarInt64(a_Value); }
+	);
+	Measure("BEInt16", CreateIntValues<Int16>(), 2,
+		[](cByteBuffer & a_Buffer, Int16 a_Value) { return a_Buffer.WriteBEInt16(a_Value); },
+		[](cByteBuffer & a_Buffer, Int16 & a_Value) { return a_Buffer.ReadBEInt16(a_Value); }
+	);
+	Measure("BEInt32", CreateIntValues<Int32>(), 4,
+		[](cByteBuffer & a_Buffer, Int32 a_Value) { return a_Buffer.WriteBEInt32(a_Value); },
+		[](cByteBuffer & a_Buffer, Int32 & a_Value) { return a_Buffer.ReadBEInt32(a_Value); }
+	);
+	Measure("BEInt64", CreateIntValues<Int64>(), 8,
+		[](cByteBuffer & a_Buffer, Int64 a_Value) { return a_Buffer.WriteBEInt64(a_Value); },
+		[](cByteBuffer & a_Buffer, Int64 & a_Value) { return a_Buffer.ReadBEInt64(a_Value); }
+	);
+	auto WriteString = [](cByteBuffer & a_Buffer, const AString & a_Value) { return a_Buffer.WriteVarUTF8String(a_Value); };
+	auto ReadString = [](cByteBuffer & a_Buffer, AString & a_Value) { return a_Buffer.ReadVarUTF8String(a_Value); };
+	Measure("VarUTF8String, 16 bytes", CreateStrings(NUM_VALUES, 16), 16 + MAX_VARINT32_SIZE, WriteString, ReadString);
+	Measure("VarUTF8String, 256 bytes", CreateStrings(NUM_VALUES / 4, 256), 256 + MAX_VARINT32_SIZE, WriteString, ReadString);
+
+	// The in-place parsing of the received packets:
+	MeasureView("View VarInt32, 1-5 bytes", Values32, MAX_VARINT32_SIZE, WriteVarInt32,
+		[](cByteBufferView & a_View, UInt32 & a_Value) { return a_View.ReadVarInt32(a_Value); }
+	);
+	MeasureView("View VarInt64, 1-10 bytes", Values64, MAX_VARINT64_SIZE,
+		[](cByteBuffer & a_Buffer, UInt64 a_Value) { return a_Buffer.WriteVarInt64(a_Value); },
+		[](cByteBufferView & a_View, UInt64 & a_Value) { return a_View.ReadVarInt64(a_Value); }
+	);
+	MeasureView("View BEInt32", CreateIntValues<Int32>(), 4,
+		[](cByteBuffer & a_Buffer, Int32 a_Value) { return a_Buffer.WriteBEInt32(a_Value); },
+		[](cByteBufferView & a_View, Int32 & a_Value) { return a_View.ReadBEInt32(a_Value); }
+	);
+	MeasureView("View VarUTF8String, 16 bytes", CreateStrings(NUM_VALUES, 16), 16 + MAX_VARINT32_SIZE, WriteString,
+		[](cByteBufferView & a_View, AString & a_Value) { return a_View.ReadVarUTF8String(a_Value); }
+	);
+	return EXIT_SUCCESS;
+}
+
+
+
+
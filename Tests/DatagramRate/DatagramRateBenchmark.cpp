@@ -0,0 +1,258 @@
+
+// DatagramRateBenchmark.cpp
+
+// Measures the datagrams/sec that a cUDPEndpoint receives and sends on loopback, one datagram at a time and in batches
+
+// Receiving: a plain UDP socket sends the datagrams to the endpoint with sendmmsg(), staying at most a window ahead of
+// the endpoint so that the OS doesn't drop them; the endpoint's callbacks count them either per datagram
+// (OnReceivedData(), with the remote address as text) or per batch (OnReceivedBatch()).
+// Sending: the endpoint sends the datagrams to a plain UDP socket that nobody reads, one per SendTo() call or in
+// SendToBatch() calls; only the sender's side is measured.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestServer.h"
+#include "OSSupport/Network.h"
+#include "OSSupport/NetworkSingleton.h"
+#include <atomic>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+/** Number of datagrams in a single measurement. */
+static const size_t NUM_DATAGRAMS = 1000000;
+
+/** Size of a single datagram, about the size of a STUN binding request. */
+static const size_t DATAGRAM_SIZE = 100;
+
+/** Number of datagrams sent in a single sendmmsg() or SendToBatch() call. */
+static const size_t SEND_BATCH_SIZE = 64;
+
+/** The most datagrams the plain socket may send ahead of the endpoint receiving them. The default socket receive buffer
+holds only a few hundred small datagrams, the kernel accounts each with its whole buffer overhead. */
+static const size_t WINDOW_SIZE = 128;
+
+
+
+
+
+/** The endpoint's callbacks, counting the received datagrams and the callback calls. */
+class cReceiverCallbacks :
+	public cUDPEndpoint::cCallbacks
+{
+public:
+	cReceiverCallbacks(bool a_ShouldBatch):
+		m_ShouldBatch(a_ShouldBatch),
+		m_NumReceived(0),
+		m_NumCalls(0)
+	{
+	}
+
+	/** If true, the datagrams are counted in OnReceivedBatch(); otherwise the default one calls OnReceivedData() for each. */
+	bool m_ShouldBatch;
+
+	std::atomic<size_t> m_NumReceived;
+	size_t m_NumCalls;
+
+
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+	{
+		fprintf(stderr, "UDP endpoint error %d: %s\n", a_ErrorCode, a_ErrorMsg.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	virtual void OnReceivedData(const char * a_Data, size_t a_Size, const AString & a_RemoteHost, UInt16 a_RemotePort) override
+	{
+		m_NumCalls += 1;
+		m_NumReceived += 1;
+	}
+
+	virtual void OnReceivedBatch(const cUDPEndpoint::cDatagram * a_Datagrams, size_t a_NumDatagrams) override
+	{
+		if (!m_ShouldBatch)
+		{
+			cUDPEndpoint::cCallbacks::OnReceivedBatch(a_Datagrams, a_NumDatagrams);
+			return;
+		}
+		m_NumCalls += 1;
+		m_NumReceived += a_NumDatagrams;
+	}
+};
+
+
+
+
+
+/** Returns a plain UDP socket bound to a free loopback port, and the port in a_Addr. */
+static int CreatePlainSocket(sockaddr_in & a_Addr)
+{
+	int Socket = socket(AF_INET, SOCK_DGRAM, 0);
+	TEST_CHECK(Socket >= 0);
+	memset(&a_Addr, 0, sizeof(a_Addr));
+	a_Addr.sin_family = AF_INET;
+	a_Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(bind(Socket, reinterpret_cast<const sockaddr *>(&a_Addr), sizeof(a_Addr)) == 0);
+	socklen_t AddrLen = sizeof(a_Addr);
+	TEST_CHECK(getsockname(Socket, reinterpret_cast<sockaddr *>(&a_Addr), &AddrLen) == 0);
+	return Socket;
+}
+
+
+
+
+
+/** Waits until the endpoint has received at least a_NumDatagrams datagrams. Exits with an error if the endpoint stops
+receiving, which means that the OS has dropped some of the datagrams. */
+static void WaitForReceived(const cReceiverCallbacks & a_Callbacks, size_t a_NumDatagrams)
+{
+	auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	size_t LastReceived = a_Callbacks.m_NumReceived;
+	while (LastReceived < a_NumDatagrams)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+		size_t NumReceived = a_Callbacks.m_NumReceived;
+		if (NumReceived != LastReceived)
+		{
+			LastReceived = NumReceived;
+			Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		}
+		else if (std::chrono::steady_clock::now() > Deadline)
+		{
+			fprintf(stderr, "The endpoint stopped receiving at %zu of %zu datagrams, some have been dropped\n", NumReceived, a_NumDatagrams);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+
+
+
+/** Prints a single measurement's results. */
+static void PrintRate(const char * a_Name, std::chrono::steady_clock::time_point a_Start, size_t a_NumCalls)
+{
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - a_Start).count();
+	printf("%-27s %8.0f datagrams/sec, %7.1f datagrams per call (%zu datagrams in %.3f s)\n",
+		a_Name, static_cast<double>(NUM_DATAGRAMS) / Elapsed,
+		static_cast<double>(NUM_DATAGRAMS) / static_cast<double>(std::max<size_t>(a_NumCalls, 1)), NUM_DATAGRAMS, Elapsed
+	);
+}
+
+
+
+
+
+/** Sends NUM_DATAGRAMS datagrams from a plain socket to the endpoint, prints the endpoint's receive rate. */
+static void MeasureReceive(bool a_ShouldBatch)
+{
+	cReceiverCallbacks Callbacks(a_ShouldBatch);
+	auto Endpoint = cNetwork::CreateUDPEndpoint(cTestServer::GetFreePort(true), Callbacks);
+	TEST_CHECK((Endpoint != nullptr) && Endpoint->IsOpen());
+	sockaddr_in SenderAddr;
+	int Sender = CreatePlainSocket(SenderAddr);
+	sockaddr_in EndpointAddr = SenderAddr;
+	EndpointAddr.sin_port = htons(Endpoint->GetPort());
+
+	char Payload[DATAGRAM_SIZE];
+	memset(Payload, 'u', sizeof(Payload));
+	iovec Vec;
+	Vec.iov_base = Payload;
+	Vec.iov_len = sizeof(Payload);
+	mmsghdr Msgs[SEND_BATCH_SIZE];
+	memset(Msgs, 0, sizeof(Msgs));
+	for (auto & Msg : Msgs)
+	{
+		Msg.msg_hdr.msg_name = &EndpointAddr;
+		Msg.msg_hdr.msg_namelen = sizeof(EndpointAddr);
+		Msg.msg_hdr.msg_iov = &Vec;
+		Msg.msg_hdr.msg_iovlen = 1;
+	}
+
+	auto Start = std::chrono::steady_clock::now();
+	for (size_t NumSent = 0; NumSent < NUM_DATAGRAMS;)
+	{
+		if (NumSent > WINDOW_SIZE)
+		{
+			WaitForReceived(Callbacks, NumSent - WINDOW_SIZE);
+		}
+		int NumMsgs = sendmmsg(Sender, Msgs, static_cast<unsigned>(std::min(SEND_BATCH_SIZE, NUM_DATAGRAMS - NumSent)), 0);
+		TEST_CHECK(NumMsgs > 0);
+		NumSent += static_cast<size_t>(NumMsgs);
+	}
+	WaitForReceived(Callbacks, NUM_DATAGRAMS);
+	PrintRate(a_ShouldBatch ? "Receive, OnReceivedBatch:" : "Receive, OnReceivedData:", Start, Callbacks.m_NumCalls);
+	Endpoint->Close();
+	close(Sender);
+}
+
+
+
+
+
+/** Sends NUM_DATAGRAMS datagrams from the endpoint to a plain socket, prints the endpoint's send rate. */
+static void MeasureSend(bool a_ShouldBatch)
+{
+	cReceiverCallbacks Callbacks(false);
+	auto Endpoint = cNetwork::CreateUDPEndpoint(cTestServer::GetFreePort(true), Callbacks);
+	TEST_CHECK((Endpoint != nullptr) && Endpoint->IsOpen());
+	sockaddr_in SinkAddr;
+	int Sink = CreatePlainSocket(SinkAddr);
+	auto Addr = reinterpret_cast<const sockaddr *>(&SinkAddr);
+
+	char Payload[DATAGRAM_SIZE];
+	memset(Payload, 'u', sizeof(Payload));
+	cUDPEndpoint::cDatagram Datagrams[SEND_BATCH_SIZE];
+	for (auto & Datagram : Datagrams)
+	{
+		Datagram.m_Data = Payload;
+		Datagram.m_Size = sizeof(Payload);
+	}
+
+	// Most of the datagrams are dropped by the unread sink's socket, which doesn't make the sending fail:
+	auto Start = std::chrono::steady_clock::now();
+	size_t NumCalls = 0;
+	if (a_ShouldBatch)
+	{
+		for (size_t NumSent = 0; NumSent < NUM_DATAGRAMS; NumSent += SEND_BATCH_SIZE)
+		{
+			TEST_CHECK(Endpoint->SendToBatch(Datagrams, SEND_BATCH_SIZE, Addr, sizeof(SinkAddr)) == SEND_BATCH_SIZE);
+			NumCalls += 1;
+		}
+	}
+	else
+	{
+		for (size_t NumSent = 0; NumSent < NUM_DATAGRAMS; NumSent++)
+		{
+			TEST_CHECK(Endpoint->SendTo(Payload, sizeof(Payload), Addr, sizeof(SinkAddr)));
+			NumCalls += 1;
+		}
+	}
+	PrintRate(a_ShouldBatch ? "Send, SendToBatch:" : "Send, SendTo:", Start, NumCalls);
+	Endpoint->Close();
+	close(Sink);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Passing %zu datagrams of %zu bytes through a loopback UDP endpoint:\n", NUM_DATAGRAMS, DATAGRAM_SIZE);
+	MeasureReceive(false);
+	MeasureReceive(true);
+	MeasureSend(false);
+	MeasureSend(true);
+	cNetworkSingleton::Get().Terminate();
+	return EXIT_SUCCESS;
+}
+
+
+
+
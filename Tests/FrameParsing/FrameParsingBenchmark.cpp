@@ -0,0 +1,186 @@
+
+// FrameParsingBenchmark.cpp
+
+// Measures the frames/sec of splitting the received data into packets and parsing them, the way cProtocol_impl does
+// it now (in place, out of the segmented receive buffer) and the way it did before (copying each frame out of a ring
+// cByteBuffer into a new cByteBuffer)
+
+// The received data is a stream of MediaMsg packets (peer ID, VarUTF8 message) with 16 to 256 byte messages, fed into
+// the receive buffer in 16 KiB blocks, the size of a single LibEvent read.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "ByteBuffer.h"
+#include "ByteBufferView.h"
+#include "SegmentedByteBuffer.h"
+#include <random>
+
+
+
+
+
+/** Number of packets parsed in each measurement. */
+static const size_t NUM_FRAMES = 4000000;
+
+/** Size of the blocks of the received data fed into the receive buffer at once. */
+static const size_t READ_SIZE = 16 KiB;
+
+/** The limit of the receive buffers, same as the server's default MaxReceiveBufferKiB. */
+static const size_t MAX_BUFFER_SIZE = 1 MiB;
+
+
+
+
+
+/** Returns the stream of NUM_FRAMES MediaMsg packets, each prefixed by its length. */
+static AString CreateStream(void)
+{
+	std::minstd_rand Random(1);
+	std::uniform_int_distribution<size_t> MsgSize(16, 256);
+	AString res;
+	cByteBuffer Packet(1 KiB);
+	AString Frame;
+	for (size_t i = 0; i < NUM_FRAMES; i++)
+	{
+		// The packet type and body:
+		VERIFY(Packet.WriteVarInt32(0x12));
+		VERIFY(Packet.WriteVarInt32(static_cast<UInt32>(i % 1000)));
+		VERIFY(Packet.WriteVarUTF8String(AString(MsgSize(Random), 'm')));
+		AString Body;
+		Packet.ReadAll(Body);
+		Packet.CommitRead();
+
+		// The length prefix:
+		VERIFY(Packet.WriteVarInt32(static_cast<UInt32>(Body.size())));
+		Packet.ReadAll(Frame);
+		Packet.CommitRead();
+		res.append(Frame);
+		res.append(Body);
+	}
+	return res;
+}
+
+
+
+
+
+/** Parses the MediaMsg body the same way cProtocol_impl::HandlePacketMediaMsg() does, returns the message's length. */
+template <typename BufferType>
+static size_t ParseMediaMsg(BufferType & a_Packet)
+{
+	UInt32 PacketType, PeerID;
+	AString Msg;
+	VERIFY(a_Packet.ReadVarInt(PacketType));
+	VERIFY(a_Packet.ReadVarInt(PeerID));
+	VERIFY(a_Packet.ReadVarUTF8String(Msg));
+	return Msg.size();
+}
+
+
+
+
+
+/** The current framing: parse each packet in place when it is contiguous in the segmented buffer, copy it only if it
+spans two chunks. Returns the total length of the parsed messages. */
+static size_t ParseInPlace(const AString & a_Stream)
+{
+	cSegmentedByteBuffer ReceivedData(MAX_BUFFER_SIZE);
+	AString WrappedPacket;
+	size_t res = 0;
+	for (size_t Pos = 0; Pos < a_Stream.size(); Pos += READ_SIZE)
+	{
+		VERIFY(ReceivedData.Write(a_Stream.data() + Pos, std::min(READ_SIZE, a_Stream.size() - Pos)));
+		for (;;)
+		{
+			UInt32 PacketLen;
+			if (!ReceivedData.ReadVarInt(PacketLen) || !ReceivedData.CanReadBytes(PacketLen))
+			{
+				ReceivedData.ResetRead();
+				break;
+			}
+			const char * PacketData;
+			if (ReceivedData.PeekContiguous(PacketData, static_cast<size_t>(PacketLen)))
+			{
+				VERIFY(ReceivedData.SkipRead(static_cast<size_t>(PacketLen)));
+			}
+			else
+			{
+				VERIFY(ReceivedData.ReadString(WrappedPacket, static_cast<size_t>(PacketLen)));
+				PacketData = WrappedPacket.data();
+			}
+			cByteBufferView bb(PacketData, static_cast<size_t>(PacketLen));
+			res += ParseMediaMsg(bb);
+			ReceivedData.CommitRead();
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** The framing before the in-place parsing: each packet is copied out of the ring into a new cByteBuffer, with an extra
+NUL appended for detecting over-reads. Returns the total length of the parsed messages. */
+static size_t ParseCopied(const AString & a_Stream)
+{
+	cByteBuffer ReceivedData(MAX_BUFFER_SIZE);
+	size_t res = 0;
+	for (size_t Pos = 0; Pos < a_Stream.size(); Pos += READ_SIZE)
+	{
+		VERIFY(ReceivedData.Write(a_Stream.data() + Pos, std::min(READ_SIZE, a_Stream.size() - Pos)));
+		for (;;)
+		{
+			UInt32 PacketLen;
+			if (!ReceivedData.ReadVarInt(PacketLen) || !ReceivedData.CanReadBytes(PacketLen))
+			{
+				ReceivedData.ResetRead();
+				break;
+			}
+			cByteBuffer bb(PacketLen + 1);
+			VERIFY(ReceivedData.ReadToByteBuffer(bb, static_cast<size_t>(PacketLen)));
+			ReceivedData.CommitRead();
+			VERIFY(bb.Write("\0", 1));
+			res += ParseMediaMsg(bb);
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** Runs the parser over the stream, prints the frames/sec. Returns the parser's result, for comparing the parsers. */
+static size_t Measure(const char * a_Name, size_t (*a_Parser)(const AString &), const AString & a_Stream)
+{
+	auto Start = std::chrono::steady_clock::now();
+	size_t res = a_Parser(a_Stream);
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	printf("%-9s %6.2f M frames/sec, %7.1f MiB/s (%zu frames in %.3f s)\n",
+		a_Name, static_cast<double>(NUM_FRAMES) / Elapsed / 1e6,
+		static_cast<double>(a_Stream.size()) / Elapsed / (1024 * 1024), NUM_FRAMES, Elapsed
+	);
+	return res;
+}
+
+
+
+
+
+int main(void)
+{
+	AString Stream = CreateStream();
+	printf("Parsing %zu MediaMsg frames, %.1f MiB in %zu KiB reads:\n",
+		NUM_FRAMES, static_cast<double>(Stream.size()) / (1024 * 1024), READ_SIZE / 1024
+	);
+	size_t Copied = Measure("Copied:", ParseCopied, Stream);
+	size_t InPlace = Measure("In place:", ParseInPlace, Stream);
+	TEST_CHECK(Copied == InPlace);
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,179 @@
+
+// IdleConnectionsBenchmark.cpp
+
+// Measures the memory that the server holds per idle connection, and the memory of a single idle receive buffer
+
+// Usage: IdleConnectionsBenchmark [NumClients]
+// The default is 5000 clients. Each client takes two file descriptors in this process (the benchmark's end and
+// the server's end); a count above the open files limit is measured at the limit instead.
+// Each client connects and exchanges a status ping with the server, so that its connection has been accepted and
+// has gone through the receive path, then stays idle. The memory is the heap in use (malloc's counters, summed over
+// all the arenas) and the resident set size; the benchmark's own client objects are allocated before the baseline
+// and the ping answers are received into a stack buffer, so that only the server's memory is counted.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "ByteBuffer.h"
+#include "SegmentedByteBuffer.h"
+#include <deque>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+/** Number of buffers created for measuring the memory of a single idle buffer. */
+static const size_t NUM_BUFFERS = 1000;
+
+
+
+
+
+/** The memory of the whole process at a single point in time. */
+struct cMemory
+{
+	/** Bytes of the heap in use, including the blocks malloc has mmap-ed separately. */
+	size_t m_Heap;
+
+	/** Bytes of the resident set. */
+	size_t m_Resident;
+};
+
+
+
+
+
+/** Returns the current memory of the process. */
+static cMemory GetMemory(void)
+{
+	cMemory res;
+	auto Info = mallinfo2();
+	res.m_Heap = Info.uordblks + Info.hblkhd;
+	res.m_Resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f != nullptr)
+	{
+		unsigned long Size, Resident;
+		if (fscanf(f, "%lu %lu", &Size, &Resident) == 2)
+		{
+			res.m_Resident = static_cast<size_t>(Resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		}
+		fclose(f);
+	}
+	return res;
+}
+
+
+
+
+
+/** Raises the open files limit as far as allowed, returns the number of clients that fit into it. */
+static size_t GetMaxClients(void)
+{
+	rlimit Limit;
+	TEST_CHECK(getrlimit(RLIMIT_NOFILE, &Limit) == 0);
+	Limit.rlim_cur = Limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &Limit);
+	TEST_CHECK(getrlimit(RLIMIT_NOFILE, &Limit) == 0);
+
+	// Leave some descriptors for the server's own sockets, LibEvent and the log files:
+	static const rlim_t RESERVED = 100;
+	return (Limit.rlim_cur > RESERVED) ? static_cast<size_t>((Limit.rlim_cur - RESERVED) / 2) : 0;
+}
+
+
+
+
+
+/** Creates NUM_BUFFERS buffers using a_Create, prints the heap and the object size per buffer. */
+template <typename T, typename CreateFn>
+static void MeasureBuffer(const char * a_Name, CreateFn a_Create)
+{
+	std::vector<std::unique_ptr<T>> Buffers;
+	Buffers.reserve(NUM_BUFFERS);
+	auto Before = GetMemory();
+	for (size_t i = 0; i < NUM_BUFFERS; i++)
+	{
+		Buffers.push_back(a_Create());
+	}
+	auto After = GetMemory();
+	size_t Heap = (After.m_Heap - Before.m_Heap) / NUM_BUFFERS;
+	printf("%-36s %6u bytes of heap per buffer, of which the object itself %u bytes\n",
+		a_Name, static_cast<unsigned>(Heap), static_cast<unsigned>(sizeof(T))
+	);
+}
+
+
+
+
+
+/** Connects the clients, lets each exchange a status ping with the server and prints the memory per connection. */
+static void MeasureIdleConnections(size_t a_NumClients)
+{
+	cTestServer Server("IdleConnections", cTestServer::DefaultSettings());
+	std::vector<std::unique_ptr<cTestClient>> Clients;
+	for (size_t i = 0; i < a_NumClients; i++)
+	{
+		Clients.emplace_back(new cTestClient);
+	}
+	AString Ping;
+	cTestClient::AppendPacket(Ping, 0x01, AString(8, '\0'));
+
+	// Let the server settle after the start, then take the baseline:
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	auto Before = GetMemory();
+	for (auto & Client : Clients)
+	{
+		TEST_CHECK(Client->Connect(Server.GetPort()));
+		TEST_CHECK(Client->SendRaw(Ping.data(), Ping.size()));
+		char Answer[256];
+		TEST_CHECK(recv(Client->GetSocket(), Answer, sizeof(Answer), 0) > 0);
+	}
+
+	// Let the server finish its bookkeeping of the last clients:
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	auto After = GetMemory();
+	auto Stats = cSegmentedByteBuffer::GetPoolStats();
+	printf("%u idle connections: %.0f bytes of heap and %.0f bytes resident per connection, %u receive chunks in use\n",
+		static_cast<unsigned>(a_NumClients),
+		(static_cast<double>(After.m_Heap) - Before.m_Heap) / a_NumClients,
+		(static_cast<double>(After.m_Resident) - Before.m_Resident) / a_NumClients,
+		static_cast<unsigned>(Stats.m_NumInUse)
+	);
+}
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+	size_t NumClients = (argc > 1) ? static_cast<size_t>(atoi(argv[1])) : 5000;
+	size_t MaxClients = GetMaxClients();
+	if (NumClients > MaxClients)
+	{
+		printf("%u clients don't fit into the open files limit, measuring with %u clients instead\n",
+			static_cast<unsigned>(NumClients), static_cast<unsigned>(MaxClients)
+		);
+		NumClients = MaxClients;
+	}
+
+	// The receive buffers alone: the ring each client used to preallocate, the chunk list the segmented buffer
+	// used to keep, and the segmented buffer now:
+	MeasureBuffer<cByteBuffer>("Ring cByteBuffer, 64 KiB", []() { return cpp14::make_unique<cByteBuffer>(64 KiB); });
+	MeasureBuffer<std::deque<char *>>("Empty std::deque<char *> chunk list", []() { return cpp14::make_unique<std::deque<char *>>(); });
+	MeasureBuffer<cSegmentedByteBuffer>("Idle cSegmentedByteBuffer", []() { return cpp14::make_unique<cSegmentedByteBuffer>(1 MiB); });
+
+	MeasureIdleConnections(NumClients);
+	return EXIT_SUCCESS;
+}
+
+
+
+
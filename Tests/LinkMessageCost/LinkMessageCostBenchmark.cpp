@@ -0,0 +1,243 @@
+
+// LinkMessageCostBenchmark.cpp
+
+// Measures the CPU time per message sent over an accepted cTCPLink, with the thread-safe links and with the
+// single-owner links (cNetwork::SetSingleOwnerLinks()), on a loopback connection
+
+// Two patterns are measured for each link mode:
+//  - echo: the link's callback sends each received message back, from the link's own network thread, as the server
+//    does in the immediate dispatch mode;
+//  - foreign: another thread sends the messages over the link, as the tick thread does.
+// The CPU time is the whole process' one, so it includes the plain socket at the other end of the connection, which
+// is the same in both modes.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "OSSupport/Network.h"
+#include "OSSupport/NetworkSingleton.h"
+#include <atomic>
+#include <sys/socket.h>
+#include <time.h>
+
+
+
+
+
+/** Number of messages sent in a single measurement. */
+static const size_t NUM_MESSAGES = 1000000;
+
+/** Size of a single message. */
+static const size_t MESSAGE_SIZE = 64;
+
+/** Number of messages the plain socket sends in a single write, in the echo pattern. */
+static const size_t BATCH_SIZE = 64;
+
+
+
+
+
+/** Returns the CPU time used by the whole process so far, in seconds. */
+static double GetProcessCPUTime(void)
+{
+	timespec Time;
+	TEST_CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &Time) == 0);
+	return static_cast<double>(Time.tv_sec) + static_cast<double>(Time.tv_nsec) / 1e9;
+}
+
+
+
+
+
+/** The callbacks of the accepted link; in the echo pattern, sends each whole received message back. */
+class cLinkCallbacks :
+	public cTCPLink::cCallbacks
+{
+public:
+	cLinkCallbacks(bool a_ShouldEcho):
+		m_ShouldEcho(a_ShouldEcho)
+	{
+	}
+
+	bool m_ShouldEcho;
+
+	/** The link, set once it has been created. */
+	std::atomic<bool> m_HasLink{false};
+	cTCPLinkPtr m_Link;
+
+	/** The received data not yet echoed, less than a single message. */
+	AString m_Partial;
+
+
+	virtual void OnLinkCreated(cTCPLinkPtr a_Link) override
+	{
+		m_Link = a_Link;
+		m_HasLink = true;
+	}
+
+	virtual void OnReceivedData(const char * a_Data, size_t a_Length) override
+	{
+		if (!m_ShouldEcho)
+		{
+			return;
+		}
+		if (!m_Partial.empty())
+		{
+			size_t Missing = std::min(MESSAGE_SIZE - m_Partial.size(), a_Length);
+			m_Partial.append(a_Data, Missing);
+			a_Data += Missing;
+			a_Length -= Missing;
+			if (m_Partial.size() < MESSAGE_SIZE)
+			{
+				return;
+			}
+			m_Link->Send(m_Partial.data(), MESSAGE_SIZE);
+			m_Partial.clear();
+		}
+		for (; a_Length >= MESSAGE_SIZE; a_Data += MESSAGE_SIZE, a_Length -= MESSAGE_SIZE)
+		{
+			m_Link->Send(a_Data, MESSAGE_SIZE);
+		}
+		m_Partial.assign(a_Data, a_Length);
+	}
+
+	virtual void OnRemoteClosed(void) override
+	{
+	}
+
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+	{
+		fprintf(stderr, "Link error %d: %s\n", a_ErrorCode, a_ErrorMsg.c_str());
+		exit(EXIT_FAILURE);
+	}
+};
+
+
+
+
+
+/** The listening callbacks, giving the accepted link the prepared callbacks. */
+class cListenCallbacks :
+	public cNetwork::cListenCallbacks
+{
+public:
+	cListenCallbacks(std::shared_ptr<cLinkCallbacks> a_LinkCallbacks):
+		m_LinkCallbacks(a_LinkCallbacks)
+	{
+	}
+
+	virtual cTCPLink::cCallbacksPtr OnIncomingConnection(const AString & a_RemoteIPAddress, UInt16 a_RemotePort) override
+	{
+		return m_LinkCallbacks;
+	}
+
+	virtual void OnAccepted(cTCPLink & a_Link) override
+	{
+	}
+
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+	{
+		fprintf(stderr, "Listening error %d: %s\n", a_ErrorCode, a_ErrorMsg.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+protected:
+	std::shared_ptr<cLinkCallbacks> m_LinkCallbacks;
+};
+
+
+
+
+
+/** Receives a_Size bytes on the plain socket, dropping them. */
+static void ReceiveAll(cTestClient & a_Client, size_t a_Size)
+{
+	char Buffer[64 KiB];
+	while (a_Size > 0)
+	{
+		auto NumReceived = recv(a_Client.GetSocket(), Buffer, std::min(sizeof(Buffer), a_Size), 0);
+		TEST_CHECK(NumReceived > 0);
+		a_Size -= static_cast<size_t>(NumReceived);
+	}
+}
+
+
+
+
+
+/** Sends NUM_MESSAGES messages over a newly accepted link in the specified pattern, prints the CPU time per message. */
+static void MeasureMessageCost(bool a_IsSingleOwner, bool a_ShouldEcho)
+{
+	cNetwork::SetSingleOwnerLinks(a_IsSingleOwner);
+	auto LinkCallbacks = std::make_shared<cLinkCallbacks>(a_ShouldEcho);
+	UInt16 Port = cTestServer::GetFreePort();
+	auto Server = cNetwork::Listen(Port, std::make_shared<cListenCallbacks>(LinkCallbacks));
+	TEST_CHECK((Server != nullptr) && Server->IsListening());
+	cTestClient Client;
+	TEST_CHECK(Client.Connect(Port));
+	while (!LinkCallbacks->m_HasLink)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	double StartCPU = GetProcessCPUTime();
+	auto Start = std::chrono::steady_clock::now();
+	std::thread Sender;
+	if (a_ShouldEcho)
+	{
+		Sender = std::thread([&Client]()
+			{
+				AString Batch(BATCH_SIZE * MESSAGE_SIZE, 'e');
+				for (size_t i = 0; i < NUM_MESSAGES; i += BATCH_SIZE)
+				{
+					TEST_CHECK(Client.SendRaw(Batch.data(), Batch.size()));
+				}
+			}
+		);
+	}
+	else
+	{
+		Sender = std::thread([&LinkCallbacks]()
+			{
+				char Message[MESSAGE_SIZE];
+				memset(Message, 'f', sizeof(Message));
+				for (size_t i = 0; i < NUM_MESSAGES; i++)
+				{
+					TEST_CHECK(LinkCallbacks->m_Link->Send(Message, sizeof(Message)));
+				}
+			}
+		);
+	}
+	ReceiveAll(Client, NUM_MESSAGES * MESSAGE_SIZE);
+	Sender.join();
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	double CPU = GetProcessCPUTime() - StartCPU;
+
+	Client.Close();
+	Server->Close();
+	printf("%-13s %-8s %7.0f ns CPU per message, %8.0f msgs/sec (%zu messages in %.3f s, %.3f s CPU)\n",
+		a_IsSingleOwner ? "Single-owner:" : "Thread-safe:", a_ShouldEcho ? "echo" : "foreign",
+		CPU * 1e9 / NUM_MESSAGES, static_cast<double>(NUM_MESSAGES) / Elapsed, NUM_MESSAGES, Elapsed, CPU
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Sending %zu messages of %zu bytes over a loopback link:\n", NUM_MESSAGES, MESSAGE_SIZE);
+	MeasureMessageCost(false, true);
+	MeasureMessageCost(true, true);
+	MeasureMessageCost(false, false);
+	MeasureMessageCost(true, false);
+	cNetworkSingleton::Get().Terminate();
+	return EXIT_SUCCESS;
+}
+
+
+
+
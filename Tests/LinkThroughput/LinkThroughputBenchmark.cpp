@@ -0,0 +1,196 @@
+
+// LinkThroughputBenchmark.cpp
+
+// Measures the throughput of the cTCPLink read path on a loopback connection, with link callbacks that take the
+// received data chunk by chunk (OnReceivedData()) and ones that take all of it at once (OnReceivedDataChunks())
+
+// The sender is a plain blocking socket pushing the data as fast as the link reads it. The receiving callbacks
+// do what cClientHandle does with the data: lock the incoming queue and append to it.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "OSSupport/Network.h"
+#include "OSSupport/NetworkSingleton.h"
+#include <atomic>
+
+
+
+
+
+/** Total amount of data sent in a single measurement. */
+static const size_t TOTAL_SIZE = 512 MiB;
+
+/** Size of the sender's writes. */
+static const size_t WRITE_SIZE = 64 KiB;
+
+/** The incoming queue is emptied whenever it grows over this size, as if the tick thread had processed it. */
+static const size_t MAX_QUEUE_SIZE = 1 MiB;
+
+
+
+
+
+/** The callbacks of the accepted link, counting the received data and the callback calls. */
+class cReceiverCallbacks :
+	public cTCPLink::cCallbacks
+{
+public:
+	cReceiverCallbacks(bool a_ShouldBatch):
+		m_ShouldBatch(a_ShouldBatch),
+		m_NumReceived(0),
+		m_NumCalls(0)
+	{
+	}
+
+	/** If true, OnReceivedDataChunks() queues all the chunks at once; otherwise the default one calls OnReceivedData() per chunk. */
+	bool m_ShouldBatch;
+
+	std::atomic<size_t> m_NumReceived;
+	std::atomic<size_t> m_NumCalls;
+
+	cCriticalSection m_CSIncomingData;
+	AString m_IncomingData;
+	cTCPLinkPtr m_Link;
+
+
+	virtual void OnLinkCreated(cTCPLinkPtr a_Link) override
+	{
+		m_Link = a_Link;
+	}
+
+	virtual void OnReceivedData(const char * a_Data, size_t a_Length) override
+	{
+		cCSLock Lock(m_CSIncomingData);
+		QueueData(a_Data, a_Length);
+		m_NumCalls += 1;
+	}
+
+	virtual void OnReceivedDataChunks(const cTCPLink::cReceivedChunk * a_Chunks, size_t a_NumChunks) override
+	{
+		if (!m_ShouldBatch)
+		{
+			cTCPLink::cCallbacks::OnReceivedDataChunks(a_Chunks, a_NumChunks);
+			return;
+		}
+		cCSLock Lock(m_CSIncomingData);
+		for (size_t i = 0; i < a_NumChunks; i++)
+		{
+			QueueData(a_Chunks[i].m_Data, a_Chunks[i].m_Length);
+		}
+		m_NumCalls += 1;
+	}
+
+	virtual void OnRemoteClosed(void) override
+	{
+		m_Link.reset();
+	}
+
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+	{
+		fprintf(stderr, "Link error %d: %s\n", a_ErrorCode, a_ErrorMsg.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+protected:
+
+	/** Appends the data to the incoming queue. Called with m_CSIncomingData held. */
+	void QueueData(const char * a_Data, size_t a_Length)
+	{
+		if (m_IncomingData.size() + a_Length > MAX_QUEUE_SIZE)
+		{
+			m_IncomingData.clear();
+		}
+		m_IncomingData.append(a_Data, a_Length);
+		m_NumReceived += a_Length;
+	}
+};
+
+
+
+
+
+/** The listening callbacks, giving each accepted link the same receiver callbacks. */
+class cListenCallbacks :
+	public cNetwork::cListenCallbacks
+{
+public:
+	cListenCallbacks(std::shared_ptr<cReceiverCallbacks> a_Receiver):
+		m_Receiver(a_Receiver)
+	{
+	}
+
+	virtual cTCPLink::cCallbacksPtr OnIncomingConnection(const AString & a_RemoteIPAddress, UInt16 a_RemotePort) override
+	{
+		return m_Receiver;
+	}
+
+	virtual void OnAccepted(cTCPLink & a_Link) override
+	{
+	}
+
+	virtual void OnError(int a_ErrorCode, const AString & a_ErrorMsg) override
+	{
+		fprintf(stderr, "Listening error %d: %s\n", a_ErrorCode, a_ErrorMsg.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+protected:
+	std::shared_ptr<cReceiverCallbacks> m_Receiver;
+};
+
+
+
+
+
+/** Sends TOTAL_SIZE bytes over a single loopback link, prints the throughput and the callback calls. */
+static void MeasureThroughput(bool a_ShouldBatch)
+{
+	auto Receiver = std::make_shared<cReceiverCallbacks>(a_ShouldBatch);
+	UInt16 Port = cTestServer::GetFreePort();
+	auto Server = cNetwork::Listen(Port, std::make_shared<cListenCallbacks>(Receiver));
+	TEST_CHECK((Server != nullptr) && Server->IsListening());
+
+	cTestClient Sender;
+	TEST_CHECK(Sender.Connect(Port));
+	AString Block(WRITE_SIZE, 'd');
+	auto Start = std::chrono::steady_clock::now();
+	for (size_t NumSent = 0; NumSent < TOTAL_SIZE; NumSent += WRITE_SIZE)
+	{
+		TEST_CHECK(Sender.SendRaw(Block.data(), Block.size()));
+	}
+	while (Receiver->m_NumReceived < TOTAL_SIZE)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	Sender.Close();
+	Server->Close();
+
+	size_t NumCalls = Receiver->m_NumCalls;
+	printf("%-9s %7.1f MiB/s, %8zu callback calls, %7.1f KiB per call (%zu MiB in %.3f s)\n",
+		a_ShouldBatch ? "Batched:" : "Chunked:",
+		static_cast<double>(TOTAL_SIZE) / Elapsed / (1024 * 1024), NumCalls,
+		static_cast<double>(TOTAL_SIZE) / static_cast<double>(std::max<size_t>(NumCalls, 1)) / 1024,
+		TOTAL_SIZE / (1024 * 1024), Elapsed
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Sending %zu MiB over a loopback link in %zu KiB writes:\n", TOTAL_SIZE / (1024 * 1024), WRITE_SIZE / 1024);
+	MeasureThroughput(false);
+	MeasureThroughput(true);
+	cNetworkSingleton::Get().Terminate();
+	return EXIT_SUCCESS;
+}
+
+
+
+
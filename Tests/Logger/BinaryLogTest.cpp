@@ -0,0 +1,148 @@
+
+// BinaryLogTest.cpp
+
+// Tests that the binary log file decodes into the same messages as the text log has, for all kinds of arguments
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "Logger.h"
+#include "BinaryLogFile.h"
+
+
+
+
+
+static const char FILE_NAME[] = "BinaryLogTest.bin";
+
+enum eTestEnum
+{
+	teFirst = 1,
+	teSecond = -2,
+};
+
+
+
+
+
+/** Logs the message through FASTLOG_LEVEL and records the line that the text log would contain. */
+#define LOG_AND_EXPECT(a_LogLevel, a_Format, ...) \
+	do \
+	{ \
+		FASTLOG_LEVEL(a_LogLevel, a_Format, __VA_ARGS__); \
+		Expected.push_back(ExpectedLine(a_LogLevel, Printf(a_Format, __VA_ARGS__))); \
+	} while (false)
+
+
+
+
+
+/** Returns the line the text log file would contain for the message, without the time prefix. */
+static AString ExpectedLine(cLogger::eLogLevel a_LogLevel, const AString & a_Message)
+{
+	static const char * Prefixes[] = {"     ", "Info ", "Warn ", "Err  "};
+	return AString(Prefixes[a_LogLevel]) + a_Message + "\n";
+}
+
+
+
+
+
+/** Returns the decoded line without its time prefix. */
+static AString StripTime(const AString & a_Line)
+{
+	auto TimeEnd = a_Line.find("] ");
+	TEST_CHECK((TimeEnd != AString::npos) && (a_Line[5] == '['));
+	return a_Line.substr(0, 5) + a_Line.substr(TimeEnd + 2);
+}
+
+
+
+
+
+/** Logs the messages into the binary log through the asynchronous writer, checks that the decoded lines match.
+Then checks that a file truncated in the middle of the last record decodes all the other records. */
+static void TestRoundTrip(void)
+{
+	AStringVector Expected;
+	{
+		std::unique_ptr<cBinaryLogFile> BinaryLog(new cBinaryLogFile);
+		TEST_CHECK(BinaryLog->Open(FILE_NAME));
+		auto Attachment = cLogger::GetInstance().AttachListener(std::move(BinaryLog));
+		cLogger::GetInstance().StartAsync(1024, cLogger::opBlock);
+
+		LOG_AND_EXPECT(cLogger::llRegular, "%d %i %u", -5, 42, 7u);
+		LOG_AND_EXPECT(cLogger::llRegular, "%x %X %o %#x", 255u, 0xabcu, 8u, 16u);
+		LOG_AND_EXPECT(cLogger::llRegular, "%x %u", -1, -2);
+		LOG_AND_EXPECT(cLogger::llRegular, "%lld %llu", -1234567890123ll, 18446744073709551615ull);
+		LOG_AND_EXPECT(cLogger::llRegular, "%zu %ld", static_cast<size_t>(123456789), -7l);
+		LOG_AND_EXPECT(cLogger::llRegular, "%hhu %hu %hhd", static_cast<unsigned char>(200), static_cast<unsigned short>(60000), static_cast<signed char>(-3));
+		LOG_AND_EXPECT(cLogger::llRegular, "[%5d|%-5d|%05d|%+d]", 42, 42, 42, 42);
+		LOG_AND_EXPECT(cLogger::llRegular, "[%*d|%-*d|%.*f]", 6, 42, 4, 7, 2, 3.14159);
+		LOG_AND_EXPECT(cLogger::llRegular, "%.3f %e %g %f", 3.14159, 1e-10, 2.5f, -0.0);
+		LOG_AND_EXPECT(cLogger::llRegular, "%s and [%10s] and %.2s", "abc", "right", "truncated");
+		LOG_AND_EXPECT(cLogger::llRegular, "%c%c %d %d", 'O', 'K', teFirst, teSecond);
+		LOG_AND_EXPECT(cLogger::llRegular, "%p", reinterpret_cast<void *>(static_cast<uintptr_t>(0x1234)));
+		LOG_AND_EXPECT(cLogger::llRegular, "100%% done, %s", "ok");
+		LOG_AND_EXPECT(cLogger::llInfo, "info %d", 1);
+		LOG_AND_EXPECT(cLogger::llWarning, "warning %s", "two");
+		LOG_AND_EXPECT(cLogger::llError, "error %u", 3u);
+		for (int i = 0; i < 1000; i++)
+		{
+			LOG_AND_EXPECT(cLogger::llRegular, "Repeated message %d of %s", i, "many");
+		}
+
+		// The already formatted messages are written as text:
+		LOG("Formatted %d", 5);
+		Expected.push_back(ExpectedLine(cLogger::llRegular, "Formatted 5"));
+
+		// Writes everything out; the attachment then closes the file:
+		cLogger::GetInstance().StopAsync();
+	}
+
+	AStringVector Decoded;
+	TEST_CHECK(cBinaryLogFile::Decode(FILE_NAME, [&Decoded](const AString & a_Line)
+		{
+			Decoded.push_back(StripTime(a_Line));
+		}
+	));
+	TEST_CHECK(Decoded.size() == Expected.size());
+	for (size_t i = 0; i < Expected.size(); i++)
+	{
+		if (Decoded[i] != Expected[i])
+		{
+			fprintf(stderr, "Line %u decoded as \"%s\", expected \"%s\"\n", static_cast<unsigned>(i), Decoded[i].c_str(), Expected[i].c_str());
+		}
+		TEST_CHECK(Decoded[i] == Expected[i]);
+	}
+
+	// Cut the last record short, as if the server stopped in the middle of writing it:
+	AString Contents = cFile::ReadWholeFile(FILE_NAME);
+	cFile File(FILE_NAME, cFile::fmWrite);
+	TEST_CHECK(File.Write(Contents.data(), Contents.size() - 3) == static_cast<int>(Contents.size() - 3));
+	File.Close();
+	size_t NumDecoded = 0;
+	TEST_CHECK(cBinaryLogFile::Decode(FILE_NAME, [&NumDecoded](const AString & a_Line)
+		{
+			UNUSED(a_Line);
+			NumDecoded += 1;
+		}
+	));
+	TEST_CHECK(NumDecoded == Expected.size() - 1);
+	cFile::DeleteFile(FILE_NAME);
+}
+
+
+
+
+
+int main(void)
+{
+	TestRoundTrip();
+	printf("BinaryLog test passed\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,144 @@
+
+// LoggerBenchmark.cpp
+
+// Measures the LOG calls per second from 8 threads at once, logging synchronously and through the asynchronous writer
+
+// Each measurement runs in a forked child process, because the logger is a singleton whose asynchronous mode can only
+// be started once. The messages go to the server's text file listener, or to the binary log file, in a fresh "logs"
+// folder that is removed afterwards.
+// The calls/sec are the rate at which the logging threads get through their calls; the written/sec include writing
+// out the queue when the asynchronous logging stops.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "Logger.h"
+#include "LoggerListeners.h"
+#include "BinaryLogFile.h"
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+
+
+
+/** Number of threads logging at the same time. */
+static const int NUM_THREADS = 8;
+
+/** Number of messages each thread logs in a single measurement. */
+static const int NUM_MESSAGES = 100000;
+
+/** The asynchronous queue's capacity, the server's default [Logging] QueueSize. */
+static const size_t QUEUE_SIZE = 16384;
+
+
+
+
+
+/** Logs NUM_MESSAGES messages from each of the NUM_THREADS threads, using FASTLOG if a_UseFastLog is set,
+prints the rate. Logs asynchronously with the specified policy if a_IsAsync is set, into the binary log file
+if a_IsBinary is set. Runs in a child process. */
+static void Measure(const char * a_Name, bool a_IsAsync, cLogger::eOverflowPolicy a_Policy, bool a_UseFastLog, bool a_IsBinary)
+{
+	auto & Logger = cLogger::GetInstance();
+	std::unique_ptr<cLogger::cListener> Listener;
+	if (a_IsBinary)
+	{
+		cFile::CreateFolder("logs");
+		std::unique_ptr<cBinaryLogFile> BinaryLog(new cBinaryLogFile);
+		TEST_CHECK(BinaryLog->Open("logs/LOG.bin"));
+		Listener = std::move(BinaryLog);
+	}
+	else
+	{
+		auto FileListener = MakeFileListener();
+		TEST_CHECK(FileListener.first);
+		Listener = std::move(FileListener.second);
+	}
+	auto Attachment = Logger.AttachListener(std::move(Listener));
+	if (a_IsAsync)
+	{
+		Logger.StartAsync(QUEUE_SIZE, a_Policy);
+	}
+
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_THREADS; i++)
+	{
+		Threads.emplace_back([i, a_UseFastLog]()
+			{
+				for (int j = 0; j < NUM_MESSAGES; j++)
+				{
+					if (a_UseFastLog)
+					{
+						FASTLOG("Client %d sent packet %d of %u bytes", i, j, 64u);
+					}
+					else
+					{
+						LOG("Client %d sent packet %d of %u bytes", i, j, 64u);
+					}
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto CallsElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	Logger.StopAsync();
+	auto WrittenElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+	auto Stats = Logger.GetAsyncStats();
+	double NumMessages = static_cast<double>(NUM_THREADS) * NUM_MESSAGES;
+	double NumWritten = NumMessages - static_cast<double>(Stats.m_NumDropped);
+	printf("%-24s %9.0f calls/sec, %9.0f written/sec (%llu dropped, %llu blocked, %.1f messages per batch)\n",
+		a_Name, NumMessages / CallsElapsed, NumWritten / WrittenElapsed,
+		static_cast<unsigned long long>(Stats.m_NumDropped), static_cast<unsigned long long>(Stats.m_NumBlocked),
+		(Stats.m_NumBatches > 0) ? static_cast<double>(Stats.m_NumWritten) / Stats.m_NumBatches : 0.0
+	);
+}
+
+
+
+
+
+/** Runs the measurement in a child process, with a fresh logs folder. */
+static void MeasureInChild(const char * a_Name, bool a_IsAsync, cLogger::eOverflowPolicy a_Policy, bool a_UseFastLog, bool a_IsBinary = false)
+{
+	TEST_CHECK(system("rm -rf logs") == 0);
+	fflush(stdout);
+	pid_t Child = fork();
+	TEST_CHECK(Child >= 0);
+	if (Child == 0)
+	{
+		Measure(a_Name, a_IsAsync, a_Policy, a_UseFastLog, a_IsBinary);
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+	int Status;
+	TEST_CHECK(waitpid(Child, &Status, 0) == Child);
+	TEST_CHECK(WIFEXITED(Status) && (WEXITSTATUS(Status) == EXIT_SUCCESS));
+	TEST_CHECK(system("rm -rf logs") == 0);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("%d threads logging %d messages each, queue size %u:\n", NUM_THREADS, NUM_MESSAGES, static_cast<unsigned>(QUEUE_SIZE));
+	MeasureInChild("Synchronous LOG", false, cLogger::opBlock, false);
+	MeasureInChild("Async LOG, block", true, cLogger::opBlock, false);
+	MeasureInChild("Async FASTLOG, block", true, cLogger::opBlock, true);
+	MeasureInChild("Async LOG, drop", true, cLogger::opDrop, false);
+	MeasureInChild("Async FASTLOG, drop", true, cLogger::opDrop, true);
+	MeasureInChild("Async LOG, binary", true, cLogger::opBlock, false, true);
+	MeasureInChild("Async FASTLOG, binary", true, cLogger::opBlock, true, true);
+	return EXIT_SUCCESS;
+}
+
+
+
+
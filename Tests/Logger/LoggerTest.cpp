@@ -0,0 +1,125 @@
+
+// LoggerTest.cpp
+
+// Tests that no message is lost when cLogger switches from asynchronous to synchronous logging while threads are logging
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "Logger.h"
+#include <atomic>
+
+
+
+
+
+/** Number of threads logging at the same time. */
+static const int NUM_THREADS = 8;
+
+/** Number of messages each thread logs. */
+static const int NUM_MESSAGES = 20000;
+
+
+
+
+
+/** Counts the messages passed to it by the logger, per logging thread (the thread's index starts each message). */
+class cCountingListener :
+	public cLogger::cListener
+{
+public:
+	cCountingListener(std::vector<int> & a_Counts) :
+		m_Counts(a_Counts)
+	{
+	}
+
+	virtual void Log(AString a_Message, cLogger::eLogLevel a_LogLevel) override
+	{
+		UNUSED(a_LogLevel);
+
+		// The message follows the "[hh:mm:ss] " line prefix:
+		auto Start = a_Message.find("] ");
+		TEST_CHECK(Start != AString::npos);
+		int ThreadIdx = atoi(a_Message.c_str() + Start + 2);
+		TEST_CHECK((ThreadIdx >= 0) && (ThreadIdx < NUM_THREADS));
+		m_Counts[static_cast<size_t>(ThreadIdx)] += 1;
+	}
+
+protected:
+	std::vector<int> & m_Counts;
+};
+
+
+
+
+
+/** Stops the asynchronous logging while the threads are logging, both with LOG and FASTLOG, through a queue small
+enough to make them block; checks that every message reaches the listener exactly once, before or after the switch. */
+static void TestStopWhileLogging(void)
+{
+	auto & Logger = cLogger::GetInstance();
+
+	// The logger calls the listener only while holding its lock, the counts need no locking:
+	std::vector<int> Counts(NUM_THREADS);
+	auto Attachment = Logger.AttachListener(std::unique_ptr<cLogger::cListener>(new cCountingListener(Counts)));
+	Logger.StartAsync(64, cLogger::opBlock);
+
+	std::atomic<int> NumStarted(0);
+	std::vector<std::thread> Threads;
+	for (int i = 0; i < NUM_THREADS; i++)
+	{
+		Threads.emplace_back([i, &NumStarted]()
+			{
+				NumStarted += 1;
+				for (int j = 0; j < NUM_MESSAGES; j++)
+				{
+					if ((j % 2) == 0)
+					{
+						LOG("%d message %d", i, j);
+					}
+					else
+					{
+						FASTLOG("%d message %d", i, j);
+					}
+				}
+			}
+		);
+	}
+	while (NumStarted < NUM_THREADS)
+	{
+		std::this_thread::yield();
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	Logger.StopAsync();
+	TEST_CHECK(!Logger.GetAsyncStats().m_IsAsync);
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+
+	auto Stats = Logger.GetAsyncStats();
+	TEST_CHECK(Stats.m_QueueSize == 0);
+	TEST_CHECK(Stats.m_NumDropped == 0);
+	for (int i = 0; i < NUM_THREADS; i++)
+	{
+		TEST_CHECK(Counts[static_cast<size_t>(i)] == NUM_MESSAGES);
+	}
+	printf("%d messages logged, %llu of them through the writer thread\n",
+		NUM_THREADS * NUM_MESSAGES, static_cast<unsigned long long>(Stats.m_NumWritten)
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	TestStopWhileLogging();
+	printf("Logger test passed\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
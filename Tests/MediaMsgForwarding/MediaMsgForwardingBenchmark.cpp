@@ -0,0 +1,143 @@
+
+// MediaMsgForwardingBenchmark.cpp
+
+// Measures forwarding the MediaMsg packets with SDP-sized payloads of 1 to 4 KiB, through cServer::ForwardMediaMsg()
+// and the protocol's packet composition, in the tick-driven and the immediate dispatch mode
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include <atomic>
+
+
+
+
+
+/** Number of client pairs forwarding the messages at the same time, each pair has its own sender and receiver thread. */
+static const int NUM_PAIRS = 4;
+
+/** Number of messages each sender sends for each payload size. */
+static const int NUM_MESSAGES = 20000;
+
+/** The most payload bytes a sender may have sent ahead of its receiver. The server kicks a client sending faster than
+it forwards, once the client's receive buffer (MaxReceiveBufferKiB, 1 MiB by default) is full. */
+static const size_t WINDOW_BYTES = 256 KiB;
+
+
+
+
+
+/** A pair of logged-in clients, the sender sends messages to the receiver through the server. */
+struct cPair
+{
+	cTestClient m_Sender;
+	cTestClient m_Receiver;
+	UInt32 m_ReceiverID;
+
+	/** Number of messages the receiver has received in the current measurement. */
+	std::atomic<int> m_NumReceived;
+};
+
+
+
+
+
+/** Forwards NUM_MESSAGES messages of the specified size through each pair at once, prints the throughput. */
+static void MeasureForwarding(std::vector<std::unique_ptr<cPair>> & a_Pairs, const char * a_Mode, size_t a_PayloadSize)
+{
+	int Window = static_cast<int>(std::max<size_t>(WINDOW_BYTES / a_PayloadSize, 1));
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (auto & Pair : a_Pairs)
+	{
+		auto & ThePair = *Pair;
+		ThePair.m_NumReceived = 0;
+		Threads.emplace_back([&ThePair, a_PayloadSize, Window]()
+			{
+				AString Packet;
+				cTestClient::AppendPacket(Packet, 0x12, cTestClient::MediaMsgBody(ThePair.m_ReceiverID, AString(a_PayloadSize, 's')));
+				for (int NumSent = 0; NumSent < NUM_MESSAGES; NumSent++)
+				{
+					while (NumSent - ThePair.m_NumReceived.load() > Window)
+					{
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+					}
+					TEST_CHECK(ThePair.m_Sender.SendRaw(Packet.data(), Packet.size()));
+				}
+			}
+		);
+		Threads.emplace_back([&ThePair, a_PayloadSize]()
+			{
+				UInt32 PacketType;
+				AString Body;
+				while (ThePair.m_NumReceived < NUM_MESSAGES)
+				{
+					TEST_CHECK(ThePair.m_Receiver.ReceivePacket(PacketType, Body));
+					if (PacketType == 0x12)
+					{
+						TEST_CHECK(Body.size() > a_PayloadSize);  // From ID, message length, message
+						ThePair.m_NumReceived += 1;
+					}
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	double NumMessages = static_cast<double>(NUM_PAIRS) * NUM_MESSAGES;
+	printf("%-9s %u KiB: %8.0f msgs/sec, %7.1f MiB/s of payload (%.0f messages in %.3f s)\n",
+		a_Mode, static_cast<unsigned>(a_PayloadSize / 1024), NumMessages / Elapsed,
+		NumMessages * static_cast<double>(a_PayloadSize) / Elapsed / (1024 * 1024), NumMessages, Elapsed
+	);
+}
+
+
+
+
+
+/** Runs the pairs against a server in the specified dispatch mode, for each payload size. */
+static void MeasureMode(bool a_ShouldDispatchImmediately)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	Settings->AddValue("Server", "ImmediateDispatch", a_ShouldDispatchImmediately);
+	cTestServer Server(a_ShouldDispatchImmediately ? "MediaMsgForwardingImmediate" : "MediaMsgForwardingTick", std::move(Settings));
+
+	std::vector<std::unique_ptr<cPair>> Pairs;
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		Pairs.emplace_back(new cPair);
+		auto & Pair = *Pairs.back();
+		AString ReceiverName = Printf("receiver%d", i);
+		TEST_CHECK(Pair.m_Sender.Connect(Server.GetPort()) && Pair.m_Sender.Login(Printf("sender%d", i)));
+		TEST_CHECK(Pair.m_Receiver.Connect(Server.GetPort()) && Pair.m_Receiver.Login(ReceiverName));
+		int ReceiverID = Pair.m_Sender.WaitForUser(ReceiverName);
+		TEST_CHECK(ReceiverID > 0);
+		Pair.m_ReceiverID = static_cast<UInt32>(ReceiverID);
+	}
+
+	for (size_t PayloadSize = 1 KiB; PayloadSize <= 4 KiB; PayloadSize += 1 KiB)
+	{
+		MeasureForwarding(Pairs, a_ShouldDispatchImmediately ? "Immediate" : "Tick", PayloadSize);
+	}
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Forwarding %d MediaMsg packets through each of %d pairs, for each payload size:\n", NUM_MESSAGES, NUM_PAIRS);
+	MeasureMode(false);
+	MeasureMode(true);
+	return EXIT_SUCCESS;
+}
+
+
+
+
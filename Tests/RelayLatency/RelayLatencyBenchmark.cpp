@@ -0,0 +1,147 @@
+
+// RelayLatencyBenchmark.cpp
+
+// Measures the p50 / p99 latency of the relayed MediaMsg packets, in the tick-driven and the immediate dispatch mode
+
+// Each sender sends a steady stream of timestamped messages to its receiver; the receiver measures the time from
+// sending to receiving (the clients share the process' clock). The server's own histogram (the "relaystats"
+// console command) covers only the time from receiving the packet to handing it to the recipient's link.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "Server.h"
+#include "ByteBufferView.h"
+#include "LatencyHistogram.h"
+
+
+
+
+
+/** Number of client pairs relaying the messages at the same time. */
+static const int NUM_PAIRS = 4;
+
+/** Number of messages each sender sends in a single measurement. */
+static const int NUM_MESSAGES = 5000;
+
+/** The pause between two messages of a single sender. */
+static const std::chrono::microseconds SEND_INTERVAL(500);
+
+
+
+
+
+/** Logs a sender and a receiver in, returns the receiver's client ID as seen by the sender. */
+static UInt32 LoginPair(UInt16 a_Port, int a_Index, cTestClient & a_Sender, cTestClient & a_Receiver)
+{
+	AString ReceiverName = Printf("receiver%d", a_Index);
+	TEST_CHECK(a_Sender.Connect(a_Port) && a_Sender.Login(Printf("sender%d", a_Index)));
+	TEST_CHECK(a_Receiver.Connect(a_Port) && a_Receiver.Login(ReceiverName));
+	int ReceiverID = a_Sender.WaitForUser(ReceiverName);
+	TEST_CHECK(ReceiverID > 0);
+	return static_cast<UInt32>(ReceiverID);
+}
+
+
+
+
+
+/** Runs the pairs against a server in the specified dispatch mode, prints the latency histograms. */
+static void MeasureLatency(bool a_ShouldDispatchImmediately)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	Settings->AddValue("Server", "ImmediateDispatch", a_ShouldDispatchImmediately);
+	cTestServer Server(a_ShouldDispatchImmediately ? "RelayLatencyImmediate" : "RelayLatencyTick", std::move(Settings));
+
+	cTestClient Senders[NUM_PAIRS], Receivers[NUM_PAIRS];
+	UInt32 ReceiverIDs[NUM_PAIRS];
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		ReceiverIDs[i] = LoginPair(Server.GetPort(), i, Senders[i], Receivers[i]);
+	}
+	Server.GetServer().GetRelayLatency().Reset();
+
+	cLatencyHistogram Latency;
+	std::vector<std::thread> Threads;
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		auto & Sender = Senders[i];
+		auto & Receiver = Receivers[i];
+		UInt32 ReceiverID = ReceiverIDs[i];
+		Threads.emplace_back([&Sender, ReceiverID]()
+			{
+				auto NextSend = std::chrono::steady_clock::now();
+				for (int j = 0; j < NUM_MESSAGES; j++)
+				{
+					std::this_thread::sleep_until(NextSend);
+					NextSend += SEND_INTERVAL;
+					auto SentTime = std::chrono::steady_clock::now().time_since_epoch().count();
+					TEST_CHECK(Sender.SendPacket(0x12, cTestClient::MediaMsgBody(ReceiverID, Printf("%lld", static_cast<long long>(SentTime)))));
+				}
+			}
+		);
+		Threads.emplace_back([&Receiver, &Latency]()
+			{
+				UInt32 PacketType;
+				AString Body;
+				int NumReceived = 0;
+				while (NumReceived < NUM_MESSAGES)
+				{
+					TEST_CHECK(Receiver.ReceivePacket(PacketType, Body));
+					auto ReceivedTime = std::chrono::steady_clock::now();
+					if (PacketType != 0x12)
+					{
+						continue;
+					}
+
+					// The body is the sender's ID and the message, the timestamp:
+					cByteBufferView Packet(Body.data(), Body.size());
+					UInt32 FromID;
+					AString Msg;
+					TEST_CHECK(Packet.ReadVarInt32(FromID) && Packet.ReadVarUTF8String(Msg));
+					std::chrono::steady_clock::duration SentTime(static_cast<std::chrono::steady_clock::rep>(atoll(Msg.c_str())));
+					Latency.Add(ReceivedTime - std::chrono::steady_clock::time_point(SentTime));
+					NumReceived += 1;
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+
+	const char * Mode = a_ShouldDispatchImmediately ? "Immediate" : "Tick";
+	printf("%-9s client to client: p50 %6llu us, p99 %6llu us (%s)\n", Mode,
+		static_cast<unsigned long long>(Latency.GetPercentileUsec(50)),
+		static_cast<unsigned long long>(Latency.GetPercentileUsec(99)),
+		Latency.Format().c_str()
+	);
+	auto & ServerLatency = Server.GetServer().GetRelayLatency();
+	printf("%-9s inside server:    p50 %6llu us, p99 %6llu us (%s)\n", Mode,
+		static_cast<unsigned long long>(ServerLatency.GetPercentileUsec(50)),
+		static_cast<unsigned long long>(ServerLatency.GetPercentileUsec(99)),
+		ServerLatency.Format().c_str()
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Relaying %d messages through each of %d pairs, one every %lld us per pair:\n",
+		NUM_MESSAGES, NUM_PAIRS, static_cast<long long>(SEND_INTERVAL.count())
+	);
+	MeasureLatency(false);
+	MeasureLatency(true);
+	printf("The percentiles are the upper bounds of the histograms' power-of-two buckets.\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,227 @@
+
+// RelayThroughputBenchmark.cpp
+
+// Measures the MediaMsg relay throughput between pairs of clients while more and more clients are connected to the server
+
+// Usage: RelayThroughputBenchmark [NumClients ...]
+// The default client counts are 100, 1000, 10000 and 100000. Each client takes two file descriptors in this process
+// (the benchmark's end and the server's end); the counts above the open files limit are measured at the limit instead,
+// raise the limit (ulimit -n) to measure them.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include <atomic>
+#include <sys/resource.h>
+
+
+
+
+
+/** Number of client pairs relaying the messages at the same time, each pair has its own sender and receiver thread. */
+static const int NUM_PAIRS = 8;
+
+/** Number of messages each sender sends in a single measurement. */
+static const int NUM_MESSAGES = 100000;
+
+/** Number of messages the senders compose into a single write. */
+static const int BATCH_SIZE = 100;
+
+/** Size of a single message's payload. */
+static const size_t MESSAGE_SIZE = 64;
+
+/** The most messages a sender may have sent ahead of its receiver. The server doesn't push back on a client
+sending faster than the server relays, it kicks the client once its receive buffer is full. */
+static const int WINDOW_SIZE = 2000;
+
+
+
+
+
+/** A pair of logged-in clients, the sender relays messages to the receiver through the server. */
+struct cPair
+{
+	cTestClient m_Sender;
+	cTestClient m_Receiver;
+
+	/** The data the sender sends in each write: BATCH_SIZE MediaMsg packets addressed to the receiver. */
+	AString m_Batch;
+
+	/** Number of messages the receiver has received in the current measurement. */
+	std::atomic<int> m_NumReceived;
+};
+
+typedef std::vector<std::unique_ptr<cPair>> cPairs;
+typedef std::vector<std::unique_ptr<cTestClient>> cTestClients;
+
+
+
+
+
+/** Raises the open files limit as far as allowed, returns the number of clients that fit into it. */
+static size_t GetMaxClients(void)
+{
+	rlimit Limit;
+	TEST_CHECK(getrlimit(RLIMIT_NOFILE, &Limit) == 0);
+	Limit.rlim_cur = Limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &Limit);
+	TEST_CHECK(getrlimit(RLIMIT_NOFILE, &Limit) == 0);
+
+	// Leave some descriptors for the server's own sockets, LibEvent and the log files:
+	static const rlim_t RESERVED = 100;
+	return (Limit.rlim_cur > RESERVED) ? static_cast<size_t>((Limit.rlim_cur - RESERVED) / 2) : 0;
+}
+
+
+
+
+
+/** Logs the pairs in and lets each sender learn its receiver's client ID. */
+static void CreatePairs(UInt16 a_Port, cPairs & a_Pairs)
+{
+	for (int i = 0; i < NUM_PAIRS; i++)
+	{
+		a_Pairs.emplace_back(new cPair);
+		auto & Pair = *a_Pairs.back();
+		AString ReceiverName = Printf("receiver%d", i);
+		TEST_CHECK(Pair.m_Sender.Connect(a_Port) && Pair.m_Sender.Login(Printf("sender%d", i)));
+		TEST_CHECK(Pair.m_Receiver.Connect(a_Port) && Pair.m_Receiver.Login(ReceiverName));
+		int ReceiverID = Pair.m_Sender.WaitForUser(ReceiverName);
+		TEST_CHECK(ReceiverID > 0);
+		auto Packet = cTestClient::MediaMsgBody(static_cast<UInt32>(ReceiverID), AString(MESSAGE_SIZE, 'm'));
+		for (int j = 0; j < BATCH_SIZE; j++)
+		{
+			cTestClient::AppendPacket(Pair.m_Batch, 0x12, Packet);
+		}
+	}
+}
+
+
+
+
+
+/** Connects more idle clients, until there are a_NumClients clients in total (including the pairs).
+The idle clients stay in the status state; all of them, old and new, send a status ping, so that
+the server doesn't time the older ones out while the benchmark goes on. */
+static void AddIdleClients(UInt16 a_Port, cTestClients & a_IdleClients, size_t a_NumClients)
+{
+	auto Start = std::chrono::steady_clock::now();
+	size_t NumNew = 0;
+	while (a_IdleClients.size() + 2 * NUM_PAIRS < a_NumClients)
+	{
+		a_IdleClients.emplace_back(new cTestClient);
+		TEST_CHECK(a_IdleClients.back()->Connect(a_Port));
+		NumNew += 1;
+	}
+	auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start);
+	if (NumNew > 0)
+	{
+		printf("Connected %u idle clients in %lld ms\n", static_cast<unsigned>(NumNew), static_cast<long long>(Elapsed.count()));
+	}
+	for (auto & Client : a_IdleClients)
+	{
+		TEST_CHECK(Client->SendPacket(0x01, AString(8, '\0')));
+	}
+
+	// Let the server answer the pings before measuring:
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+}
+
+
+
+
+
+/** Relays NUM_MESSAGES messages through each pair at once, prints the throughput. */
+static void MeasureRelay(cPairs & a_Pairs, size_t a_NumClients)
+{
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (auto & Pair : a_Pairs)
+	{
+		auto & ThePair = *Pair;
+		ThePair.m_NumReceived = 0;
+		Threads.emplace_back([&ThePair]()
+			{
+				for (int NumSent = 0; NumSent < NUM_MESSAGES; NumSent += BATCH_SIZE)
+				{
+					while (NumSent - ThePair.m_NumReceived.load() > WINDOW_SIZE)
+					{
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+					}
+					TEST_CHECK(ThePair.m_Sender.SendRaw(ThePair.m_Batch.data(), ThePair.m_Batch.size()));
+				}
+			}
+		);
+		Threads.emplace_back([&ThePair]()
+			{
+				UInt32 PacketType;
+				AString Body;
+				while (ThePair.m_NumReceived < NUM_MESSAGES)
+				{
+					TEST_CHECK(ThePair.m_Receiver.ReceivePacket(PacketType, Body));
+					if (PacketType == 0x12)
+					{
+						ThePair.m_NumReceived += 1;
+					}
+				}
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	double NumMessages = static_cast<double>(NUM_PAIRS) * NUM_MESSAGES;
+	printf("%7u clients: %9.0f msgs/sec, %7.1f MiB/s of payload (%d pairs, %.0f messages in %.3f s)\n",
+		static_cast<unsigned>(a_NumClients), NumMessages / Elapsed,
+		NumMessages * MESSAGE_SIZE / Elapsed / (1024 * 1024), NUM_PAIRS, NumMessages, Elapsed
+	);
+}
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+	std::vector<size_t> ClientCounts;
+	for (int i = 1; i < argc; i++)
+	{
+		ClientCounts.push_back(static_cast<size_t>(atoi(argv[i])));
+	}
+	if (ClientCounts.empty())
+	{
+		ClientCounts = {100, 1000, 10000, 100000};
+	}
+	size_t MaxClients = GetMaxClients();
+
+	cTestServer Server("RelayThroughput", cTestServer::DefaultSettings());
+	cPairs Pairs;
+	CreatePairs(Server.GetPort(), Pairs);
+	cTestClients IdleClients;
+
+	for (auto NumClients : ClientCounts)
+	{
+		if (NumClients > MaxClients)
+		{
+			printf("%u clients don't fit into the open files limit, measuring with %u clients instead\n",
+				static_cast<unsigned>(NumClients), static_cast<unsigned>(MaxClients)
+			);
+			if (IdleClients.size() + 2 * NUM_PAIRS >= MaxClients)
+			{
+				continue;
+			}
+			NumClients = MaxClients;
+		}
+		AddIdleClients(Server.GetPort(), IdleClients, NumClients);
+		MeasureRelay(Pairs, IdleClients.size() + 2 * NUM_PAIRS);
+	}
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,216 @@
+
+// StunLoadBenchmark.cpp
+
+// A local load generator for the built-in STUN server, measures the binding requests answered per second
+
+// Each of the generator's threads has its own UDP socket and keeps a window of binding requests in flight, sending
+// them with sendmmsg() and receiving the responses with recvmmsg(). The responses are checked to be binding successes
+// for the outstanding transactions. Requests unanswered within a timeout are counted as lost and the window reopened.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestServer.h"
+#include <atomic>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+/** Number of the generator's threads, each with its own socket. */
+static const int NUM_GENERATORS = 4;
+
+/** Number of binding requests each generator thread sends. */
+static const size_t NUM_REQUESTS = 250000;
+
+/** The most requests a generator thread keeps unanswered. All the threads' requests in flight must fit into the server
+socket's receive buffer (a few hundred small datagrams by default), otherwise the OS drops them. */
+static const size_t WINDOW_SIZE = 32;
+
+/** Number of requests sent, and the most responses received, in a single OS call. */
+static const size_t BATCH_SIZE = 16;
+
+static const size_t STUN_HEADER_SIZE = 20;
+static const UInt32 STUN_MAGIC_COOKIE = 0x2112a442;
+static const UInt16 STUN_BINDING_REQUEST = 0x0001;
+static const UInt16 STUN_BINDING_SUCCESS = 0x0101;
+
+/** Size of the receive buffer of each response slot, larger than any of the server's responses. */
+static const size_t RESPONSE_SLOT_SIZE = 512;
+
+
+
+
+
+/** The results of a single generator thread. */
+struct cGeneratorResult
+{
+	size_t m_NumAnswered = 0;
+	size_t m_NumLost = 0;
+};
+
+
+
+
+
+/** Writes the binding request with the transaction ID composed of the generator's and the request's index. */
+static void WriteBindingRequest(Byte * a_Out, UInt32 a_GeneratorIdx, UInt64 a_RequestIdx)
+{
+	UInt16 Type = htons(STUN_BINDING_REQUEST);
+	UInt16 Length = 0;
+	UInt32 Cookie = htonl(STUN_MAGIC_COOKIE);
+	memcpy(a_Out, &Type, 2);
+	memcpy(a_Out + 2, &Length, 2);
+	memcpy(a_Out + 4, &Cookie, 4);
+	memcpy(a_Out + 8, &a_GeneratorIdx, 4);
+	memcpy(a_Out + 12, &a_RequestIdx, 8);
+}
+
+
+
+
+
+/** Returns true if the datagram is a binding success response to a request sent by the specified generator. */
+static bool IsBindingSuccess(const Byte * a_Data, size_t a_Size, UInt32 a_GeneratorIdx)
+{
+	UInt16 Type;
+	UInt32 Cookie, GeneratorIdx;
+	if (a_Size < STUN_HEADER_SIZE)
+	{
+		return false;
+	}
+	memcpy(&Type, a_Data, 2);
+	memcpy(&Cookie, a_Data + 4, 4);
+	memcpy(&GeneratorIdx, a_Data + 8, 4);
+	return ((ntohs(Type) == STUN_BINDING_SUCCESS) && (ntohl(Cookie) == STUN_MAGIC_COOKIE) && (GeneratorIdx == a_GeneratorIdx));
+}
+
+
+
+
+
+/** Sends NUM_REQUESTS binding requests to the server, keeping WINDOW_SIZE of them in flight. */
+static cGeneratorResult RunGenerator(UInt32 a_GeneratorIdx, UInt16 a_ServerPort)
+{
+	int Socket = socket(AF_INET, SOCK_DGRAM, 0);
+	TEST_CHECK(Socket >= 0);
+	timeval Timeout;
+	Timeout.tv_sec = 0;
+	Timeout.tv_usec = 200000;
+	TEST_CHECK(setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) == 0);
+	sockaddr_in ServerAddr;
+	memset(&ServerAddr, 0, sizeof(ServerAddr));
+	ServerAddr.sin_family = AF_INET;
+	ServerAddr.sin_port = htons(a_ServerPort);
+	ServerAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// The request and response slots, reused for every batch:
+	Byte Requests[BATCH_SIZE][STUN_HEADER_SIZE];
+	iovec RequestVecs[BATCH_SIZE];
+	mmsghdr RequestMsgs[BATCH_SIZE];
+	Byte Responses[BATCH_SIZE][RESPONSE_SLOT_SIZE];
+	iovec ResponseVecs[BATCH_SIZE];
+	mmsghdr ResponseMsgs[BATCH_SIZE];
+	memset(RequestMsgs, 0, sizeof(RequestMsgs));
+	memset(ResponseMsgs, 0, sizeof(ResponseMsgs));
+	for (size_t i = 0; i < BATCH_SIZE; i++)
+	{
+		RequestVecs[i].iov_base = Requests[i];
+		RequestVecs[i].iov_len = STUN_HEADER_SIZE;
+		RequestMsgs[i].msg_hdr.msg_name = &ServerAddr;
+		RequestMsgs[i].msg_hdr.msg_namelen = sizeof(ServerAddr);
+		RequestMsgs[i].msg_hdr.msg_iov = &RequestVecs[i];
+		RequestMsgs[i].msg_hdr.msg_iovlen = 1;
+		ResponseVecs[i].iov_base = Responses[i];
+		ResponseVecs[i].iov_len = RESPONSE_SLOT_SIZE;
+		ResponseMsgs[i].msg_hdr.msg_iov = &ResponseVecs[i];
+		ResponseMsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	cGeneratorResult res;
+	size_t NumSent = 0;
+	while (res.m_NumAnswered + res.m_NumLost < NUM_REQUESTS)
+	{
+		// Fill the window:
+		size_t NumOutstanding = NumSent - res.m_NumAnswered - res.m_NumLost;
+		while ((NumSent < NUM_REQUESTS) && (NumOutstanding + BATCH_SIZE <= WINDOW_SIZE))
+		{
+			size_t NumToSend = std::min(BATCH_SIZE, NUM_REQUESTS - NumSent);
+			for (size_t i = 0; i < NumToSend; i++)
+			{
+				WriteBindingRequest(Requests[i], a_GeneratorIdx, NumSent + i);
+			}
+			int NumMsgs = sendmmsg(Socket, RequestMsgs, static_cast<unsigned>(NumToSend), 0);
+			TEST_CHECK(NumMsgs > 0);
+			NumSent += static_cast<size_t>(NumMsgs);
+			NumOutstanding += static_cast<size_t>(NumMsgs);
+		}
+
+		// Receive the responses available, waiting for at least one:
+		int NumMsgs = recvmmsg(Socket, ResponseMsgs, BATCH_SIZE, MSG_WAITFORONE, nullptr);
+		if (NumMsgs <= 0)
+		{
+			TEST_CHECK((errno == EAGAIN) || (errno == EWOULDBLOCK));
+			res.m_NumLost += NumOutstanding;
+			continue;
+		}
+		for (int i = 0; i < NumMsgs; i++)
+		{
+			TEST_CHECK(IsBindingSuccess(Responses[i], ResponseMsgs[i].msg_len, a_GeneratorIdx));
+		}
+		res.m_NumAnswered += static_cast<size_t>(NumMsgs);
+	}
+	close(Socket);
+	return res;
+}
+
+
+
+
+
+int main(void)
+{
+	auto Settings = cTestServer::DefaultSettings();
+	UInt16 StunPort = cTestServer::GetFreePort(true);
+	Settings->DeleteValue("STUN", "Enabled");  // Disabled by the defaults
+	Settings->AddValue("STUN", "Enabled", true);
+	Settings->AddValue("STUN", "Port", static_cast<Int64>(StunPort));
+	cTestServer Server("StunLoad", std::move(Settings));
+
+	printf("Sending %zu binding requests from each of %d sockets, %zu in flight per socket:\n", NUM_REQUESTS, NUM_GENERATORS, WINDOW_SIZE);
+	std::vector<cGeneratorResult> Results(NUM_GENERATORS);
+	std::vector<std::thread> Threads;
+	auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_GENERATORS; i++)
+	{
+		Threads.emplace_back([i, StunPort, &Results]()
+			{
+				Results[static_cast<size_t>(i)] = RunGenerator(static_cast<UInt32>(i), StunPort);
+			}
+		);
+	}
+	for (auto & Thread : Threads)
+	{
+		Thread.join();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+	size_t NumAnswered = 0, NumLost = 0;
+	for (const auto & Result : Results)
+	{
+		NumAnswered += Result.m_NumAnswered;
+		NumLost += Result.m_NumLost;
+	}
+	printf("%8.0f binding requests answered per second (%zu answered, %zu lost, in %.3f s)\n",
+		static_cast<double>(NumAnswered) / Elapsed, NumAnswered, NumLost, Elapsed
+	);
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,350 @@
+
+// TestClient.cpp
+
+// Implements the cTestClient class representing a single client connection to the test server, for the end-to-end benchmarks
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestClient.h"
+#include "ByteBufferView.h"
+#include "VarInt.h"
+#include "md5.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+/** Appends the value encoded as a VarInt to a_Out. */
+static void AppendVarInt(AString & a_Out, UInt32 a_Value)
+{
+	char Buffer[MAX_VARINT32_SIZE];
+	a_Out.append(Buffer, EncodeVarInt32(a_Value, Buffer));
+}
+
+
+
+
+
+/** Appends the string, prefixed by its VarInt length, to a_Out. */
+static void AppendString(AString & a_Out, const AString & a_Value)
+{
+	AppendVarInt(a_Out, static_cast<UInt32>(a_Value.size()));
+	a_Out.append(a_Value);
+}
+
+
+
+
+
+/** Appends the value as a big-endian 32-bit integer to a_Out. */
+static void AppendBEInt32(AString & a_Out, Int32 a_Value)
+{
+	UInt32 Value = htonl(static_cast<UInt32>(a_Value));
+	a_Out.append(reinterpret_cast<const char *>(&Value), 4);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cTestClient:
+
+cTestClient::cTestClient(void):
+	m_Socket(-1),
+	m_ReadPos(0),
+	m_IsLoggedIn(false)
+{
+}
+
+
+
+
+
+cTestClient::~cTestClient()
+{
+	Close();
+}
+
+
+
+
+
+bool cTestClient::Connect(UInt16 a_Port)
+{
+	Close();
+	m_Socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (m_Socket < 0)
+	{
+		return false;
+	}
+	sockaddr_in Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons(a_Port);
+	Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(m_Socket, reinterpret_cast<const sockaddr *>(&Addr), sizeof(Addr)) != 0)
+	{
+		Close();
+		return false;
+	}
+
+	// The benchmarks send small packets and measure their latency, don't let Nagle delay them:
+	int One = 1;
+	setsockopt(m_Socket, IPPROTO_TCP, TCP_NODELAY, &One, sizeof(One));
+	return true;
+}
+
+
+
+
+
+void cTestClient::Close(void)
+{
+	if (m_Socket >= 0)
+	{
+		close(m_Socket);
+		m_Socket = -1;
+	}
+	m_ReceivedData.clear();
+	m_ReadPos = 0;
+	m_IsLoggedIn = false;
+	m_Users.clear();
+}
+
+
+
+
+
+bool cTestClient::Login(const AString & a_UserName)
+{
+	// Status request, asking for the login state:
+	AString Status;
+	AppendString(Status, "p2pchat");
+	AppendString(Status, "localhost");
+	AppendBEInt32(Status, 0);
+	AppendBEInt32(Status, 2);
+	if (!SendPacket(0x00, Status))
+	{
+		return false;
+	}
+	UInt32 PacketType;
+	AString Body;
+	if (!ReceivePacket(PacketType, Body) || (PacketType != 0x00))
+	{
+		return false;
+	}
+
+	// Login with the UsernameHash credentials:
+	MD5 Hash;
+	Hash.update(a_UserName.data(), a_UserName.size());
+	AString LoginInfo;
+	AppendString(LoginInfo, a_UserName);
+	AppendString(LoginInfo, StrToLower(Hash.toString()));
+	if (!SendPacket(0x00, LoginInfo))
+	{
+		return false;
+	}
+	if (!ReceivePacket(PacketType, Body) || (PacketType != 0x01))  // 0x00 is a disconnect
+	{
+		return false;
+	}
+	m_IsLoggedIn = true;
+	return true;
+}
+
+
+
+
+
+int cTestClient::WaitForUser(const AString & a_UserName)
+{
+	for (;;)
+	{
+		auto itr = m_Users.find(a_UserName);
+		if (itr != m_Users.end())
+		{
+			return itr->second;
+		}
+		UInt32 PacketType;
+		AString Body;
+		if (!ReceivePacket(PacketType, Body))
+		{
+			return -1;
+		}
+	}
+}
+
+
+
+
+
+bool cTestClient::SendPacket(UInt32 a_PacketType, const AString & a_Body)
+{
+	AString Packet;
+	AppendPacket(Packet, a_PacketType, a_Body);
+	return SendRaw(Packet.data(), Packet.size());
+}
+
+
+
+
+
+bool cTestClient::SendRaw(const char * a_Data, size_t a_Size)
+{
+	while (a_Size > 0)
+	{
+		auto NumSent = send(m_Socket, a_Data, a_Size, MSG_NOSIGNAL);
+		if (NumSent <= 0)
+		{
+			return false;
+		}
+		a_Data += NumSent;
+		a_Size -= static_cast<size_t>(NumSent);
+	}
+	return true;
+}
+
+
+
+
+
+bool cTestClient::ReceivePacket(UInt32 & a_PacketType, AString & a_Body)
+{
+	for (;;)
+	{
+		// Try to parse a whole packet out of the data received so far:
+		cByteBufferView Frame(m_ReceivedData.data() + m_ReadPos, m_ReceivedData.size() - m_ReadPos);
+		UInt32 PacketLen;
+		if (Frame.ReadVarInt32(PacketLen) && Frame.CanReadBytes(PacketLen))
+		{
+			size_t Start = m_ReadPos + Frame.GetUsedSpace() - Frame.GetReadableSpace();
+			cByteBufferView Packet(m_ReceivedData.data() + Start, PacketLen);
+			if (!Packet.ReadVarInt32(a_PacketType))
+			{
+				return false;
+			}
+			size_t BodyStart = Start + PacketLen - Packet.GetReadableSpace();
+			a_Body.assign(m_ReceivedData, BodyStart, Packet.GetReadableSpace());
+			m_ReadPos = Start + PacketLen;
+			if (!m_IsLoggedIn)
+			{
+				return true;
+			}
+			if ((a_PacketType == 0x02) || (a_PacketType == 0x03))
+			{
+				ParseUsers(a_Body);
+			}
+			else if (a_PacketType == 0x00)
+			{
+				// Answer the keepalive ping right away, so that the server doesn't time out the clients that only receive:
+				if (!SendPacket(0x00, a_Body))
+				{
+					return false;
+				}
+				continue;
+			}
+			return true;
+		}
+
+		// Drop the already parsed data and receive more:
+		if (m_ReadPos > 0)
+		{
+			m_ReceivedData.erase(0, m_ReadPos);
+			m_ReadPos = 0;
+		}
+		char Buffer[64 KiB];
+		auto NumReceived = recv(m_Socket, Buffer, sizeof(Buffer), 0);
+		if (NumReceived <= 0)
+		{
+			return false;
+		}
+		m_ReceivedData.append(Buffer, static_cast<size_t>(NumReceived));
+	}
+}
+
+
+
+
+
+void cTestClient::AppendPacket(AString & a_Out, UInt32 a_PacketType, const AString & a_Body)
+{
+	char Type[MAX_VARINT32_SIZE];
+	size_t TypeSize = EncodeVarInt32(a_PacketType, Type);
+	AppendVarInt(a_Out, static_cast<UInt32>(TypeSize + a_Body.size()));
+	a_Out.append(Type, TypeSize);
+	a_Out.append(a_Body);
+}
+
+
+
+
+
+AString cTestClient::MediaMsgBody(UInt32 a_PeerID, const AString & a_Msg)
+{
+	AString res;
+	AppendVarInt(res, a_PeerID);
+	AppendString(res, a_Msg);
+	return res;
+}
+
+
+
+
+
+AString cTestClient::MediaBody(UInt32 a_PeerID, UInt32 a_Type)
+{
+	AString res;
+	AppendVarInt(res, a_PeerID);
+	AppendVarInt(res, a_Type);
+	return res;
+}
+
+
+
+
+
+AString cTestClient::RelayRequestBody(UInt32 a_PeerID, UInt16 a_UDPPort)
+{
+	AString res;
+	AppendVarInt(res, a_PeerID);
+	if (a_UDPPort != 0)
+	{
+		UInt16 Port = htons(a_UDPPort);
+		res.append(reinterpret_cast<const char *>(&Port), 2);
+	}
+	return res;
+}
+
+
+
+
+
+void cTestClient::ParseUsers(const AString & a_Body)
+{
+	cByteBufferView Body(a_Body.data(), a_Body.size());
+	UInt32 Count;
+	if (!Body.ReadVarInt32(Count))
+	{
+		return;
+	}
+	for (UInt32 i = 0; i < Count; i++)
+	{
+		UInt32 ID, State;
+		AString Name;
+		if (!Body.ReadVarInt32(ID) || !Body.ReadVarUTF8String(Name) || !Body.ReadVarInt32(State))
+		{
+			return;
+		}
+		m_Users[Name] = static_cast<int>(ID);
+	}
+}
+
+
+
+
@@ -0,0 +1,91 @@
+
+// TestClient.h
+
+// Declares the cTestClient class representing a single client connection to the test server, for the end-to-end benchmarks
+
+// The client uses a plain blocking socket, so that the benchmarks' own side of the traffic doesn't go through
+// the server's LibEvent loops being measured. The packets are framed the same way as in the server's protocol:
+// VarInt length, VarInt packet type, packet body.
+
+
+
+
+
+#pragma once
+
+#include <map>
+
+
+
+
+
+class cTestClient
+{
+public:
+	cTestClient(void);
+	~cTestClient();
+
+	/** Connects to the server on the specified local port. Returns false on failure. */
+	bool Connect(UInt16 a_Port);
+
+	/** Closes the connection. */
+	void Close(void);
+
+	/** Goes through the status and login exchange and waits for the login to succeed.
+	The credentials are the MD5 hash of the username, as required by the UsernameHash authentication backend.
+	Returns false if the server refuses the login or disconnects. */
+	bool Login(const AString & a_UserName);
+
+	/** Receives packets until the specified user is reported in a roster or presence packet, returns its client ID.
+	Returns -1 if the connection is closed. The packets received meanwhile are dropped. */
+	int WaitForUser(const AString & a_UserName);
+
+	/** Sends a single packet of the specified type and body. Returns false if the connection is closed. */
+	bool SendPacket(UInt32 a_PacketType, const AString & a_Body);
+
+	/** Sends the raw data, typically several packets composed by AppendPacket(). Returns false if the connection is closed. */
+	bool SendRaw(const char * a_Data, size_t a_Size);
+
+	/** Receives a single packet, blocking until the whole packet arrives. Returns false if the connection is closed.
+	After logging in, the roster and presence packets also update the known users (see WaitForUser()),
+	and the keepalive pings are answered and not returned. */
+	bool ReceivePacket(UInt32 & a_PacketType, AString & a_Body);
+
+	/** Returns the socket, for polling it from the benchmarks' own loops. */
+	int GetSocket(void) const { return m_Socket; }
+
+	/** Appends a single packet of the specified type and body, including its length, to a_Out. */
+	static void AppendPacket(AString & a_Out, UInt32 a_PacketType, const AString & a_Body);
+
+	/** Returns the body of a MediaMsg packet (0x12) sending the message to the specified peer. */
+	static AString MediaMsgBody(UInt32 a_PeerID, const AString & a_Msg);
+
+	/** Returns the body of a Media packet (0x11) sending the media type to the specified peer. */
+	static AString MediaBody(UInt32 a_PeerID, UInt32 a_Type);
+
+	/** Returns the body of a RelayRequest packet (0x13) asking for a relay to the specified peer.
+	a_UDPPort is the UDP port the client sends from, it is left out of the packet if zero. */
+	static AString RelayRequestBody(UInt32 a_PeerID, UInt16 a_UDPPort = 0);
+
+protected:
+
+	int m_Socket;
+
+	/** The received data not yet returned as packets, starting at m_ReadPos. */
+	AString m_ReceivedData;
+	size_t m_ReadPos;
+
+	/** Set once the login succeeds, the packets are then interpreted in the work state. */
+	bool m_IsLoggedIn;
+
+	/** The client IDs of the users reported by the server, by their username. */
+	std::map<AString, int> m_Users;
+
+
+	/** Updates m_Users from a roster (0x03) or presence (0x02) packet's body. */
+	void ParseUsers(const AString & a_Body);
+};
+
+
+
+
@@ -0,0 +1,35 @@
+
+// TestHelpers.h
+
+// Declares the helpers shared by the standalone tests
+
+// Each test is a separate executable that returns a non-zero exit code on failure, so that CTest reports it.
+
+
+
+
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+
+
+
+
+/** Checks the condition; if it doesn't hold, reports the failure and exits the test with an error code.
+Unlike ASSERT, the check is done in release builds, too. */
+#define TEST_CHECK(Condition) \
+	do \
+	{ \
+		if (!(Condition)) \
+		{ \
+			fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #Condition); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (false)
+
+
+
+
@@ -0,0 +1,186 @@
+
+// TestServer.cpp
+
+// Implements the cTestServer class that runs the whole server in-process, for the end-to-end benchmarks
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestServer.h"
+#include "Root.h"
+#include "Server.h"
+#include "OSSupport/NetworkSingleton.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+// The globals otherwise defined in the server's main.cpp, which isn't linked into the benchmarks:
+bool cRoot::m_TerminateEventRaised = false;
+bool cRoot::m_RunAsService = false;
+bool g_ShouldLogCommIn = false;
+bool g_ShouldLogCommOut = false;
+
+
+
+
+
+/** Shuts LibEvent down when the process exits, after the last test server has stopped.
+Constructed after the network singleton, so it is destroyed before it. */
+class cNetworkTerminator
+{
+public:
+	cNetworkTerminator(void)
+	{
+		cNetworkSingleton::Get();
+	}
+
+	~cNetworkTerminator()
+	{
+		cNetworkSingleton::Get().Terminate();
+	}
+};
+
+
+
+
+
+/** Replaces the standard input with a pipe that is never written to nor closed.
+cRoot's input thread stops the server on the end of the standard input, which is what the benchmarks get when
+run in the background or with the input redirected. */
+static void ReplaceStdin(void)
+{
+	int Pipe[2];
+	TEST_CHECK(pipe(Pipe) == 0);
+	TEST_CHECK(dup2(Pipe[0], STDIN_FILENO) == STDIN_FILENO);
+	close(Pipe[0]);
+	// Pipe[1] is kept open for the rest of the process' lifetime
+}
+
+
+
+
+
+/** Returns true if a TCP connection to the specified local port succeeds. */
+static bool CanConnect(UInt16 a_Port)
+{
+	int Socket = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_CHECK(Socket >= 0);
+	sockaddr_in Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons(a_Port);
+	Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bool res = (connect(Socket, reinterpret_cast<const sockaddr *>(&Addr), sizeof(Addr)) == 0);
+	close(Socket);
+	return res;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// cTestServer:
+
+std::unique_ptr<cMemorySettingsRepository> cTestServer::DefaultSettings(void)
+{
+	std::unique_ptr<cMemorySettingsRepository> Settings(new cMemorySettingsRepository);
+	Settings->AddValue("Server", "Port", static_cast<Int64>(GetFreePort()));
+	Settings->AddValue("STUN", "Enabled", false);
+	Settings->AddValue("Authentication", "Authenticate", true);
+	Settings->AddValue("Authentication", "Backend", AString("UsernameHash"));
+	return Settings;
+}
+
+
+
+
+
+cTestServer::cTestServer(const AString & a_FolderName, std::unique_ptr<cMemorySettingsRepository> a_Settings)
+{
+	static cNetworkTerminator NetworkTerminator;
+	static bool HasReplacedStdin = false;
+	if (!HasReplacedStdin)
+	{
+		ReplaceStdin();
+		HasReplacedStdin = true;
+	}
+
+	// Run in a fresh folder, the previous run's settings.ini would override the defaults:
+	char PrevFolder[4096];
+	TEST_CHECK(getcwd(PrevFolder, sizeof(PrevFolder)) != nullptr);
+	m_PrevFolder = PrevFolder;
+	cFile::CreateFolder(a_FolderName);
+	TEST_CHECK(chdir(a_FolderName.c_str()) == 0);
+	cFile::DeleteFile("settings.ini");
+
+	m_Port = static_cast<UInt16>(a_Settings->GetValueSetI("Server", "Port", 6666));
+	a_Settings->SetReadOnly();
+	m_Thread = std::thread([](std::unique_ptr<cMemorySettingsRepository> a_OverridesRepo)
+		{
+			cRoot Root;
+			Root.Start(std::move(a_OverridesRepo));
+		},
+		std::move(a_Settings)
+	);
+
+	// Wait for the server to start listening:
+	auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!CanConnect(m_Port))
+	{
+		if (std::chrono::steady_clock::now() > Deadline)
+		{
+			fprintf(stderr, "The test server didn't start listening on port %u\n", m_Port);
+			exit(EXIT_FAILURE);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+
+
+
+
+cTestServer::~cTestServer()
+{
+	cRoot::m_ShouldStop = true;
+	m_Thread.join();
+	TEST_CHECK(chdir(m_PrevFolder.c_str()) == 0);
+}
+
+
+
+
+
+cServer & cTestServer::GetServer(void)
+{
+	return *cRoot::Get()->GetServer();
+}
+
+
+
+
+
+UInt16 cTestServer::GetFreePort(bool a_IsUDP)
+{
+	int Socket = socket(AF_INET, a_IsUDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+	TEST_CHECK(Socket >= 0);
+	sockaddr_in Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(bind(Socket, reinterpret_cast<const sockaddr *>(&Addr), sizeof(Addr)) == 0);
+	socklen_t AddrLen = sizeof(Addr);
+	TEST_CHECK(getsockname(Socket, reinterpret_cast<sockaddr *>(&Addr), &AddrLen) == 0);
+	close(Socket);
+	return ntohs(Addr.sin_port);
+}
+
+
+
+
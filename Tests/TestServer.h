@@ -0,0 +1,67 @@
+
+// TestServer.h
+
+// Declares the cTestServer class that runs the whole server in-process, for the end-to-end benchmarks
+
+// The server runs in its own thread, exactly as in the real executable (cRoot::Start()), in a subfolder of the
+// current folder, so that its settings.ini and logs don't mix with the other benchmarks' ones.
+// Only a single server may run at a time, cRoot is a singleton.
+
+
+
+
+
+#pragma once
+
+#include "MemorySettingsRepository.h"
+#include <thread>
+
+
+
+
+
+// fwd:
+class cServer;
+
+
+
+
+
+class cTestServer
+{
+public:
+	/** Creates the settings that every test server starts with: a free TCP port, no STUN server, and
+	the UsernameHash authentication backend (see cTestClient::Login()). The caller may add further values. */
+	static std::unique_ptr<cMemorySettingsRepository> DefaultSettings(void);
+
+	/** Starts the server in the specified subfolder of the current folder, with the specified settings
+	overriding the defaults of settings.ini. Returns once the server accepts connections; exits the process
+	with an error if the server doesn't start. */
+	cTestServer(const AString & a_FolderName, std::unique_ptr<cMemorySettingsRepository> a_Settings);
+
+	/** Stops the server and waits for it to finish. */
+	~cTestServer();
+
+	/** Returns the TCP port on which the server listens. */
+	UInt16 GetPort(void) const { return m_Port; }
+
+	/** Returns the running server instance. */
+	cServer & GetServer(void);
+
+	/** Returns an unused local port, for the settings of the server's listening sockets. */
+	static UInt16 GetFreePort(bool a_IsUDP = false);
+
+protected:
+
+	/** The thread running cRoot::Start(). */
+	std::thread m_Thread;
+
+	UInt16 m_Port;
+
+	/** The folder that was current before the server has been started, restored when the server stops. */
+	AString m_PrevFolder;
+};
+
+
+
+
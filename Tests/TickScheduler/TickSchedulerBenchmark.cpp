@@ -0,0 +1,218 @@
+
+// TickSchedulerBenchmark.cpp
+
+// Measures the tick thread's CPU time with many idle clients, driven by cTickScheduler vs. visiting every client each tick
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TickScheduler.h"
+#include <ctime>
+
+
+
+
+
+typedef std::chrono::steady_clock::time_point cTimePoint;
+
+static const int NUM_CLIENTS = 50000;
+
+/** The tick length, the ping interval and the timeout, same as in cServer and cClientHandle. */
+static const std::chrono::milliseconds TICK_DURATION(50);
+static const std::chrono::milliseconds PING_TIME(15000);
+static const std::chrono::milliseconds CLIENT_TIMEOUT(30000);
+
+/** The simulated time over which the clients are ticked. */
+static const std::chrono::seconds SIMULATED_TIME(120);
+
+
+
+
+
+/** An idle, working client: it only answers the keepalive pings. */
+struct cIdleClient
+{
+	cTimePoint m_LastReceivedTime;
+	cTimePoint m_PingStartTime;
+
+	/** The client's timer in the scheduler, unused when visiting all the clients. */
+	cTimerWheel::cTimer m_TickTimer;
+
+	int m_NumPings;
+	bool m_HasTimedOut;
+
+
+	/** Same as cClientHandle::CheckTimers(): sends a ping when due, checks the timeout and returns the next check time.
+	The ping is answered right away, the answer marks the client ready in a_Scheduler (if given), as received data does. */
+	cTimePoint CheckTimers(cTimePoint a_Now, cTickScheduler * a_Scheduler, int a_ClientID)
+	{
+		auto NextCheck = m_LastReceivedTime + CLIENT_TIMEOUT;
+		if (NextCheck <= a_Now)
+		{
+			m_HasTimedOut = true;
+			NextCheck = a_Now + CLIENT_TIMEOUT;
+		}
+		if (m_PingStartTime + PING_TIME <= a_Now)
+		{
+			m_NumPings += 1;
+			m_PingStartTime = a_Now;
+			m_LastReceivedTime = a_Now;
+			if (a_Scheduler != nullptr)
+			{
+				a_Scheduler->AddReady(a_ClientID);
+			}
+		}
+		return std::min(NextCheck, m_PingStartTime + PING_TIME);
+	}
+};
+
+typedef std::vector<std::unique_ptr<cIdleClient>> cIdleClients;
+
+
+
+
+
+/** Creates the clients, with their pings spread evenly over the ping interval. */
+static cIdleClients CreateClients(cTimePoint a_Start)
+{
+	cIdleClients Clients;
+	for (int i = 0; i < NUM_CLIENTS; i++)
+	{
+		Clients.emplace_back(new cIdleClient);
+		auto & Client = *Clients.back();
+		Client.m_PingStartTime = a_Start - PING_TIME + (PING_TIME * i) / NUM_CLIENTS;
+		Client.m_LastReceivedTime = Client.m_PingStartTime;
+		Client.m_NumPings = 0;
+		Client.m_HasTimedOut = false;
+	}
+	return Clients;
+}
+
+
+
+
+
+/** Checks that every client has been pinged on time and none has timed out. */
+static void VerifyClients(const cIdleClients & a_Clients)
+{
+	int ExpectedPings = static_cast<int>(SIMULATED_TIME / PING_TIME);
+	for (const auto & Client : a_Clients)
+	{
+		TEST_CHECK(!Client->m_HasTimedOut);
+		TEST_CHECK((Client->m_NumPings >= ExpectedPings - 1) && (Client->m_NumPings <= ExpectedPings + 1));
+	}
+}
+
+
+
+
+
+/** Prints the CPU time spent ticking the clients over the simulated time. */
+static void PrintResult(const char * a_Name, std::clock_t a_CPUTime, size_t a_NumProcessed)
+{
+	double MSec = 1000.0 * static_cast<double>(a_CPUTime) / CLOCKS_PER_SEC;
+	auto NumTicks = SIMULATED_TIME / TICK_DURATION;
+	printf("%-12s %9.1f ms CPU for %lld s (%.4f %% of a core), %7.1f us and %8.1f clients per tick\n",
+		a_Name, MSec, static_cast<long long>(SIMULATED_TIME.count()),
+		MSec / 10.0 / static_cast<double>(SIMULATED_TIME.count()),
+		1000.0 * MSec / static_cast<double>(NumTicks),
+		static_cast<double>(a_NumProcessed) / static_cast<double>(NumTicks)
+	);
+}
+
+
+
+
+
+/** The old tick thread: every client is visited each tick. */
+static void BenchmarkVisitAll(cTimePoint a_Start)
+{
+	auto Clients = CreateClients(a_Start);
+	size_t NumProcessed = 0;
+	auto CPUStart = std::clock();
+	for (auto Now = a_Start + TICK_DURATION; Now <= a_Start + SIMULATED_TIME; Now += TICK_DURATION)
+	{
+		for (auto & Client : Clients)
+		{
+			Client->CheckTimers(Now, nullptr, 0);
+		}
+		NumProcessed += Clients.size();
+	}
+	PrintResult("Visit all:", std::clock() - CPUStart, NumProcessed);
+	VerifyClients(Clients);
+}
+
+
+
+
+
+/** The current tick thread (cServer::TickReadyClients() and cServer::TickClientTimers()): only the ready clients
+and the clients whose timer has expired are processed. */
+static void BenchmarkScheduler(cTimePoint a_Start)
+{
+	auto Clients = CreateClients(a_Start);
+	cTickScheduler Scheduler;
+	std::vector<int> ReadyClients;
+	size_t NumProcessed = 0;
+	cTimePoint Now = a_Start;
+
+	// Same as cServer::OnClientTimerExpired():
+	for (int i = 0; i < NUM_CLIENTS; i++)
+	{
+		auto & Client = *Clients[static_cast<size_t>(i)];
+		Client.m_TickTimer.SetCallback([&, i]()
+			{
+				Scheduler.Schedule(Client.m_TickTimer, Client.CheckTimers(Now, &Scheduler, i));
+				NumProcessed += 1;
+			}
+		);
+	}
+
+	auto CPUStart = std::clock();
+	for (int i = 0; i < NUM_CLIENTS; i++)
+	{
+		auto & Client = *Clients[static_cast<size_t>(i)];
+		Scheduler.Schedule(Client.m_TickTimer, Client.CheckTimers(a_Start, &Scheduler, i));
+	}
+	for (Now = a_Start + TICK_DURATION; Now <= a_Start + SIMULATED_TIME; Now += TICK_DURATION)
+	{
+		Scheduler.TakeReady(ReadyClients);
+		for (auto ClientID : ReadyClients)
+		{
+			auto & Client = *Clients[static_cast<size_t>(ClientID)];
+			Scheduler.Schedule(Client.m_TickTimer, Client.CheckTimers(Now, &Scheduler, ClientID));
+		}
+		NumProcessed += ReadyClients.size();
+
+		Scheduler.Advance(Now);
+	}
+	PrintResult("Scheduler:", std::clock() - CPUStart, NumProcessed);
+	VerifyClients(Clients);
+
+	auto Stats = Scheduler.GetStats();
+	printf("Scheduler stats: %llu timers scheduled, %llu expired, %llu clients marked ready, %llu timers pending\n",
+		static_cast<unsigned long long>(Stats.m_NumScheduled), static_cast<unsigned long long>(Stats.m_NumExpired),
+		static_cast<unsigned long long>(Stats.m_NumReady), static_cast<unsigned long long>(Stats.m_NumTimers)
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	printf("Ticking %d idle clients every %lld ms, pinging each every %lld s:\n",
+		NUM_CLIENTS, static_cast<long long>(TICK_DURATION.count()), static_cast<long long>(PING_TIME.count() / 1000)
+	);
+
+	// The time is simulated, the ticks run back to back and only the CPU time spent in them is measured:
+	auto Start = std::chrono::steady_clock::now();
+	BenchmarkVisitAll(Start);
+	BenchmarkScheduler(Start);
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,145 @@
+
+// TimerWheelBenchmark.cpp
+
+// Measures arming, re-arming, cancelling and expiring 1M timers in cTimerWheel, compared to a std::multimap of deadlines
+
+#include "Globals.h"
+#include "Common.h"
+#include "OSSupport/TimerWheel.h"
+#include <random>
+
+
+
+
+
+typedef std::chrono::steady_clock::time_point cTimePoint;
+typedef std::multimap<cTimePoint, size_t> cTimerMap;
+
+static const size_t NUM_TIMERS = 1000000;
+
+
+
+
+
+/** Returns the time elapsed since a_Start, in nanoseconds per operation. */
+static double GetNSecPerOp(cTimePoint a_Start, size_t a_NumOps)
+{
+	auto Elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - a_Start);
+	return static_cast<double>(Elapsed.count()) / static_cast<double>(std::max<size_t>(a_NumOps, 1));
+}
+
+
+
+
+
+/** Arms all the timers, re-arms them all with different deadlines, cancels every other one and expires the rest. */
+static void BenchmarkWheel(cTimePoint a_Now, const std::vector<Int64> & a_Delays)
+{
+	cTimerWheel Wheel(std::chrono::milliseconds(10));
+	std::vector<cTimerWheel::cTimer> Timers(NUM_TIMERS);
+	size_t NumExpired = 0;
+	for (auto & Timer : Timers)
+	{
+		Timer.SetCallback([&NumExpired]() { NumExpired += 1; });
+	}
+
+	auto Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i++)
+	{
+		Wheel.Arm(Timers[i], a_Now + std::chrono::milliseconds(a_Delays[i]));
+	}
+	double Arm = GetNSecPerOp(Start, NUM_TIMERS);
+
+	Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i++)
+	{
+		Wheel.Arm(Timers[i], a_Now + std::chrono::milliseconds(a_Delays[NUM_TIMERS - 1 - i] + 1000));
+	}
+	double ReArm = GetNSecPerOp(Start, NUM_TIMERS);
+
+	Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i += 2)
+	{
+		Timers[i].Cancel();
+	}
+	double Cancel = GetNSecPerOp(Start, NUM_TIMERS / 2);
+
+	Start = std::chrono::steady_clock::now();
+	Wheel.Advance(a_Now + std::chrono::seconds(62));
+	double Expire = GetNSecPerOp(Start, NumExpired);
+
+	printf("cTimerWheel:   arm %7.1f ns, re-arm %7.1f ns, cancel %7.1f ns, expire %7.1f ns per timer (%zu expired)\n",
+		Arm, ReArm, Cancel, Expire, NumExpired
+	);
+}
+
+
+
+
+
+/** Same operations as BenchmarkWheel(), on a std::multimap ordered by the deadline. */
+static void BenchmarkMultimap(cTimePoint a_Now, const std::vector<Int64> & a_Delays)
+{
+	cTimerMap Map;
+	std::vector<cTimerMap::iterator> Timers(NUM_TIMERS);
+
+	auto Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i++)
+	{
+		Timers[i] = Map.emplace(a_Now + std::chrono::milliseconds(a_Delays[i]), i);
+	}
+	double Arm = GetNSecPerOp(Start, NUM_TIMERS);
+
+	Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i++)
+	{
+		Map.erase(Timers[i]);
+		Timers[i] = Map.emplace(a_Now + std::chrono::milliseconds(a_Delays[NUM_TIMERS - 1 - i] + 1000), i);
+	}
+	double ReArm = GetNSecPerOp(Start, NUM_TIMERS);
+
+	Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < NUM_TIMERS; i += 2)
+	{
+		Map.erase(Timers[i]);
+	}
+	double Cancel = GetNSecPerOp(Start, NUM_TIMERS / 2);
+
+	Start = std::chrono::steady_clock::now();
+	size_t NumExpired = 0;
+	auto Limit = a_Now + std::chrono::seconds(62);
+	while (!Map.empty() && (Map.begin()->first <= Limit))
+	{
+		Map.erase(Map.begin());
+		NumExpired += 1;
+	}
+	double Expire = GetNSecPerOp(Start, NumExpired);
+
+	printf("std::multimap: arm %7.1f ns, re-arm %7.1f ns, cancel %7.1f ns, expire %7.1f ns per timer (%zu expired)\n",
+		Arm, ReArm, Cancel, Expire, NumExpired
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	// Random deadlines within a minute, the same for both containers:
+	std::mt19937 Random(1);
+	std::vector<Int64> Delays(NUM_TIMERS);
+	for (auto & Delay : Delays)
+	{
+		Delay = static_cast<Int64>(Random() % 60000);
+	}
+
+	auto Now = std::chrono::steady_clock::now();
+	BenchmarkWheel(Now, Delays);
+	BenchmarkMultimap(Now, Delays);
+	return EXIT_SUCCESS;
+}
+
+
+
+
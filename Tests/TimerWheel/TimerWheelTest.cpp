@@ -0,0 +1,234 @@
+
+// TimerWheelTest.cpp
+
+// Tests the cTimerWheel class against a reference model with random sequences of arming, cancelling and advancing
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "OSSupport/TimerWheel.h"
+#include <random>
+
+
+
+
+
+typedef std::chrono::steady_clock::time_point cTimePoint;
+
+static const std::chrono::milliseconds GRANULARITY(10);
+
+
+
+
+
+/** A timer together with the reference model's idea of its state. */
+struct cModelTimer
+{
+	cTimerWheel::cTimer m_Timer;
+	bool m_IsArmed = false;
+	cTimePoint m_Deadline;
+};
+
+typedef std::vector<std::unique_ptr<cModelTimer>> cModelTimers;
+
+
+
+
+
+/** Runs a random sequence of operations on many timers and checks the wheel against the model:
+- a timer expires only if armed, never before its deadline, and no later than the first Advance() a tick after its deadline
+- the number of armed timers matches
+- the callbacks may re-arm their own timer (also into the past) and cancel other timers. */
+static void TestRandomOperations(void)
+{
+	static const size_t NUM_TIMERS = 20000;
+	static const int NUM_STEPS = 200000;
+
+	std::mt19937_64 Random(1);
+	cTimerWheel Wheel(GRANULARITY);
+	cTimePoint Now = std::chrono::steady_clock::now();
+	cModelTimers Timers;
+	bool IsDraining = false;
+	UInt64 NumExpired = 0;
+
+	// The time of the previous Advance() call; any timer a whole tick overdue at that time should have expired then:
+	cTimePoint PrevNow = Now;
+
+	// Checks that no armed timer is overdue by a whole tick after advancing to Now:
+	auto CheckNoneOverdue = [&]()
+	{
+		for (const auto & Timer : Timers)
+		{
+			TEST_CHECK(!Timer->m_IsArmed || (Timer->m_Deadline + GRANULARITY > Now));
+		}
+	};
+
+	for (size_t i = 0; i < NUM_TIMERS; i++)
+	{
+		Timers.emplace_back(new cModelTimer);
+		auto Timer = Timers.back().get();
+		Timer->m_Timer.SetCallback([&, Timer]()
+			{
+				TEST_CHECK(Timer->m_IsArmed);
+				TEST_CHECK(Timer->m_Deadline <= Now);
+				TEST_CHECK(Timer->m_Deadline + GRANULARITY > PrevNow);
+				TEST_CHECK(!Timer->m_Timer.IsArmed());
+				Timer->m_IsArmed = false;
+				NumExpired += 1;
+
+				// Sometimes re-arm the timer, possibly into the past:
+				if (!IsDraining && (Random() % 4 == 0))
+				{
+					Timer->m_Deadline = Now + std::chrono::milliseconds(static_cast<Int64>(Random() % 3000) - 5);
+					Timer->m_IsArmed = true;
+					Wheel.Arm(Timer->m_Timer, Timer->m_Deadline);
+				}
+
+				// Sometimes cancel another timer, possibly one expiring in this very Advance() call:
+				if (Random() % 8 == 0)
+				{
+					auto & Other = *Timers[Random() % Timers.size()];
+					if (&Other != Timer)
+					{
+						Other.m_Timer.Cancel();
+						Other.m_IsArmed = false;
+					}
+				}
+			}
+		);
+	}
+
+	for (int Step = 0; Step < NUM_STEPS; Step++)
+	{
+		auto Operation = Random() % 100;
+		if (Operation < 60)
+		{
+			// Arm or re-arm a timer; the deadlines range from the next tick to beyond the wheel's span (2^26 ticks):
+			auto & Timer = *Timers[Random() % NUM_TIMERS];
+			Int64 Delay;
+			switch (Random() % 4)
+			{
+				case 0:  Delay = static_cast<Int64>(Random() % 100); break;
+				case 1:  Delay = static_cast<Int64>(Random() % 5000); break;
+				case 2:  Delay = static_cast<Int64>(Random() % 400000); break;
+				default: Delay = static_cast<Int64>(Random() % 2000000000); break;
+			}
+			Timer.m_Deadline = Now + std::chrono::milliseconds(Delay);
+			Timer.m_IsArmed = true;
+			Wheel.Arm(Timer.m_Timer, Timer.m_Deadline);
+		}
+		else if (Operation < 70)
+		{
+			auto & Timer = *Timers[Random() % NUM_TIMERS];
+			Timer.m_Timer.Cancel();
+			Timer.m_IsArmed = false;
+		}
+		else
+		{
+			// Advance, mostly by a few ticks, sometimes by up to a day, and not aligned to the ticks:
+			Int64 Delay = (Random() % 50 == 0) ? static_cast<Int64>(Random() % 100000000) : static_cast<Int64>(Random() % 30);
+			Now += std::chrono::milliseconds(Delay) + std::chrono::microseconds(Random() % 1000);
+			Wheel.Advance(Now);
+			PrevNow = Now;
+		}
+
+		if (Step % 1000 == 0)
+		{
+			auto NumArmed = std::count_if(Timers.begin(), Timers.end(), [](const std::unique_ptr<cModelTimer> & a_Timer) { return a_Timer->m_IsArmed; });
+			TEST_CHECK(Wheel.GetNumArmed() == static_cast<size_t>(NumArmed));
+			CheckNoneOverdue();
+		}
+	}
+
+	// Expire everything that is left:
+	IsDraining = true;
+	Now += std::chrono::hours(24 * 60);
+	Wheel.Advance(Now);
+	PrevNow = Now;
+	CheckNoneOverdue();
+	TEST_CHECK(Wheel.GetNumArmed() == 0);
+	cTimePoint NextExpiry;
+	TEST_CHECK(!Wheel.GetNextExpiry(NextExpiry));
+
+	auto Stats = Wheel.GetStats();
+	TEST_CHECK(Stats.m_NumExpired == NumExpired);
+	printf("Random operations: %llu arms, %llu cancels, %llu expired, %llu cascaded\n",
+		static_cast<unsigned long long>(Stats.m_NumArms), static_cast<unsigned long long>(Stats.m_NumCancels),
+		static_cast<unsigned long long>(Stats.m_NumExpired), static_cast<unsigned long long>(Stats.m_NumCascaded)
+	);
+}
+
+
+
+
+
+/** Checks that GetNextExpiry() never reports a time after the first timer's actual expiry. */
+static void TestNextExpiry(void)
+{
+	std::mt19937_64 Random(2);
+	cTimerWheel Wheel(GRANULARITY);
+	auto Start = std::chrono::steady_clock::now();
+	bool HasExpired = false;
+	std::vector<std::unique_ptr<cTimerWheel::cTimer>> Timers;
+	for (int i = 0; i < 1000; i++)
+	{
+		Timers.emplace_back(new cTimerWheel::cTimer([&HasExpired]() { HasExpired = true; }));
+		Wheel.Arm(*Timers.back(), Start + std::chrono::milliseconds(static_cast<Int64>(Random() % 10000000)));
+	}
+
+	while (Wheel.GetNumArmed() > 0)
+	{
+		cTimePoint NextExpiry;
+		TEST_CHECK(Wheel.GetNextExpiry(NextExpiry));
+
+		// Nothing may expire before the reported time:
+		HasExpired = false;
+		Wheel.Advance(NextExpiry - std::chrono::microseconds(1));
+		TEST_CHECK(!HasExpired);
+		Wheel.Advance(NextExpiry);
+	}
+}
+
+
+
+
+
+/** Checks that a callback may destroy its own timer, and the other timers expiring with it still expire. */
+static void TestDestroyFromCallback(void)
+{
+	cTimerWheel Wheel(GRANULARITY);
+	int NumCalls = 0;
+	std::unique_ptr<cTimerWheel::cTimer> Timer(new cTimerWheel::cTimer);
+	Timer->SetCallback([&]()
+		{
+			NumCalls += 1;
+			Timer.reset();
+		}
+	);
+	cTimerWheel::cTimer Other([&NumCalls]() { NumCalls += 10; });
+
+	auto Now = std::chrono::steady_clock::now();
+	Wheel.Arm(*Timer, Now);
+	Wheel.Arm(Other, Now);
+	TEST_CHECK(Wheel.Advance(Now + std::chrono::seconds(1)) == 2);
+	TEST_CHECK(NumCalls == 11);
+	TEST_CHECK(Timer == nullptr);
+	TEST_CHECK(Wheel.GetNumArmed() == 0);
+}
+
+
+
+
+
+int main(void)
+{
+	TestRandomOperations();
+	TestNextExpiry();
+	TestDestroyFromCallback();
+	printf("TimerWheel tests passed\n");
+	return EXIT_SUCCESS;
+}
+
+
+
+
@@ -0,0 +1,345 @@
+
+// UdpRelayBenchmark.cpp
+
+// Measures the datagrams per second relayed by cRelayEngine, and the latency the relay adds, against direct loopback UDP
+
+// Two clients log in and ask for a relay allocation to each other, reporting the UDP ports they send from. Each client
+// then has a plain UDP socket, latched by the relay port assigned to it. The same measurements are run twice, once with
+// the first client sending straight to the second client's socket, once through the relay:
+//  - round trip: the first client sends a datagram, the second client echoes it back to where it came from,
+//    the first client waits for the echo before sending the next one;
+//  - rate: the first client sends a stream of datagrams, keeping a window of them in flight, the second client counts them.
+
+#include "Globals.h"
+#include "Common.h"
+#include "TestHelpers.h"
+#include "TestClient.h"
+#include "TestServer.h"
+#include "ByteBufferView.h"
+#include <atomic>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+
+
+/** Size of each datagram, a typical audio / video RTP packet. */
+static const size_t DATAGRAM_SIZE = 200;
+
+/** Number of round trips in the latency measurement. */
+static const int NUM_ROUND_TRIPS = 20000;
+
+/** Number of datagrams sent in the rate measurement. */
+static const long long NUM_DATAGRAMS = 200000;
+
+/** The most datagrams the sender keeps in flight in the rate measurement. All of them must fit into the receiving
+sockets' buffers (a few hundred small datagrams by default), otherwise the OS drops them. */
+static const long long WINDOW_SIZE = 64;
+
+/** How long the sockets wait for a datagram; a datagram not received within this time is counted as lost. */
+static const int RECEIVE_TIMEOUT_MSEC = 200;
+
+
+
+
+
+/** Returns the IPv4 loopback address with the specified port. */
+static sockaddr_in LoopbackAddr(UInt16 a_Port)
+{
+	sockaddr_in Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons(a_Port);
+	Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return Addr;
+}
+
+
+
+
+
+/** Opens a UDP socket on a free loopback port, with the receive timeout set. Returns the socket, a_Port is set to its port. */
+static int OpenSocket(UInt16 & a_Port)
+{
+	int Socket = socket(AF_INET, SOCK_DGRAM, 0);
+	TEST_CHECK(Socket >= 0);
+	auto Addr = LoopbackAddr(0);
+	TEST_CHECK(bind(Socket, reinterpret_cast<const sockaddr *>(&Addr), sizeof(Addr)) == 0);
+	socklen_t AddrLen = sizeof(Addr);
+	TEST_CHECK(getsockname(Socket, reinterpret_cast<sockaddr *>(&Addr), &AddrLen) == 0);
+	a_Port = ntohs(Addr.sin_port);
+	timeval Timeout;
+	Timeout.tv_sec = 0;
+	Timeout.tv_usec = RECEIVE_TIMEOUT_MSEC * 1000;
+	TEST_CHECK(setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) == 0);
+	return Socket;
+}
+
+
+
+
+
+/** Asks the server for a relay to the peer, reporting the client's UDP port. Returns the relay port assigned to the client. */
+static UInt16 AllocateRelay(cTestClient & a_Client, UInt32 a_PeerID, UInt16 a_UDPPort)
+{
+	TEST_CHECK(a_Client.SendPacket(0x13, cTestClient::RelayRequestBody(a_PeerID, a_UDPPort)));
+	for (;;)
+	{
+		UInt32 PacketType;
+		AString Body;
+		TEST_CHECK(a_Client.ReceivePacket(PacketType, Body));
+		if (PacketType != 0x13)
+		{
+			continue;
+		}
+		cByteBufferView Packet(Body.data(), Body.size());
+		UInt32 PeerID;
+		UInt16 RelayPort;
+		TEST_CHECK(Packet.ReadVarInt32(PeerID) && Packet.ReadBEUInt16(RelayPort));
+		if (PeerID == a_PeerID)
+		{
+			TEST_CHECK(RelayPort != 0);
+			return RelayPort;
+		}
+	}
+}
+
+
+
+
+
+/** Drops all the datagrams waiting in the socket. */
+static void Drain(int a_Socket)
+{
+	char Buffer[DATAGRAM_SIZE];
+	while (recv(a_Socket, Buffer, sizeof(Buffer), MSG_DONTWAIT) > 0)
+	{
+	}
+}
+
+
+
+
+
+/** Sends datagrams from both sockets to their relay ports until each socket receives the other one's datagram,
+which means that the relay has latched both clients' addresses. */
+static void Latch(int a_Socket1, UInt16 a_RelayPort1, int a_Socket2, UInt16 a_RelayPort2)
+{
+	auto Addr1 = LoopbackAddr(a_RelayPort1);
+	auto Addr2 = LoopbackAddr(a_RelayPort2);
+	bool HasReceived1 = false, HasReceived2 = false;
+	char Buffer[DATAGRAM_SIZE];
+	for (int i = 0; !HasReceived1 || !HasReceived2; i++)
+	{
+		TEST_CHECK(i < 100);
+		TEST_CHECK(sendto(a_Socket1, "latch", 5, 0, reinterpret_cast<const sockaddr *>(&Addr1), sizeof(Addr1)) == 5);
+		TEST_CHECK(sendto(a_Socket2, "latch", 5, 0, reinterpret_cast<const sockaddr *>(&Addr2), sizeof(Addr2)) == 5);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		HasReceived1 = HasReceived1 || (recv(a_Socket1, Buffer, sizeof(Buffer), MSG_DONTWAIT) > 0);
+		HasReceived2 = HasReceived2 || (recv(a_Socket2, Buffer, sizeof(Buffer), MSG_DONTWAIT) > 0);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	Drain(a_Socket1);
+	Drain(a_Socket2);
+}
+
+
+
+
+
+/** Echoes every datagram received on the socket back to its source, until a_ShouldStop is set. */
+static void RunEcho(int a_Socket, const std::atomic<bool> & a_ShouldStop)
+{
+	char Buffer[DATAGRAM_SIZE];
+	while (!a_ShouldStop)
+	{
+		sockaddr_in From;
+		socklen_t FromLen = sizeof(From);
+		auto Size = recvfrom(a_Socket, Buffer, sizeof(Buffer), 0, reinterpret_cast<sockaddr *>(&From), &FromLen);
+		if (Size > 0)
+		{
+			sendto(a_Socket, Buffer, static_cast<size_t>(Size), 0, reinterpret_cast<const sockaddr *>(&From), FromLen);
+		}
+	}
+}
+
+
+
+
+
+/** Measures the round trips from a_Sender to a_Dest, echoed by a_Echo. Returns the median round trip in microseconds. */
+static double MeasureRoundTrip(const char * a_Name, int a_Sender, const sockaddr_in & a_Dest, int a_Echo)
+{
+	std::atomic<bool> ShouldStop(false);
+	std::thread Echo(RunEcho, a_Echo, std::cref(ShouldStop));
+
+	std::vector<double> RoundTrips;
+	RoundTrips.reserve(NUM_ROUND_TRIPS);
+	int NumLost = 0;
+	char Datagram[DATAGRAM_SIZE];
+	char Buffer[DATAGRAM_SIZE];
+	memset(Datagram, 0, sizeof(Datagram));
+	for (int i = 0; i < NUM_ROUND_TRIPS; i++)
+	{
+		memcpy(Datagram, &i, sizeof(i));
+		auto Start = std::chrono::steady_clock::now();
+		TEST_CHECK(sendto(a_Sender, Datagram, sizeof(Datagram), 0, reinterpret_cast<const sockaddr *>(&a_Dest), sizeof(a_Dest)) == static_cast<ssize_t>(sizeof(Datagram)));
+		for (;;)
+		{
+			auto Size = recv(a_Sender, Buffer, sizeof(Buffer), 0);
+			if (Size <= 0)
+			{
+				NumLost += 1;
+				break;
+			}
+			if ((static_cast<size_t>(Size) == sizeof(Datagram)) && (memcmp(Buffer, &i, sizeof(i)) == 0))
+			{
+				RoundTrips.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - Start).count());
+				break;
+			}
+			// An echo of a datagram already counted as lost, keep waiting for this one
+		}
+	}
+	ShouldStop = true;
+	Echo.join();
+	Drain(a_Sender);
+
+	TEST_CHECK(!RoundTrips.empty());
+	std::sort(RoundTrips.begin(), RoundTrips.end());
+	double p50 = RoundTrips[RoundTrips.size() / 2];
+	double p99 = RoundTrips[RoundTrips.size() * 99 / 100];
+	printf("%-7s round trip: p50 %7.1f us, p99 %7.1f us (%d round trips, %d lost)\n", a_Name, p50, p99, NUM_ROUND_TRIPS, NumLost);
+	return p50;
+}
+
+
+
+
+
+/** Sends NUM_DATAGRAMS datagrams from a_Sender to a_Dest, received by a_Receiver, prints the datagrams received per second. */
+static void MeasureRate(const char * a_Name, int a_Sender, const sockaddr_in & a_Dest, int a_Receiver)
+{
+	std::atomic<long long> NumReceived(0);
+	std::atomic<bool> ShouldStop(false);
+	std::thread Receiver([a_Receiver, &NumReceived, &ShouldStop]()
+		{
+			char Buffer[DATAGRAM_SIZE];
+			while (!ShouldStop)
+			{
+				if (recv(a_Receiver, Buffer, sizeof(Buffer), 0) > 0)
+				{
+					NumReceived += 1;
+				}
+			}
+		}
+	);
+
+	char Datagram[DATAGRAM_SIZE];
+	memset(Datagram, 'r', sizeof(Datagram));
+	long long NumSent = 0, NumLost = 0;
+	long long LastReceived = 0;
+	auto LastProgress = std::chrono::steady_clock::now();
+	auto Start = LastProgress;
+
+	// Returns true if the window is full. If nothing has been received for the timeout, the datagrams in flight are counted as lost:
+	auto IsWindowFull = [&]()
+	{
+		long long Received = NumReceived.load();
+		if (NumSent - Received - NumLost < WINDOW_SIZE)
+		{
+			return false;
+		}
+		auto Now = std::chrono::steady_clock::now();
+		if (Received != LastReceived)
+		{
+			LastReceived = Received;
+			LastProgress = Now;
+		}
+		else if (Now - LastProgress > std::chrono::milliseconds(RECEIVE_TIMEOUT_MSEC))
+		{
+			NumLost = NumSent - Received;
+			LastProgress = Now;
+			return false;
+		}
+		std::this_thread::yield();
+		return true;
+	};
+
+	while (NumSent < NUM_DATAGRAMS)
+	{
+		if (IsWindowFull())
+		{
+			continue;
+		}
+		TEST_CHECK(sendto(a_Sender, Datagram, sizeof(Datagram), 0, reinterpret_cast<const sockaddr *>(&a_Dest), sizeof(a_Dest)) == static_cast<ssize_t>(sizeof(Datagram)));
+		NumSent += 1;
+	}
+
+	// Wait for the last datagrams in flight:
+	while (NumReceived.load() + NumLost < NumSent)
+	{
+		auto Received = NumReceived.load();
+		if (Received != LastReceived)
+		{
+			LastReceived = Received;
+			LastProgress = std::chrono::steady_clock::now();
+		}
+		else if (std::chrono::steady_clock::now() - LastProgress > std::chrono::milliseconds(RECEIVE_TIMEOUT_MSEC))
+		{
+			NumLost = NumSent - Received;
+			break;
+		}
+		std::this_thread::yield();
+	}
+	auto Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	ShouldStop = true;
+	Receiver.join();
+
+	long long Received = NumReceived.load();
+	printf("%-7s rate:       %9.0f datagrams/sec (%lld sent, %lld received, in %.3f s)\n",
+		a_Name, static_cast<double>(Received) / Elapsed, NumSent, Received, Elapsed
+	);
+}
+
+
+
+
+
+int main(void)
+{
+	cTestServer Server("UdpRelay", cTestServer::DefaultSettings());
+
+	cTestClient Client1, Client2;
+	TEST_CHECK(Client1.Connect(Server.GetPort()) && Client1.Login("client1"));
+	TEST_CHECK(Client2.Connect(Server.GetPort()) && Client2.Login("client2"));
+	int ClientID2 = Client1.WaitForUser("client2");
+	int ClientID1 = Client2.WaitForUser("client1");
+	TEST_CHECK((ClientID1 > 0) && (ClientID2 > 0));
+
+	UInt16 Port1, Port2;
+	int Socket1 = OpenSocket(Port1);
+	int Socket2 = OpenSocket(Port2);
+	UInt16 RelayPort1 = AllocateRelay(Client1, static_cast<UInt32>(ClientID2), Port1);
+	UInt16 RelayPort2 = AllocateRelay(Client2, static_cast<UInt32>(ClientID1), Port2);
+	Latch(Socket1, RelayPort1, Socket2, RelayPort2);
+
+	printf("Sending %zu-byte datagrams between two loopback UDP sockets, directly and through the relay:\n", DATAGRAM_SIZE);
+	auto DirectAddr = LoopbackAddr(Port2);
+	auto RelayAddr = LoopbackAddr(RelayPort1);
+	double DirectRoundTrip = MeasureRoundTrip("Direct", Socket1, DirectAddr, Socket2);
+	double RelayRoundTrip = MeasureRoundTrip("Relayed", Socket1, RelayAddr, Socket2);
+	MeasureRate("Direct", Socket1, DirectAddr, Socket2);
+	MeasureRate("Relayed", Socket1, RelayAddr, Socket2);
+	printf("The relay adds %.1f us per direction at the median\n", (RelayRoundTrip - DirectRoundTrip) / 2);
+
+	close(Socket1);
+	close(Socket2);
+	return EXIT_SUCCESS;
+}
+
+
+
+